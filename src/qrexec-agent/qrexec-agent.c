@@ -619,20 +619,21 @@ BOOL VchanSendHello(
  * @param domain Data vchan domain.
  * @param port Data vchan port.
  * @param userName User name for the local executable.
+ * @param targetDomain Target of a local service call, the executable gets it in QREXEC_REQUESTED_TARGET. Optional.
  * @param commandLine Local executable to connect to data vchan.
  * @param isServer Determines whether qrexec-wrapper should act as a vchan server.
  * @param piped Determines whether the local executable's I/O should be connected to the data vchan.
  * @param interactive Determines whether the local executable should be run in the interactive session.
  * @return Error code.
  */
-static DWORD StartChild(int domain, int port, PWSTR userName, PWSTR commandLine, BOOL isServer, BOOL piped, BOOL interactive)
+static DWORD StartChild(int domain, int port, PWSTR userName, PWSTR targetDomain, PWSTR commandLine, BOOL isServer, BOOL piped, BOOL interactive)
 {
     PWSTR command = malloc(MAX_PATH_LONG * sizeof(WCHAR));
     int flags = 0;
     HANDLE wrapper;
     DWORD status;
     /*
-    * @param argv Expected arguments are: <domain> <port> <user_name> <flags> <command_line>
+    * @param argv Expected arguments are: <domain> <port> <user_name> <flags> <target> <command_line>
     *             domain:       remote domain for data vchan
     *             port:         remote port for data vchan
     *             user_name:    user name to use for the child process or (null) for current user
@@ -640,6 +641,8 @@ static DWORD StartChild(int domain, int port, PWSTR userName, PWSTR commandLine,
     *                      0x01 act as vchan server (default is client)
     *                      0x02 pipe child process' io to vchan (default is not)
     *                      0x04 run the child process in the interactive session (requires that a user is logged on)
+    *             target:       domain requested by a local service call, passed to the child
+    *                           in QREXEC_REQUESTED_TARGET, or (null)
     *             command_line: local program to execute
     */
     if (!command)
@@ -649,11 +652,12 @@ static DWORD StartChild(int domain, int port, PWSTR userName, PWSTR commandLine,
     if (piped)       flags |= 0x02;
     if (interactive) flags |= 0x04;
 
-    StringCchPrintf(command, MAX_PATH_LONG, L"qrexec-wrapper.exe %d%c%d%c%s%c%d%c%s",
+    StringCchPrintf(command, MAX_PATH_LONG, L"qrexec-wrapper.exe %d%c%d%c%s%c%d%c%s%c%s",
                     domain, QUBES_ARGUMENT_SEPARATOR,
                     port, QUBES_ARGUMENT_SEPARATOR,
                     userName, QUBES_ARGUMENT_SEPARATOR,
                     flags, QUBES_ARGUMENT_SEPARATOR,
+                    targetDomain, QUBES_ARGUMENT_SEPARATOR,
                     commandLine);
 
     // wrapper will run as current user (SYSTEM, we're a service)
@@ -714,6 +718,7 @@ DWORD HandleServiceConnect(IN const struct msg_header *header)
     DWORD status;
     struct exec_params *params = NULL;
     PSERVICE_REQUEST context = NULL;
+    WCHAR *targetDomain = NULL;
 
     LogDebug("msg 0x%x, len %d", header->type, header->len);
 
@@ -735,8 +740,13 @@ DWORD HandleServiceConnect(IN const struct msg_header *header)
         goto cleanup;
     }
 
+    // The local handler may want to open more connections to the same domain (file-sender does),
+    // the wrapper passes the target to it. Not fatal, the handler then uses a single connection.
+    if (ERROR_SUCCESS != ConvertUTF8ToUTF16(context->ServiceParams.target_domain, &targetDomain, NULL))
+        targetDomain = NULL;
+
     // TODO: should all service handlers run as current user (SYSTEM)?
-    status = StartChild(params->connect_domain, params->connect_port, NULL, context->CommandLine, TRUE, TRUE, TRUE);
+    status = StartChild(params->connect_domain, params->connect_port, NULL, targetDomain, context->CommandLine, TRUE, TRUE, TRUE);
     if (ERROR_SUCCESS != status)
         perror("StartChild");
 
@@ -749,6 +759,7 @@ cleanup:
         free(context->CommandLine);
     free(context);
     free(params);
+    free(targetDomain);
     return status;
 }
 
@@ -887,7 +898,7 @@ static DWORD HandleExec(IN const struct msg_header *header, BOOL piped)
     if (commandLine)
     {
         // Start the wrapper that will take care of data vchan, launch the child and redirect child's IO to data vchan if piped==TRUE.
-        status = StartChild(exec->connect_domain, exec->connect_port, userName, commandLine, FALSE, piped, interactive);
+        status = StartChild(exec->connect_domain, exec->connect_port, userName, NULL, commandLine, FALSE, piped, interactive);
         if (ERROR_SUCCESS != status)
             LogError("StartChild(%s) failed", commandLine);
 
@@ -897,7 +908,7 @@ static DWORD HandleExec(IN const struct msg_header *header, BOOL piped)
     else
     {
         // parsing failed, most likely unknown service - start the wrapper with dummy command line to send non-zero exit code through data vchan
-        StartChild(exec->connect_domain, exec->connect_port, userName, L"dummy", FALSE, piped, interactive);
+        StartChild(exec->connect_domain, exec->connect_port, userName, NULL, L"dummy", FALSE, piped, interactive);
         status = ERROR_SUCCESS;
     }
 
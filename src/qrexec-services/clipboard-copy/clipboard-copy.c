@@ -23,12 +23,113 @@
 #include <Shlwapi.h>
 #include <strsafe.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include <qubes-io.h>
 #include <utf8-conv.h>
+#include <config.h>
 #include <log.h>
 
+#include "clipboard-cache.h"
+#include "clipboard-protocol.h"
+#include "qoi.h"
+#include "pixels.h"
+
 #define CLIPBOARD_FORMAT CF_UNICODETEXT
+#define IMAGE_FORMAT CF_DIB
+
+// Copies the text cached by clipboard-monitor if it is still the clipboard content.
+// The copy is written out after releasing the lock so a slow reader never holds up the monitor.
+static BOOL ReadCachedText(IN HANDLE section, OUT BYTE **text, OUT DWORD *size)
+{
+    CLIPBOARD_CACHE *cache = NULL;
+    HANDLE lock;
+    DWORD status;
+    BOOL ret = FALSE;
+
+    *text = NULL;
+    *size = 0;
+
+    lock = OpenMutex(SYNCHRONIZE, FALSE, CLIPBOARD_CACHE_LOCK);
+    if (!lock)
+    {
+        perror("OpenMutex");
+        return FALSE;
+    }
+
+    cache = MapViewOfFile(section, FILE_MAP_READ, 0, 0, 0);
+    if (!cache)
+    {
+        perror("MapViewOfFile");
+        goto cleanup;
+    }
+
+    status = WaitForSingleObject(lock, CLIPBOARD_CACHE_LOCK_TIMEOUT);
+    if (status != WAIT_OBJECT_0)
+    {
+        // abandoned: the monitor died while updating, don't trust the content
+        if (status == WAIT_ABANDONED)
+            ReleaseMutex(lock);
+        LogWarning("clipboard cache not available (%lu)", status);
+        goto cleanup;
+    }
+
+    if (cache->Valid && cache->Sequence == GetClipboardSequenceNumber() && cache->Size <= cache->Capacity)
+    {
+        *text = malloc(max(cache->Size, 1));
+        if (*text)
+        {
+            memcpy(*text, cache->Data, cache->Size);
+            *size = cache->Size;
+            ret = TRUE;
+        }
+    }
+    else
+    {
+        LogDebug("clipboard cache is stale");
+    }
+
+    ReleaseMutex(lock);
+
+cleanup:
+    if (cache)
+        UnmapViewOfFile(cache);
+    CloseHandle(lock);
+    return ret;
+}
+
+// Starts clipboard-monitor for this session, later copies are served from its cache.
+static void StartMonitor(void)
+{
+    WCHAR path[MAX_PATH];
+    STARTUPINFO si = { 0 };
+    PROCESS_INFORMATION pi;
+
+    if (!GetModuleFileName(NULL, path, RTL_NUMBER_OF(path)))
+    {
+        perror("GetModuleFileName");
+        return;
+    }
+
+    PathRemoveFileSpec(path);
+    if (!PathAppend(path, L"clipboard-monitor.exe"))
+    {
+        perror("PathAppend");
+        return;
+    }
+
+    // no handles inherited: the service must not wait for the monitor's exit
+    si.cb = sizeof(si);
+    if (!CreateProcess(path, NULL, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi))
+    {
+        perror("CreateProcess");
+        return;
+    }
+
+    LogDebug("started clipboard monitor, pid %lu", pi.dwProcessId);
+    CloseHandle(pi.hThread);
+    CloseHandle(pi.hProcess);
+}
 
 BOOL WriteClipboardText(IN HWND window, OUT HANDLE outputFile)
 {
@@ -83,9 +184,199 @@ BOOL WriteClipboardText(IN HWND window, OUT HANDLE outputFile)
     return TRUE;
 }
 
+// QOI data goes out in chunks, each written together with its header.
+typedef struct _IMAGE_OUTPUT
+{
+    HANDLE File;
+    QOI_ENCODER Encoder;
+    BYTE *Buffer; // struct clip_chunk and CLIP_MAX_CHUNK bytes
+    DWORD Used;
+} IMAGE_OUTPUT;
+
+static BOOL FlushImageChunk(IN OUT IMAGE_OUTPUT *output)
+{
+    struct clip_chunk *chunk = (struct clip_chunk *)output->Buffer;
+
+    if (output->Used == 0)
+        return TRUE;
+
+    chunk->size = output->Used;
+    if (!QioWriteBuffer(output->File, output->Buffer, sizeof(*chunk) + output->Used))
+    {
+        perror("QioWriteBuffer");
+        return FALSE;
+    }
+
+    output->Used = 0;
+    return TRUE;
+}
+
+// Encodes a packed DIB (24 or 32 bpp, uncompressed) as a CLIP_ITEM_IMAGE_QOI item.
+// Rows are converted and encoded one at a time straight from the clipboard block.
+static BOOL WriteDib(IN const BITMAPINFOHEADER *dib, IN SIZE_T cbDib, OUT HANDLE outputFile)
+{
+    IMAGE_OUTPUT output = { 0 };
+    const DWORD *masks = (const DWORD *)((const BYTE *)dib + sizeof(BITMAPINFOHEADER));
+    const BYTE *pixels;
+    BYTE *row = NULL;
+    UINT64 cbPixels;
+    DWORD width, height, stride, y;
+    SIZE_T offset;
+    BOOL topDown, opaque;
+    struct clip_item item = { CLIP_ITEM_IMAGE_QOI, 0 };
+    BYTE end[sizeof(struct clip_chunk) + sizeof(struct clip_item)] = { 0 }; // empty chunk, CLIP_ITEM_END
+    BOOL success = FALSE;
+
+    if (cbDib < sizeof(BITMAPINFOHEADER) || dib->biSize < sizeof(BITMAPINFOHEADER) || dib->biSize > cbDib)
+        goto invalid;
+
+    if (dib->biWidth <= 0 || dib->biHeight == 0 || dib->biHeight == INT_MIN || dib->biPlanes != 1 || dib->biClrUsed > 256)
+        goto invalid;
+
+    if (dib->biBitCount == 32 && dib->biCompression == BI_BITFIELDS)
+    {
+        // V4/V5 headers have the masks in the same place
+        if (cbDib < sizeof(BITMAPINFOHEADER) + 3 * sizeof(DWORD) ||
+            masks[0] != 0x00FF0000 || masks[1] != 0x0000FF00 || masks[2] != 0x000000FF)
+            goto unsupported;
+    }
+    else if ((dib->biBitCount != 32 && dib->biBitCount != 24) || dib->biCompression != BI_RGB)
+    {
+        goto unsupported;
+    }
+
+    width = dib->biWidth;
+    height = abs(dib->biHeight);
+    topDown = dib->biHeight < 0;
+    stride = ((width * dib->biBitCount + 31) / 32) * 4;
+
+    offset = dib->biSize + dib->biClrUsed * sizeof(RGBQUAD);
+    if (dib->biSize == sizeof(BITMAPINFOHEADER) && dib->biCompression == BI_BITFIELDS)
+        offset += 3 * sizeof(DWORD);
+
+    cbPixels = (UINT64)stride * height;
+    if (width > MAXDWORD / 32 || offset > cbDib || cbPixels > cbDib - offset)
+        goto invalid;
+
+    // a whole encoded row must fit in a chunk
+    if (QOI_ENCODE_BOUND((UINT64)width) > CLIP_MAX_CHUNK)
+        goto unsupported;
+
+    pixels = (const BYTE *)dib + offset;
+
+    // 32 bpp bitmaps often leave alpha at zero, those are opaque
+    opaque = TRUE;
+    if (dib->biBitCount == 32)
+    {
+        for (y = 0; y < height && opaque; y++)
+            opaque = !PxHasAlpha(pixels + (SIZE_T)y * stride, width);
+    }
+
+    row = malloc((SIZE_T)width * 4);
+    output.Buffer = malloc(sizeof(struct clip_chunk) + CLIP_MAX_CHUNK);
+    if (!row || !output.Buffer)
+    {
+        perror("malloc");
+        goto cleanup;
+    }
+    output.File = outputFile;
+
+    if (!QioWriteBuffer(outputFile, CLIP_MAGIC, CLIP_MAGIC_SIZE) || !QioWriteBuffer(outputFile, &item, sizeof(item)))
+    {
+        perror("QioWriteBuffer");
+        goto cleanup;
+    }
+
+    QoiEncodeBegin(&output.Encoder, width, height, !opaque, output.Buffer + sizeof(struct clip_chunk));
+    output.Used = QOI_HEADER_SIZE;
+
+    for (y = 0; y < height; y++)
+    {
+        const BYTE *source = pixels + (SIZE_T)(topDown ? y : height - 1 - y) * stride;
+
+        if (dib->biBitCount == 24)
+            PxBgrToRgba(row, source, width);
+        else
+            PxBgraToRgba(row, source, width, opaque);
+
+        if (output.Used + QOI_ENCODE_BOUND(width) > CLIP_MAX_CHUNK && !FlushImageChunk(&output))
+            goto cleanup;
+
+        output.Used += (DWORD)QoiEncodePixels(&output.Encoder, row, width,
+            output.Buffer + sizeof(struct clip_chunk) + output.Used);
+    }
+
+    if (!FlushImageChunk(&output))
+        goto cleanup;
+
+    if (!QioWriteBuffer(outputFile, end, sizeof(end)))
+    {
+        perror("QioWriteBuffer");
+        goto cleanup;
+    }
+
+    success = TRUE;
+    goto cleanup;
+
+unsupported:
+    LogWarning("unsupported bitmap: %d bpp, compression %lu", dib->biBitCount, dib->biCompression);
+    goto cleanup;
+
+invalid:
+    LogError("invalid bitmap in the clipboard");
+
+cleanup:
+    free(output.Buffer);
+    free(row);
+    return success;
+}
+
+BOOL WriteClipboardImage(IN HWND window, OUT HANDLE outputFile)
+{
+    HANDLE clipData;
+    BITMAPINFOHEADER *dib;
+    BOOL success;
+
+    if (!IsClipboardFormatAvailable(IMAGE_FORMAT))
+        return FALSE;
+
+    if (!OpenClipboard(window))
+    {
+        perror("OpenClipboard");
+        return FALSE;
+    }
+
+    clipData = GetClipboardData(IMAGE_FORMAT);
+    if (!clipData)
+    {
+        perror("GetClipboardData");
+        CloseClipboard();
+        return FALSE;
+    }
+
+    dib = GlobalLock(clipData);
+    if (!dib)
+    {
+        perror("GlobalLock");
+        CloseClipboard();
+        return FALSE;
+    }
+
+    success = WriteDib(dib, GlobalSize(clipData), outputFile);
+
+    GlobalUnlock(clipData);
+    CloseClipboard();
+    return success;
+}
+
 int APIENTRY wWinMain(HINSTANCE instance, HINSTANCE previousInstance, WCHAR *commandLine, int showFlags)
 {
     HANDLE stdOut;
+    HANDLE cacheSection;
+    DWORD startMonitor;
+    DWORD sendImages;
+    BYTE *cachedText;
+    DWORD cbCachedText;
 
     stdOut = GetStdHandle(STD_OUTPUT_HANDLE);
     if (stdOut == INVALID_HANDLE_VALUE)
@@ -93,7 +384,41 @@ int APIENTRY wWinMain(HINSTANCE instance, HINSTANCE previousInstance, WCHAR *com
         perror("GetStdHandle");
         return 1;
     }
-    if (!WriteClipboardText(NULL, stdOut))
+
+    cacheSection = OpenFileMapping(FILE_MAP_READ, FALSE, CLIPBOARD_CACHE_SECTION);
+    if (cacheSection)
+    {
+        BOOL cached = ReadCachedText(cacheSection, &cachedText, &cbCachedText);
+
+        CloseHandle(cacheSection);
+        if (cached)
+        {
+            BOOL written = QioWriteBuffer(stdOut, cachedText, cbCachedText);
+
+            free(cachedText);
+            if (!written)
+            {
+                perror("QioWriteBuffer");
+                return 1;
+            }
+
+            LogDebug("all ok (cached)");
+            return 0;
+        }
+    }
+    else if (ERROR_SUCCESS == CfgReadDword(NULL, L"ClipboardMonitor", &startMonitor, NULL) && startMonitor)
+    {
+        StartMonitor();
+    }
+
+    // images only go to agents that understand the framed format
+    if (!IsClipboardFormatAvailable(CLIPBOARD_FORMAT) &&
+        ERROR_SUCCESS == CfgReadDword(NULL, L"ClipboardImages", &sendImages, NULL) && sendImages)
+    {
+        if (!WriteClipboardImage(NULL, stdOut))
+            return 1;
+    }
+    else if (!WriteClipboardText(NULL, stdOut))
     {
         return 1;
     }
@@ -0,0 +1,244 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Optional per-session clipboard listener. Keeps the current clipboard text converted
+// to UTF-8 in a shared section so qubes.ClipboardCopy only has to copy it out.
+// Started by clipboard-copy when the ClipboardMonitor config value is set.
+
+#include <windows.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include <config.h>
+#include <log.h>
+
+#include "clipboard-cache.h"
+
+#define CLIPBOARD_FORMAT CF_UNICODETEXT
+
+HANDLE g_cacheLock = NULL;
+CLIPBOARD_CACHE *g_cache = NULL;
+SIZE_T g_committed = 0; // bytes of the section committed so far
+
+// Commits the section up to the header and size bytes of data.
+static BOOL CommitCache(IN SIZE_T size)
+{
+    SIZE_T needed = FIELD_OFFSET(CLIPBOARD_CACHE, Data) + size;
+
+    if (needed <= g_committed)
+        return TRUE;
+
+    if (!VirtualAlloc(g_cache, needed, MEM_COMMIT, PAGE_READWRITE))
+    {
+        perror("VirtualAlloc");
+        return FALSE;
+    }
+
+    g_committed = needed;
+    return TRUE;
+}
+
+// Converts the clipboard text straight into the section, called with the lock held.
+static BOOL CacheClipboardText(IN HWND window)
+{
+    HANDLE clipData;
+    WCHAR *clipText;
+    size_t cchText;
+    int cbTextUtf8;
+    BOOL ret = FALSE;
+
+    if (!IsClipboardFormatAvailable(CLIPBOARD_FORMAT))
+        return FALSE;
+
+    if (!OpenClipboard(window))
+    {
+        perror("OpenClipboard");
+        return FALSE;
+    }
+
+    clipData = GetClipboardData(CLIPBOARD_FORMAT);
+    if (!clipData)
+    {
+        perror("GetClipboardData");
+        goto cleanup;
+    }
+
+    clipText = GlobalLock(clipData);
+    if (!clipText)
+    {
+        perror("GlobalLock");
+        goto cleanup;
+    }
+
+    // the block may not be terminated
+    cchText = wcsnlen(clipText, GlobalSize(clipData) / sizeof(WCHAR));
+    if (cchText > INT_MAX)
+        goto unlock;
+
+    cbTextUtf8 = WideCharToMultiByte(CP_UTF8, 0, clipText, (int)cchText, NULL, 0, NULL, NULL);
+    if (cbTextUtf8 == 0 && cchText > 0)
+    {
+        perror("WideCharToMultiByte");
+        goto unlock;
+    }
+
+    if ((DWORD)cbTextUtf8 > g_cache->Capacity)
+    {
+        LogDebug("clipboard text too large to cache (%d bytes)", cbTextUtf8);
+        goto unlock;
+    }
+
+    if (!CommitCache(cbTextUtf8))
+        goto unlock;
+
+    if (cchText > 0 && !WideCharToMultiByte(CP_UTF8, 0, clipText, (int)cchText, (char *)g_cache->Data, cbTextUtf8, NULL, NULL))
+    {
+        perror("WideCharToMultiByte");
+        goto unlock;
+    }
+
+    g_cache->Size = cbTextUtf8;
+    ret = TRUE;
+
+unlock:
+    GlobalUnlock(clipData);
+cleanup:
+    CloseClipboard();
+    return ret;
+}
+
+static void UpdateCache(IN HWND window)
+{
+    // taken before reading the content: if it changes in between, readers see
+    // a stale sequence and read the clipboard themselves until the next update
+    DWORD sequence = GetClipboardSequenceNumber();
+
+    if (WaitForSingleObject(g_cacheLock, INFINITE) == WAIT_FAILED)
+    {
+        perror("WaitForSingleObject");
+        return;
+    }
+
+    g_cache->Valid = FALSE;
+    g_cache->Sequence = sequence;
+    g_cache->Size = 0;
+    g_cache->Valid = CacheClipboardText(window);
+
+    ReleaseMutex(g_cacheLock);
+    LogVerbose("sequence %lu, valid %lu, size %lu", sequence, g_cache->Valid, g_cache->Size);
+}
+
+static LRESULT CALLBACK WindowProc(HWND window, UINT message, WPARAM wParam, LPARAM lParam)
+{
+    if (message == WM_CLIPBOARDUPDATE)
+    {
+        UpdateCache(window);
+        return 0;
+    }
+
+    return DefWindowProc(window, message, wParam, lParam);
+}
+
+static HWND CreateListenerWindow(IN HINSTANCE instance)
+{
+    WNDCLASSEX windowClass = { 0 };
+    HWND window;
+
+    windowClass.cbSize = sizeof(windowClass);
+    windowClass.lpfnWndProc = WindowProc;
+    windowClass.hInstance = instance;
+    windowClass.lpszClassName = L"QubesClipboardMonitor";
+
+    if (!RegisterClassEx(&windowClass))
+    {
+        perror("RegisterClassEx");
+        return NULL;
+    }
+
+    window = CreateWindowEx(0, windowClass.lpszClassName, NULL, 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, instance, NULL);
+    if (!window)
+    {
+        perror("CreateWindowEx");
+        return NULL;
+    }
+
+    if (!AddClipboardFormatListener(window))
+    {
+        perror("AddClipboardFormatListener");
+        DestroyWindow(window);
+        return NULL;
+    }
+
+    return window;
+}
+
+int APIENTRY wWinMain(HINSTANCE instance, HINSTANCE previousInstance, WCHAR *commandLine, int showFlags)
+{
+    HANDLE section;
+    HWND window;
+    DWORD capacity;
+    UINT64 sectionSize;
+    MSG message;
+
+    if (ERROR_SUCCESS != CfgReadDword(NULL, L"MaxClipboardSize", &capacity, NULL))
+        capacity = CLIPBOARD_CACHE_DEFAULT_SIZE;
+
+    g_cacheLock = CreateMutex(NULL, FALSE, CLIPBOARD_CACHE_LOCK);
+    if (!g_cacheLock)
+        return perror("CreateMutex");
+
+    // only reserved, data pages are committed when text is cached
+    sectionSize = FIELD_OFFSET(CLIPBOARD_CACHE, Data) + (UINT64)capacity;
+    section = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE | SEC_RESERVE,
+        (DWORD)(sectionSize >> 32), (DWORD)sectionSize, CLIPBOARD_CACHE_SECTION);
+    if (!section)
+        return perror("CreateFileMapping");
+
+    if (GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        LogDebug("monitor already running in this session");
+        return 0;
+    }
+
+    g_cache = MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, 0);
+    if (!g_cache)
+        return perror("MapViewOfFile");
+
+    if (!CommitCache(0))
+        return 1;
+
+    g_cache->Capacity = capacity;
+
+    window = CreateListenerWindow(instance);
+    if (!window)
+        return 1;
+
+    UpdateCache(window);
+
+    LogInfo("caching up to %lu bytes of clipboard text", capacity);
+    while (GetMessage(&message, NULL, 0, 0) > 0)
+    {
+        TranslateMessage(&message);
+        DispatchMessage(&message);
+    }
+
+    return 0;
+}
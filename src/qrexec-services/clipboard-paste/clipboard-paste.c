@@ -23,93 +23,540 @@
 #include <Shlwapi.h>
 #include <strsafe.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include <qubes-io.h>
-#include <utf8-conv.h>
+#include <config.h>
 #include <log.h>
 
+#include "clipboard-protocol.h"
+#include "qoi.h"
+#include "pixels.h"
+
 #define CLIPBOARD_FORMAT CF_UNICODETEXT
+#define IMAGE_FORMAT CF_DIBV5
+
+// input is read and converted in chunks of this size
+#define CLIPBOARD_CHUNK_SIZE (64*1024)
+
+// default for the MaxClipboardSize config value, bytes of UTF-8 input
+#define DEFAULT_MAX_CLIPBOARD_SIZE (16*1024*1024)
 
-#define MAX_CLIPBOARD_SIZE 65000
+// default for the MaxClipboardImageSize config value, bytes of decoded pixels
+#define DEFAULT_MAX_IMAGE_SIZE (256*1024*1024)
 
-BOOL ReadClipboardText(IN HWND window, IN HANDLE inputFile)
+// Text converted so far, kept in the (locked) block that is handed to the clipboard.
+typedef struct _CLIPBOARD_TEXT
 {
-    HANDLE clipData;
-    WCHAR *text, *textLocked;
-    char *inputText;
-    size_t cchText;
-    DWORD cbRead;
+    HGLOBAL Memory;
+    WCHAR *Text;
+    size_t Length; // in characters
+    size_t Capacity; // in characters
+} CLIPBOARD_TEXT;
+
+// Image being decoded, rows go straight into the block that becomes the clipboard data.
+typedef struct _CLIPBOARD_IMAGE
+{
+    HGLOBAL Memory;
+    BITMAPV5HEADER *Header; // locked block
+    BYTE *Pixels; // bottom-up rows
+    DWORD Stride;
+    DWORD Height;
+} CLIPBOARD_IMAGE;
 
-    inputText = malloc(MAX_CLIPBOARD_SIZE + 1);
-    if (!inputText)
-        goto fail;
+// Makes room for cchMore characters and the terminating null.
+static BOOL ReserveText(IN OUT CLIPBOARD_TEXT *clip, IN size_t cchMore)
+{
+    size_t newCapacity;
+    HGLOBAL newMemory;
 
-    ZeroMemory(inputText, MAX_CLIPBOARD_SIZE + 1);
+    if (clip->Length + cchMore + 1 <= clip->Capacity)
+        return TRUE;
 
-    cbRead = QioReadUntilEof(inputFile, inputText, MAX_CLIPBOARD_SIZE);
-    if (cbRead == 0)
+    newCapacity = max(clip->Length + cchMore + 1, 2 * clip->Capacity);
+    if (clip->Memory)
     {
-        LogError("QioReadUntilEof returned 0");
-        goto fail;
+        GlobalUnlock(clip->Memory);
+        newMemory = GlobalReAlloc(clip->Memory, newCapacity * sizeof(WCHAR), GMEM_MOVEABLE);
+    }
+    else
+    {
+        newMemory = GlobalAlloc(GMEM_MOVEABLE, newCapacity * sizeof(WCHAR));
     }
 
-    inputText[cbRead] = '\0';
+    if (!newMemory)
+    {
+        perror("GlobalAlloc");
+        // the old block is still valid
+        if (clip->Memory)
+            clip->Text = GlobalLock(clip->Memory);
+        return FALSE;
+    }
 
-    if (ERROR_SUCCESS != ConvertUTF8ToUTF16(inputText, &text, &cchText))
+    clip->Memory = newMemory;
+    clip->Capacity = newCapacity;
+    clip->Text = GlobalLock(clip->Memory);
+    if (!clip->Text)
     {
-        perror("ConvertUTF8ToUTF16");
-        goto fail;
+        perror("GlobalLock");
+        return FALSE;
     }
 
-    clipData = GlobalAlloc(GMEM_MOVEABLE, (cchText + 1) * sizeof(WCHAR));
-    if (!clipData)
+    return TRUE;
+}
+
+// Returns how many bytes at the end of data are an incomplete UTF-8 sequence,
+// they are converted with the next chunk.
+static DWORD GetIncompleteTail(IN const BYTE *data, IN DWORD size)
+{
+    DWORD start = size;
+    DWORD expected;
+
+    // back over at most three continuation bytes to the lead byte
+    while (start > 0 && size - start < 3 && (data[start - 1] & 0xC0) == 0x80)
+        start--;
+
+    if (start == 0)
+        return 0;
+
+    start--;
+    if ((data[start] & 0xE0) == 0xC0)
+        expected = 2;
+    else if ((data[start] & 0xF0) == 0xE0)
+        expected = 3;
+    else if ((data[start] & 0xF8) == 0xF0)
+        expected = 4;
+    else
+        return 0; // ASCII or invalid, the conversion decides
+
+    return (size - start < expected) ? size - start : 0;
+}
+
+// Converts UTF-8 straight into the clipboard block.
+static BOOL AppendText(IN OUT CLIPBOARD_TEXT *clip, IN const BYTE *data, IN DWORD size)
+{
+    int cchConverted;
+
+    if (size == 0)
+        return TRUE;
+
+    // never more UTF-16 characters than UTF-8 bytes
+    if (!ReserveText(clip, size))
+        return FALSE;
+
+    cchConverted = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, (const char *)data, size,
+        clip->Text + clip->Length, (int)(clip->Capacity - clip->Length));
+    if (cchConverted == 0)
+    {
+        perror("MultiByteToWideChar");
+        return FALSE;
+    }
+
+    clip->Length += cchConverted;
+    return TRUE;
+}
+
+// Converts the complete sequences in the chunk and moves an incomplete one to its start.
+static BOOL AppendChunk(IN OUT CLIPBOARD_TEXT *clip, IN OUT BYTE *chunk, IN OUT DWORD *cbChunk)
+{
+    DWORD cbTail = GetIncompleteTail(chunk, *cbChunk);
+
+    if (!AppendText(clip, chunk, *cbChunk - cbTail))
+        return FALSE;
+
+    memmove(chunk, chunk + *cbChunk - cbTail, cbTail);
+    *cbChunk = cbTail;
+    return TRUE;
+}
+
+// Terminates the text and gives back what the doubling reserved, the block stays unlocked.
+static BOOL FinishText(IN OUT CLIPBOARD_TEXT *clip)
+{
+    HGLOBAL shrunk;
+
+    if (!ReserveText(clip, 0))
+        return FALSE;
+
+    clip->Text[clip->Length] = L'\0';
+    GlobalUnlock(clip->Memory);
+    clip->Text = NULL;
+
+    shrunk = GlobalReAlloc(clip->Memory, (clip->Length + 1) * sizeof(WCHAR), GMEM_MOVEABLE);
+    if (shrunk)
+        clip->Memory = shrunk;
+
+    return TRUE;
+}
+
+static void FreeText(IN OUT CLIPBOARD_TEXT *clip)
+{
+    if (clip->Memory)
+    {
+        if (clip->Text)
+            GlobalUnlock(clip->Memory);
+        GlobalFree(clip->Memory);
+    }
+
+    clip->Memory = NULL;
+    clip->Text = NULL;
+}
+
+static int ImageHeader(IN void *opaque, IN uint32_t width, IN uint32_t height, IN int hasAlpha)
+{
+    CLIPBOARD_IMAGE *image = opaque;
+    BITMAPV5HEADER *header;
+    UINT64 imageSize = (UINT64)width * height * 4;
+
+    if (image->Memory)
+        return EINVAL; // one image per transfer
+
+    // the decoder has checked the size against the configured limit, which may be
+    // raised past what the header fields (and a 32-bit allocation) can hold
+    if (width > MAXLONG / 4 || height > MAXLONG || imageSize > MAXDWORD - sizeof(BITMAPV5HEADER))
+    {
+        LogWarning("image %ux%u is too large for the clipboard", width, height);
+        return EINVAL;
+    }
+
+    image->Memory = GlobalAlloc(GMEM_MOVEABLE, sizeof(BITMAPV5HEADER) + (SIZE_T)imageSize);
+    if (!image->Memory)
     {
         perror("GlobalAlloc");
-        goto fail;
+        return ENOMEM;
     }
 
-    textLocked = GlobalLock(clipData);
-    if (!textLocked)
+    header = GlobalLock(image->Memory);
+    if (!header)
     {
         perror("GlobalLock");
-        GlobalFree(clipData);
-        goto fail;
+        return ENOMEM;
     }
 
-    memcpy(textLocked, text, (cchText + 1) * sizeof(WCHAR));
-    free(text);
+    ZeroMemory(header, sizeof(*header));
+    header->bV5Size = sizeof(*header);
+    header->bV5Width = width;
+    header->bV5Height = height; // bottom-up, the layout every application handles
+    header->bV5Planes = 1;
+    header->bV5BitCount = 32;
+    header->bV5Compression = BI_BITFIELDS;
+    header->bV5SizeImage = (DWORD)imageSize; // checked above
+    header->bV5RedMask = 0x00FF0000;
+    header->bV5GreenMask = 0x0000FF00;
+    header->bV5BlueMask = 0x000000FF;
+    header->bV5AlphaMask = hasAlpha ? 0xFF000000 : 0;
+    header->bV5CSType = LCS_sRGB;
+    header->bV5Intent = LCS_GM_IMAGES;
+
+    image->Header = header;
+    image->Pixels = (BYTE *)(header + 1);
+    image->Stride = width * 4;
+    image->Height = height;
+    return 0;
+}
+
+static int ImageRow(IN void *opaque, IN uint32_t y, IN const uint8_t *rgba)
+{
+    CLIPBOARD_IMAGE *image = opaque;
 
-    GlobalUnlock(clipData);
+    PxRgbaToBgra(image->Pixels + (SIZE_T)(image->Height - 1 - y) * image->Stride, rgba, image->Stride / 4);
+    return 0;
+}
+
+static void FreeImage(IN OUT CLIPBOARD_IMAGE *image)
+{
+    if (image->Memory)
+    {
+        if (image->Header)
+            GlobalUnlock(image->Memory);
+        GlobalFree(image->Memory);
+    }
+
+    image->Memory = NULL;
+    image->Header = NULL;
+}
+
+// Replaces the clipboard content. Blocks handed over are owned by the clipboard
+// and set to NULL.
+static BOOL SetClipboardContent(IN HWND window, IN OUT HGLOBAL *text, IN OUT HGLOBAL *image)
+{
+    BOOL success = FALSE;
 
     if (!OpenClipboard(window))
     {
         perror("OpenClipboard");
-        GlobalFree(clipData);
-        goto fail;
+        return FALSE;
     }
 
     if (!EmptyClipboard())
     {
         perror("EmptyClipboard");
-        GlobalFree(clipData);
-        CloseClipboard();
-        goto fail;
+        goto cleanup;
+    }
+
+    if (*text)
+    {
+        if (!SetClipboardData(CLIPBOARD_FORMAT, *text))
+        {
+            perror("SetClipboardData");
+            goto cleanup;
+        }
+        *text = NULL;
     }
 
-    if (!SetClipboardData(CLIPBOARD_FORMAT, clipData))
+    if (*image)
     {
-        perror("SetClipboardData");
-        GlobalFree(clipData);
-        CloseClipboard();
-        goto fail;
+        if (!SetClipboardData(IMAGE_FORMAT, *image))
+        {
+            perror("SetClipboardData");
+            goto cleanup;
+        }
+        *image = NULL;
     }
 
+    success = TRUE;
+
+cleanup:
     CloseClipboard();
-    return TRUE;
+    return success;
+}
+
+static DWORD GetSizeLimit(IN const WCHAR *name, IN DWORD defaultLimit)
+{
+    DWORD limit;
 
-fail:
-    free(inputText);
-    return FALSE;
+    if (ERROR_SUCCESS != CfgReadDword(NULL, name, &limit, NULL) || limit == 0)
+        limit = defaultLimit;
+
+    return limit;
+}
+
+// Reads UTF-8 text in chunks and converts each one directly into the block that
+// becomes the clipboard data, so the text exists in memory about once.
+// prefix holds what was already read to tell the format.
+BOOL ReadClipboardText(IN HWND window, IN HANDLE inputFile, IN const BYTE *prefix, IN DWORD cbPrefix)
+{
+    CLIPBOARD_TEXT clip = { 0 };
+    HGLOBAL image = NULL;
+    BYTE *chunk = NULL;
+    DWORD cbChunk; // carried over incomplete sequence and new data
+    DWORD cbRead;
+    DWORD maxSize = GetSizeLimit(L"MaxClipboardSize", DEFAULT_MAX_CLIPBOARD_SIZE);
+    UINT64 cbTotal;
+    BOOL success = FALSE;
+
+    chunk = malloc(CLIPBOARD_CHUNK_SIZE);
+    if (!chunk)
+    {
+        perror("malloc");
+        goto cleanup;
+    }
+
+    memcpy(chunk, prefix, cbPrefix);
+    cbChunk = cbPrefix;
+    cbTotal = cbPrefix;
+
+    for (;;)
+    {
+        if (!AppendChunk(&clip, chunk, &cbChunk))
+            goto cleanup;
+
+        if (cbTotal >= maxSize)
+        {
+            LogWarning("clipboard data truncated to %lu bytes", maxSize);
+            break;
+        }
+
+        if (!ReadFile(inputFile, chunk + cbChunk, (DWORD)min(CLIPBOARD_CHUNK_SIZE - cbChunk, maxSize - cbTotal), &cbRead, NULL))
+        {
+            if (GetLastError() != ERROR_BROKEN_PIPE)
+            {
+                perror("ReadFile");
+                goto cleanup;
+            }
+            cbRead = 0;
+        }
+
+        if (cbRead == 0)
+            break;
+
+        cbTotal += cbRead;
+        cbChunk += cbRead;
+    }
+
+    if (cbTotal == 0)
+    {
+        LogError("no clipboard data received");
+        goto cleanup;
+    }
+
+    // an incomplete sequence at the very end is dropped
+    if (!FinishText(&clip))
+        goto cleanup;
+
+    success = SetClipboardContent(window, &clip.Memory, &image);
+
+cleanup:
+    FreeText(&clip);
+    free(chunk);
+    return success;
+}
+
+// Reads data in the framed format (clipboard-protocol.h) after CLIP_MAGIC.
+// Text and image items are decoded chunk by chunk into their clipboard blocks.
+BOOL ReadClipboardItems(IN HWND window, IN HANDLE inputFile)
+{
+    CLIPBOARD_TEXT clip = { 0 };
+    CLIPBOARD_IMAGE image = { 0 };
+    QOI_DECODER decoder;
+    struct clip_item item;
+    struct clip_chunk chunk;
+    BYTE *data = NULL;
+    DWORD cbCarry = 0; // incomplete UTF-8 sequence in front of the next text chunk
+    DWORD cbChunk;
+    DWORD maxSize = GetSizeLimit(L"MaxClipboardSize", DEFAULT_MAX_CLIPBOARD_SIZE);
+    DWORD maxImageSize = GetSizeLimit(L"MaxClipboardImageSize", DEFAULT_MAX_IMAGE_SIZE);
+    UINT64 cbText = 0;
+    BOOL haveText = FALSE;
+    BOOL truncated = FALSE;
+    int status;
+    BOOL success = FALSE;
+
+    QoiDecodeInit(&decoder, maxImageSize / 4, ImageHeader, ImageRow, &image);
+
+    data = malloc(CLIP_MAX_CHUNK + 4);
+    if (!data)
+    {
+        perror("malloc");
+        goto cleanup;
+    }
+
+    for (;;)
+    {
+        if (!QioReadBuffer(inputFile, &item, sizeof(item)))
+            goto truncated;
+
+        if (item.type == CLIP_ITEM_END)
+            break;
+
+        if (item.type == CLIP_ITEM_TEXT)
+            haveText = TRUE;
+
+        for (;;)
+        {
+            if (!QioReadBuffer(inputFile, &chunk, sizeof(chunk)))
+                goto truncated;
+
+            if (chunk.size == 0)
+                break;
+
+            if (chunk.size > CLIP_MAX_CHUNK)
+            {
+                LogError("invalid clipboard chunk size %lu", chunk.size);
+                goto cleanup;
+            }
+
+            if (!QioReadBuffer(inputFile, data + cbCarry, chunk.size))
+                goto truncated;
+
+            switch (item.type)
+            {
+            case CLIP_ITEM_TEXT:
+                // past the limit the rest of the text is read and dropped,
+                // a later chunk that fits must not leave a gap
+                if (truncated)
+                    break;
+
+                cbChunk = chunk.size;
+                if (cbText + cbChunk > maxSize)
+                {
+                    cbChunk = (DWORD)(maxSize - cbText);
+                    LogWarning("clipboard text truncated to %lu bytes", maxSize);
+                    truncated = TRUE;
+                }
+
+                cbText += cbChunk;
+                cbCarry += cbChunk;
+                if (!AppendChunk(&clip, data, &cbCarry))
+                    goto cleanup;
+                break;
+
+            case CLIP_ITEM_IMAGE_QOI:
+                status = QoiDecode(&decoder, data, chunk.size);
+                if (status != 0)
+                {
+                    LogError("invalid clipboard image (%d)", status);
+                    goto cleanup;
+                }
+                break;
+
+            default:
+                break; // unknown item types are skipped
+            }
+        }
+
+        // an incomplete sequence at the end of the item is dropped
+        cbCarry = 0;
+
+        if (item.type == CLIP_ITEM_IMAGE_QOI && QoiDecodeFinish(&decoder) != 0)
+        {
+            LogError("incomplete clipboard image");
+            goto cleanup;
+        }
+    }
+
+    if (haveText && !FinishText(&clip))
+        goto cleanup;
+
+    if (image.Header)
+    {
+        GlobalUnlock(image.Memory);
+        image.Header = NULL;
+    }
+
+    if (!clip.Memory && !image.Memory)
+    {
+        LogError("no clipboard data received");
+        goto cleanup;
+    }
+
+    success = SetClipboardContent(window, &clip.Memory, &image.Memory);
+    goto cleanup;
+
+truncated:
+    LogError("clipboard data truncated");
+
+cleanup:
+    QoiDecodeCleanup(&decoder);
+    FreeImage(&image);
+    FreeText(&clip);
+    free(data);
+    return success;
+}
+
+// Reads up to size bytes, less only at the end of input.
+static BOOL ReadPrefix(IN HANDLE inputFile, OUT BYTE *buffer, IN DWORD size, OUT DWORD *cbPrefix)
+{
+    DWORD cbRead;
+
+    *cbPrefix = 0;
+    while (*cbPrefix < size)
+    {
+        if (!ReadFile(inputFile, buffer + *cbPrefix, size - *cbPrefix, &cbRead, NULL))
+        {
+            if (GetLastError() == ERROR_BROKEN_PIPE)
+                break;
+
+            perror("ReadFile");
+            return FALSE;
+        }
+
+        if (cbRead == 0)
+            break;
+
+        *cbPrefix += cbRead;
+    }
+
+    return TRUE;
 }
 
 HWND CreateMainWindow(IN HINSTANCE instance)
@@ -153,6 +600,9 @@ int APIENTRY wWinMain(HINSTANCE instance, HINSTANCE previousInstance, WCHAR *com
 {
     HANDLE stdIn;
     HWND window;
+    BYTE prefix[CLIP_MAGIC_SIZE];
+    DWORD cbPrefix;
+    BOOL success;
 
     stdIn = GetStdHandle(STD_INPUT_HANDLE);
     if (stdIn == INVALID_HANDLE_VALUE)
@@ -166,7 +616,17 @@ int APIENTRY wWinMain(HINSTANCE instance, HINSTANCE previousInstance, WCHAR *com
         return perror("createMainWindow");
     }
 
-    if (!ReadClipboardText(window, stdIn))
+    if (!ReadPrefix(stdIn, prefix, sizeof(prefix), &cbPrefix))
+    {
+        return GetLastError();
+    }
+
+    if (cbPrefix == CLIP_MAGIC_SIZE && memcmp(prefix, CLIP_MAGIC, CLIP_MAGIC_SIZE) == 0)
+        success = ReadClipboardItems(window, stdIn);
+    else
+        success = ReadClipboardText(window, stdIn, prefix, cbPrefix);
+
+    if (!success)
     {
         return GetLastError();
     }
@@ -0,0 +1,464 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#include <windows.h>
+#include <ShlObj.h>
+#include <Knownfolders.h>
+#include <strsafe.h>
+#include <Sddl.h>
+#include <stdlib.h>
+
+#include <qubes-io.h>
+#include <log.h>
+
+#include "app-map.h"
+
+// machine-wide: "SYSTEM" requests run under a different profile than the user's
+#define APP_MAP_DIRECTORY L"Qubes"
+#define APP_MAP_FILE L"AppMap.bin"
+// SYSTEM and administrators full control, interactive users modify, other users read
+#define APP_MAP_DIRECTORY_SDDL L"D:P(A;OICI;FA;;;SY)(A;OICI;FA;;;BA)(A;OICI;0x1301bf;;;IU)(A;OICI;FR;;;BU)"
+#define APP_MAP_MAGIC 0x314d4151 // "QAM1"
+
+// larger files are treated as corrupted
+#define APP_MAP_MAX_SIZE (64*1024*1024)
+
+// File: APP_MAP_HEADER, SlotCount slots, then the string arena: null-terminated
+// keys and values. Arena offsets are in characters, 0 is an empty string so it
+// marks an empty slot. At most half of the slots are used.
+typedef struct _APP_MAP_HEADER
+{
+    DWORD Magic;
+    DWORD SlotCount; // power of two
+    DWORD ArenaLength; // characters
+    DWORD Reserved;
+} APP_MAP_HEADER;
+
+typedef struct _APP_MAP_SLOT
+{
+    DWORD Hash;
+    DWORD Key; // arena offset, 0 if the slot is empty
+    DWORD Value; // arena offset
+} APP_MAP_SLOT;
+
+static WCHAR FoldCase(IN WCHAR c)
+{
+    return (c >= L'A' && c <= L'Z') ? c - L'A' + L'a' : c;
+}
+
+// FNV-1a of the case-folded key
+static DWORD HashKey(IN const WCHAR *key)
+{
+    DWORD hash = 0x811c9dc5;
+
+    for (; *key; key++)
+    {
+        hash ^= FoldCase(*key);
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+static BOOL KeysEqual(IN const WCHAR *a, IN const WCHAR *b)
+{
+    for (; *a && FoldCase(*a) == FoldCase(*b); a++, b++)
+        ;
+
+    return FoldCase(*a) == FoldCase(*b);
+}
+
+// The directory is created with its own ACL, users mustn't replace a table written for another user.
+static BOOL CreateAppMapDirectory(IN const WCHAR *directoryPath)
+{
+    SECURITY_ATTRIBUTES sa = { 0 };
+    BOOL created;
+
+    sa.nLength = sizeof(sa);
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptor(APP_MAP_DIRECTORY_SDDL, SDDL_REVISION_1, &sa.lpSecurityDescriptor, NULL))
+    {
+        perror("ConvertStringSecurityDescriptorToSecurityDescriptor");
+        return FALSE;
+    }
+
+    created = CreateDirectory(directoryPath, &sa);
+    if (!created && GetLastError() == ERROR_ALREADY_EXISTS)
+        created = TRUE;
+    else if (!created)
+        perror("CreateDirectory");
+
+    LocalFree(sa.lpSecurityDescriptor);
+    return created;
+}
+
+static BOOL GetAppMapPath(IN BOOL create, OUT WCHAR *path, IN size_t cchPath)
+{
+    WCHAR *programData;
+    HRESULT hresult;
+
+    hresult = SHGetKnownFolderPath(&FOLDERID_ProgramData, 0, NULL, &programData);
+    if (FAILED(hresult))
+    {
+        perror2(hresult, "SHGetKnownFolderPath");
+        return FALSE;
+    }
+
+    hresult = StringCchPrintf(path, cchPath, L"%s\\%s", programData, APP_MAP_DIRECTORY);
+    CoTaskMemFree(programData);
+    if (FAILED(hresult))
+    {
+        perror2(hresult, "StringCchPrintf");
+        return FALSE;
+    }
+
+    if (create && !CreateAppMapDirectory(path))
+        return FALSE;
+
+    hresult = StringCchCat(path, cchPath, L"\\" APP_MAP_FILE);
+    if (FAILED(hresult))
+    {
+        perror2(hresult, "StringCchCat");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Builds the whole file in memory: header, slots and arena.
+static BYTE *BuildTable(IN const APP_MAP_PAIR *pairs, IN size_t count, OUT DWORD *size)
+{
+    APP_MAP_HEADER *header;
+    APP_MAP_SLOT *slots, *slot;
+    WCHAR *arena;
+    UINT64 arenaLength = 1; // the empty string at 0
+    UINT64 tableSize;
+    DWORD slotCount = 16;
+    DWORD hash, mask;
+    size_t i;
+    BYTE *table;
+
+    for (i = 0; i < count; i++)
+        arenaLength += wcslen(pairs[i].Key) + wcslen(pairs[i].Value) + 2;
+
+    while (slotCount < 2 * count)
+        slotCount *= 2;
+
+    tableSize = sizeof(APP_MAP_HEADER) + (UINT64)slotCount * sizeof(APP_MAP_SLOT) + arenaLength * sizeof(WCHAR);
+    if (tableSize > APP_MAP_MAX_SIZE)
+    {
+        LogError("table too large: %I64u bytes", tableSize);
+        return NULL;
+    }
+
+    table = calloc(1, (size_t)tableSize);
+    if (!table)
+        return NULL;
+
+    header = (APP_MAP_HEADER *)table;
+    slots = (APP_MAP_SLOT *)(header + 1);
+    arena = (WCHAR *)(slots + slotCount);
+    mask = slotCount - 1;
+
+    header->Magic = APP_MAP_MAGIC;
+    header->SlotCount = slotCount;
+    header->ArenaLength = 1;
+
+    for (i = 0; i < count; i++)
+    {
+        hash = HashKey(pairs[i].Key);
+
+        // linear probing, a key that is already there is overwritten
+        for (slot = &slots[hash & mask]; slot->Key; slot = &slots[(slot - slots + 1) & mask])
+        {
+            if (slot->Hash == hash && KeysEqual(arena + slot->Key, pairs[i].Key))
+                break;
+        }
+
+        if (!slot->Key)
+        {
+            slot->Hash = hash;
+            slot->Key = header->ArenaLength;
+            wcscpy_s(arena + slot->Key, (size_t)arenaLength - slot->Key, pairs[i].Key);
+            header->ArenaLength += (DWORD)wcslen(pairs[i].Key) + 1;
+        }
+
+        slot->Value = header->ArenaLength;
+        wcscpy_s(arena + slot->Value, (size_t)arenaLength - slot->Value, pairs[i].Value);
+        header->ArenaLength += (DWORD)wcslen(pairs[i].Value) + 1;
+    }
+
+    // duplicates left some of the arena unused
+    *size = (DWORD)(sizeof(APP_MAP_HEADER) + slotCount * sizeof(APP_MAP_SLOT) + header->ArenaLength * sizeof(WCHAR));
+    return table;
+}
+
+BOOL AppMapWrite(IN const APP_MAP_PAIR *pairs, IN size_t count)
+{
+    WCHAR mapPath[MAX_PATH];
+    WCHAR tempPath[MAX_PATH];
+    HANDLE file;
+    BYTE *table;
+    DWORD size;
+    BOOL written;
+
+    if (!GetAppMapPath(TRUE, mapPath, RTL_NUMBER_OF(mapPath)) ||
+        FAILED(StringCchPrintf(tempPath, RTL_NUMBER_OF(tempPath), L"%s.tmp", mapPath)))
+        return FALSE;
+
+    table = BuildTable(pairs, count, &size);
+    if (!table)
+        return FALSE;
+
+    // written aside and moved in place, a mapped old table stays valid
+    file = CreateFile(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        perror("CreateFile");
+        free(table);
+        return FALSE;
+    }
+
+    written = QioWriteBuffer(file, table, size);
+    CloseHandle(file);
+    free(table);
+
+    if (!written || !MoveFileEx(tempPath, mapPath, MOVEFILE_REPLACE_EXISTING))
+    {
+        perror("writing app map");
+        DeleteFile(tempPath);
+        return FALSE;
+    }
+
+    LogDebug("%Iu entries, %lu bytes", count, size);
+    return TRUE;
+}
+
+// Writes the table from the values of the registry key.
+static DWORD ImportRegistry(void)
+{
+    HKEY key = NULL;
+    DWORD status;
+    DWORD valueCount, maxName, maxData;
+    DWORD cchName, cbData, type, i;
+    APP_MAP_PAIR *pairs = NULL;
+    size_t count = 0;
+    WCHAR *name, *data;
+
+    SetLastError(status = RegOpenKeyEx(HKEY_LOCAL_MACHINE, APP_MAP_REGISTRY_KEY, 0, KEY_READ, &key));
+    if (status != ERROR_SUCCESS)
+        return perror("RegOpenKeyEx(AppMap key)");
+
+    SetLastError(status = RegQueryInfoKey(key, NULL, NULL, NULL, NULL, NULL, NULL, &valueCount, &maxName, &maxData, NULL, NULL));
+    if (status != ERROR_SUCCESS)
+    {
+        status = perror("RegQueryInfoKey");
+        goto cleanup;
+    }
+
+    status = ERROR_NOT_ENOUGH_MEMORY;
+    pairs = calloc(valueCount + 1, sizeof(APP_MAP_PAIR));
+    if (!pairs)
+        goto cleanup;
+
+    for (i = 0; i < valueCount; i++)
+    {
+        cchName = maxName + 1;
+        cbData = maxData + sizeof(WCHAR);
+        name = malloc(cchName * sizeof(WCHAR));
+        data = calloc(1, cbData + sizeof(WCHAR));
+        if (!name || !data)
+        {
+            free(name);
+            free(data);
+            goto cleanup;
+        }
+
+        // the data may lack the terminating null, there is room for one more
+        if (ERROR_SUCCESS != RegEnumValue(key, i, name, &cchName, NULL, &type, (BYTE *)data, &cbData) || type != REG_SZ)
+        {
+            free(name);
+            free(data);
+            continue;
+        }
+
+        pairs[count].Key = name;
+        pairs[count].Value = data;
+        count++;
+    }
+
+    LogInfo("importing %Iu entries from the registry", count);
+    status = AppMapWrite(pairs, count) ? ERROR_SUCCESS : ERROR_WRITE_FAULT;
+
+cleanup:
+    if (pairs)
+    {
+        for (i = 0; i < count; i++)
+        {
+            free((WCHAR *)pairs[i].Key);
+            free((WCHAR *)pairs[i].Value);
+        }
+        free(pairs);
+    }
+    if (key)
+        RegCloseKey(key);
+    return status;
+}
+
+// The legacy key may still be written by older tools, the table follows it then.
+static BOOL RegistryNewer(IN const FILETIME *tableTime)
+{
+    HKEY key;
+    FILETIME keyTime;
+    LONG status;
+
+    if (ERROR_SUCCESS != RegOpenKeyEx(HKEY_LOCAL_MACHINE, APP_MAP_REGISTRY_KEY, 0, KEY_READ, &key))
+        return FALSE;
+
+    status = RegQueryInfoKey(key, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &keyTime);
+    RegCloseKey(key);
+
+    return status == ERROR_SUCCESS && CompareFileTime(&keyTime, tableTime) > 0;
+}
+
+static DWORD MapTable(OUT APP_MAP *map, OUT FILETIME *writeTime)
+{
+    WCHAR mapPath[MAX_PATH];
+    HANDLE file;
+    LARGE_INTEGER size;
+    const APP_MAP_HEADER *header;
+    DWORD status = ERROR_SUCCESS;
+
+    if (!GetAppMapPath(FALSE, mapPath, RTL_NUMBER_OF(mapPath)))
+        return ERROR_PATH_NOT_FOUND;
+
+    file = CreateFile(mapPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return GetLastError();
+
+    if (!GetFileTime(file, NULL, NULL, writeTime) ||
+        !GetFileSizeEx(file, &size) || size.QuadPart < sizeof(APP_MAP_HEADER) || size.QuadPart > APP_MAP_MAX_SIZE)
+    {
+        status = ERROR_INVALID_DATA;
+        goto cleanup;
+    }
+
+    map->Mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!map->Mapping)
+    {
+        status = perror("CreateFileMapping");
+        goto cleanup;
+    }
+
+    map->View = MapViewOfFile(map->Mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!map->View)
+    {
+        status = perror("MapViewOfFile");
+        goto cleanup;
+    }
+
+    map->Size = size.QuadPart;
+    header = (const APP_MAP_HEADER *)map->View;
+    // lookups check every offset, only the layout is checked here
+    if (header->Magic != APP_MAP_MAGIC || header->SlotCount == 0 || (header->SlotCount & (header->SlotCount - 1)) ||
+        sizeof(*header) + (UINT64)header->SlotCount * sizeof(APP_MAP_SLOT) + (UINT64)header->ArenaLength * sizeof(WCHAR) != map->Size)
+    {
+        LogWarning("'%s' is not valid", mapPath);
+        status = ERROR_INVALID_DATA;
+    }
+
+cleanup:
+    CloseHandle(file);
+    if (status != ERROR_SUCCESS)
+        AppMapClose(map);
+    return status;
+}
+
+DWORD AppMapOpen(OUT APP_MAP *map)
+{
+    DWORD status;
+    FILETIME writeTime;
+
+    ZeroMemory(map, sizeof(*map));
+
+    status = MapTable(map, &writeTime);
+    if (status == ERROR_SUCCESS)
+    {
+        if (!RegistryNewer(&writeTime))
+            return ERROR_SUCCESS;
+
+        AppMapClose(map);
+    }
+    else if (status != ERROR_FILE_NOT_FOUND && status != ERROR_PATH_NOT_FOUND)
+    {
+        return status;
+    }
+
+    status = ImportRegistry();
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    return MapTable(map, &writeTime);
+}
+
+// Returns the arena string at offset, NULL if it's not inside the arena.
+static const WCHAR *GetArenaString(IN const APP_MAP *map, IN DWORD offset)
+{
+    const APP_MAP_HEADER *header = (const APP_MAP_HEADER *)map->View;
+    const WCHAR *arena = (const WCHAR *)((const APP_MAP_SLOT *)(header + 1) + header->SlotCount);
+
+    if (offset >= header->ArenaLength || wcsnlen(arena + offset, header->ArenaLength - offset) == header->ArenaLength - offset)
+        return NULL;
+
+    return arena + offset;
+}
+
+const WCHAR *AppMapLookup(IN const APP_MAP *map, IN const WCHAR *key)
+{
+    const APP_MAP_HEADER *header = (const APP_MAP_HEADER *)map->View;
+    const APP_MAP_SLOT *slots = (const APP_MAP_SLOT *)(header + 1);
+    const WCHAR *slotKey;
+    DWORD hash = HashKey(key);
+    DWORD mask = header->SlotCount - 1;
+    DWORD i, probes;
+
+    // the table is never full, but a damaged one must not loop forever
+    for (i = hash & mask, probes = 0; slots[i].Key && probes < header->SlotCount; i = (i + 1) & mask, probes++)
+    {
+        if (slots[i].Hash != hash)
+            continue;
+
+        slotKey = GetArenaString(map, slots[i].Key);
+        if (slotKey && KeysEqual(slotKey, key))
+            return GetArenaString(map, slots[i].Value);
+    }
+
+    return NULL;
+}
+
+void AppMapClose(IN OUT APP_MAP *map)
+{
+    if (map->View)
+        UnmapViewOfFile(map->View);
+    if (map->Mapping)
+        CloseHandle(map->Mapping);
+    ZeroMemory(map, sizeof(*map));
+}
@@ -0,0 +1,58 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+// Maps icon names (shortcut path hashes) and .desktop names to shortcut paths.
+// Written by qubes.GetAppMenus in one go, read by the services that get these
+// names from the other side. The file is a hash table mapped read-only, so a
+// lookup is a hash and usually a single probe, with no registry access.
+
+#pragma once
+#include <windows.h>
+
+// before the table existed the map was kept in this key, it's imported when it's newer than the table
+#define APP_MAP_REGISTRY_KEY L"Software\\Invisible Things Lab\\Qubes Tools\\AppMap"
+
+typedef struct _APP_MAP_PAIR
+{
+    const WCHAR *Key;
+    const WCHAR *Value;
+} APP_MAP_PAIR;
+
+typedef struct _APP_MAP
+{
+    HANDLE Mapping;
+    const BYTE *View;
+    UINT64 Size;
+} APP_MAP;
+
+// Replaces the table on disk, readers see either the old one or the new one.
+// Keys are compared case-insensitively (ASCII only), the last of duplicates wins.
+BOOL AppMapWrite(IN const APP_MAP_PAIR *pairs, IN size_t count);
+
+// Maps the table (%ProgramData%\Qubes\AppMap.bin), imports the registry key first
+// if there is no table yet or the key was changed after the table was written.
+DWORD AppMapOpen(OUT APP_MAP *map);
+
+// Returns the value for key, NULL if there is none. Valid until AppMapClose.
+const WCHAR *AppMapLookup(IN const APP_MAP *map, IN const WCHAR *key);
+
+void AppMapClose(IN OUT APP_MAP *map);
@@ -0,0 +1,50 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Clipboard text cache kept by clipboard-monitor for qubes.ClipboardCopy.
+//
+// The monitor owns a per-session section holding the current clipboard text already
+// converted to UTF-8. clipboard-copy only uses it when the recorded sequence number
+// is still the current one, so a stale cache (monitor busy or gone) just means the
+// clipboard is read directly as before.
+
+#pragma once
+#include <windows.h>
+
+#define CLIPBOARD_CACHE_SECTION L"Local\\qubes-clipboard-cache"
+#define CLIPBOARD_CACHE_LOCK L"Local\\qubes-clipboard-cache-lock"
+
+// readers give up on the cache after this long, ms
+#define CLIPBOARD_CACHE_LOCK_TIMEOUT 500
+
+// default for the MaxClipboardSize config value, bytes of UTF-8 text
+#define CLIPBOARD_CACHE_DEFAULT_SIZE (16*1024*1024)
+
+// The section is reserved for the header and Capacity bytes of data, pages are
+// committed by the monitor as needed. Protected by the CLIPBOARD_CACHE_LOCK mutex.
+typedef struct _CLIPBOARD_CACHE
+{
+    DWORD Sequence; // GetClipboardSequenceNumber() the content was taken at
+    DWORD Valid; // Data holds the clipboard text for Sequence
+    DWORD Capacity;
+    DWORD Size;
+    BYTE Data[ANYSIZE_ARRAY]; // UTF-8, not null-terminated
+} CLIPBOARD_CACHE;
@@ -0,0 +1,55 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Wire format of qubes.ClipboardCopy and qubes.ClipboardPaste data.
+//
+// Plain data is UTF-8 text, as it always was. Data starting with CLIP_MAGIC is
+// a sequence of typed items instead: struct clip_item followed by the item data
+// in chunks (struct clip_chunk and size bytes), a chunk of size 0 ends the item.
+// An item of type CLIP_ITEM_END ends the data. Agents that don't know the format
+// would paste it as text, so it is only sent when enabled in the configuration.
+
+#pragma once
+#include <stdint.h>
+
+#define CLIP_MAGIC "\0QCLIP1\n"
+#define CLIP_MAGIC_SIZE 8
+
+#define CLIP_ITEM_END 0
+#define CLIP_ITEM_TEXT 1 // UTF-8
+#define CLIP_ITEM_IMAGE_QOI 2 // see qoi.h
+
+#define CLIP_MAX_CHUNK (1024*1024)
+
+#pragma pack(push, 1)
+struct clip_item
+{
+    uint32_t type;
+    uint32_t _pad;
+};
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+struct clip_chunk
+{
+    uint32_t size;
+};
+#pragma pack(pop)
@@ -0,0 +1,206 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dir-enum.h"
+
+static BYTE **g_dirEnumBuffers = NULL; // one per depth, allocated on first use
+static ULONG g_dirEnumBuffersCount = 0;
+
+BOOL DirEnumPathInit(OUT DIR_ENUM_PATH *path, IN const WCHAR *initialPath)
+{
+    path->Length = wcslen(initialPath);
+    path->Capacity = max(path->Length + 1, MAX_PATH);
+    path->Buffer = malloc(path->Capacity * sizeof(WCHAR));
+    if (!path->Buffer)
+        return FALSE;
+
+    memcpy(path->Buffer, initialPath, (path->Length + 1) * sizeof(WCHAR));
+    return TRUE;
+}
+
+void DirEnumPathFree(IN OUT DIR_ENUM_PATH *path)
+{
+    free(path->Buffer);
+    path->Buffer = NULL;
+    path->Length = 0;
+    path->Capacity = 0;
+}
+
+BOOL DirEnumPathAppend(IN OUT DIR_ENUM_PATH *path, IN WCHAR separator, IN const WCHAR *name, IN size_t nameLength, OUT size_t *previousLength)
+{
+    size_t required = path->Length + nameLength + 2;
+    size_t newCapacity;
+    WCHAR *newBuffer;
+
+    if (required > path->Capacity)
+    {
+        newCapacity = max(required, 2 * path->Capacity);
+        newBuffer = realloc(path->Buffer, newCapacity * sizeof(WCHAR));
+        if (!newBuffer)
+            return FALSE;
+
+        path->Buffer = newBuffer;
+        path->Capacity = newCapacity;
+    }
+
+    *previousLength = path->Length;
+    path->Buffer[path->Length++] = separator;
+    memcpy(path->Buffer + path->Length, name, nameLength * sizeof(WCHAR));
+    path->Length += nameLength;
+    path->Buffer[path->Length] = L'\0';
+    return TRUE;
+}
+
+void DirEnumPathTruncate(IN OUT DIR_ENUM_PATH *path, IN size_t length)
+{
+    path->Length = length;
+    path->Buffer[length] = L'\0';
+}
+
+static BYTE *GetDepthBuffer(IN ULONG depth)
+{
+    BYTE **newBuffers;
+
+    if (depth >= g_dirEnumBuffersCount)
+    {
+        newBuffers = realloc(g_dirEnumBuffers, (depth + 1) * sizeof(BYTE *));
+        if (!newBuffers)
+            return NULL;
+
+        ZeroMemory(newBuffers + g_dirEnumBuffersCount, (depth + 1 - g_dirEnumBuffersCount) * sizeof(BYTE *));
+        g_dirEnumBuffers = newBuffers;
+        g_dirEnumBuffersCount = depth + 1;
+    }
+
+    if (!g_dirEnumBuffers[depth])
+        g_dirEnumBuffers[depth] = VirtualAlloc(NULL, DIR_ENUM_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+    return g_dirEnumBuffers[depth];
+}
+
+static void FreeDepthBuffers(void)
+{
+    ULONG i;
+
+    for (i = 0; i < g_dirEnumBuffersCount; i++)
+    {
+        if (g_dirEnumBuffers[i])
+            VirtualFree(g_dirEnumBuffers[i], 0, MEM_RELEASE);
+    }
+
+    free(g_dirEnumBuffers);
+    g_dirEnumBuffers = NULL;
+    g_dirEnumBuffersCount = 0;
+}
+
+DWORD DirEnumOpen(IN const WCHAR *path, IN ULONG depth, OUT DIR_ENUM *dirEnum)
+{
+    DWORD status;
+
+    ZeroMemory(dirEnum, sizeof(*dirEnum));
+    dirEnum->Depth = depth;
+
+    dirEnum->Buffer = GetDepthBuffer(depth);
+    if (!dirEnum->Buffer)
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto fail;
+    }
+
+    // FILE_FLAG_BACKUP_SEMANTICS required to open directories
+    dirEnum->Handle = CreateFile(path, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (dirEnum->Handle == INVALID_HANDLE_VALUE)
+    {
+        status = GetLastError();
+        goto fail;
+    }
+
+    dirEnum->Restart = TRUE;
+    return ERROR_SUCCESS;
+
+fail:
+    // not closed by the caller
+    if (depth == 0)
+        FreeDepthBuffers();
+    return status;
+}
+
+DWORD DirEnumNext(IN OUT DIR_ENUM *dirEnum, OUT DIR_ENUM_ENTRY *entry)
+{
+    FILE_FULL_DIR_INFO *info;
+    DWORD status;
+
+    while (TRUE)
+    {
+        if (!dirEnum->Next)
+        {
+            if (!GetFileInformationByHandleEx(dirEnum->Handle,
+                dirEnum->Restart ? FileFullDirectoryRestartInfo : FileFullDirectoryInfo,
+                dirEnum->Buffer, DIR_ENUM_BUFFER_SIZE))
+            {
+                status = GetLastError();
+                // nothing at all, not even "." (root of a volume)
+                if (dirEnum->Restart && status == ERROR_FILE_NOT_FOUND)
+                    status = ERROR_NO_MORE_FILES;
+                return status;
+            }
+
+            dirEnum->Restart = FALSE;
+            dirEnum->Next = (FILE_FULL_DIR_INFO *)dirEnum->Buffer;
+        }
+
+        info = dirEnum->Next;
+        if (info->NextEntryOffset)
+            dirEnum->Next = (FILE_FULL_DIR_INFO *)((BYTE *)info + info->NextEntryOffset);
+        else
+            dirEnum->Next = NULL;
+
+        entry->Name = info->FileName;
+        entry->NameLength = info->FileNameLength / sizeof(WCHAR);
+        if ((entry->NameLength == 1 && entry->Name[0] == L'.') ||
+            (entry->NameLength == 2 && entry->Name[0] == L'.' && entry->Name[1] == L'.'))
+            continue;
+
+        entry->Attributes = info->FileAttributes;
+        entry->Size = info->EndOfFile.QuadPart;
+        entry->WriteTime = info->LastWriteTime.QuadPart;
+        return ERROR_SUCCESS;
+    }
+}
+
+void DirEnumClose(IN OUT DIR_ENUM *dirEnum)
+{
+    if (dirEnum->Handle && dirEnum->Handle != INVALID_HANDLE_VALUE)
+        CloseHandle(dirEnum->Handle);
+
+    dirEnum->Handle = NULL;
+    dirEnum->Next = NULL;
+    dirEnum->Buffer = NULL;
+
+    // the walk is over
+    if (dirEnum->Depth == 0)
+        FreeDepthBuffers();
+}
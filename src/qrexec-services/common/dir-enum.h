@@ -0,0 +1,72 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#pragma once
+#include <windows.h>
+
+// Bulk directory listing for walking trees. Entries are read many at a time with
+// GetFileInformationByHandleEx into a large buffer that is reused by all directories
+// at the same depth, and paths are built in place in a single growable buffer,
+// so walking a tree doesn't allocate per entry. One walk at a time, the buffers are shared.
+
+// per directory depth, holds a few hundred entries
+#define DIR_ENUM_BUFFER_SIZE (64*1024)
+
+typedef struct _DIR_ENUM_PATH
+{
+    WCHAR *Buffer; // null-terminated, may move when the path grows
+    size_t Length; // in characters
+    size_t Capacity;
+} DIR_ENUM_PATH;
+
+typedef struct _DIR_ENUM
+{
+    HANDLE Handle;
+    BYTE *Buffer;
+    FILE_FULL_DIR_INFO *Next; // NULL if the buffer is used up
+    BOOL Restart;
+    ULONG Depth;
+} DIR_ENUM;
+
+typedef struct _DIR_ENUM_ENTRY
+{
+    const WCHAR *Name; // not null-terminated, valid until the next DirEnumNext at this depth
+    size_t NameLength; // in characters
+    DWORD Attributes;
+    UINT64 Size;
+    UINT64 WriteTime; // FILETIME
+} DIR_ENUM_ENTRY;
+
+BOOL DirEnumPathInit(OUT DIR_ENUM_PATH *path, IN const WCHAR *initialPath);
+void DirEnumPathFree(IN OUT DIR_ENUM_PATH *path);
+
+// Appends separator and name, previousLength is what DirEnumPathTruncate needs to undo it.
+BOOL DirEnumPathAppend(IN OUT DIR_ENUM_PATH *path, IN WCHAR separator, IN const WCHAR *name, IN size_t nameLength, OUT size_t *previousLength);
+void DirEnumPathTruncate(IN OUT DIR_ENUM_PATH *path, IN size_t length);
+
+// Directories being listed at the same time must have different depths.
+DWORD DirEnumOpen(IN const WCHAR *path, IN ULONG depth, OUT DIR_ENUM *dirEnum);
+
+// Returns ERROR_NO_MORE_FILES after the last entry, "." and ".." are skipped.
+DWORD DirEnumNext(IN OUT DIR_ENUM *dirEnum, OUT DIR_ENUM_ENTRY *entry);
+
+// Closing the depth 0 directory ends the walk and frees the buffers of all depths.
+void DirEnumClose(IN OUT DIR_ENUM *dirEnum);
@@ -0,0 +1,186 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <stdlib.h>
+
+#include <qubes-io.h>
+#include <log.h>
+
+#include "dvm-stream.h"
+
+typedef struct _DVM_STREAM_BUFFER
+{
+    BYTE *Data;
+    DWORD Size; // 0 marks the end of input
+    DWORD Error; // set with Size 0 if reading failed
+} DVM_STREAM_BUFFER;
+
+typedef struct _DVM_STREAM
+{
+    HANDLE Input;
+    DVM_STREAM_BUFFER Buffers[DVM_STREAM_BUFFERS];
+    HANDLE BuffersFree; // semaphore
+    HANDLE BuffersUsed; // semaphore
+    volatile LONG Cancel;
+} DVM_STREAM;
+
+static DWORD WINAPI ReaderThread(IN void *param)
+{
+    DVM_STREAM *stream = param;
+    DVM_STREAM_BUFFER *buffer;
+    DWORD next = 0;
+    DWORD cbRead;
+
+    while (TRUE)
+    {
+        WaitForSingleObject(stream->BuffersFree, INFINITE);
+        buffer = &stream->Buffers[next];
+        next = (next + 1) % DVM_STREAM_BUFFERS;
+        buffer->Error = ERROR_SUCCESS;
+
+        if (InterlockedCompareExchange(&stream->Cancel, 0, 0))
+        {
+            buffer->Size = 0;
+            buffer->Error = ERROR_CANCELLED;
+        }
+        // pipes return whatever is available, pass it on right away
+        else if (!ReadFile(stream->Input, buffer->Data, DVM_STREAM_BUFFER_SIZE, &cbRead, NULL))
+        {
+            buffer->Size = 0;
+            if (GetLastError() != ERROR_BROKEN_PIPE) // other end closed, that's the end of input
+                buffer->Error = GetLastError();
+        }
+        else
+        {
+            buffer->Size = cbRead;
+        }
+
+        ReleaseSemaphore(stream->BuffersUsed, 1, NULL);
+        if (buffer->Size == 0)
+            break;
+    }
+
+    return 0;
+}
+
+BOOL DvmStreamCopy(IN HANDLE output, IN HANDLE input, IN fDvmDataCallback dataCallback OPTIONAL)
+{
+    DVM_STREAM stream;
+    DVM_STREAM_BUFFER *buffer;
+    HANDLE readerThread = NULL;
+    DWORD next = 0;
+    DWORD status = ERROR_SUCCESS;
+    UINT64 bytesDone = 0;
+    int i;
+
+    ZeroMemory(&stream, sizeof(stream));
+    stream.Input = input;
+
+    for (i = 0; i < DVM_STREAM_BUFFERS; i++)
+    {
+        stream.Buffers[i].Data = VirtualAlloc(NULL, DVM_STREAM_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (!stream.Buffers[i].Data)
+        {
+            status = perror("VirtualAlloc");
+            goto cleanup;
+        }
+    }
+
+    stream.BuffersFree = CreateSemaphore(NULL, DVM_STREAM_BUFFERS, DVM_STREAM_BUFFERS, NULL);
+    stream.BuffersUsed = CreateSemaphore(NULL, 0, DVM_STREAM_BUFFERS, NULL);
+    if (!stream.BuffersFree || !stream.BuffersUsed)
+    {
+        status = perror("CreateSemaphore");
+        goto cleanup;
+    }
+
+    readerThread = CreateThread(NULL, 0, ReaderThread, &stream, 0, NULL);
+    if (!readerThread)
+    {
+        status = perror("CreateThread");
+        goto cleanup;
+    }
+
+    while (TRUE)
+    {
+        WaitForSingleObject(stream.BuffersUsed, INFINITE);
+        buffer = &stream.Buffers[next];
+        next = (next + 1) % DVM_STREAM_BUFFERS;
+
+        if (buffer->Size == 0)
+        {
+            status = buffer->Error;
+            break;
+        }
+
+        if (!QioWriteBuffer(output, buffer->Data, buffer->Size))
+        {
+            status = perror("QioWriteBuffer");
+            break;
+        }
+
+        bytesDone += buffer->Size;
+        if (dataCallback && !dataCallback(buffer->Data, buffer->Size, bytesDone))
+        {
+            status = GetLastError();
+            if (status == ERROR_SUCCESS)
+                status = ERROR_CANCELLED;
+            break;
+        }
+
+        ReleaseSemaphore(stream.BuffersFree, 1, NULL);
+    }
+
+cleanup:
+    if (readerThread)
+    {
+        if (status != ERROR_SUCCESS)
+        {
+            // the reader may be waiting for a free buffer (this one is still held)
+            // or blocked reading, possibly not yet when the read is cancelled
+            InterlockedExchange(&stream.Cancel, 1);
+            ReleaseSemaphore(stream.BuffersFree, 1, NULL);
+            while (WaitForSingleObject(readerThread, 100) == WAIT_TIMEOUT)
+                CancelSynchronousIo(readerThread);
+        }
+        else
+        {
+            WaitForSingleObject(readerThread, INFINITE);
+        }
+
+        CloseHandle(readerThread);
+    }
+
+    if (stream.BuffersFree)
+        CloseHandle(stream.BuffersFree);
+    if (stream.BuffersUsed)
+        CloseHandle(stream.BuffersUsed);
+
+    for (i = 0; i < DVM_STREAM_BUFFERS; i++)
+    {
+        if (stream.Buffers[i].Data)
+            VirtualFree(stream.Buffers[i].Data, 0, MEM_RELEASE);
+    }
+
+    SetLastError(status);
+    return status == ERROR_SUCCESS;
+}
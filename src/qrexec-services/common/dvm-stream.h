@@ -0,0 +1,38 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#pragma once
+#include <windows.h>
+
+// Streaming copy for the DispVM services (qubes.OpenInVM). A reader thread fills a
+// ring of large buffers while the calling thread writes the filled ones out, so
+// reading from the vchan and writing to disk (or the other way around) overlap.
+
+#define DVM_STREAM_BUFFER_SIZE (1024*1024)
+#define DVM_STREAM_BUFFERS 4
+
+// Called after every written buffer with its data and the total written so far.
+// Returning FALSE stops the copy with the last error set by the callback.
+typedef BOOL(*fDvmDataCallback)(const BYTE *data, DWORD size, UINT64 bytesDone);
+
+// Copies input to output until the end of input (end of file or closed pipe).
+// Returns FALSE with the last error set on failure.
+BOOL DvmStreamCopy(IN HANDLE output, IN HANDLE input, IN fDvmDataCallback dataCallback OPTIONAL);
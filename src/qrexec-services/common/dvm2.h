@@ -19,4 +19,64 @@
  *
  */
 
+#pragma once
+#include <stdint.h>
+
 #define DVM_FILENAME_SIZE 256
+
+/*
+ * Block-level delta for the edited file (Windows peers only).
+ *
+ * The file name block is a NUL-terminated name padded with zeros. A sender that
+ * can apply deltas puts struct dvm_delta_offer in the last bytes of the padding,
+ * only if the name is short enough to leave room for it (longer names are sent
+ * whole, without an offer). Other editors just see the name.
+ *
+ * An editor that got the offer answers a changed file with struct dvm_delta_header
+ * carrying the offer's nonce instead of the raw content, followed by the blocks that
+ * differ from the original: struct dvm_delta_block and
+ * min(block_size, new_size - index * block_size) bytes each, ending with index
+ * DVM_DELTA_END. Blocks past the original length are always sent, the result is
+ * truncated to new_size. The sender applies them to the content it sent, not to
+ * the file as it is now.
+ *
+ * A reply is a delta only if an offer was made and the header has both the magic
+ * and the nonce, so a raw file that happens to start with the magic (from an editor
+ * that ignored the offer) is never taken for one.
+ */
+#define DVM_DELTA_OFFER_MAGIC 0x31445144 // "DQD1"
+#define DVM_DELTA_BLOCK_SIZE (64*1024)
+#define DVM_DELTA_END UINT64_MAX
+
+#define DVM_DELTA_MAGIC "QubesDvmDelta01"
+#define DVM_DELTA_MAGIC_SIZE 16
+
+#pragma pack(push, 1)
+struct dvm_delta_offer
+{
+    uint32_t magic; // DVM_DELTA_OFFER_MAGIC
+    uint32_t block_size; // DVM_DELTA_BLOCK_SIZE
+    uint64_t nonce; // random, echoed in dvm_delta_header
+};
+#pragma pack(pop)
+
+// longest name (with the terminating NUL) that leaves room for the offer
+#define DVM_DELTA_FILENAME_SIZE (DVM_FILENAME_SIZE - sizeof(struct dvm_delta_offer))
+
+#pragma pack(push, 1)
+struct dvm_delta_header
+{
+    char magic[DVM_DELTA_MAGIC_SIZE]; // DVM_DELTA_MAGIC including the NUL
+    uint64_t new_size;
+    uint32_t block_size; // DVM_DELTA_BLOCK_SIZE
+    uint32_t _pad;
+    uint64_t nonce; // from dvm_delta_offer
+};
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+struct dvm_delta_block
+{
+    uint64_t index;
+};
+#pragma pack(pop)
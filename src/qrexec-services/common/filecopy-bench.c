@@ -0,0 +1,397 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Packs and unpacks synthetic trees over a pipe with the POSIX backends and
+// reports the throughput of the filecopy engine:
+//
+//   filecopy-bench [-t tiny files] [-h huge file MB] [-d depth] [work directory]
+//
+// Scenarios: many tiny files, a few huge files and deeply nested directories.
+// The defaults (20000 tiny files, 256 MB huge files, depth 200) run in seconds,
+// raise them for measurements that matter.
+
+#define _XOPEN_SOURCE 700
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filecopy-posix.h"
+
+#define TINY_FILE_SIZE 16
+#define TINY_FILES_PER_DIRECTORY 1000
+#define HUGE_FILES 3
+#define DEEP_NAME "deep"
+// both ends open entries by their whole relative path, it must fit in PATH_MAX
+#define MAX_DEPTH ((PATH_MAX - 64) / (int)sizeof("/" DEEP_NAME))
+
+// the trees are created in a temporary directory, the benchmark runs in it
+#define SOURCE_DIRECTORY "src"
+#define DESTINATION_DIRECTORY "dst"
+
+typedef struct _SCENARIO
+{
+    uint64_t Files; // files and directories
+    uint64_t Bytes;
+} SCENARIO;
+
+static double Now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int WriteFile(const char *path, const void *data, size_t size, uint64_t count)
+{
+    int file = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+    if (file < 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    while (count-- > 0)
+    {
+        if (write(file, data, size) != (ssize_t)size)
+        {
+            perror(path);
+            close(file);
+            return -1;
+        }
+    }
+
+    return close(file);
+}
+
+static int MakeTinyTree(const char *root, uint64_t files, SCENARIO *scenario)
+{
+    char path[256];
+    char data[TINY_FILE_SIZE];
+    uint64_t i;
+
+    memset(data, 'x', sizeof(data));
+    if (mkdir(root, 0755) < 0)
+        return -1;
+
+    scenario->Files = 1;
+    for (i = 0; i < files; i++)
+    {
+        if (i % TINY_FILES_PER_DIRECTORY == 0)
+        {
+            snprintf(path, sizeof(path), "%.64s/%llu", root, (unsigned long long)(i / TINY_FILES_PER_DIRECTORY));
+            if (mkdir(path, 0755) < 0)
+                return -1;
+            scenario->Files++;
+        }
+
+        snprintf(path, sizeof(path), "%.64s/%llu/%llu", root,
+            (unsigned long long)(i / TINY_FILES_PER_DIRECTORY), (unsigned long long)i);
+        if (WriteFile(path, data, sizeof(data), 1) < 0)
+            return -1;
+    }
+
+    scenario->Files += files;
+    scenario->Bytes = files * TINY_FILE_SIZE;
+    return 0;
+}
+
+static int MakeHugeTree(const char *root, uint64_t megabytes, SCENARIO *scenario)
+{
+    char path[256];
+    uint8_t *data;
+    int i, j;
+
+    data = malloc(1024 * 1024);
+    if (!data || mkdir(root, 0755) < 0)
+    {
+        free(data);
+        return -1;
+    }
+
+    // not all zeros, a sparse-aware sender must not skip anything here
+    for (i = 0; i < 1024 * 1024; i++)
+        data[i] = (uint8_t)(i * 7 + 1);
+
+    for (j = 0; j < HUGE_FILES; j++)
+    {
+        snprintf(path, sizeof(path), "%.64s/huge%d", root, j);
+        if (WriteFile(path, data, 1024 * 1024, megabytes) < 0)
+        {
+            free(data);
+            return -1;
+        }
+    }
+
+    free(data);
+    scenario->Files = 1 + HUGE_FILES;
+    scenario->Bytes = (uint64_t)HUGE_FILES * megabytes * 1024 * 1024;
+    return 0;
+}
+
+// A chain of directories, each with one small file.
+static int MakeDeepTree(const char *root, int depth, SCENARIO *scenario)
+{
+    char path[MAX_PATH_LENGTH];
+    size_t length = strlen(root);
+    int i;
+
+    if (length + (sizeof("/" DEEP_NAME) - 1) * (size_t)depth + sizeof("/f") > sizeof(path))
+        return -1;
+
+    memcpy(path, root, length + 1);
+    for (i = 0; i < depth; i++)
+    {
+        if (mkdir(path, 0755) < 0)
+            return -1;
+
+        memcpy(path + length, "/f", sizeof("/f"));
+        if (WriteFile(path, "deep", 4, 1) < 0)
+            return -1;
+
+        memcpy(path + length, "/" DEEP_NAME, sizeof("/" DEEP_NAME));
+        length += sizeof("/" DEEP_NAME) - 1;
+    }
+
+    scenario->Files = 2 * (uint64_t)depth;
+    scenario->Bytes = 4 * (uint64_t)depth;
+    return 0;
+}
+
+static int RemoveEntry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+static void RemoveTree(const char *path)
+{
+    nftw(path, RemoveEntry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+static int Unpack(int input, int output, const char *destination)
+{
+    FCE_POSIX_UNPACK posix;
+    FCE_UNPACK unpack;
+    int root;
+    int status;
+
+    root = open(destination, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root < 0 || FcePosixUnpackInit(&posix, input, output, root) != 0)
+        return EIO;
+
+    FceUnpackInit(&unpack, &g_fcePosixUnpackBackend, &posix);
+    status = FceUnpack(&unpack);
+    FceUnpackSendResult(&unpack, status, status ? unpack.LastName : NULL);
+    FceUnpackCleanup(&unpack);
+    FcePosixUnpackCleanup(&posix);
+    close(root);
+    return status;
+}
+
+static int Pack(int input, int output, const char *directory, const char *name)
+{
+    FCE_POSIX_PACK posix;
+    FCE_PACK pack;
+    FCE_RESULT result;
+    int source;
+    int status;
+
+    source = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (source < 0 || FcePosixPackInit(&posix, input, output) != 0)
+        return EIO;
+
+    FcePackInit(&pack, &g_fcePosixPackBackend, &posix);
+    status = FcePosixPackPath(&pack, source, name);
+    if (status == 0)
+        status = FcePackEnd(&pack);
+
+    // the receiver reports its own failure even if the stream broke
+    if (FcePackReadResult(&pack, &result) != 0)
+        status = status ? status : EIO;
+    else if (result.ErrorCode != 0)
+        status = (int)result.ErrorCode;
+    else if (!result.CrcMatches)
+        status = EILSEQ;
+
+    FcePosixPackCleanup(&posix);
+    close(source);
+    return status;
+}
+
+// Sends source/name to destination/name through a pair of pipes, the receiver
+// runs in a child process.
+static int Transfer(const char *source, const char *destination, const char *name)
+{
+    int toReceiver[2], toSender[2];
+    int childStatus;
+    int status;
+    pid_t child;
+
+    if (pipe(toReceiver) < 0 || pipe(toSender) < 0)
+        return errno;
+
+    child = fork();
+    if (child < 0)
+        return errno;
+
+    if (child == 0)
+    {
+        close(toReceiver[1]);
+        close(toSender[0]);
+        _exit(Unpack(toReceiver[0], toSender[1], destination) ? 1 : 0);
+    }
+
+    close(toReceiver[0]);
+    close(toSender[1]);
+    status = Pack(toSender[0], toReceiver[1], source, name);
+    close(toReceiver[1]);
+    close(toSender[0]);
+
+    if (waitpid(child, &childStatus, 0) < 0)
+        return errno;
+
+    if (status == 0 && (!WIFEXITED(childStatus) || WEXITSTATUS(childStatus) != 0))
+        status = EIO;
+
+    return status;
+}
+
+static int Failed(const char *name)
+{
+    fprintf(stderr, "%s: creating the source tree failed: %s\n", name, strerror(errno));
+    return 1;
+}
+
+static int Run(const char *name, SCENARIO *scenario)
+{
+    char path[256];
+    double start, elapsed;
+    int status;
+
+    if (mkdir(DESTINATION_DIRECTORY, 0755) < 0)
+    {
+        perror(DESTINATION_DIRECTORY);
+        return 1;
+    }
+
+    start = Now();
+    status = Transfer(SOURCE_DIRECTORY, DESTINATION_DIRECTORY, name);
+    elapsed = Now() - start;
+
+    if (status != 0)
+        fprintf(stderr, "%s: transfer failed: %s\n", name, strerror(status));
+    else
+        printf("%-6s %10llu files %10.1f MB %8.3f s %12.0f files/s %10.1f MB/s\n",
+            name, (unsigned long long)scenario->Files, scenario->Bytes / 1e6, elapsed,
+            scenario->Files / elapsed, scenario->Bytes / 1e6 / elapsed);
+
+    RemoveTree(DESTINATION_DIRECTORY);
+    snprintf(path, sizeof(path), SOURCE_DIRECTORY "/%.64s", name);
+    RemoveTree(path);
+    return status != 0;
+}
+
+int main(int argc, char **argv)
+{
+    char workDirectory[MAX_PATH_LENGTH];
+    const char *parent;
+    uint64_t tinyFiles = 20000;
+    uint64_t hugeMegabytes = 256;
+    int depth = 200;
+    SCENARIO scenario;
+    int failed = 0;
+    int option;
+
+    while ((option = getopt(argc, argv, "t:h:d:")) != -1)
+    {
+        switch (option)
+        {
+        case 't':
+            tinyFiles = strtoull(optarg, NULL, 0);
+            break;
+        case 'h':
+            hugeMegabytes = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t tiny files] [-h huge file MB] [-d depth] [work directory]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (depth < 1 || depth > MAX_DEPTH)
+    {
+        fprintf(stderr, "depth must be between 1 and %d\n", MAX_DEPTH);
+        return 2;
+    }
+
+    parent = optind < argc ? argv[optind] : "/tmp";
+    if (strlen(parent) + sizeof("/filecopy-bench.XXXXXX") > sizeof(workDirectory))
+    {
+        fprintf(stderr, "%s: path too long\n", parent);
+        return 2;
+    }
+
+    strcpy(workDirectory, parent);
+    strcat(workDirectory, "/filecopy-bench.XXXXXX");
+    if (!mkdtemp(workDirectory))
+    {
+        perror(workDirectory);
+        return 1;
+    }
+
+    if (chdir(workDirectory) < 0 || mkdir(SOURCE_DIRECTORY, 0755) < 0)
+    {
+        perror(workDirectory);
+        RemoveTree(workDirectory);
+        return 1;
+    }
+
+    memset(&scenario, 0, sizeof(scenario));
+    failed |= MakeTinyTree(SOURCE_DIRECTORY "/tiny", tinyFiles, &scenario) ? Failed("tiny") : Run("tiny", &scenario);
+
+    memset(&scenario, 0, sizeof(scenario));
+    failed |= MakeHugeTree(SOURCE_DIRECTORY "/huge", hugeMegabytes, &scenario) ? Failed("huge") : Run("huge", &scenario);
+
+    memset(&scenario, 0, sizeof(scenario));
+    failed |= MakeDeepTree(SOURCE_DIRECTORY "/" DEEP_NAME, depth, &scenario) ? Failed("deep") : Run(DEEP_NAME, &scenario);
+
+    if (chdir("/") < 0)
+        perror("/");
+    RemoveTree(workDirectory);
+    return failed;
+}
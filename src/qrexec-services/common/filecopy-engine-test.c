@@ -0,0 +1,1283 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Streams produced with the pack functions and parsed by FceUnpack through in-memory
+// backends: round trips of every extension (file contents and the crc32 on both ends),
+// the crc32 helpers and hostile streams the receiver must refuse.
+//
+// The sender side runs first with the receiver's replies queued in advance, then
+// the receiver parses the stream, and its replies must start with the queued ones.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <crc32.h>
+
+#include "filecopy-engine.h"
+
+#define MAX_STORED_FILES 64
+#define MAX_STORED_NAME 256
+// zero runs at least this long are sent as holes
+#define MIN_HOLE 512
+
+static int g_failures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            g_failures++; \
+        } \
+    } while (0)
+
+static uint32_t g_random = 0x12345678;
+
+// xorshift, the same sequence on every run
+static uint32_t Random(void)
+{
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 17;
+    g_random ^= g_random << 5;
+    return g_random;
+}
+
+static uint32_t Crc32(uint32_t crc32, const void *buffer, size_t size)
+{
+    return (uint32_t)Crc32_ComputeBuf(crc32, buffer, size);
+}
+
+/*
+ * buffers
+ */
+
+typedef struct _BUFFER
+{
+    uint8_t *Data;
+    size_t Size;
+    size_t Capacity;
+    size_t ReadOffset;
+} BUFFER;
+
+static int BufferAppend(BUFFER *buffer, const void *data, size_t size)
+{
+    size_t capacity;
+    uint8_t *newData;
+
+    if (buffer->Size + size > buffer->Capacity)
+    {
+        capacity = buffer->Capacity ? buffer->Capacity : 4096;
+        while (capacity < buffer->Size + size)
+            capacity *= 2;
+
+        newData = realloc(buffer->Data, capacity);
+        if (!newData)
+            return ENOMEM;
+
+        buffer->Data = newData;
+        buffer->Capacity = capacity;
+    }
+
+    // data is NULL for zeros
+    if (data)
+        memcpy(buffer->Data + buffer->Size, data, size);
+    else
+        memset(buffer->Data + buffer->Size, 0, size);
+    buffer->Size += size;
+    return 0;
+}
+
+static int BufferRead(BUFFER *buffer, void *data, size_t size)
+{
+    if (buffer->Size - buffer->ReadOffset < size)
+        return EIO;
+
+    memcpy(data, buffer->Data + buffer->ReadOffset, size);
+    buffer->ReadOffset += size;
+    return 0;
+}
+
+static void BufferFree(BUFFER *buffer)
+{
+    free(buffer->Data);
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+// Stands in for SHA-256, only equality matters here.
+static void TestHash(const uint8_t *data, size_t size, uint8_t *hash)
+{
+    uint32_t crc32;
+    int i;
+
+    for (i = 0; i < FC_HASH_SIZE / 4; i++)
+    {
+        crc32 = Crc32((uint32_t)i, data, size);
+        memcpy(hash + 4 * i, &crc32, 4);
+    }
+}
+
+// Stands in for XPRESS: (count, byte) pairs.
+static size_t RleCompress(const uint8_t *input, size_t size, uint8_t *output)
+{
+    size_t in = 0, out = 0, run;
+
+    while (in < size)
+    {
+        for (run = 1; in + run < size && run < 255 && input[in + run] == input[in]; run++)
+            ;
+        output[out++] = (uint8_t)run;
+        output[out++] = input[in];
+        in += run;
+    }
+
+    return out;
+}
+
+/*
+ * receiving end: files are kept in memory
+ */
+
+typedef struct _STORED_FILE
+{
+    char Name[MAX_STORED_NAME];
+    uint32_t Mode;
+    BUFFER Data;
+    char *LinkTarget;
+} STORED_FILE;
+
+typedef struct _STORE
+{
+    BUFFER *Input;
+    BUFFER Replies;
+    STORED_FILE Files[MAX_STORED_FILES];
+    size_t FilesCount;
+    STORED_FILE *Current;
+    uint8_t *Buffer; // FC_COPY_BUFFER_SIZE
+    int Finished;
+
+    // what OpenJournal reports
+    struct resume_reply Journal;
+    const char *JournalPartialName;
+    int JournalOpens;
+} STORE;
+
+static STORED_FILE *FindFile(STORE *store, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < store->FilesCount; i++)
+    {
+        if (0 == strcmp(store->Files[i].Name, name))
+            return &store->Files[i];
+    }
+
+    return NULL;
+}
+
+static STORED_FILE *AddFile(STORE *store, const char *name, uint32_t mode)
+{
+    STORED_FILE *file = FindFile(store, name);
+
+    if (!file)
+    {
+        if (store->FilesCount == MAX_STORED_FILES || strlen(name) >= MAX_STORED_NAME)
+            return NULL;
+
+        file = &store->Files[store->FilesCount++];
+        strcpy(file->Name, name);
+    }
+
+    file->Mode = mode;
+    file->Data.Size = 0;
+    return file;
+}
+
+static void RemoveFile(STORE *store, STORED_FILE *file)
+{
+    BufferFree(&file->Data);
+    free(file->LinkTarget);
+    *file = store->Files[--store->FilesCount];
+}
+
+static int StoreRead(void *opaque, void *buffer, size_t size)
+{
+    STORE *store = opaque;
+
+    return BufferRead(store->Input, buffer, size);
+}
+
+static int StoreReply(void *opaque, const void *buffer, size_t size)
+{
+    STORE *store = opaque;
+
+    return BufferAppend(&store->Replies, buffer, size);
+}
+
+static void *StoreGetBuffer(void *opaque, size_t *size)
+{
+    STORE *store = opaque;
+
+    *size = FC_COPY_BUFFER_SIZE;
+    return store->Buffer;
+}
+
+static int StoreBeginFile(void *opaque, const struct file_header *untrustedHeader, const char *untrustedName, uint64_t resumeOffset)
+{
+    STORE *store = opaque;
+    STORED_FILE *file;
+
+    if (resumeOffset)
+    {
+        file = FindFile(store, untrustedName);
+        if (!file || file->Data.Size < resumeOffset)
+            return EINVAL;
+
+        file->Data.Size = (size_t)resumeOffset;
+        store->Current = file;
+        return 0;
+    }
+
+    store->Current = AddFile(store, untrustedName, untrustedHeader->mode);
+    return store->Current ? 0 : ENOMEM;
+}
+
+static int StoreWriteData(void *opaque, void *buffer, size_t size)
+{
+    STORE *store = opaque;
+
+    return BufferAppend(&store->Current->Data, buffer, size);
+}
+
+static int StoreEndFile(void *opaque)
+{
+    STORE *store = opaque;
+
+    store->Current = NULL;
+    return 0;
+}
+
+static int StoreMakeDirectory(void *opaque, const struct file_header *untrustedHeader, const char *untrustedName)
+{
+    STORE *store = opaque;
+
+    return AddFile(store, untrustedName, untrustedHeader->mode) ? 0 : ENOMEM;
+}
+
+static int StoreMakeLink(void *opaque, const struct file_header *untrustedHeader, const char *untrustedName, const char *untrustedTarget)
+{
+    STORE *store = opaque;
+    STORED_FILE *file = AddFile(store, untrustedName, untrustedHeader->mode);
+
+    if (!file)
+        return ENOMEM;
+
+    free(file->LinkTarget);
+    file->LinkTarget = malloc(strlen(untrustedTarget) + 1);
+    if (!file->LinkTarget)
+        return ENOMEM;
+
+    strcpy(file->LinkTarget, untrustedTarget);
+    return 0;
+}
+
+static int StoreFinish(void *opaque)
+{
+    STORE *store = opaque;
+
+    store->Finished = 1;
+    return 0;
+}
+
+static int StoreSkipHole(void *opaque, uint64_t size)
+{
+    STORE *store = opaque;
+
+    return BufferAppend(&store->Current->Data, NULL, (size_t)size);
+}
+
+static int StoreOpenJournal(void *opaque, uint64_t manifest, struct resume_reply *resumePoint, const char **partialName)
+{
+    STORE *store = opaque;
+
+    (void)manifest;
+    store->JournalOpens++;
+    *resumePoint = store->Journal;
+    *partialName = store->JournalPartialName;
+    return 0;
+}
+
+static int StoreCopyDuplicate(void *opaque, const struct file_header *untrustedHeader, const char *untrustedName,
+    const char *sourceName, const uint8_t *untrustedHash, int *matched)
+{
+    STORE *store = opaque;
+    STORED_FILE *source = FindFile(store, sourceName);
+    STORED_FILE *copy;
+    uint8_t hash[FC_HASH_SIZE];
+    int status;
+
+    *matched = 0;
+    if (!source)
+        return 0; // removed in the meantime, sent again
+
+    copy = AddFile(store, untrustedName, untrustedHeader->mode);
+    if (!copy)
+        return ENOMEM;
+
+    status = BufferAppend(&copy->Data, source->Data.Data, source->Data.Size);
+    if (status != 0)
+        return status;
+
+    TestHash(copy->Data.Data, copy->Data.Size, hash);
+    *matched = (copy->Data.Size == untrustedHeader->filelen && 0 == memcmp(hash, untrustedHash, FC_HASH_SIZE));
+    if (!*matched)
+        RemoveFile(store, copy);
+
+    return 0;
+}
+
+static int StoreWriteCompressed(void *opaque, void *buffer, size_t size, uint32_t originalSize, uint32_t untrustedCrc32)
+{
+    STORE *store = opaque;
+    BUFFER *data = &store->Current->Data;
+    size_t start = data->Size;
+    const uint8_t *rle = buffer;
+    size_t i;
+    int status;
+
+    if (size % 2)
+        return EINVAL;
+
+    for (i = 0; i < size; i += 2)
+    {
+        if (rle[i] == 0 || data->Size - start + rle[i] > originalSize)
+            return EINVAL;
+
+        status = BufferAppend(data, NULL, rle[i]);
+        if (status != 0)
+            return status;
+        memset(data->Data + data->Size - rle[i], rle[i + 1], rle[i]);
+    }
+
+    if (data->Size - start != originalSize || Crc32(0, data->Data + start, originalSize) != untrustedCrc32)
+        return EINVAL;
+
+    return 0;
+}
+
+static const FCE_UNPACK_BACKEND g_storeBackend =
+{
+    StoreRead,
+    StoreReply,
+    StoreGetBuffer,
+    StoreBeginFile,
+    StoreWriteData,
+    StoreEndFile,
+    StoreMakeDirectory,
+    StoreMakeLink,
+    StoreFinish,
+    StoreSkipHole,
+    StoreOpenJournal,
+    StoreCopyDuplicate,
+    StoreWriteCompressed,
+};
+
+static int StoreInit(STORE *store, BUFFER *input)
+{
+    memset(store, 0, sizeof(*store));
+    store->Input = input;
+    store->Buffer = malloc(FC_COPY_BUFFER_SIZE);
+    return store->Buffer ? 0 : ENOMEM;
+}
+
+static void StoreFree(STORE *store)
+{
+    while (store->FilesCount > 0)
+        RemoveFile(store, &store->Files[0]);
+
+    BufferFree(&store->Replies);
+    free(store->Buffer);
+}
+
+static int HasFile(STORE *store, const char *name, const uint8_t *data, size_t size)
+{
+    STORED_FILE *file = FindFile(store, name);
+
+    return file && FC_S_ISREG(file->Mode) && file->Data.Size == size && (size == 0 || 0 == memcmp(file->Data.Data, data, size));
+}
+
+/*
+ * sending end: the stream goes to a buffer, replies are queued in advance
+ */
+
+typedef struct _TRANSFER
+{
+    BUFFER Stream;
+    BUFFER Replies;
+} TRANSFER;
+
+static int TransferWrite(void *opaque, const void *buffer, size_t size)
+{
+    TRANSFER *transfer = opaque;
+
+    return BufferAppend(&transfer->Stream, buffer, size);
+}
+
+static int TransferRead(void *opaque, void *buffer, size_t size)
+{
+    TRANSFER *transfer = opaque;
+
+    return BufferRead(&transfer->Replies, buffer, size);
+}
+
+static int TransferWaitForInput(void *opaque, uint32_t timeout)
+{
+    TRANSFER *transfer = opaque;
+
+    (void)timeout;
+    return transfer->Replies.ReadOffset < transfer->Replies.Size;
+}
+
+static const FCE_PACK_BACKEND g_transferBackend =
+{
+    TransferWrite,
+    TransferRead,
+    TransferWaitForInput,
+};
+
+static void ExpectCapsReply(TRANSFER *transfer, uint32_t caps)
+{
+    struct caps_reply reply;
+
+    reply.magic = FC_CAPS_REPLY_MAGIC;
+    reply.caps = caps;
+    CHECK(BufferAppend(&transfer->Replies, &reply, sizeof(reply)) == 0);
+}
+
+static void ExpectResumeReply(TRANSFER *transfer, const struct resume_reply *journal)
+{
+    struct resume_reply reply = *journal;
+
+    reply.magic = FC_RESUME_REPLY_MAGIC;
+    CHECK(BufferAppend(&transfer->Replies, &reply, sizeof(reply)) == 0);
+}
+
+static void ExpectDuplicateReply(TRANSFER *transfer, uint32_t status)
+{
+    struct duplicate_reply reply;
+
+    reply.magic = FC_DUPLICATE_REPLY_MAGIC;
+    reply.status = status;
+    CHECK(BufferAppend(&transfer->Replies, &reply, sizeof(reply)) == 0);
+}
+
+static int SendEntry(FCE_PACK *pack, const char *name, uint32_t mode, uint64_t size)
+{
+    struct file_header header;
+
+    memset(&header, 0, sizeof(header));
+    header.mode = mode;
+    header.filelen = size;
+    header.mtime = 1234567890;
+    return FcePackEntry(pack, &header, name);
+}
+
+static int SendDirectory(FCE_PACK *pack, const char *name)
+{
+    return SendEntry(pack, name, FC_S_IFDIR | 0755, 0);
+}
+
+// Holes are zero runs of at least MIN_HOLE bytes, the rest goes in data records.
+static int SendSparseData(FCE_PACK *pack, const uint8_t *data, size_t size)
+{
+    size_t offset = 0, run, dataStart;
+    int status = 0;
+
+    while (offset < size && status == 0)
+    {
+        for (run = 0; offset + run < size && data[offset + run] == 0; run++)
+            ;
+
+        if (run >= MIN_HOLE || offset + run == size)
+        {
+            status = FcePackHole(pack, run);
+            offset += run;
+            continue;
+        }
+
+        // data up to the next long zero run
+        dataStart = offset;
+        while (offset < size)
+        {
+            for (run = 0; offset + run < size && data[offset + run] == 0; run++)
+                ;
+            if (run >= MIN_HOLE || offset + run == size)
+                break;
+            offset += run + 1;
+        }
+
+        status = FcePackDataRecord(pack, offset - dataStart);
+        if (status == 0)
+            status = FcePackWrite(pack, data + dataStart, offset - dataStart);
+    }
+
+    return status;
+}
+
+static int SendCompressedData(FCE_PACK *pack, const uint8_t *data, size_t size)
+{
+    uint8_t *compressed = malloc(2 * FC_COMPRESS_BLOCK_SIZE);
+    size_t offset, block, compressedSize;
+    int status = 0;
+
+    if (!compressed)
+        return ENOMEM;
+
+    for (offset = 0; offset < size && status == 0; offset += block)
+    {
+        block = size - offset < FC_COMPRESS_BLOCK_SIZE ? size - offset : FC_COMPRESS_BLOCK_SIZE;
+        compressedSize = RleCompress(data + offset, block, compressed);
+        if (compressedSize < block)
+            status = FcePackCompressedBlock(pack, compressed, compressedSize, data + offset, block);
+        else
+            status = FcePackStoredBlock(pack, data + offset, block);
+    }
+
+    free(compressed);
+    return status;
+}
+
+// Sends data from offset on, flags are FC_MODE_* bits.
+static int SendFile(FCE_PACK *pack, const char *name, const uint8_t *data, size_t size, uint32_t flags, size_t offset)
+{
+    int status = SendEntry(pack, name, FC_S_IFREG | 0644 | flags, size);
+
+    if (status != 0)
+        return status;
+
+    if (flags & FC_MODE_SPARSE)
+        return SendSparseData(pack, data, size);
+    if (flags & FC_MODE_COMPRESSED)
+        return SendCompressedData(pack, data + offset, size - offset);
+    return FcePackWrite(pack, data + offset, size - offset);
+}
+
+static int SendLink(FCE_PACK *pack, const char *name, const char *target)
+{
+    int status = SendEntry(pack, name, FC_S_IFLNK | 0777, strlen(target));
+
+    if (status != 0)
+        return status;
+
+    return FcePackWrite(pack, target, strlen(target));
+}
+
+static int SendCapsEntry(FCE_PACK *pack, uint32_t magic, uint32_t caps)
+{
+    return SendEntry(pack, FC_CAPS_NAME, FC_S_IFDIR | 0755, ((uint64_t)magic << 32) | caps);
+}
+
+// Parses the stream, checks the receiver's replies against the queued ones and
+// reads the result on the sending end. Returns the status of FceUnpack.
+static int Receive(FCE_PACK *pack, TRANSFER *transfer, STORE *store, uint32_t supportedCaps)
+{
+    FCE_UNPACK *unpack = malloc(sizeof(FCE_UNPACK));
+    FCE_RESULT result;
+    size_t expected = transfer->Replies.Size;
+    int status;
+
+    if (!unpack)
+        return ENOMEM;
+
+    FceUnpackInit(unpack, &g_storeBackend, store);
+    unpack->SupportedCaps &= supportedCaps;
+    status = FceUnpack(unpack);
+    CHECK(FceUnpackSendResult(unpack, status, status ? unpack->LastName : NULL) == 0);
+    FceUnpackCleanup(unpack);
+    free(unpack);
+
+    // the sender was right about every reply
+    CHECK(transfer->Replies.ReadOffset == expected);
+    CHECK(store->Replies.Size >= expected);
+    if (store->Replies.Size < expected || (expected && memcmp(store->Replies.Data, transfer->Replies.Data, expected) != 0))
+    {
+        fprintf(stderr, "%s:%d: receiver replies differ from the expected ones\n", __FILE__, __LINE__);
+        g_failures++;
+        return status;
+    }
+
+    CHECK(BufferAppend(&transfer->Replies, store->Replies.Data + expected, store->Replies.Size - expected) == 0);
+    CHECK(FcePackReadResult(pack, &result) == 0);
+    CHECK(result.ErrorCode == (uint32_t)status);
+    if (status == 0)
+        CHECK(result.CrcMatches);
+
+    return status;
+}
+
+static uint8_t *MakeData(size_t size, int zeros)
+{
+    uint8_t *data = malloc(size ? size : 1);
+    size_t i;
+
+    if (!data)
+        return NULL;
+
+    for (i = 0; i < size; i++)
+        data[i] = zeros ? 0 : (uint8_t)Random();
+
+    return data;
+}
+
+/*
+ * round trips
+ */
+
+static void TestPlain(uint32_t requestedCaps)
+{
+    static const size_t sizes[] = { 0, 1, 4095, FC_COPY_BUFFER_SIZE + 7 };
+    char name[32];
+    uint8_t *data[4];
+    TRANSFER transfer;
+    FCE_PACK pack;
+    STORE store;
+    size_t i;
+
+    memset(&transfer, 0, sizeof(transfer));
+    CHECK(StoreInit(&store, &transfer.Stream) == 0);
+    FcePackInit(&pack, &g_transferBackend, &transfer);
+
+    // nothing queued: a receiver that doesn't answer in time, its late reply is skipped
+    CHECK(FcePackNegotiate(&pack, requestedCaps, 0) == 0);
+    CHECK(pack.Caps == 0);
+
+    CHECK(SendDirectory(&pack, "plain") == 0);
+    for (i = 0; i < 4; i++)
+    {
+        data[i] = MakeData(sizes[i], 0);
+        snprintf(name, sizeof(name), "plain/%zu", sizes[i]);
+        CHECK(data[i] && SendFile(&pack, name, data[i], sizes[i], 0, 0) == 0);
+    }
+    CHECK(SendLink(&pack, "plain/link", "../target") == 0);
+    CHECK(SendDirectory(&pack, "plain") == 0);
+    CHECK(FcePackEnd(&pack) == 0);
+
+    CHECK(Receive(&pack, &transfer, &store, ~0U) == 0);
+    CHECK(store.Finished);
+    CHECK(FindFile(&store, "plain") && FC_S_ISDIR(FindFile(&store, "plain")->Mode));
+    CHECK(FindFile(&store, "plain/link") && 0 == strcmp(FindFile(&store, "plain/link")->LinkTarget, "../target"));
+    for (i = 0; i < 4; i++)
+    {
+        snprintf(name, sizeof(name), "plain/%zu", sizes[i]);
+        CHECK(HasFile(&store, name, data[i], sizes[i]));
+        free(data[i]);
+    }
+
+    StoreFree(&store);
+    BufferFree(&transfer.Stream);
+    BufferFree(&transfer.Replies);
+}
+
+static void TestSparse(void)
+{
+    size_t size = 3 * FC_COPY_BUFFER_SIZE + 100;
+    uint8_t *data = MakeData(size, 0);
+    uint8_t *zeros = MakeData(70000, 1);
+    TRANSFER transfer;
+    FCE_PACK pack;
+    STORE store;
+
+    memset(&transfer, 0, sizeof(transfer));
+    CHECK(StoreInit(&store, &transfer.Stream) == 0);
+    FcePackInit(&pack, &g_transferBackend, &transfer);
+    if (!data || !zeros)
+        goto cleanup;
+
+    // holes at the start, in the middle (larger than a buffer) and at the end
+    memset(data, 0, 5000);
+    memset(data + 10000, 0, FC_COPY_BUFFER_SIZE + 3);
+    memset(data + 2 * FC_COPY_BUFFER_SIZE, 0, 100); // too short to be a hole
+    memset(data + size - 9000, 0, 9000);
+
+    ExpectCapsReply(&transfer, FC_CAP_SPARSE);
+    CHECK(FcePackNegotiate(&pack, FC_CAP_SPARSE, 0) == 0);
+    CHECK(pack.Caps == FC_CAP_SPARSE);
+    CHECK(SendFile(&pack, "sparse", data, size, FC_MODE_SPARSE, 0) == 0);
+    CHECK(SendFile(&pack, "zeros", zeros, 70000, FC_MODE_SPARSE, 0) == 0);
+    CHECK(SendFile(&pack, "empty", zeros, 0, FC_MODE_SPARSE, 0) == 0);
+    CHECK(FcePackEnd(&pack) == 0);
+
+    // holes don't travel
+    CHECK(transfer.Stream.Size < size - FC_COPY_BUFFER_SIZE);
+
+    CHECK(Receive(&pack, &transfer, &store, ~0U) == 0);
+    CHECK(HasFile(&store, "sparse", data, size));
+    CHECK(HasFile(&store, "zeros", zeros, 70000));
+    CHECK(HasFile(&store, "empty", zeros, 0));
+
+cleanup:
+    free(zeros);
+    free(data);
+    StoreFree(&store);
+    BufferFree(&transfer.Stream);
+    BufferFree(&transfer.Replies);
+}
+
+static void TestCompressed(void)
+{
+    size_t size = 3 * FC_COMPRESS_BLOCK_SIZE + 5;
+    uint8_t *data = MakeData(size, 0);
+    uint8_t *noise = MakeData(FC_COMPRESS_BLOCK_SIZE + 1, 0);
+    TRANSFER transfer;
+    FCE_PACK pack;
+    STORE store;
+    size_t i;
+
+    memset(&transfer, 0, sizeof(transfer));
+    CHECK(StoreInit(&store, &transfer.Stream) == 0);
+    FcePackInit(&pack, &g_transferBackend, &transfer);
+    if (!data || !noise)
+        goto cleanup;
+
+    // compressible blocks with a stored (noise) block between them
+    for (i = 0; i < size; i++)
+    {
+        if (i < FC_COMPRESS_BLOCK_SIZE || i >= 2 * FC_COMPRESS_BLOCK_SIZE)
+            data[i] = (uint8_t)(i / 1000);
+    }
+
+    ExpectCapsReply(&transfer, FC_CAP_COMPRESS);
+    CHECK(FcePackNegotiate(&pack, FC_CAP_COMPRESS | FC_CAP_SPARSE, 0) == 0);
+    CHECK(pack.Caps == FC_CAP_COMPRESS);
+    CHECK(SendFile(&pack, "mixed", data, size, FC_MODE_COMPRESSED, 0) == 0);
+    CHECK(SendFile(&pack, "noise", noise, FC_COMPRESS_BLOCK_SIZE + 1, FC_MODE_COMPRESSED, 0) == 0);
+    CHECK(FcePackEnd(&pack) == 0);
+
+    CHECK(transfer.Stream.Size < size);
+
+    CHECK(Receive(&pack, &transfer, &store, FC_CAP_COMPRESS) == 0);
+    CHECK(HasFile(&store, "mixed", data, size));
+    CHECK(HasFile(&store, "noise", noise, FC_COMPRESS_BLOCK_SIZE + 1));
+
+cleanup:
+    free(noise);
+    free(data);
+    StoreFree(&store);
+    BufferFree(&transfer.Stream);
+    BufferFree(&transfer.Replies);
+}
+
+static void TestDedup(void)
+{
+    size_t size = 100000;
+    uint8_t *data = MakeData(size, 0);
+    uint8_t *other = MakeData(size, 0);
+    uint8_t hash[FC_HASH_SIZE];
+    struct file_header header;
+    TRANSFER transfer;
+    FCE_PACK pack;
+    STORE store;
+    int matched;
+
+    memset(&transfer, 0, sizeof(transfer));
+    CHECK(StoreInit(&store, &transfer.Stream) == 0);
+    FcePackInit(&pack, &g_transferBackend, &transfer);
+    if (!data || !other)
+        goto cleanup;
+
+    memset(&header, 0, sizeof(header));
+    header.mode = FC_S_IFREG | 0644;
+    header.filelen = size;
+
+    ExpectCapsReply(&transfer, FC_CAP_DEDUP);
+    ExpectDuplicateReply(&transfer, FC_DUPLICATE_OK);
+    ExpectDuplicateReply(&transfer, FC_DUPLICATE_MISMATCH);
+    CHECK(FcePackNegotiate(&pack, FC_CAP_DEDUP, 0) == 0);
+    CHECK(pack.Caps == FC_CAP_DEDUP);
+
+    CHECK(SendDirectory(&pack, "d") == 0); // entry 0
+    CHECK(SendFile(&pack, "d/source", data, size, FC_MODE_DEDUP_SOURCE, 0) == 0); // entry 1
+
+    TestHash(data, size, hash);
+    CHECK(FcePackDuplicate(&pack, &header, "d/copy", 1, hash, &matched) == 0);
+    CHECK(matched);
+
+    // the receiver's source differs from what the sender expects, sent in full then
+    TestHash(other, size, hash);
+    CHECK(FcePackDuplicate(&pack, &header, "d/other", 1, hash, &matched) == 0);
+    CHECK(!matched);
+    CHECK(SendFile(&pack, "d/other", other, size, 0, 0) == 0);
+    CHECK(FcePackEnd(&pack) == 0);
+
+    CHECK(Receive(&pack, &transfer, &store, ~0U) == 0);
+    CHECK(HasFile(&store, "d/source", data, size));
+    CHECK(HasFile(&store, "d/copy", data, size));
+    CHECK(HasFile(&store, "d/other", other, size));
+
+cleanup:
+    free(other);
+    free(data);
+    StoreFree(&store);
+    BufferFree(&transfer.Stream);
+    BufferFree(&transfer.Replies);
+}
+
+static void TestResume(uint32_t flags)
+{
+    size_t size = 2 * FC_COPY_BUFFER_SIZE + 33;
+    size_t partial = FC_COPY_BUFFER_SIZE + 1;
+    uint8_t *one = MakeData(1000, 0);
+    uint8_t *two = MakeData(size, 0);
+    uint8_t *three = MakeData(500, 0);
+    struct resume_reply resumePoint;
+    TRANSFER transfer;
+    FCE_PACK pack;
+    STORE store;
+    STORED_FILE *file;
+
+    memset(&transfer, 0, sizeof(transfer));
+    CHECK(StoreInit(&store, &transfer.Stream) == 0);
+    FcePackInit(&pack, &g_transferBackend, &transfer);
+    if (!one || !two || !three)
+        goto cleanup;
+
+    // left by the interrupted transfer: "r", "r/one" and the beginning of "r/two"
+    CHECK(AddFile(&store, "r", FC_S_IFDIR | 0755) != NULL);
+    file = AddFile(&store, "r/one", FC_S_IFREG | 0644);
+    CHECK(file && BufferAppend(&file->Data, one, 1000) == 0);
+    file = AddFile(&store, "r/two", FC_S_IFREG | 0644);
+    CHECK(file && BufferAppend(&file->Data, two, partial + 77) == 0); // written past the journal
+    store.Journal.flags = FC_RESUME_PARTIAL;
+    store.Journal.entries_done = 2;
+    store.Journal.offset = partial;
+    store.JournalPartialName = "r/two";
+
+    ExpectCapsReply(&transfer, FC_CAP_RESUME | FC_CAP_COMPRESS);
+    ExpectResumeReply(&transfer, &store.Journal);
+    CHECK(FcePackNegotiate(&pack, FC_CAP_RESUME | FC_CAP_COMPRESS, 0) == 0);
+    CHECK(FcePackRequestResume(&pack, 0x1122334455667788ULL, &resumePoint) == 0);
+    CHECK(resumePoint.entries_done == 2 && resumePoint.offset == partial && (resumePoint.flags & FC_RESUME_PARTIAL));
+
+    CHECK(SendFile(&pack, "r/two", two, size, FC_MODE_RESUMED | flags, partial) == 0);
+    CHECK(SendFile(&pack, "r/three", three, 500, flags, 0) == 0);
+    CHECK(SendDirectory(&pack, "r") == 0);
+    CHECK(FcePackEnd(&pack) == 0);
+
+    CHECK(Receive(&pack, &transfer, &store, ~0U) == 0);
+    CHECK(store.JournalOpens == 1);
+    CHECK(HasFile(&store, "r/one", one, 1000));
+    CHECK(HasFile(&store, "r/two", two, size));
+    CHECK(HasFile(&store, "r/three", three, 500));
+
+cleanup:
+    free(three);
+    free(two);
+    free(one);
+    StoreFree(&store);
+    BufferFree(&transfer.Stream);
+    BufferFree(&transfer.Replies);
+}
+
+// A flipped data byte goes through, the sender learns from the crc32.
+static void TestCorruptData(void)
+{
+    uint8_t *data = MakeData(5000, 0);
+    TRANSFER transfer;
+    FCE_PACK pack;
+    STORE store;
+    FCE_UNPACK *unpack = malloc(sizeof(FCE_UNPACK));
+    FCE_RESULT result;
+
+    memset(&transfer, 0, sizeof(transfer));
+    CHECK(StoreInit(&store, &transfer.Stream) == 0);
+    FcePackInit(&pack, &g_transferBackend, &transfer);
+    if (!data || !unpack)
+        goto cleanup;
+
+    CHECK(SendFile(&pack, "file", data, 5000, 0, 0) == 0);
+    CHECK(FcePackEnd(&pack) == 0);
+    transfer.Stream.Data[sizeof(struct file_header) + 4 + 1234] ^= 0x40;
+
+    FceUnpackInit(unpack, &g_storeBackend, &store);
+    CHECK(FceUnpack(unpack) == 0);
+    CHECK(FceUnpackSendResult(unpack, 0, NULL) == 0);
+    FceUnpackCleanup(unpack);
+
+    CHECK(BufferAppend(&transfer.Replies, store.Replies.Data, store.Replies.Size) == 0);
+    CHECK(FcePackReadResult(&pack, &result) == 0);
+    CHECK(result.ErrorCode == 0);
+    CHECK(!result.CrcMatches);
+
+cleanup:
+    free(unpack);
+    free(data);
+    StoreFree(&store);
+    BufferFree(&transfer.Stream);
+    BufferFree(&transfer.Replies);
+}
+
+/*
+ * hostile streams
+ */
+
+typedef enum _HOSTILE
+{
+    HOSTILE_CONFIRM_TWICE,
+    HOSTILE_CONFIRM_AFTER_ENTRY,
+    HOSTILE_CONFIRM_RESUME_TWICE,
+    HOSTILE_CONFIRM_UNSUPPORTED,
+    HOSTILE_SPARSE_NOT_CONFIRMED,
+    HOSTILE_HOLE_TOO_LONG,
+    HOSTILE_EMPTY_RECORD,
+    HOSTILE_UNKNOWN_RECORD,
+    HOSTILE_BLOCK_TOO_LARGE,
+    HOSTILE_BLOCK_NOT_SMALLER,
+    HOSTILE_STORED_SIZE_MISMATCH,
+    HOSTILE_BLOCK_BAD_CRC,
+    HOSTILE_COMPRESSED_SPARSE,
+    HOSTILE_RESUMED_NOT_PARTIAL,
+    HOSTILE_RESUMED_WRONG_NAME,
+    HOSTILE_RESUMED_WITHOUT_RESUME,
+    HOSTILE_RESUME_BAD_MAGIC,
+    HOSTILE_DUPLICATE_UNKNOWN_SOURCE,
+    HOSTILE_DUPLICATE_SPARSE,
+    HOSTILE_DUPLICATE_NOT_CONFIRMED,
+    HOSTILE_NAME_TOO_LONG,
+    HOSTILE_UNKNOWN_TYPE,
+    HOSTILE_BYTES_LIMIT,
+    HOSTILE_FILES_LIMIT,
+    HOSTILE_TRUNCATED_DATA,
+    HOSTILE_TRUNCATED_HEADER,
+    HOSTILE_COUNT,
+} HOSTILE;
+
+static void WriteRaw(TRANSFER *transfer, const void *data, size_t size)
+{
+    CHECK(BufferAppend(&transfer->Stream, data, size) == 0);
+}
+
+static void WriteBlockRecord(TRANSFER *transfer, uint32_t type, uint32_t originalSize, uint32_t dataSize, uint32_t crc32)
+{
+    struct block_record record;
+
+    record.type = type;
+    record.original_size = originalSize;
+    record.data_size = dataSize;
+    record.crc32 = crc32;
+    WriteRaw(transfer, &record, sizeof(record));
+}
+
+// Builds the stream and returns the status FceUnpack must fail with.
+static int BuildHostile(HOSTILE hostile, FCE_PACK *pack, TRANSFER *transfer, STORE *store, FCE_UNPACK *unpack)
+{
+    static const uint8_t data[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+    uint8_t rle[2] = { 16, 7 };
+    uint8_t pair[2] = { 2, 7 };
+    uint8_t sevens[16];
+    struct resume_request request;
+    struct duplicate_record duplicate;
+    struct file_header header;
+    struct data_record record;
+    size_t i;
+
+    switch (hostile)
+    {
+    case HOSTILE_CONFIRM_TWICE:
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_SPARSE);
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_COMPRESS);
+        return EINVAL;
+
+    case HOSTILE_CONFIRM_AFTER_ENTRY:
+        SendDirectory(pack, "d");
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_SPARSE);
+        return EINVAL;
+
+    case HOSTILE_CONFIRM_RESUME_TWICE:
+        // would rewind the resume point mid-transfer
+        store->Journal.entries_done = 5;
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_RESUME);
+        request.magic = FC_RESUME_REQUEST_MAGIC;
+        request._pad = 0;
+        request.manifest = 1;
+        FcePackWrite(pack, &request, sizeof(request));
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_RESUME);
+        FcePackWrite(pack, &request, sizeof(request));
+        return EINVAL;
+
+    case HOSTILE_CONFIRM_UNSUPPORTED:
+        unpack->SupportedCaps &= ~FC_CAP_COMPRESS;
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_COMPRESS);
+        return EINVAL;
+
+    case HOSTILE_SPARSE_NOT_CONFIRMED:
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_COMPRESS);
+        SendFile(pack, "f", data, sizeof(data), FC_MODE_SPARSE, 0);
+        return EINVAL;
+
+    case HOSTILE_HOLE_TOO_LONG:
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_SPARSE);
+        SendEntry(pack, "f", FC_S_IFREG | 0644 | FC_MODE_SPARSE, 100);
+        FcePackHole(pack, 101);
+        return EINVAL;
+
+    case HOSTILE_EMPTY_RECORD:
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_SPARSE);
+        SendEntry(pack, "f", FC_S_IFREG | 0644 | FC_MODE_SPARSE, 100);
+        FcePackDataRecord(pack, 0); // would never end, the rest is valid
+        FcePackHole(pack, 100);
+        return EINVAL;
+
+    case HOSTILE_UNKNOWN_RECORD:
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_SPARSE);
+        SendEntry(pack, "f", FC_S_IFREG | 0644 | FC_MODE_SPARSE, 100);
+        record.type = 3;
+        record._pad = 0;
+        record.length = 100;
+        WriteRaw(transfer, &record, sizeof(record));
+        return EINVAL;
+
+    case HOSTILE_BLOCK_TOO_LARGE:
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_COMPRESS);
+        SendEntry(pack, "f", FC_S_IFREG | 0644 | FC_MODE_COMPRESSED, 2 * FC_COMPRESS_BLOCK_SIZE);
+        WriteBlockRecord(transfer, FC_BLOCK_XPRESS, FC_COMPRESS_BLOCK_SIZE + 1, 2, 0);
+        return EINVAL;
+
+    case HOSTILE_BLOCK_NOT_SMALLER:
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_COMPRESS);
+        // decompresses fine, but the block is not smaller than the data
+        memset(sevens, 7, sizeof(sevens));
+        SendEntry(pack, "f", FC_S_IFREG | 0644 | FC_MODE_COMPRESSED, sizeof(sevens));
+        WriteBlockRecord(transfer, FC_BLOCK_XPRESS, sizeof(sevens), sizeof(sevens), Crc32(0, sevens, sizeof(sevens)));
+        for (i = 0; i < sizeof(sevens); i += 2)
+            WriteRaw(transfer, pair, sizeof(pair));
+        return EINVAL;
+
+    case HOSTILE_STORED_SIZE_MISMATCH:
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_COMPRESS);
+        SendEntry(pack, "f", FC_S_IFREG | 0644 | FC_MODE_COMPRESSED, 16);
+        WriteBlockRecord(transfer, FC_BLOCK_STORED, 16, 8, 0);
+        return EINVAL;
+
+    case HOSTILE_BLOCK_BAD_CRC:
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_COMPRESS);
+        SendEntry(pack, "f", FC_S_IFREG | 0644 | FC_MODE_COMPRESSED, 16);
+        WriteBlockRecord(transfer, FC_BLOCK_XPRESS, 16, sizeof(rle), 0x12345678);
+        WriteRaw(transfer, rle, sizeof(rle));
+        return EINVAL;
+
+    case HOSTILE_COMPRESSED_SPARSE:
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_COMPRESS | FC_CAP_SPARSE);
+        SendEntry(pack, "f", FC_S_IFREG | 0644 | FC_MODE_COMPRESSED | FC_MODE_SPARSE, 16);
+        return EINVAL;
+
+    case HOSTILE_RESUMED_NOT_PARTIAL:
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_RESUME);
+        request.magic = FC_RESUME_REQUEST_MAGIC;
+        request._pad = 0;
+        request.manifest = 1;
+        FcePackWrite(pack, &request, sizeof(request));
+        SendFile(pack, "f", data, sizeof(data), FC_MODE_RESUMED, 8);
+        return EINVAL;
+
+    case HOSTILE_RESUMED_WRONG_NAME:
+        store->Journal.flags = FC_RESUME_PARTIAL;
+        store->Journal.offset = 8;
+        store->JournalPartialName = "f";
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_RESUME);
+        request.magic = FC_RESUME_REQUEST_MAGIC;
+        request._pad = 0;
+        request.manifest = 1;
+        FcePackWrite(pack, &request, sizeof(request));
+        SendFile(pack, "g", data, sizeof(data), FC_MODE_RESUMED, 8);
+        return EINVAL;
+
+    case HOSTILE_RESUMED_WITHOUT_RESUME:
+        SendFile(pack, "f", data, sizeof(data), FC_MODE_RESUMED, 8);
+        return EINVAL;
+
+    case HOSTILE_RESUME_BAD_MAGIC:
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_RESUME);
+        request.magic = FC_RESUME_REPLY_MAGIC;
+        request._pad = 0;
+        request.manifest = 1;
+        FcePackWrite(pack, &request, sizeof(request));
+        return EINVAL;
+
+    case HOSTILE_DUPLICATE_UNKNOWN_SOURCE:
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_DEDUP);
+        SendFile(pack, "a", data, sizeof(data), 0, 0); // entry 0, but not a dedup source
+        SendEntry(pack, "b", FC_S_IFREG | 0644 | FC_MODE_DUPLICATE, sizeof(data));
+        memset(&duplicate, 0, sizeof(duplicate));
+        FcePackWrite(pack, &duplicate, sizeof(duplicate));
+        return EINVAL;
+
+    case HOSTILE_DUPLICATE_SPARSE:
+        SendCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, FC_CAP_DEDUP | FC_CAP_SPARSE);
+        SendFile(pack, "a", data, sizeof(data), FC_MODE_DEDUP_SOURCE, 0);
+        SendEntry(pack, "b", FC_S_IFREG | 0644 | FC_MODE_DUPLICATE | FC_MODE_SPARSE, sizeof(data));
+        return EINVAL;
+
+    case HOSTILE_DUPLICATE_NOT_CONFIRMED:
+        SendFile(pack, "a", data, sizeof(data), FC_MODE_DEDUP_SOURCE, 0);
+        return EINVAL;
+
+    case HOSTILE_NAME_TOO_LONG:
+        memset(&header, 0, sizeof(header));
+        header.namelen = MAX_PATH_LENGTH;
+        header.mode = FC_S_IFREG | 0644;
+        FcePackWrite(pack, &header, sizeof(header));
+        return FC_ENAMETOOLONG;
+
+    case HOSTILE_UNKNOWN_TYPE:
+        SendEntry(pack, "fifo", 0010644, 0);
+        return EINVAL;
+
+    case HOSTILE_BYTES_LIMIT:
+        unpack->BytesLimit = 20;
+        SendFile(pack, "a", data, sizeof(data), 0, 0);
+        SendFile(pack, "b", data, sizeof(data), 0, 0);
+        return FC_EDQUOT;
+
+    case HOSTILE_FILES_LIMIT:
+        unpack->FilesLimit = 2;
+        SendDirectory(pack, "a");
+        SendDirectory(pack, "b");
+        SendDirectory(pack, "c");
+        return FC_EDQUOT;
+
+    case HOSTILE_TRUNCATED_DATA:
+        SendEntry(pack, "f", FC_S_IFREG | 0644, 100);
+        FcePackWrite(pack, data, sizeof(data));
+        return EIO;
+
+    case HOSTILE_TRUNCATED_HEADER:
+        SendDirectory(pack, "d");
+        FcePackWrite(pack, data, 5);
+        return LEGAL_EOF;
+
+    default:
+        return 0;
+    }
+}
+
+static void TestHostile(HOSTILE hostile)
+{
+    TRANSFER transfer;
+    FCE_PACK pack;
+    STORE store;
+    FCE_UNPACK *unpack = malloc(sizeof(FCE_UNPACK));
+    int expected;
+    int status;
+
+    memset(&transfer, 0, sizeof(transfer));
+    CHECK(StoreInit(&store, &transfer.Stream) == 0);
+    FcePackInit(&pack, &g_transferBackend, &transfer);
+    if (!unpack)
+        goto cleanup;
+
+    FceUnpackInit(unpack, &g_storeBackend, &store);
+    expected = BuildHostile(hostile, &pack, &transfer, &store, unpack);
+    // a truncated stream has no end marker, the others would be accepted after it
+    if (expected != EIO && expected != LEGAL_EOF)
+        FcePackEnd(&pack);
+
+    status = FceUnpack(unpack);
+    if (status != expected)
+    {
+        fprintf(stderr, "hostile stream %d: status %d, expected %d\n", hostile, status, expected);
+        g_failures++;
+    }
+
+    CHECK(!store.Finished);
+    CHECK(store.JournalOpens <= 1);
+    FceUnpackCleanup(unpack);
+
+cleanup:
+    free(unpack);
+    StoreFree(&store);
+    BufferFree(&transfer.Stream);
+    BufferFree(&transfer.Replies);
+}
+
+/*
+ * crc32 helpers
+ */
+
+static void TestCrc32(void)
+{
+    static const uint64_t zeroSizes[] = { 0, 1, 2, 3, 7, 64, 1000, 65536, (1 << 20) + 3 };
+    size_t size = (1 << 20) + 3;
+    uint8_t *data = MakeData(size, 0);
+    uint8_t *zeros = MakeData(size, 1);
+    uint32_t crc1, crc2;
+    size_t i, split;
+
+    if (!data || !zeros)
+        goto cleanup;
+
+    for (i = 0; i < 50; i++)
+    {
+        split = i < 2 ? i * size : Random() % size; // also empty halves
+        crc1 = Crc32(0, data, split);
+        crc2 = Crc32(0, data + split, size - split);
+        CHECK(FceCrc32Combine(crc1, crc2, size - split) == Crc32(0, data, size));
+    }
+
+    for (i = 0; i < sizeof(zeroSizes) / sizeof(zeroSizes[0]); i++)
+    {
+        crc1 = Crc32(0, data, 100);
+        CHECK(FceCrc32Zeros(crc1, zeroSizes[i]) == Crc32(crc1, zeros, (size_t)zeroSizes[i]));
+        CHECK(FceCrc32Zeros(0, zeroSizes[i]) == Crc32(0, zeros, (size_t)zeroSizes[i]));
+    }
+
+    // sizes that can't be checked byte by byte still have to compose
+    crc1 = Crc32(0, data, 100);
+    CHECK(FceCrc32Zeros(FceCrc32Zeros(crc1, 1ULL << 40), 12345) == FceCrc32Zeros(crc1, (1ULL << 40) + 12345));
+
+cleanup:
+    free(zeros);
+    free(data);
+}
+
+int main(void)
+{
+    HOSTILE hostile;
+
+    TestCrc32();
+
+    TestPlain(0);
+    TestPlain(FC_CAP_SPARSE | FC_CAP_COMPRESS);
+    TestSparse();
+    TestCompressed();
+    TestDedup();
+    TestResume(0);
+    TestResume(FC_MODE_COMPRESSED);
+    TestCorruptData();
+
+    for (hostile = 0; hostile < HOSTILE_COUNT; hostile++)
+        TestHostile(hostile);
+
+    if (g_failures)
+        fprintf(stderr, "%d checks failed\n", g_failures);
+    return g_failures != 0;
+}
@@ -0,0 +1,857 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <crc32.h>
+
+#include "filecopy-engine.h"
+
+/*
+ * unpack
+ */
+
+void FceUnpackInit(FCE_UNPACK *unpack, const FCE_UNPACK_BACKEND *backend, void *opaque)
+{
+    memset(unpack, 0, sizeof(*unpack));
+    unpack->Backend = backend;
+    unpack->Opaque = opaque;
+
+    // what the backend can do decides what is offered to the sender
+    if (backend->SkipHole)
+        unpack->SupportedCaps |= FC_CAP_SPARSE;
+    if (backend->OpenJournal)
+        unpack->SupportedCaps |= FC_CAP_RESUME;
+    if (backend->CopyDuplicate)
+        unpack->SupportedCaps |= FC_CAP_DEDUP;
+    if (backend->WriteCompressed)
+        unpack->SupportedCaps |= FC_CAP_COMPRESS;
+}
+
+void FceUnpackCleanup(FCE_UNPACK *unpack)
+{
+    size_t i;
+
+    for (i = 0; i < unpack->DedupSourcesCount; i++)
+        free(unpack->DedupSources[i].Name);
+
+    free(unpack->DedupSources);
+    unpack->DedupSources = NULL;
+    unpack->DedupSourcesCount = 0;
+    unpack->DedupSourcesCapacity = 0;
+}
+
+static int ReadWithCrc(FCE_UNPACK *unpack, void *buffer, size_t size)
+{
+    int status = unpack->Backend->Read(unpack->Opaque, buffer, size);
+
+    if (status == 0)
+        unpack->Crc32 = Crc32_ComputeBuf(unpack->Crc32, buffer, size);
+
+    return status;
+}
+
+static int ReceiveData(FCE_UNPACK *unpack, uint64_t size)
+{
+    uint64_t remaining = size;
+    size_t chunk, bufferSize;
+    void *buffer;
+    int status;
+
+    while (remaining > 0)
+    {
+        buffer = unpack->Backend->GetBuffer(unpack->Opaque, &bufferSize);
+        if (!buffer)
+            return ENOMEM;
+
+        if (remaining > bufferSize)
+            chunk = bufferSize;
+        else
+            chunk = (size_t)remaining; // safe cast: less than bufferSize
+
+        if (ReadWithCrc(unpack, buffer, chunk) != 0)
+            return EIO;
+
+        status = unpack->Backend->WriteData(unpack->Opaque, buffer, chunk);
+        if (status != 0)
+            return status;
+
+        remaining -= chunk;
+    }
+
+    return 0;
+}
+
+static int ReceiveSparseData(FCE_UNPACK *unpack, uint64_t size)
+{
+    struct data_record untrustedRecord;
+    uint64_t remaining = size;
+    int status;
+
+    while (remaining > 0)
+    {
+        // records are not part of the checksum, only the logical content is
+        if (unpack->Backend->Read(unpack->Opaque, &untrustedRecord, sizeof(untrustedRecord)) != 0)
+            return EIO;
+
+        if (untrustedRecord.length == 0 || untrustedRecord.length > remaining)
+            return EINVAL;
+
+        switch (untrustedRecord.type)
+        {
+        case FC_RECORD_DATA:
+            status = ReceiveData(unpack, untrustedRecord.length);
+            break;
+
+        case FC_RECORD_HOLE:
+            unpack->Crc32 = FceCrc32Zeros(unpack->Crc32, untrustedRecord.length);
+            status = unpack->Backend->SkipHole(unpack->Opaque, untrustedRecord.length);
+            break;
+
+        default:
+            status = EINVAL;
+        }
+
+        if (status != 0)
+            return status;
+
+        remaining -= untrustedRecord.length;
+    }
+
+    return 0;
+}
+
+static int ReceiveCompressedData(FCE_UNPACK *unpack, uint64_t size)
+{
+    struct block_record untrustedRecord;
+    uint64_t remaining = size;
+    size_t bufferSize;
+    void *buffer;
+    int status;
+
+    while (remaining > 0)
+    {
+        // like data records, block records are not part of the checksum
+        if (unpack->Backend->Read(unpack->Opaque, &untrustedRecord, sizeof(untrustedRecord)) != 0)
+            return EIO;
+
+        if (untrustedRecord.original_size == 0 ||
+            untrustedRecord.original_size > FC_COMPRESS_BLOCK_SIZE ||
+            untrustedRecord.original_size > remaining)
+            return EINVAL;
+
+        switch (untrustedRecord.type)
+        {
+        case FC_BLOCK_STORED:
+            if (untrustedRecord.data_size != untrustedRecord.original_size)
+                return EINVAL;
+
+            status = ReceiveData(unpack, untrustedRecord.original_size);
+            break;
+
+        case FC_BLOCK_XPRESS:
+            if (untrustedRecord.data_size == 0 || untrustedRecord.data_size >= untrustedRecord.original_size)
+                return EINVAL;
+
+            buffer = unpack->Backend->GetBuffer(unpack->Opaque, &bufferSize);
+            if (!buffer)
+                return ENOMEM;
+
+            if (untrustedRecord.data_size > bufferSize)
+                return EINVAL;
+
+            if (unpack->Backend->Read(unpack->Opaque, buffer, untrustedRecord.data_size) != 0)
+                return EIO;
+
+            // the backend fails the transfer if the block doesn't decompress to this checksum
+            status = unpack->Backend->WriteCompressed(unpack->Opaque, buffer, untrustedRecord.data_size,
+                untrustedRecord.original_size, untrustedRecord.crc32);
+            unpack->Crc32 = FceCrc32Combine(unpack->Crc32, untrustedRecord.crc32, untrustedRecord.original_size);
+            break;
+
+        default:
+            status = EINVAL;
+        }
+
+        if (status != 0)
+            return status;
+
+        remaining -= untrustedRecord.original_size;
+    }
+
+    return 0;
+}
+
+static char *DuplicateString(const char *string)
+{
+    size_t size = strlen(string) + 1;
+    char *copy = malloc(size);
+
+    if (copy)
+        memcpy(copy, string, size);
+
+    return copy;
+}
+
+static int AddDedupSource(FCE_UNPACK *unpack, const char *untrustedName)
+{
+    FCE_DEDUP_SOURCE *source;
+
+    if (unpack->DedupSourcesCount == unpack->DedupSourcesCapacity)
+    {
+        size_t newCapacity = unpack->DedupSourcesCapacity ? 2 * unpack->DedupSourcesCapacity : 256;
+        FCE_DEDUP_SOURCE *newSources = realloc(unpack->DedupSources, newCapacity * sizeof(FCE_DEDUP_SOURCE));
+
+        if (!newSources)
+            return ENOMEM;
+
+        unpack->DedupSources = newSources;
+        unpack->DedupSourcesCapacity = newCapacity;
+    }
+
+    source = &unpack->DedupSources[unpack->DedupSourcesCount];
+    source->Entry = unpack->EntryIndex;
+    source->Name = DuplicateString(untrustedName);
+    if (!source->Name)
+        return ENOMEM;
+
+    unpack->DedupSourcesCount++;
+    return 0;
+}
+
+static const char *FindDedupSource(FCE_UNPACK *unpack, uint64_t entry)
+{
+    size_t low = 0, high = unpack->DedupSourcesCount;
+    size_t middle;
+
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if (unpack->DedupSources[middle].Entry == entry)
+            return unpack->DedupSources[middle].Name;
+
+        if (unpack->DedupSources[middle].Entry < entry)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return NULL;
+}
+
+// The local copy may not match, *complete is cleared then and the sender sends the file again.
+static int ProcessDuplicate(FCE_UNPACK *unpack, const struct file_header *untrustedHeader, const char *untrustedName, int *complete)
+{
+    struct duplicate_record untrustedRecord;
+    struct duplicate_reply reply;
+    const char *sourceName;
+    int matched = 0;
+    int status;
+
+    if (ReadWithCrc(unpack, &untrustedRecord, sizeof(untrustedRecord)) != 0)
+        return EIO;
+
+    sourceName = FindDedupSource(unpack, untrustedRecord.source_entry);
+    if (!sourceName)
+        return EINVAL;
+
+    status = unpack->Backend->CopyDuplicate(unpack->Opaque, untrustedHeader, untrustedName, sourceName, untrustedRecord.hash, &matched);
+    if (status != 0)
+        return status;
+
+    reply.magic = FC_DUPLICATE_REPLY_MAGIC;
+    reply.status = matched ? FC_DUPLICATE_OK : FC_DUPLICATE_MISMATCH;
+    if (!matched)
+    {
+        unpack->TotalBytes -= untrustedHeader->filelen; // counted again when resent
+        *complete = 0;
+    }
+
+    return unpack->Backend->Reply(unpack->Opaque, &reply, sizeof(reply));
+}
+
+// The only entry allowed to continue an existing file is the one the journal says was interrupted.
+static int GetResumeOffset(FCE_UNPACK *unpack, const struct file_header *untrustedHeader, const char *untrustedName, uint64_t *offset)
+{
+    *offset = 0;
+    if (!(untrustedHeader->mode & FC_MODE_RESUMED))
+        return 0;
+
+    if (!(unpack->Caps & FC_CAP_RESUME)
+        || !(unpack->ResumePoint.flags & FC_RESUME_PARTIAL)
+        || unpack->EntryIndex != unpack->ResumePoint.entries_done
+        || (untrustedHeader->mode & FC_MODE_SPARSE)
+        || !unpack->ResumePartialName
+        || 0 != strcmp(untrustedName, unpack->ResumePartialName)
+        || untrustedHeader->filelen < unpack->ResumePoint.offset)
+    {
+        return EINVAL;
+    }
+
+    *offset = unpack->ResumePoint.offset;
+    return 0;
+}
+
+static int ProcessRegularFile(FCE_UNPACK *unpack, const struct file_header *untrustedHeader, const char *untrustedName, int *complete)
+{
+    uint64_t resumeOffset;
+    int status;
+
+    status = GetResumeOffset(unpack, untrustedHeader, untrustedName, &resumeOffset);
+    if (status != 0)
+        return status;
+
+    if ((untrustedHeader->mode & (FC_MODE_DEDUP_SOURCE | FC_MODE_DUPLICATE)) && !(unpack->Caps & FC_CAP_DEDUP))
+        return EINVAL;
+
+    if ((untrustedHeader->mode & FC_MODE_SPARSE) && !(unpack->Caps & FC_CAP_SPARSE))
+        return EINVAL;
+
+    if (untrustedHeader->mode & FC_MODE_COMPRESSED)
+    {
+        if (!(unpack->Caps & FC_CAP_COMPRESS) || (untrustedHeader->mode & FC_MODE_SPARSE))
+            return EINVAL;
+    }
+
+    unpack->TotalBytes += untrustedHeader->filelen - resumeOffset;
+    if (unpack->BytesLimit && unpack->TotalBytes > unpack->BytesLimit)
+        return FC_EDQUOT;
+
+    if (untrustedHeader->mode & FC_MODE_DUPLICATE)
+    {
+        if (untrustedHeader->mode & (FC_MODE_SPARSE | FC_MODE_RESUMED | FC_MODE_DEDUP_SOURCE | FC_MODE_COMPRESSED))
+            return EINVAL;
+
+        return ProcessDuplicate(unpack, untrustedHeader, untrustedName, complete);
+    }
+
+    status = unpack->Backend->BeginFile(unpack->Opaque, untrustedHeader, untrustedName, resumeOffset);
+    if (status != 0)
+        return status;
+
+    if (untrustedHeader->mode & FC_MODE_SPARSE)
+        status = ReceiveSparseData(unpack, untrustedHeader->filelen);
+    else if (untrustedHeader->mode & FC_MODE_COMPRESSED)
+        status = ReceiveCompressedData(unpack, untrustedHeader->filelen - resumeOffset);
+    else
+        status = ReceiveData(unpack, untrustedHeader->filelen - resumeOffset);
+
+    if (status != 0)
+        return status;
+
+    status = unpack->Backend->EndFile(unpack->Opaque);
+    if (status != 0)
+        return status;
+
+    if (untrustedHeader->mode & FC_MODE_DEDUP_SOURCE)
+        return AddDedupSource(unpack, untrustedName);
+
+    return 0;
+}
+
+static int ProcessLink(FCE_UNPACK *unpack, const struct file_header *untrustedHeader, const char *untrustedName)
+{
+    char untrustedTarget[MAX_PATH_LENGTH];
+    size_t targetSize;
+
+    if (untrustedHeader->filelen > MAX_PATH_LENGTH - 1)
+        return FC_ENAMETOOLONG;
+
+    targetSize = (size_t)untrustedHeader->filelen; // sanitized above
+    if (ReadWithCrc(unpack, untrustedTarget, targetSize) != 0)
+        return EIO;
+
+    untrustedTarget[targetSize] = 0;
+    return unpack->Backend->MakeLink(unpack->Opaque, untrustedHeader, untrustedName, untrustedTarget);
+}
+
+static int ProcessResumeRequest(FCE_UNPACK *unpack)
+{
+    struct resume_request untrustedRequest;
+    int status;
+
+    if (ReadWithCrc(unpack, &untrustedRequest, sizeof(untrustedRequest)) != 0)
+        return EIO;
+
+    if (untrustedRequest.magic != FC_RESUME_REQUEST_MAGIC)
+        return EINVAL;
+
+    memset(&unpack->ResumePoint, 0, sizeof(unpack->ResumePoint));
+    status = unpack->Backend->OpenJournal(unpack->Opaque, untrustedRequest.manifest, &unpack->ResumePoint, &unpack->ResumePartialName);
+    if (status != 0)
+        return status;
+
+    unpack->ResumePoint.magic = FC_RESUME_REPLY_MAGIC;
+    unpack->EntryIndex = unpack->ResumePoint.entries_done;
+    return unpack->Backend->Reply(unpack->Opaque, &unpack->ResumePoint, sizeof(unpack->ResumePoint));
+}
+
+// Handles the capability probe/confirmation entries, *handled is cleared for other entries.
+static int ProcessCapsEntry(FCE_UNPACK *unpack, const struct file_header *untrustedHeader, const char *untrustedName, int *handled)
+{
+    struct caps_reply reply;
+
+    *handled = 0;
+    if (0 != strcmp(untrustedName, FC_CAPS_NAME))
+        return 0;
+
+    switch (FC_CAPS_MAGIC(untrustedHeader->filelen))
+    {
+    case FC_CAPS_PROBE_MAGIC:
+        *handled = 1;
+        reply.magic = FC_CAPS_REPLY_MAGIC;
+        reply.caps = FC_CAPS_VALUE(untrustedHeader->filelen) & unpack->SupportedCaps;
+        return unpack->Backend->Reply(unpack->Opaque, &reply, sizeof(reply));
+
+    case FC_CAPS_CONFIRM_MAGIC:
+        *handled = 1;
+        // a later one would switch the caps and rewind the resume point mid-transfer
+        if (unpack->CapsConfirmed || unpack->EntryIndex != 0)
+            return EINVAL;
+        unpack->CapsConfirmed = 1;
+        unpack->Caps = FC_CAPS_VALUE(untrustedHeader->filelen);
+        if (unpack->Caps & ~unpack->SupportedCaps)
+            return EINVAL;
+        if (unpack->Caps & FC_CAP_RESUME)
+            return ProcessResumeRequest(unpack);
+        return 0;
+    }
+
+    return 0;
+}
+
+static int ProcessEntry(FCE_UNPACK *unpack, const struct file_header *untrustedHeader)
+{
+    uint32_t nameSize;
+    int complete = 1;
+    int handled;
+    int status;
+
+    if (untrustedHeader->namelen > MAX_PATH_LENGTH - 1)
+        return FC_ENAMETOOLONG;
+
+    nameSize = untrustedHeader->namelen; // sanitized above
+    if (ReadWithCrc(unpack, unpack->UntrustedName, nameSize) != 0)
+        return LEGAL_EOF; // hopefully remote has produced error message
+
+    unpack->UntrustedName[nameSize] = 0;
+    unpack->LastName = unpack->UntrustedName;
+
+    if (FC_S_ISREG(untrustedHeader->mode))
+    {
+        status = ProcessRegularFile(unpack, untrustedHeader, unpack->UntrustedName, &complete);
+    }
+    else if (FC_S_ISLNK(untrustedHeader->mode))
+    {
+        status = ProcessLink(unpack, untrustedHeader, unpack->UntrustedName);
+    }
+    else if (FC_S_ISDIR(untrustedHeader->mode))
+    {
+        status = ProcessCapsEntry(unpack, untrustedHeader, unpack->UntrustedName, &handled);
+        if (status != 0 || handled)
+        {
+            unpack->LastName = NULL;
+            return status;
+        }
+
+        status = unpack->Backend->MakeDirectory(unpack->Opaque, untrustedHeader, unpack->UntrustedName);
+    }
+    else
+    {
+        status = EINVAL;
+    }
+
+    if (status != 0 || !complete)
+        return status;
+
+    unpack->EntryIndex++;
+    unpack->TotalFiles++;
+    if (unpack->FilesLimit && unpack->TotalFiles > unpack->FilesLimit)
+        return FC_EDQUOT;
+
+    unpack->LastName = NULL;
+    return 0;
+}
+
+int FceUnpack(FCE_UNPACK *unpack)
+{
+    struct file_header untrustedHeader;
+    int status;
+
+    unpack->Crc32 = 0;
+    unpack->LastName = NULL;
+    while (ReadWithCrc(unpack, &untrustedHeader, sizeof(untrustedHeader)) == 0)
+    {
+        // check for end of transfer marker
+        if (untrustedHeader.namelen == 0)
+            return unpack->Backend->Finish(unpack->Opaque);
+
+        status = ProcessEntry(unpack, &untrustedHeader);
+        if (status != 0)
+            return status;
+    }
+
+    // hopefully remote has produced error message
+    return LEGAL_EOF;
+}
+
+int FceUnpackSendResult(FCE_UNPACK *unpack, uint32_t status, const char *lastName)
+{
+    struct result_header header;
+    struct result_header_ext headerExt;
+    int replyStatus;
+
+    memset(&header, 0, sizeof(header));
+    header.error_code = status;
+    header.crc32 = unpack->Crc32;
+    replyStatus = unpack->Backend->Reply(unpack->Opaque, &header, sizeof(header));
+    if (replyStatus != 0 || !lastName)
+        return replyStatus;
+
+    headerExt.last_namelen = (uint32_t)strlen(lastName);
+    replyStatus = unpack->Backend->Reply(unpack->Opaque, &headerExt, sizeof(headerExt));
+    if (replyStatus != 0)
+        return replyStatus;
+
+    return unpack->Backend->Reply(unpack->Opaque, lastName, headerExt.last_namelen);
+}
+
+/*
+ * pack
+ */
+
+void FcePackInit(FCE_PACK *pack, const FCE_PACK_BACKEND *backend, void *opaque)
+{
+    memset(pack, 0, sizeof(*pack));
+    pack->Backend = backend;
+    pack->Opaque = opaque;
+}
+
+int FcePackWrite(FCE_PACK *pack, const void *buffer, size_t size)
+{
+    pack->Crc32 = Crc32_ComputeBuf(pack->Crc32, buffer, size);
+    return pack->Backend->Write(pack->Opaque, buffer, size);
+}
+
+int FcePackEntry(FCE_PACK *pack, struct file_header *header, const char *name)
+{
+    int status;
+
+    header->namelen = (uint32_t)strlen(name);
+    status = FcePackWrite(pack, header, sizeof(*header));
+    if (status != 0)
+        return status;
+
+    return FcePackWrite(pack, name, header->namelen);
+}
+
+static int WriteRecord(FCE_PACK *pack, uint32_t type, uint64_t length)
+{
+    struct data_record record;
+
+    record.type = type;
+    record._pad = 0;
+    record.length = length;
+    // records are not covered by the checksum
+    return pack->Backend->Write(pack->Opaque, &record, sizeof(record));
+}
+
+int FcePackDataRecord(FCE_PACK *pack, uint64_t length)
+{
+    return WriteRecord(pack, FC_RECORD_DATA, length);
+}
+
+int FcePackHole(FCE_PACK *pack, uint64_t length)
+{
+    pack->Crc32 = FceCrc32Zeros(pack->Crc32, length);
+    return WriteRecord(pack, FC_RECORD_HOLE, length);
+}
+
+static int WriteBlockRecord(FCE_PACK *pack, uint32_t type, size_t originalSize, size_t dataSize, uint32_t crc32)
+{
+    struct block_record record;
+
+    record.type = type;
+    record.original_size = (uint32_t)originalSize; // safe cast: at most FC_COMPRESS_BLOCK_SIZE
+    record.data_size = (uint32_t)dataSize;
+    record.crc32 = crc32;
+    return pack->Backend->Write(pack->Opaque, &record, sizeof(record));
+}
+
+int FcePackStoredBlock(FCE_PACK *pack, const void *buffer, size_t size)
+{
+    int status = WriteBlockRecord(pack, FC_BLOCK_STORED, size, size, 0);
+
+    if (status != 0)
+        return status;
+
+    return FcePackWrite(pack, buffer, size);
+}
+
+int FcePackCompressedBlock(FCE_PACK *pack, const void *compressed, size_t compressedSize,
+    const void *original, size_t originalSize)
+{
+    uint32_t crc32 = Crc32_ComputeBuf(0, original, originalSize);
+    int status;
+
+    pack->Crc32 = FceCrc32Combine(pack->Crc32, crc32, originalSize);
+    status = WriteBlockRecord(pack, FC_BLOCK_XPRESS, originalSize, compressedSize, crc32);
+    if (status != 0)
+        return status;
+
+    return pack->Backend->Write(pack->Opaque, compressed, compressedSize);
+}
+
+static int WriteCapsEntry(FCE_PACK *pack, uint32_t magic, uint32_t caps, uint32_t time)
+{
+    struct file_header header;
+
+    memset(&header, 0, sizeof(header));
+    header.mode = 0755 | FC_S_IFDIR;
+    header.filelen = ((uint64_t)magic << 32) | caps;
+    header.atime = time;
+    header.mtime = time;
+    return FcePackEntry(pack, &header, FC_CAPS_NAME);
+}
+
+// Reads a reply, or keeps what was read as the beginning of an early result.
+static int ReadReply(FCE_PACK *pack, void *reply, size_t size, uint32_t magic)
+{
+    uint32_t replyMagic;
+
+    if (pack->Backend->Read(pack->Opaque, reply, sizeof(pack->ResultPrefix)) != 0)
+        return EIO;
+
+    memcpy(&replyMagic, reply, sizeof(replyMagic));
+    if (replyMagic != magic)
+    {
+        // the receiver failed and sent the result instead
+        memcpy(pack->ResultPrefix, reply, sizeof(pack->ResultPrefix));
+        pack->ResultPrefixValid = 1;
+        return EPROTO;
+    }
+
+    if (size > sizeof(pack->ResultPrefix)
+        && pack->Backend->Read(pack->Opaque, (uint8_t *)reply + sizeof(pack->ResultPrefix), size - sizeof(pack->ResultPrefix)) != 0)
+    {
+        return EIO;
+    }
+
+    return 0;
+}
+
+int FcePackNegotiate(FCE_PACK *pack, uint32_t requested, uint32_t time)
+{
+    struct caps_reply reply;
+    int status;
+
+    pack->Caps = 0;
+    if (!requested)
+        return 0;
+
+    status = WriteCapsEntry(pack, FC_CAPS_PROBE_MAGIC, requested, time);
+    if (status != 0)
+        return status;
+
+    // old receivers never reply
+    pack->CapsReplyPending = 1;
+    if (pack->Backend->WaitForInput(pack->Opaque, FC_CAPS_TIMEOUT))
+    {
+        status = ReadReply(pack, &reply, sizeof(reply), FC_CAPS_REPLY_MAGIC);
+        if (status != 0)
+            return status;
+
+        pack->Caps = reply.caps & requested;
+        pack->CapsReplyPending = 0;
+    }
+
+    return WriteCapsEntry(pack, FC_CAPS_CONFIRM_MAGIC, pack->Caps, time);
+}
+
+int FcePackRequestResume(FCE_PACK *pack, uint64_t manifest, struct resume_reply *resumePoint)
+{
+    struct resume_request request;
+    int status;
+
+    request.magic = FC_RESUME_REQUEST_MAGIC;
+    request._pad = 0;
+    request.manifest = manifest;
+    status = FcePackWrite(pack, &request, sizeof(request));
+    if (status != 0)
+        return status;
+
+    return ReadReply(pack, resumePoint, sizeof(*resumePoint), FC_RESUME_REPLY_MAGIC);
+}
+
+int FcePackDuplicate(FCE_PACK *pack, struct file_header *header, const char *name,
+    uint64_t sourceEntry, const uint8_t *hash, int *matched)
+{
+    struct duplicate_record record;
+    struct duplicate_reply reply;
+    int status;
+
+    *matched = 0;
+    header->mode |= FC_MODE_DUPLICATE;
+    status = FcePackEntry(pack, header, name);
+    header->mode &= ~FC_MODE_DUPLICATE;
+    if (status != 0)
+        return status;
+
+    record.source_entry = sourceEntry;
+    memcpy(record.hash, hash, FC_HASH_SIZE);
+    status = FcePackWrite(pack, &record, sizeof(record));
+    if (status != 0)
+        return status;
+
+    status = ReadReply(pack, &reply, sizeof(reply), FC_DUPLICATE_REPLY_MAGIC);
+    if (status != 0)
+        return status;
+
+    *matched = (reply.status == FC_DUPLICATE_OK);
+    return 0;
+}
+
+int FcePackEnd(FCE_PACK *pack)
+{
+    struct file_header endHeader;
+
+    memset(&endHeader, 0, sizeof(endHeader));
+    return FcePackWrite(pack, &endHeader, sizeof(endHeader));
+}
+
+int FcePackReadResult(FCE_PACK *pack, FCE_RESULT *result)
+{
+    struct result_header header;
+    struct result_header_ext headerExt;
+    uint8_t *rest = (uint8_t *)&header + sizeof(pack->ResultPrefix);
+    uint32_t nameLength;
+
+    memset(result, 0, sizeof(*result));
+
+    // read the first part only, it may be a late caps_reply
+    if (pack->ResultPrefixValid)
+        memcpy(&header, pack->ResultPrefix, sizeof(pack->ResultPrefix));
+    else if (pack->Backend->Read(pack->Opaque, &header, sizeof(pack->ResultPrefix)) != 0)
+        return EIO;
+
+    if (pack->CapsReplyPending && !pack->ResultPrefixValid && header.error_code == FC_CAPS_REPLY_MAGIC)
+    {
+        if (pack->Backend->Read(pack->Opaque, &header, sizeof(pack->ResultPrefix)) != 0)
+            return EIO;
+    }
+
+    pack->ResultPrefixValid = 0;
+    if (pack->Backend->Read(pack->Opaque, rest, sizeof(header) - sizeof(pack->ResultPrefix)) != 0)
+        return EIO;
+
+    result->ErrorCode = header.error_code;
+    result->CrcMatches = (header.crc32 == pack->Crc32);
+
+    // remote may use the old result_header without the extension
+    if (pack->Backend->Read(pack->Opaque, &headerExt, sizeof(headerExt)) != 0)
+        return 0;
+
+    // keep only the beginning of a long name
+    nameLength = headerExt.last_namelen;
+    if (nameLength > FCE_MAX_RESULT_NAME)
+        nameLength = FCE_MAX_RESULT_NAME;
+
+    if (pack->Backend->Read(pack->Opaque, result->LastName, nameLength) != 0)
+        nameLength = 0;
+
+    result->LastName[nameLength] = 0;
+    return 0;
+}
+
+static uint32_t Gf2MatrixTimes(const uint32_t *matrix, uint32_t vector)
+{
+    uint32_t sum = 0;
+
+    while (vector)
+    {
+        if (vector & 1)
+            sum ^= *matrix;
+        vector >>= 1;
+        matrix++;
+    }
+
+    return sum;
+}
+
+static void Gf2MatrixSquare(uint32_t *square, const uint32_t *matrix)
+{
+    int n;
+
+    for (n = 0; n < 32; n++)
+        square[n] = Gf2MatrixTimes(matrix, matrix[n]);
+}
+
+// Same as zlib's crc32_combine: applies size2 zero bytes to crc1 with repeatedly
+// squared operator matrices, so the cost is logarithmic in size2.
+uint32_t FceCrc32Combine(uint32_t crc1, uint32_t crc2, uint64_t size2)
+{
+    uint32_t even[32]; // operator for an even power of two zero bits
+    uint32_t odd[32]; // operator for an odd power of two zero bits
+    uint32_t row;
+    int n;
+
+    if (size2 == 0)
+        return crc1;
+
+    // operator for one zero bit
+    odd[0] = 0xEDB88320;
+    row = 1;
+    for (n = 1; n < 32; n++)
+    {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    Gf2MatrixSquare(even, odd); // two zero bits
+    Gf2MatrixSquare(odd, even); // four zero bits
+
+    // the first square below gives the operator for one zero byte
+    do
+    {
+        Gf2MatrixSquare(even, odd);
+        if (size2 & 1)
+            crc1 = Gf2MatrixTimes(even, crc1);
+        size2 >>= 1;
+        if (size2 == 0)
+            break;
+
+        Gf2MatrixSquare(odd, even);
+        if (size2 & 1)
+            crc1 = Gf2MatrixTimes(odd, crc1);
+        size2 >>= 1;
+    } while (size2 != 0);
+
+    return crc1 ^ crc2;
+}
+
+// Zeros only shift the register, without the pre- and post-inversion that is the
+// operator FceCrc32Combine applies to crc1.
+uint32_t FceCrc32Zeros(uint32_t crc32, uint64_t size)
+{
+    return ~FceCrc32Combine(~crc32, 0, size);
+}
@@ -0,0 +1,190 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Platform independent parts of the filecopy stream: parsing entries on the receiving
+// end (unpack) and producing them on the sending end (pack). All state lives in the
+// context structures, everything that touches the OS goes through a backend.
+// Functions return 0 or an errno-style status that can be reported to the other end.
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "filecopy-protocol.h"
+
+// longest last file name reported in result_header_ext that is kept
+#define FCE_MAX_RESULT_NAME 260
+
+typedef struct _FCE_UNPACK_BACKEND
+{
+    // Reads exactly size bytes of the stream.
+    int (*Read)(void *opaque, void *buffer, size_t size);
+    // Writes to the sender (extension replies and the final result).
+    int (*Reply)(void *opaque, const void *buffer, size_t size);
+
+    // File data is read directly into buffers provided by the backend and handed back
+    // with WriteData, so a backend may write them asynchronously.
+    void *(*GetBuffer)(void *opaque, size_t *size);
+    // resumeOffset is nonzero only for FC_MODE_RESUMED entries
+    int (*BeginFile)(void *opaque, const struct file_header *untrustedHeader, const char *untrustedName, uint64_t resumeOffset);
+    int (*WriteData)(void *opaque, void *buffer, size_t size);
+    int (*EndFile)(void *opaque);
+    int (*MakeDirectory)(void *opaque, const struct file_header *untrustedHeader, const char *untrustedName);
+    int (*MakeLink)(void *opaque, const struct file_header *untrustedHeader, const char *untrustedName, const char *untrustedTarget);
+    // Called after the end marker, returns once everything is stored.
+    int (*Finish)(void *opaque);
+
+    // Optional, NULL if the backend doesn't support the matching extension.
+
+    // FC_CAP_SPARSE: skips size bytes of the current file, they read as zeros.
+    int (*SkipHole)(void *opaque, uint64_t size);
+    // FC_CAP_RESUME: fills the resume point for the transfer identified by manifest,
+    // partialName is the name of the partially written file, if any.
+    int (*OpenJournal)(void *opaque, uint64_t manifest, struct resume_reply *resumePoint, const char **partialName);
+    // FC_CAP_DEDUP: copies sourceName, matched is set if the copy has the expected hash
+    // (otherwise the copy must be removed).
+    int (*CopyDuplicate)(void *opaque, const struct file_header *untrustedHeader, const char *untrustedName,
+        const char *sourceName, const uint8_t *untrustedHash, int *matched);
+    // FC_CAP_COMPRESS: like WriteData, but buffer holds size bytes of compressed data
+    // that must decompress to originalSize bytes with the given crc32 (the backend
+    // checks both, the engine only accounts for them).
+    int (*WriteCompressed)(void *opaque, void *buffer, size_t size, uint32_t originalSize, uint32_t untrustedCrc32);
+} FCE_UNPACK_BACKEND;
+
+typedef struct _FCE_DEDUP_SOURCE
+{
+    uint64_t Entry;
+    char *Name;
+} FCE_DEDUP_SOURCE;
+
+typedef struct _FCE_UNPACK
+{
+    const FCE_UNPACK_BACKEND *Backend;
+    void *Opaque;
+
+    uint32_t Crc32;
+    uint32_t SupportedCaps;
+    uint32_t Caps; // confirmed by the sender
+    int CapsConfirmed; // only once, before the first entry
+
+    uint64_t BytesLimit; // 0 = unlimited
+    uint64_t FilesLimit;
+    uint64_t TotalBytes;
+    uint64_t TotalFiles;
+
+    uint64_t EntryIndex; // in the whole (resumed) transfer
+    struct resume_reply ResumePoint;
+    const char *ResumePartialName;
+
+    // files that later entries may refer to (FC_MODE_DEDUP_SOURCE), in entry order
+    FCE_DEDUP_SOURCE *DedupSources;
+    size_t DedupSourcesCount;
+    size_t DedupSourcesCapacity;
+
+    // name of the entry being processed, for error reporting
+    const char *LastName;
+    char UntrustedName[MAX_PATH_LENGTH];
+} FCE_UNPACK;
+
+void FceUnpackInit(FCE_UNPACK *unpack, const FCE_UNPACK_BACKEND *backend, void *opaque);
+void FceUnpackCleanup(FCE_UNPACK *unpack);
+
+// Processes the whole stream up to the end marker. On failure unpack->LastName
+// is the entry that failed (or NULL). LEGAL_EOF means the sender went away.
+int FceUnpack(FCE_UNPACK *unpack);
+
+// Sends result_header (and result_header_ext if lastName is set) to the sender.
+int FceUnpackSendResult(FCE_UNPACK *unpack, uint32_t status, const char *lastName);
+
+typedef struct _FCE_PACK_BACKEND
+{
+    // Writes exactly size bytes to the stream.
+    int (*Write)(void *opaque, const void *buffer, size_t size);
+    // Reads exactly size bytes of replies from the receiver.
+    int (*Read)(void *opaque, void *buffer, size_t size);
+    // Returns nonzero if a reply can be read within timeout (ms).
+    int (*WaitForInput)(void *opaque, uint32_t timeout);
+} FCE_PACK_BACKEND;
+
+typedef struct _FCE_PACK
+{
+    const FCE_PACK_BACKEND *Backend;
+    void *Opaque;
+
+    uint32_t Crc32;
+    uint32_t Caps; // confirmed, valid after FcePackNegotiate
+    int CapsReplyPending; // probe sent but not answered in time
+
+    // beginning of the result, read while a reply was expected
+    uint8_t ResultPrefix[sizeof(struct caps_reply)];
+    int ResultPrefixValid;
+} FCE_PACK;
+
+typedef struct _FCE_RESULT
+{
+    uint32_t ErrorCode;
+    int CrcMatches;
+    char LastName[FCE_MAX_RESULT_NAME + 1]; // "" if not reported
+} FCE_RESULT;
+
+void FcePackInit(FCE_PACK *pack, const FCE_PACK_BACKEND *backend, void *opaque);
+
+// Writes data covered by the crc32.
+int FcePackWrite(FCE_PACK *pack, const void *buffer, size_t size);
+
+// Writes the header (namelen is filled in) and the name, data follows with FcePackWrite.
+int FcePackEntry(FCE_PACK *pack, struct file_header *header, const char *name);
+
+// Data records of FC_MODE_SPARSE files, the data itself follows with FcePackWrite.
+int FcePackDataRecord(FCE_PACK *pack, uint64_t length);
+int FcePackHole(FCE_PACK *pack, uint64_t length);
+
+// Blocks of FC_MODE_COMPRESSED files, at most FC_COMPRESS_BLOCK_SIZE bytes of content each.
+// A stored block is written with its data. A compressed block is written with the
+// compressed data, the original data only goes into the crc32.
+int FcePackStoredBlock(FCE_PACK *pack, const void *buffer, size_t size);
+int FcePackCompressedBlock(FCE_PACK *pack, const void *compressed, size_t compressedSize,
+    const void *original, size_t originalSize);
+
+// Agrees on protocol extensions with the receiver, see filecopy-protocol.h.
+// Only for receivers known to support them, others fail or stall on the probe.
+// time is used for the probe entries. Sets pack->Caps.
+int FcePackNegotiate(FCE_PACK *pack, uint32_t requested, uint32_t time);
+
+// FC_CAP_RESUME: asks where an interrupted transfer of the same files ended.
+int FcePackRequestResume(FCE_PACK *pack, uint64_t manifest, struct resume_reply *resumePoint);
+
+// FC_CAP_DEDUP: sends header as a duplicate of sourceEntry, matched is cleared
+// if the receiver's copy is different and the file must be sent in full.
+int FcePackDuplicate(FCE_PACK *pack, struct file_header *header, const char *name,
+    uint64_t sourceEntry, const uint8_t *hash, int *matched);
+
+// Writes the end marker.
+int FcePackEnd(FCE_PACK *pack);
+
+// Reads the final result, also after a failed write.
+int FcePackReadResult(FCE_PACK *pack, FCE_RESULT *result);
+
+// Updates crc32 as if size zero bytes were processed, in O(log size).
+uint32_t FceCrc32Zeros(uint32_t crc32, uint64_t size);
+
+// Returns the crc32 of two concatenated blocks from their own checksums.
+uint32_t FceCrc32Combine(uint32_t crc1, uint32_t crc2, uint64_t size2);
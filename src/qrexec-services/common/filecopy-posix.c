@@ -0,0 +1,482 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "filecopy-posix.h"
+
+static int ReadAll(int fd, void *buffer, size_t size)
+{
+    uint8_t *position = buffer;
+    ssize_t cbRead;
+
+    while (size > 0)
+    {
+        cbRead = read(fd, position, size);
+        if (cbRead < 0 && errno == EINTR)
+            continue;
+        if (cbRead <= 0)
+            return EIO;
+
+        position += cbRead;
+        size -= (size_t)cbRead;
+    }
+
+    return 0;
+}
+
+static int WriteAll(int fd, const void *buffer, size_t size)
+{
+    const uint8_t *position = buffer;
+    ssize_t cbWritten;
+
+    while (size > 0)
+    {
+        cbWritten = write(fd, position, size);
+        if (cbWritten < 0 && errno == EINTR)
+            continue;
+        if (cbWritten < 0)
+            return errno == ENOSPC ? ENOSPC : EIO;
+
+        position += cbWritten;
+        size -= (size_t)cbWritten;
+    }
+
+    return 0;
+}
+
+/*
+ * unpack
+ */
+
+// There is no chroot here, so names must not leave the root directory.
+static int CheckName(const char *untrustedName)
+{
+    const char *component = untrustedName;
+    size_t length;
+
+    if (untrustedName[0] == '\0' || untrustedName[0] == '/')
+        return EINVAL;
+
+    while (*component)
+    {
+        length = strcspn(component, "/");
+        if (length == 2 && component[0] == '.' && component[1] == '.')
+            return EINVAL;
+
+        component += length;
+        if (*component == '/')
+            component++;
+    }
+
+    return 0;
+}
+
+static void HeaderToTimes(const struct file_header *untrustedHeader, struct timespec times[2])
+{
+    times[0].tv_sec = untrustedHeader->atime;
+    times[0].tv_nsec = untrustedHeader->atime_nsec < 1000000000 ? untrustedHeader->atime_nsec : 0;
+    times[1].tv_sec = untrustedHeader->mtime;
+    times[1].tv_nsec = untrustedHeader->mtime_nsec < 1000000000 ? untrustedHeader->mtime_nsec : 0;
+}
+
+static int UnpackRead(void *opaque, void *buffer, size_t size)
+{
+    FCE_POSIX_UNPACK *posix = opaque;
+
+    return ReadAll(posix->Input, buffer, size);
+}
+
+static int UnpackReply(void *opaque, const void *buffer, size_t size)
+{
+    FCE_POSIX_UNPACK *posix = opaque;
+
+    return WriteAll(posix->Output, buffer, size);
+}
+
+static void *UnpackGetBuffer(void *opaque, size_t *size)
+{
+    FCE_POSIX_UNPACK *posix = opaque;
+
+    *size = FC_COPY_BUFFER_SIZE;
+    return posix->Buffer;
+}
+
+static int UnpackBeginFile(void *opaque, const struct file_header *untrustedHeader, const char *untrustedName, uint64_t resumeOffset)
+{
+    FCE_POSIX_UNPACK *posix = opaque;
+    int status = CheckName(untrustedName);
+
+    if (status != 0)
+        return status;
+
+    if (untrustedHeader->mode & FC_MODE_RESUMED)
+        posix->File = openat(posix->RootDirectory, untrustedName, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+    else
+        posix->File = openat(posix->RootDirectory, untrustedName, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+            (mode_t)(untrustedHeader->mode & 0777));
+
+    if (posix->File < 0)
+        return (errno == EEXIST || errno == EACCES) ? errno : EIO;
+
+    posix->FileHeader = *untrustedHeader;
+
+    if (resumeOffset > 0 && lseek(posix->File, (off_t)resumeOffset, SEEK_SET) < 0)
+        return EIO;
+
+    // holes are skipped, the size covers the trailing one
+    if ((untrustedHeader->mode & FC_MODE_SPARSE) && ftruncate(posix->File, (off_t)untrustedHeader->filelen) < 0)
+        return errno == ENOSPC ? ENOSPC : EIO;
+
+    return 0;
+}
+
+static int UnpackWriteData(void *opaque, void *buffer, size_t size)
+{
+    FCE_POSIX_UNPACK *posix = opaque;
+
+    return WriteAll(posix->File, buffer, size);
+}
+
+static int UnpackSkipHole(void *opaque, uint64_t size)
+{
+    FCE_POSIX_UNPACK *posix = opaque;
+
+    if (lseek(posix->File, (off_t)size, SEEK_CUR) < 0)
+        return EIO;
+
+    return 0;
+}
+
+static int UnpackEndFile(void *opaque)
+{
+    FCE_POSIX_UNPACK *posix = opaque;
+    struct timespec times[2];
+    int status = 0;
+
+    HeaderToTimes(&posix->FileHeader, times);
+    if (futimens(posix->File, times) < 0)
+        status = EIO;
+
+    if (close(posix->File) < 0)
+        status = EIO;
+
+    posix->File = -1;
+    return status;
+}
+
+static int UnpackMakeDirectory(void *opaque, const struct file_header *untrustedHeader, const char *untrustedName)
+{
+    FCE_POSIX_UNPACK *posix = opaque;
+    struct timespec times[2];
+    int status = CheckName(untrustedName);
+
+    if (status != 0)
+        return status;
+
+    if (mkdirat(posix->RootDirectory, untrustedName, 0700) < 0 && errno != EEXIST)
+        return ENOTDIR;
+
+    // directories are sent again after their contents, the last times stay
+    HeaderToTimes(untrustedHeader, times);
+    if (utimensat(posix->RootDirectory, untrustedName, times, AT_SYMLINK_NOFOLLOW) < 0)
+        return EIO;
+
+    return 0;
+}
+
+static int UnpackMakeLink(void *opaque, const struct file_header *untrustedHeader, const char *untrustedName, const char *untrustedTarget)
+{
+    FCE_POSIX_UNPACK *posix = opaque;
+    int status = CheckName(untrustedName);
+
+    (void)untrustedHeader;
+    if (status != 0)
+        return status;
+
+    // a link leading out of the root would let later entries escape through it
+    if (CheckName(untrustedTarget) != 0)
+        return EPERM;
+
+    if (symlinkat(untrustedTarget, posix->RootDirectory, untrustedName) < 0)
+        return (errno == EEXIST || errno == EACCES) ? errno : EIO;
+
+    return 0;
+}
+
+static int UnpackFinish(void *opaque)
+{
+    (void)opaque;
+    return 0;
+}
+
+const FCE_UNPACK_BACKEND g_fcePosixUnpackBackend =
+{
+    UnpackRead,
+    UnpackReply,
+    UnpackGetBuffer,
+    UnpackBeginFile,
+    UnpackWriteData,
+    UnpackEndFile,
+    UnpackMakeDirectory,
+    UnpackMakeLink,
+    UnpackFinish,
+    UnpackSkipHole,
+    NULL, // no resume journal
+    NULL, // no deduplication
+    NULL, // no decompression
+};
+
+int FcePosixUnpackInit(FCE_POSIX_UNPACK *posix, int input, int output, int rootDirectory)
+{
+    memset(posix, 0, sizeof(*posix));
+    posix->Input = input;
+    posix->Output = output;
+    posix->RootDirectory = rootDirectory;
+    posix->File = -1;
+    posix->Buffer = malloc(FC_COPY_BUFFER_SIZE);
+    return posix->Buffer ? 0 : ENOMEM;
+}
+
+void FcePosixUnpackCleanup(FCE_POSIX_UNPACK *posix)
+{
+    if (posix->File >= 0)
+        close(posix->File);
+
+    free(posix->Buffer);
+    posix->Buffer = NULL;
+}
+
+/*
+ * pack
+ */
+
+static int PackWrite(void *opaque, const void *buffer, size_t size)
+{
+    FCE_POSIX_PACK *posix = opaque;
+
+    return WriteAll(posix->Output, buffer, size);
+}
+
+static int PackRead(void *opaque, void *buffer, size_t size)
+{
+    FCE_POSIX_PACK *posix = opaque;
+
+    return ReadAll(posix->Input, buffer, size);
+}
+
+static int PackWaitForInput(void *opaque, uint32_t timeout)
+{
+    FCE_POSIX_PACK *posix = opaque;
+    struct pollfd pollInput;
+
+    pollInput.fd = posix->Input;
+    pollInput.events = POLLIN;
+    return poll(&pollInput, 1, (int)timeout) > 0;
+}
+
+const FCE_PACK_BACKEND g_fcePosixPackBackend =
+{
+    PackWrite,
+    PackRead,
+    PackWaitForInput,
+};
+
+int FcePosixPackInit(FCE_POSIX_PACK *posix, int input, int output)
+{
+    memset(posix, 0, sizeof(*posix));
+    posix->Input = input;
+    posix->Output = output;
+    posix->Buffer = malloc(FC_COPY_BUFFER_SIZE);
+    return posix->Buffer ? 0 : ENOMEM;
+}
+
+void FcePosixPackCleanup(FCE_POSIX_PACK *posix)
+{
+    free(posix->Buffer);
+    posix->Buffer = NULL;
+}
+
+static void StatToHeader(const struct stat *st, struct file_header *header)
+{
+    memset(header, 0, sizeof(*header));
+    header->mode = (uint32_t)st->st_mode;
+    header->atime = (uint32_t)st->st_atim.tv_sec;
+    header->atime_nsec = (uint32_t)st->st_atim.tv_nsec;
+    header->mtime = (uint32_t)st->st_mtim.tv_sec;
+    header->mtime_nsec = (uint32_t)st->st_mtim.tv_nsec;
+}
+
+static int PackRegularFile(FCE_PACK *pack, int directory, const char *name, const char *path, const struct stat *st)
+{
+    FCE_POSIX_PACK *posix = pack->Opaque;
+    struct file_header header;
+    uint64_t remaining;
+    ssize_t cbRead;
+    int file;
+    int status;
+
+    file = openat(directory, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (file < 0)
+        return EIO;
+
+    StatToHeader(st, &header);
+    header.filelen = (uint64_t)st->st_size;
+    status = FcePackEntry(pack, &header, path);
+
+    remaining = header.filelen;
+    while (status == 0 && remaining > 0)
+    {
+        cbRead = read(file, posix->Buffer, remaining > FC_COPY_BUFFER_SIZE ? FC_COPY_BUFFER_SIZE : (size_t)remaining);
+        if (cbRead < 0 && errno == EINTR)
+            continue;
+        if (cbRead <= 0)
+        {
+            status = EIO; // shrunk while being sent
+            break;
+        }
+
+        status = FcePackWrite(pack, posix->Buffer, (size_t)cbRead);
+        remaining -= (uint64_t)cbRead;
+    }
+
+    close(file);
+    return status;
+}
+
+static int PackLink(FCE_PACK *pack, int directory, const char *name, const char *path, const struct stat *st)
+{
+    struct file_header header;
+    char target[MAX_PATH_LENGTH];
+    ssize_t targetLength;
+    int status;
+
+    targetLength = readlinkat(directory, name, target, sizeof(target) - 1);
+    if (targetLength < 0)
+        return EIO;
+
+    StatToHeader(st, &header);
+    header.filelen = (uint64_t)targetLength;
+    status = FcePackEntry(pack, &header, path);
+    if (status != 0)
+        return status;
+
+    return FcePackWrite(pack, target, (size_t)targetLength);
+}
+
+static int PackTree(FCE_PACK *pack, int directory, const char *name, const char *path);
+
+static int PackDirectory(FCE_PACK *pack, int directory, const char *name, const char *path, const struct stat *st)
+{
+    struct file_header header;
+    struct dirent *entry;
+    DIR *listing;
+    char *childPath;
+    size_t childPathSize;
+    int child;
+    int status;
+
+    StatToHeader(st, &header);
+    status = FcePackEntry(pack, &header, path);
+    if (status != 0)
+        return status;
+
+    child = openat(directory, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (child < 0)
+        return EIO;
+
+    listing = fdopendir(child);
+    if (!listing)
+    {
+        close(child);
+        return EIO;
+    }
+
+    while (status == 0 && (entry = readdir(listing)) != NULL)
+    {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+
+        childPathSize = strlen(path) + strlen(entry->d_name) + 2;
+        if (childPathSize > MAX_PATH_LENGTH)
+        {
+            status = FC_ENAMETOOLONG;
+            break;
+        }
+
+        childPath = malloc(childPathSize);
+        if (!childPath)
+        {
+            status = ENOMEM;
+            break;
+        }
+
+        if (snprintf(childPath, childPathSize, "%s/%s", path, entry->d_name) != (int)(childPathSize - 1))
+        {
+            free(childPath);
+            status = FC_ENAMETOOLONG;
+            break;
+        }
+
+        status = PackTree(pack, dirfd(listing), entry->d_name, childPath);
+        free(childPath);
+    }
+
+    closedir(listing);
+    if (status != 0)
+        return status;
+
+    // directory metadata is resent, so the times are set after the contents
+    return FcePackEntry(pack, &header, path);
+}
+
+static int PackTree(FCE_PACK *pack, int directory, const char *name, const char *path)
+{
+    struct stat st;
+
+    if (fstatat(directory, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return EIO;
+
+    if (S_ISREG(st.st_mode))
+        return PackRegularFile(pack, directory, name, path, &st);
+    if (S_ISLNK(st.st_mode))
+        return PackLink(pack, directory, name, path, &st);
+    if (S_ISDIR(st.st_mode))
+        return PackDirectory(pack, directory, name, path, &st);
+
+    return EINVAL; // special files are not sent
+}
+
+int FcePosixPackPath(FCE_PACK *pack, int directory, const char *name)
+{
+    return PackTree(pack, directory, name, name);
+}
@@ -0,0 +1,58 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// POSIX backends of the filecopy engine, so the stream handling can be built
+// and exercised on other systems, e.g. packing and unpacking over a pipe.
+
+#pragma once
+#include "filecopy-engine.h"
+
+typedef struct _FCE_POSIX_UNPACK
+{
+    int Input; // stream from the sender
+    int Output; // replies to the sender
+    int RootDirectory; // entries are created below it
+    int File; // current output file, -1 if none
+    struct file_header FileHeader; // of the current file, for its times
+    void *Buffer;
+} FCE_POSIX_UNPACK;
+
+extern const FCE_UNPACK_BACKEND g_fcePosixUnpackBackend;
+
+// rootDirectory stays owned by the caller. Returns 0 or errno.
+int FcePosixUnpackInit(FCE_POSIX_UNPACK *posix, int input, int output, int rootDirectory);
+void FcePosixUnpackCleanup(FCE_POSIX_UNPACK *posix);
+
+typedef struct _FCE_POSIX_PACK
+{
+    int Input; // replies from the receiver
+    int Output; // stream to the receiver
+    void *Buffer;
+} FCE_POSIX_PACK;
+
+extern const FCE_PACK_BACKEND g_fcePosixPackBackend;
+
+int FcePosixPackInit(FCE_POSIX_PACK *posix, int input, int output);
+void FcePosixPackCleanup(FCE_POSIX_PACK *posix);
+
+// Sends name (a file, a symlink or a whole directory tree) found in directory,
+// under the same name. pack must use posix as its opaque pointer.
+int FcePosixPackPath(FCE_PACK *pack, int directory, const char *name);
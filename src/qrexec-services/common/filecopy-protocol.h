@@ -0,0 +1,245 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Wire format of the filecopy stream (qubes.Filecopy), shared by both ends and
+// kept free of platform headers so it can be built anywhere.
+
+#pragma once
+#include <stdint.h>
+
+#define MAX_PATH_LENGTH 16384
+
+// file data is moved in chunks of this size (a multiple of the page size),
+// so the output file sees few large, aligned writes instead of many small ones
+#define FC_COPY_BUFFER_SIZE (1024*1024)
+
+#define LEGAL_EOF 31415926
+
+// status codes are Linux errno values, these differ from the Windows CRT ones
+#define FC_ENAMETOOLONG 36
+#define FC_EDQUOT 122
+
+// file_header.mode uses Linux mode bits
+#define FC_S_IFMT 0170000
+#define FC_S_IFLNK 0120000
+#define FC_S_IFREG 0100000
+#define FC_S_IFDIR 0040000
+
+#define FC_S_ISLNK(m) (((m) & FC_S_IFMT) == FC_S_IFLNK)
+#define FC_S_ISREG(m) (((m) & FC_S_IFMT) == FC_S_IFREG)
+#define FC_S_ISDIR(m) (((m) & FC_S_IFMT) == FC_S_IFDIR)
+
+struct file_header
+{
+    uint32_t namelen;
+    uint32_t mode;
+    uint64_t filelen;
+    uint32_t atime;
+    uint32_t atime_nsec;
+    uint32_t mtime;
+    uint32_t mtime_nsec;
+    /*
+    char filename[0];
+    char data[0];
+    */
+};
+
+#pragma pack(push, 1)
+struct result_header
+{
+    uint32_t error_code;
+    uint32_t _pad;
+    uint64_t crc32;
+};
+#pragma pack(pop)
+
+/* optional info about last processed file */
+#pragma pack(push, 1)
+struct result_header_ext
+{
+    uint32_t last_namelen;
+    char last_name[0];
+};
+#pragma pack(pop)
+
+/*
+ * Optional protocol extensions.
+ *
+ * A sender that wants extensions starts the stream with a probe entry: a directory
+ * named "." with filelen = FC_CAPS_PROBE_MAGIC << 32 | requested capabilities.
+ * A receiver with extension support answers immediately with struct caps_reply. The sender
+ * waits up to FC_CAPS_TIMEOUT for the reply, then always sends a second "." entry
+ * with filelen = FC_CAPS_CONFIRM_MAGIC << 32 | capabilities in use (possibly none).
+ * The rest of the stream uses only the confirmed capabilities.
+ * A reply that arrives after the timeout is skipped when reading the result.
+ *
+ * Receivers without extension support don't treat the probe as a no-op:
+ * - qfile-unpacker on Linux validates every path component and rejects ".", the
+ *   whole transfer fails with EINVAL on the probe.
+ * - Older receivers (older Linux ones and the Windows one before the extensions)
+ *   take "." as the incoming directory, it already exists. The transfer works, but
+ *   waits the full FC_CAPS_TIMEOUT for a reply that never comes.
+ * No entry type is a no-op on all of them, so a sender must only probe receivers
+ * it knows to support extensions (the Windows file-sender has a list of target qubes).
+ */
+#define FC_CAPS_PROBE_MAGIC 0x51435031 // "QCP1"
+#define FC_CAPS_CONFIRM_MAGIC 0x51435032 // "QCP2"
+#define FC_CAPS_REPLY_MAGIC 0x51435033 // "QCP3"
+#define FC_CAPS_NAME "."
+#define FC_CAPS_TIMEOUT 500 // ms
+
+#define FC_CAPS_MAGIC(filelen) ((uint32_t)((filelen) >> 32))
+#define FC_CAPS_VALUE(filelen) ((uint32_t)((filelen) & 0xFFFFFFFF))
+
+// sparse files: holes are not sent, see FC_MODE_SPARSE
+#define FC_CAP_SPARSE 0x00000001
+// interrupted transfers can be resumed, see struct resume_request
+#define FC_CAP_RESUME 0x00000002
+// files with the same content are sent once, see FC_MODE_DUPLICATE
+#define FC_CAP_DEDUP 0x00000004
+// file data can be sent compressed, see FC_MODE_COMPRESSED
+#define FC_CAP_COMPRESS 0x00000008
+
+#pragma pack(push, 1)
+struct caps_reply
+{
+    uint32_t magic; // FC_CAPS_REPLY_MAGIC
+    uint32_t caps;
+};
+#pragma pack(pop)
+
+/*
+ * Flags in file_header.mode above the Unix mode bits, only valid with the matching capability.
+ */
+
+// Regular file data is a sequence of data_record entries covering filelen bytes.
+// The crc32 covers the logical file content (holes count as zeros), not the records.
+#define FC_MODE_SPARSE 0x00010000
+
+#define FC_RECORD_DATA 1 // followed by length bytes of data
+#define FC_RECORD_HOLE 2 // length bytes of zeros, nothing follows
+
+#pragma pack(push, 1)
+struct data_record
+{
+    uint32_t type;
+    uint32_t _pad;
+    uint64_t length;
+};
+#pragma pack(pop)
+
+// Set on the entry that continues a partially received file: only data from
+// the offset in resume_reply follows. Never combined with FC_MODE_SPARSE.
+#define FC_MODE_RESUMED 0x00020000
+
+/*
+ * Resuming (FC_CAP_RESUME): right after the confirmation entry the sender sends
+ * struct resume_request (covered by the crc32) identifying the set of files
+ * being sent. The receiver replies with struct resume_reply: the number of entries
+ * it already has from an interrupted transfer of the same set, and possibly an
+ * offset into the next one. The sender skips those entries and the crc32 covers
+ * only what is actually sent.
+ */
+#define FC_RESUME_REQUEST_MAGIC 0x51435231 // "QCR1"
+#define FC_RESUME_REPLY_MAGIC 0x51435232 // "QCR2"
+
+// the entry at entries_done was partially written, continue it at offset
+#define FC_RESUME_PARTIAL 0x00000001
+
+#pragma pack(push, 1)
+struct resume_request
+{
+    uint32_t magic; // FC_RESUME_REQUEST_MAGIC
+    uint32_t _pad;
+    uint64_t manifest; // hash of paths, sizes and modification times
+};
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+struct resume_reply
+{
+    uint32_t magic; // FC_RESUME_REPLY_MAGIC
+    uint32_t flags;
+    uint64_t entries_done;
+    uint64_t offset;
+};
+#pragma pack(pop)
+
+/*
+ * Deduplication (FC_CAP_DEDUP): the receiver remembers names of regular files sent
+ * with FC_MODE_DEDUP_SOURCE. A later entry with FC_MODE_DUPLICATE has struct
+ * duplicate_record (covered by the crc32) instead of data: the receiver copies the
+ * source entry, checks that the copy has the expected hash and answers with struct
+ * duplicate_reply. On FC_DUPLICATE_MISMATCH the copy is discarded and the sender
+ * sends the same file again as a normal entry.
+ */
+#define FC_MODE_DEDUP_SOURCE 0x00040000
+#define FC_MODE_DUPLICATE 0x00080000
+
+#define FC_DUPLICATE_REPLY_MAGIC 0x51434431 // "QCD1"
+#define FC_DUPLICATE_OK 0
+#define FC_DUPLICATE_MISMATCH 1
+
+// SHA-256
+#define FC_HASH_SIZE 32
+
+#pragma pack(push, 1)
+struct duplicate_record
+{
+    uint64_t source_entry; // index of the source entry in the whole transfer
+    uint8_t hash[FC_HASH_SIZE];
+};
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+struct duplicate_reply
+{
+    uint32_t magic; // FC_DUPLICATE_REPLY_MAGIC
+    uint32_t status;
+};
+#pragma pack(pop)
+
+/*
+ * Compression (FC_CAP_COMPRESS): data of an FC_MODE_COMPRESSED file is a sequence of
+ * block_record entries covering filelen bytes (or what follows the resume offset),
+ * not covered by the crc32. A stored block is followed by original_size bytes of
+ * data as usual. A compressed block is followed by data_size bytes of raw XPRESS
+ * data (as produced by the Windows compression API with COMPRESS_RAW) and crc32 is
+ * the checksum of the original_size bytes it decompresses to, so the transfer crc32
+ * still covers the file content. Never combined with FC_MODE_SPARSE.
+ */
+#define FC_MODE_COMPRESSED 0x00100000
+
+#define FC_BLOCK_STORED 1
+#define FC_BLOCK_XPRESS 2
+
+// largest original_size, a compressed block is always smaller
+#define FC_COMPRESS_BLOCK_SIZE (256*1024)
+
+#pragma pack(push, 1)
+struct block_record
+{
+    uint32_t type;
+    uint32_t original_size;
+    uint32_t data_size; // == original_size for stored blocks
+    uint32_t crc32; // of the original data, 0 for stored blocks
+};
+#pragma pack(pop)
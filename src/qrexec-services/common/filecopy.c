@@ -27,43 +27,78 @@
 #include <qubes-io.h>
 #include <log.h>
 
+// page-aligned, allocated on first use and kept for the rest of the transfer
+static BYTE *g_copyBuffer = NULL;
+
 FC_COPY_STATUS FcCopyFile(IN HANDLE output, IN HANDLE input, IN UINT64 size, OUT UINT32 *crc32 OPTIONAL, IN fNotifyProgressCallback progressCallback OPTIONAL)
 {
-    BYTE buffer[4096];
+    const DWORD cbBuffer = FC_COPY_BUFFER_SIZE;
     UINT64 cbTransferred = 0;
     DWORD cbRead;
-    DWORD cbToRead;
+    DWORD cbChunk;
+    DWORD cbFilled;
+    FC_COPY_STATUS status = COPY_FILE_OK;
+    BYTE *buffer;
+
+    if (size == 0)
+        return COPY_FILE_OK;
 
+    if (!g_copyBuffer)
+    {
+        g_copyBuffer = VirtualAlloc(NULL, cbBuffer, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (!g_copyBuffer)
+        {
+            perror("VirtualAlloc");
+            return COPY_FILE_WRITE_ERROR;
+        }
+    }
+
+    buffer = g_copyBuffer;
     while (cbTransferred < size)
     {
-        if (size - cbTransferred > sizeof(buffer))
-            cbToRead = sizeof(buffer);
+        if (size - cbTransferred > cbBuffer)
+            cbChunk = cbBuffer;
         else
-            cbToRead = (DWORD)(size - cbTransferred); // safe cast: difference is always <= sizeof(buffer)
+            cbChunk = (DWORD)(size - cbTransferred); // safe cast: difference is always <= cbBuffer
 
-        if (!ReadFile(input, buffer, cbToRead, &cbRead, NULL))
+        // Pipes return whatever is available, fill the whole chunk before writing it out.
+        cbFilled = 0;
+        while (cbFilled < cbChunk)
         {
-            perror("ReadFile");
-            return COPY_FILE_READ_ERROR;
-        }
+            if (!ReadFile(input, buffer + cbFilled, cbChunk - cbFilled, &cbRead, NULL))
+            {
+                perror("ReadFile");
+                status = COPY_FILE_READ_ERROR;
+                goto cleanup;
+            }
+
+            if (cbRead == 0)
+            {
+                status = COPY_FILE_READ_EOF;
+                goto cleanup;
+            }
 
-        if (cbRead == 0)
-            return COPY_FILE_READ_EOF;
+            cbFilled += cbRead;
+        }
 
         /* accumulate crc32 if requested */
         if (crc32)
-            *crc32 = Crc32_ComputeBuf(*crc32, buffer, cbRead);
+            *crc32 = Crc32_ComputeBuf(*crc32, buffer, cbChunk);
 
-        if (!QioWriteBuffer(output, buffer, cbRead))
-            return COPY_FILE_WRITE_ERROR;
+        if (!QioWriteBuffer(output, buffer, cbChunk))
+        {
+            status = COPY_FILE_WRITE_ERROR;
+            goto cleanup;
+        }
 
         if (progressCallback)
-            progressCallback(cbRead, PROGRESS_TYPE_NORMAL);
+            progressCallback(cbChunk, PROGRESS_TYPE_NORMAL);
 
-        cbTransferred += cbRead;
+        cbTransferred += cbChunk;
     }
 
-    return COPY_FILE_OK;
+cleanup:
+    return status;
 }
 
 char *FcStatusToString(IN FC_COPY_STATUS status)
@@ -79,3 +114,81 @@ char *FcStatusToString(IN FC_COPY_STATUS status)
         return "Unknown error";
     }
 }
+
+BOOL FcWaitForInput(IN HANDLE input, IN DWORD timeout)
+{
+    DWORD cbAvailable;
+    ULONGLONG start = GetTickCount64();
+
+    do
+    {
+        if (!PeekNamedPipe(input, NULL, 0, NULL, &cbAvailable, NULL))
+        {
+            perror("PeekNamedPipe");
+            return FALSE;
+        }
+
+        if (cbAvailable > 0)
+            return TRUE;
+
+        Sleep(10);
+    } while (GetTickCount64() - start < timeout);
+
+    return FALSE;
+}
+
+BCRYPT_ALG_HANDLE g_hashAlgorithm = NULL;
+
+BCRYPT_HASH_HANDLE FcHashStart(void)
+{
+    BCRYPT_HASH_HANDLE hash;
+    NTSTATUS status;
+
+    if (!g_hashAlgorithm)
+    {
+        status = BCryptOpenAlgorithmProvider(&g_hashAlgorithm, BCRYPT_SHA256_ALGORITHM, NULL, 0);
+        if (!BCRYPT_SUCCESS(status))
+        {
+            perror2(status, "BCryptOpenAlgorithmProvider");
+            g_hashAlgorithm = NULL;
+            return NULL;
+        }
+    }
+
+    // let CNG allocate the hash object
+    status = BCryptCreateHash(g_hashAlgorithm, &hash, NULL, 0, NULL, 0, 0);
+    if (!BCRYPT_SUCCESS(status))
+    {
+        perror2(status, "BCryptCreateHash");
+        return NULL;
+    }
+
+    return hash;
+}
+
+BOOL FcHashUpdate(IN BCRYPT_HASH_HANDLE hash, IN const void *data, IN DWORD size)
+{
+    NTSTATUS status = BCryptHashData(hash, (UCHAR *)data, size, 0);
+
+    if (!BCRYPT_SUCCESS(status))
+    {
+        perror2(status, "BCryptHashData");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOL FcHashFinish(IN BCRYPT_HASH_HANDLE hash, OUT BYTE *digest)
+{
+    NTSTATUS status = BCryptFinishHash(hash, digest, FC_HASH_SIZE, 0);
+
+    BCryptDestroyHash(hash);
+    if (!BCRYPT_SUCCESS(status))
+    {
+        perror2(status, "BCryptFinishHash");
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,232 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <log.h>
+
+#include "icon-rgba.h"
+#include "pixels.h"
+
+// room for the "width height\n" line
+#define ICON_HEADER_SIZE 32
+
+// Reads bitmap as a bottom-up 32 bpp DIB, whatever its own format is.
+static BOOL GetBitmapBits(IN HDC dc, IN HBITMAP bitmap, IN LONG width, IN LONG height, OUT BYTE *bits)
+{
+    BITMAPINFO bmi;
+
+    ZeroMemory(&bmi, sizeof(bmi));
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = width;
+    bmi.bmiHeader.biHeight = height;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    if (GetDIBits(dc, bitmap, 0, height, bits, &bmi, DIB_RGB_COLORS) != height)
+    {
+        perror("GetDIBits");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOL IconRgbaInit(OUT ICON_RGBA *context)
+{
+    ZeroMemory(context, sizeof(*context));
+
+    context->Dc = CreateCompatibleDC(NULL);
+    if (!context->Dc)
+    {
+        perror("CreateCompatibleDC");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void IconRgbaCleanup(IN OUT ICON_RGBA *context)
+{
+    if (context->Dc)
+        DeleteDC(context->Dc);
+    free(context->Color);
+    free(context->Mask);
+    free(context->Output);
+    free(context->Pixels);
+    free(context->Scratch);
+    ZeroMemory(context, sizeof(*context));
+}
+
+// Grows the buffers for cbPixels bytes of pixels, they are never shrunk.
+static BOOL ReserveBuffers(IN OUT ICON_RGBA *context, IN DWORD cbPixels)
+{
+    BYTE *color, *mask, *output, *pixels;
+
+    if (cbPixels <= context->Capacity)
+        return TRUE;
+
+    // the output also has the header line and the final newline
+    color = realloc(context->Color, cbPixels);
+    if (color)
+        context->Color = color;
+    mask = realloc(context->Mask, cbPixels);
+    if (mask)
+        context->Mask = mask;
+    output = realloc(context->Output, cbPixels + ICON_HEADER_SIZE + 1);
+    if (output)
+        context->Output = output;
+    pixels = realloc(context->Pixels, cbPixels);
+    if (pixels)
+        context->Pixels = pixels;
+
+    if (!color || !mask || !output || !pixels)
+    {
+        perror("realloc");
+        return FALSE;
+    }
+
+    context->Capacity = cbPixels;
+    return TRUE;
+}
+
+static BOOL ReserveScratch(IN OUT ICON_RGBA *context, IN size_t size)
+{
+    void *scratch;
+
+    if (size <= context->ScratchSize)
+        return TRUE;
+
+    scratch = realloc(context->Scratch, size);
+    if (!scratch)
+    {
+        perror("realloc");
+        return FALSE;
+    }
+
+    context->Scratch = scratch;
+    context->ScratchSize = size;
+    return TRUE;
+}
+
+// Fits width x height into targetSize, the longer side becomes targetSize.
+static void GetScaledSize(IN LONG width, IN LONG height, IN DWORD targetSize, OUT LONG *scaledWidth, OUT LONG *scaledHeight)
+{
+    *scaledWidth = width;
+    *scaledHeight = height;
+
+    if (targetSize == 0 || (width <= (LONG)targetSize && height <= (LONG)targetSize))
+        return;
+
+    if (width >= height)
+    {
+        *scaledWidth = targetSize;
+        *scaledHeight = max(1, MulDiv(height, targetSize, width));
+    }
+    else
+    {
+        *scaledHeight = targetSize;
+        *scaledWidth = max(1, MulDiv(width, targetSize, height));
+    }
+}
+
+BOOL IconRgbaRender(IN OUT ICON_RGBA *context, IN HICON icon, IN DWORD targetSize, OUT const BYTE **output, OUT DWORD *size)
+{
+    ICONINFO ii;
+    BITMAP bm;
+    BOOL haveMask;
+    int cbHeader;
+    DWORD cbPixels;
+    LONG width, height;
+    BOOL scale;
+    BYTE *pixels;
+    BOOL success = FALSE;
+
+    if (!GetIconInfo(icon, &ii))
+    {
+        perror("GetIconInfo");
+        return FALSE;
+    }
+
+    if (!ii.hbmColor)
+    {
+        LogWarning("monochrome icons are not supported");
+        goto cleanup;
+    }
+
+    if (!GetObject(ii.hbmColor, sizeof(bm), &bm))
+    {
+        perror("GetObject");
+        goto cleanup;
+    }
+
+    if (bm.bmWidth <= 0 || bm.bmHeight <= 0 || bm.bmWidth > ICON_MAX_SIZE || bm.bmHeight > ICON_MAX_SIZE)
+    {
+        LogWarning("unsupported icon size %dx%d", bm.bmWidth, bm.bmHeight);
+        goto cleanup;
+    }
+
+    LogDebug("Size: %dx%d, %d bpp", bm.bmWidth, bm.bmHeight, bm.bmBitsPixel);
+
+    cbPixels = 4 * bm.bmWidth * bm.bmHeight;
+    if (!ReserveBuffers(context, cbPixels))
+        goto cleanup;
+
+    if (!GetBitmapBits(context->Dc, ii.hbmColor, bm.bmWidth, bm.bmHeight, context->Color))
+        goto cleanup;
+
+    // only used if the color bitmap has no alpha
+    haveMask = ii.hbmMask && GetBitmapBits(context->Dc, ii.hbmMask, bm.bmWidth, bm.bmHeight, context->Mask);
+
+    GetScaledSize(bm.bmWidth, bm.bmHeight, targetSize, &width, &height);
+    scale = width != bm.bmWidth || height != bm.bmHeight;
+    if (scale && !ReserveScratch(context, PxScaleScratchSize(bm.bmWidth, bm.bmHeight, width, height)))
+        goto cleanup;
+
+    cbHeader = sprintf_s((char *)context->Output, ICON_HEADER_SIZE, "%d %d\n", width, height);
+
+    // written straight to the output when not scaling
+    pixels = scale ? context->Pixels : context->Output + cbHeader;
+    PxDibToRgba(pixels, context->Color, bm.bmWidth, bm.bmHeight, TRUE, haveMask ? context->Mask : NULL);
+
+    if (scale)
+    {
+        LogDebug("Scaled to %dx%d", width, height);
+        PxScaleRgba(context->Output + cbHeader, width, height, pixels, bm.bmWidth, bm.bmHeight, context->Scratch);
+        cbPixels = 4 * width * height;
+    }
+
+    context->Output[cbHeader + cbPixels] = '\n';
+
+    *output = context->Output;
+    *size = cbHeader + cbPixels + 1;
+    success = TRUE;
+
+cleanup:
+    if (ii.hbmColor)
+        DeleteObject(ii.hbmColor);
+    if (ii.hbmMask)
+        DeleteObject(ii.hbmMask);
+    return success;
+}
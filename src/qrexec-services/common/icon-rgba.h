@@ -0,0 +1,52 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Icons in the qubes.GetImageRGBA format, shared by the services that send icons.
+
+#pragma once
+#include <windows.h>
+
+// largest icon side accepted
+#define ICON_MAX_SIZE 4096
+
+// largest size icons are scaled to, Windows has no bigger icon resources
+#define ICON_MAX_TARGET_SIZE 256
+
+// Scratch buffers and the DC, kept for rendering any number of icons.
+typedef struct _ICON_RGBA
+{
+    HDC Dc;
+    BYTE *Color;
+    BYTE *Mask;
+    BYTE *Output;
+    BYTE *Pixels; // unscaled RGBA when scaling
+    DWORD Capacity; // bytes of pixels the buffers hold
+    void *Scratch;
+    size_t ScratchSize;
+} ICON_RGBA;
+
+BOOL IconRgbaInit(OUT ICON_RGBA *context);
+void IconRgbaCleanup(IN OUT ICON_RGBA *context);
+
+// Renders icon as "width height\n", straight RGBA rows top to bottom and a final
+// newline, ready to be written with one call. output stays valid until the next call.
+// Icons larger than targetSize (if not 0) are downscaled to fit, keeping the aspect ratio.
+BOOL IconRgbaRender(IN OUT ICON_RGBA *context, IN HICON icon, IN DWORD targetSize, OUT const BYTE **output, OUT DWORD *size);
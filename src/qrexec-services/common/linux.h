@@ -21,7 +21,8 @@
 
 #pragma once
 
-#define UNIX_EPOCH_OFFSET 11644478640LL
+// seconds between 1601-01-01 (FILETIME epoch) and 1970-01-01
+#define UNIX_EPOCH_OFFSET 11644473600LL
 
 #pragma warning(suppress:4005) // macro redefinition: ENAMETOOLONG is defined as 38 in crt's errno.h even though MSDN claims it should be Unix compatible
 #define ENAMETOOLONG    36      /* File name too long */
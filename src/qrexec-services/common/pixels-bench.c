@@ -0,0 +1,156 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Times the pixel conversions with SIMD against the scalar code, on a 4K screenshot
+// and on icon sized images:
+//
+//   pixels-bench [iterations]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pixels.h"
+
+#define SCREEN_WIDTH 3840
+#define SCREEN_HEIGHT 2160
+#define ICON_SOURCE_SIZE 256
+#define ICON_SIZE 32
+
+typedef struct _IMAGES
+{
+    uint8_t *Bgra; // a screenshot, alpha not used
+    uint8_t *Bgr;
+    uint8_t *Icon; // RGBA with alpha
+    uint8_t *Rgba;
+    void *Scratch;
+} IMAGES;
+
+typedef void (*BENCH_FUNCTION)(IMAGES *images);
+
+static double Now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void BenchBgraToRgba(IMAGES *images)
+{
+    PxBgraToRgba(images->Rgba, images->Bgra, (size_t)SCREEN_WIDTH * SCREEN_HEIGHT, 0);
+}
+
+static void BenchBgrToRgba(IMAGES *images)
+{
+    PxBgrToRgba(images->Rgba, images->Bgr, (size_t)SCREEN_WIDTH * SCREEN_HEIGHT);
+}
+
+static void BenchHasAlpha(IMAGES *images)
+{
+    // alpha is all zeros, so the whole image is scanned
+    if (PxHasAlpha(images->Bgra, (size_t)SCREEN_WIDTH * SCREEN_HEIGHT))
+        abort();
+}
+
+static void BenchDibToRgba(IMAGES *images)
+{
+    PxDibToRgba(images->Rgba, images->Bgra, SCREEN_WIDTH, SCREEN_HEIGHT, 1, NULL);
+}
+
+static void BenchScaleIcon(IMAGES *images)
+{
+    PxScaleRgba(images->Rgba, ICON_SIZE, ICON_SIZE, images->Icon, ICON_SOURCE_SIZE, ICON_SOURCE_SIZE, images->Scratch);
+}
+
+static double Time(BENCH_FUNCTION function, IMAGES *images, int iterations)
+{
+    double start;
+    int i;
+
+    function(images); // warm up
+    start = Now();
+    for (i = 0; i < iterations; i++)
+        function(images);
+
+    return (Now() - start) / iterations;
+}
+
+static void Bench(const char *name, BENCH_FUNCTION function, IMAGES *images, int iterations, double pixels)
+{
+    double scalar, simd;
+
+    PxEnableSimd(0);
+    scalar = Time(function, images, iterations);
+    PxEnableSimd(1);
+    simd = Time(function, images, iterations);
+
+    printf("%-12s scalar %9.1f Mpx/s   simd %9.1f Mpx/s   %5.2fx\n",
+        name, pixels / scalar / 1e6, pixels / simd / 1e6, scalar / simd);
+}
+
+int main(int argc, char **argv)
+{
+    size_t screenPixels = (size_t)SCREEN_WIDTH * SCREEN_HEIGHT;
+    int iterations = argc > 1 ? atoi(argv[1]) : 20;
+    IMAGES images;
+    size_t i;
+
+    if (iterations < 1)
+    {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 2;
+    }
+
+    images.Bgra = malloc(screenPixels * 4);
+    images.Bgr = malloc(screenPixels * 3);
+    images.Rgba = malloc(screenPixels * 4);
+    images.Icon = malloc(ICON_SOURCE_SIZE * ICON_SOURCE_SIZE * 4);
+    images.Scratch = malloc(PxScaleScratchSize(ICON_SOURCE_SIZE, ICON_SOURCE_SIZE, ICON_SIZE, ICON_SIZE));
+    if (!images.Bgra || !images.Bgr || !images.Rgba || !images.Icon || !images.Scratch)
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    for (i = 0; i < screenPixels * 4; i++)
+        images.Bgra[i] = (i % 4 == 3) ? 0 : (uint8_t)(i * 7 + i / 4096);
+    for (i = 0; i < screenPixels * 3; i++)
+        images.Bgr[i] = (uint8_t)(i * 5);
+    for (i = 0; i < ICON_SOURCE_SIZE * ICON_SOURCE_SIZE * 4; i++)
+        images.Icon[i] = (uint8_t)(i * 13 + i / 1024);
+
+    Bench("BgraToRgba", BenchBgraToRgba, &images, iterations, (double)screenPixels);
+    Bench("BgrToRgba", BenchBgrToRgba, &images, iterations, (double)screenPixels);
+    Bench("HasAlpha", BenchHasAlpha, &images, iterations, (double)screenPixels);
+    Bench("DibToRgba", BenchDibToRgba, &images, iterations, (double)screenPixels);
+    Bench("ScaleIcon", BenchScaleIcon, &images, iterations * 10, (double)ICON_SOURCE_SIZE * ICON_SOURCE_SIZE);
+
+    free(images.Bgra);
+    free(images.Bgr);
+    free(images.Rgba);
+    free(images.Icon);
+    free(images.Scratch);
+    return 0;
+}
@@ -0,0 +1,298 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Compares the SIMD and scalar pixel conversions on odd widths, so every SIMD
+// loop ends in a scalar tail. Buffers are allocated with their exact size to let
+// sanitizers catch reads past the end.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pixels.h"
+
+static int g_failures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            g_failures++; \
+        } \
+    } while (0)
+
+static uint32_t g_random = 0x9e3779b9;
+
+// xorshift, the same sequence on every run
+static uint32_t Random(void)
+{
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 17;
+    g_random ^= g_random << 5;
+    return g_random;
+}
+
+static uint8_t *RandomBytes(size_t size)
+{
+    uint8_t *buffer = malloc(size ? size : 1);
+    size_t i;
+
+    if (buffer)
+    {
+        for (i = 0; i < size; i++)
+            buffer[i] = (uint8_t)Random();
+    }
+
+    return buffer;
+}
+
+static uint8_t *Copy(const uint8_t *buffer, size_t size)
+{
+    uint8_t *copy = malloc(size ? size : 1);
+
+    if (copy)
+        memcpy(copy, buffer, size);
+    return copy;
+}
+
+// widths around the 4 pixel SIMD blocks and the 6 pixel minimum of the BGR loop
+static const uint32_t g_widths[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 15, 16, 17, 31, 33, 63, 255, 1001 };
+
+#define WIDTHS (sizeof(g_widths) / sizeof(g_widths[0]))
+
+static void TestBgraToRgba(size_t count, int opaque)
+{
+    uint8_t *src = RandomBytes(4 * count);
+    uint8_t *simd = malloc(4 * count);
+    uint8_t *scalar = malloc(4 * count);
+    uint8_t *inPlace;
+    size_t i;
+
+    CHECK(src && simd && scalar);
+    if (!src || !simd || !scalar)
+        goto cleanup;
+
+    PxEnableSimd(0);
+    PxBgraToRgba(scalar, src, count, opaque);
+    PxEnableSimd(1);
+    PxBgraToRgba(simd, src, count, opaque);
+    CHECK(memcmp(simd, scalar, 4 * count) == 0);
+
+    // the scalar result against the definition, including the last pixel
+    for (i = 0; i < count; i++)
+    {
+        CHECK(scalar[4 * i] == src[4 * i + 2] && scalar[4 * i + 1] == src[4 * i + 1] && scalar[4 * i + 2] == src[4 * i]);
+        CHECK(scalar[4 * i + 3] == (opaque ? 255 : src[4 * i + 3]));
+    }
+
+    inPlace = Copy(src, 4 * count);
+    CHECK(inPlace != NULL);
+    if (inPlace)
+    {
+        PxBgraToRgba(inPlace, inPlace, count, opaque);
+        CHECK(memcmp(inPlace, scalar, 4 * count) == 0);
+
+        // and back again
+        if (!opaque)
+        {
+            PxRgbaToBgra(inPlace, inPlace, count);
+            CHECK(memcmp(inPlace, src, 4 * count) == 0);
+        }
+        free(inPlace);
+    }
+
+cleanup:
+    free(src);
+    free(simd);
+    free(scalar);
+}
+
+static void TestBgrToRgba(size_t count)
+{
+    uint8_t *src = RandomBytes(3 * count);
+    uint8_t *simd = malloc(4 * count);
+    uint8_t *scalar = malloc(4 * count);
+    size_t i;
+
+    CHECK(src && simd && scalar);
+    if (!src || !simd || !scalar)
+        goto cleanup;
+
+    PxEnableSimd(0);
+    PxBgrToRgba(scalar, src, count);
+    PxEnableSimd(1);
+    PxBgrToRgba(simd, src, count);
+    CHECK(memcmp(simd, scalar, 4 * count) == 0);
+
+    for (i = 0; i < count; i++)
+    {
+        CHECK(scalar[4 * i] == src[3 * i + 2] && scalar[4 * i + 1] == src[3 * i + 1] && scalar[4 * i + 2] == src[3 * i]);
+        CHECK(scalar[4 * i + 3] == 255);
+    }
+
+cleanup:
+    free(src);
+    free(simd);
+    free(scalar);
+}
+
+static void TestHasAlpha(size_t count)
+{
+    uint8_t *src = RandomBytes(4 * count);
+    size_t i, position;
+
+    CHECK(src != NULL);
+    if (!src)
+        return;
+
+    for (i = 0; i < count; i++)
+        src[4 * i + 3] = 0;
+
+    PxEnableSimd(1);
+    CHECK(!PxHasAlpha(src, count));
+    PxEnableSimd(0);
+    CHECK(!PxHasAlpha(src, count));
+
+    // alpha in the first, a middle and the last (possibly tail) pixel
+    for (i = 0; i < 3; i++)
+    {
+        position = i == 0 ? 0 : i == 1 ? count / 2 : count - 1;
+        src[4 * position + 3] = 1;
+        PxEnableSimd(1);
+        CHECK(PxHasAlpha(src, count));
+        PxEnableSimd(0);
+        CHECK(PxHasAlpha(src, count));
+        src[4 * position + 3] = 0;
+    }
+
+    free(src);
+}
+
+static void TestDibToRgba(uint32_t width, uint32_t height, int bottomUp, int withAlpha, int withMask)
+{
+    size_t size = (size_t)width * height * 4;
+    uint8_t *src = RandomBytes(size);
+    uint8_t *mask = RandomBytes(size);
+    uint8_t *simd = malloc(size);
+    uint8_t *scalar = malloc(size);
+    const uint8_t *srcRow;
+    const uint8_t *maskRow;
+    uint32_t x, y;
+    int opaque;
+
+    CHECK(src && mask && simd && scalar);
+    if (!src || !mask || !simd || !scalar)
+        goto cleanup;
+
+    // a bitmap without alpha, or with it only in the very last pixel
+    for (x = 0; x < width * height; x++)
+        src[4 * x + 3] = 0;
+    if (withAlpha)
+        src[size - 1] = 0x80;
+
+    PxEnableSimd(0);
+    PxDibToRgba(scalar, src, width, height, bottomUp, withMask ? mask : NULL);
+    PxEnableSimd(1);
+    PxDibToRgba(simd, src, width, height, bottomUp, withMask ? mask : NULL);
+    CHECK(memcmp(simd, scalar, size) == 0);
+
+    opaque = !withAlpha;
+    for (y = 0; y < height; y++)
+    {
+        srcRow = src + (size_t)(bottomUp ? height - 1 - y : y) * width * 4;
+        maskRow = mask + (size_t)(bottomUp ? height - 1 - y : y) * width * 4;
+        for (x = 0; x < width; x++)
+        {
+            const uint8_t *out = scalar + ((size_t)y * width + x) * 4;
+            uint8_t alpha = srcRow[4 * x + 3];
+
+            if (opaque)
+                alpha = (withMask && (maskRow[4 * x] | maskRow[4 * x + 1] | maskRow[4 * x + 2])) ? 0 : 255;
+            CHECK(out[0] == srcRow[4 * x + 2] && out[1] == srcRow[4 * x + 1] && out[2] == srcRow[4 * x] && out[3] == alpha);
+        }
+    }
+
+cleanup:
+    free(src);
+    free(mask);
+    free(simd);
+    free(scalar);
+}
+
+static void TestScale(uint32_t srcWidth, uint32_t srcHeight, uint32_t dstWidth, uint32_t dstHeight)
+{
+    uint8_t *src = RandomBytes((size_t)srcWidth * srcHeight * 4);
+    uint8_t *simd = malloc((size_t)dstWidth * dstHeight * 4);
+    uint8_t *scalar = malloc((size_t)dstWidth * dstHeight * 4);
+    void *scratch = malloc(PxScaleScratchSize(srcWidth, srcHeight, dstWidth, dstHeight));
+    size_t i;
+    int difference;
+
+    CHECK(src && simd && scalar && scratch);
+    if (!src || !simd || !scalar || !scratch)
+        goto cleanup;
+
+    PxEnableSimd(0);
+    PxScaleRgba(scalar, dstWidth, dstHeight, src, srcWidth, srcHeight, scratch);
+    PxEnableSimd(1);
+    PxScaleRgba(simd, dstWidth, dstHeight, src, srcWidth, srcHeight, scratch);
+
+    // float rounding may differ between the two, by one at most
+    for (i = 0; i < (size_t)dstWidth * dstHeight * 4; i++)
+    {
+        difference = simd[i] - scalar[i];
+        CHECK(difference >= -1 && difference <= 1);
+    }
+
+cleanup:
+    free(src);
+    free(simd);
+    free(scalar);
+    free(scratch);
+}
+
+int main(void)
+{
+    size_t i;
+
+    for (i = 0; i < WIDTHS; i++)
+    {
+        TestBgraToRgba(g_widths[i], 0);
+        TestBgraToRgba(g_widths[i], 1);
+        TestBgrToRgba(g_widths[i]);
+        TestHasAlpha(g_widths[i]);
+        TestDibToRgba(g_widths[i], 3, 0, 0, 0);
+        TestDibToRgba(g_widths[i], 3, 1, 0, 1);
+        TestDibToRgba(g_widths[i], 5, 1, 1, 1);
+        TestDibToRgba(g_widths[i], 1, 0, 1, 0);
+    }
+
+    TestScale(7, 5, 3, 2);
+    TestScale(33, 17, 16, 16);
+    TestScale(256, 256, 32, 32);
+    TestScale(101, 3, 101, 1);
+
+    if (g_failures)
+        fprintf(stderr, "%d checks failed\n", g_failures);
+    return g_failures != 0;
+}
@@ -0,0 +1,398 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <string.h>
+
+#include "pixels.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define PX_SSSE3
+#include <tmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PX_TARGET_SSSE3
+#else
+#define PX_TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#endif
+
+#ifdef PX_SSSE3
+static int g_haveSsse3 = -1;
+
+static int HaveSsse3(void)
+{
+    if (g_haveSsse3 < 0)
+    {
+#ifdef _MSC_VER
+        int info[4];
+
+        __cpuid(info, 1);
+        g_haveSsse3 = (info[2] & (1 << 9)) != 0;
+#else
+        g_haveSsse3 = __builtin_cpu_supports("ssse3");
+#endif
+    }
+
+    return g_haveSsse3;
+}
+
+PX_TARGET_SSSE3
+static size_t BgraToRgbaSsse3(uint8_t *dst, const uint8_t *src, size_t count, int opaque)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    const __m128i alpha = opaque ? _mm_set1_epi32((int)0xff000000) : _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i + 4 <= count; i += 4)
+    {
+        __m128i px = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+
+        px = _mm_or_si128(_mm_shuffle_epi8(px, shuffle), alpha);
+        _mm_storeu_si128((__m128i *)(dst + 4 * i), px);
+    }
+
+    return i;
+}
+
+PX_TARGET_SSSE3
+static size_t BgrToRgbaSsse3(uint8_t *dst, const uint8_t *src, size_t count)
+{
+    // 12 of the 16 bytes loaded are used, the rest must still be inside src
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+    size_t i;
+
+    for (i = 0; i + 6 <= count; i += 4)
+    {
+        __m128i px = _mm_loadu_si128((const __m128i *)(src + 3 * i));
+
+        px = _mm_or_si128(_mm_shuffle_epi8(px, shuffle), alpha);
+        _mm_storeu_si128((__m128i *)(dst + 4 * i), px);
+    }
+
+    return i;
+}
+
+PX_TARGET_SSSE3
+static size_t HasAlphaSsse3(const uint8_t *src, size_t count, int *hasAlpha)
+{
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+    __m128i any = _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i + 4 <= count; i += 4)
+        any = _mm_or_si128(any, _mm_loadu_si128((const __m128i *)(src + 4 * i)));
+
+    *hasAlpha = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(any, alpha), _mm_setzero_si128())) != 0xffff;
+    return i;
+}
+
+// Box filter rows, one pixel is one vector of four float channels.
+// Only SSE2 is needed, every CPU with SSSE3 has it.
+PX_TARGET_SSSE3
+static void ScaleRowSsse3(float *dst, uint32_t dstWidth, const uint8_t *src, const uint32_t *first, const float *weights, uint32_t taps)
+{
+    const __m128 inv255 = _mm_set1_ps(1.0f / 255);
+    const __m128 colorMask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+    const __m128 alphaOne = _mm_setr_ps(0, 0, 0, 1);
+    uint32_t x, t;
+
+    for (x = 0; x < dstWidth; x++)
+    {
+        const uint8_t *px = src + 4 * first[x];
+        __m128 acc = _mm_setzero_ps();
+
+        for (t = 0; t < taps; t++, px += 4)
+        {
+            __m128i v = _mm_cvtsi32_si128(*(const int *)px);
+            __m128 p, m;
+
+            v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(v, _mm_setzero_si128()), _mm_setzero_si128());
+            p = _mm_cvtepi32_ps(v);
+            // premultiply the color, keep alpha itself
+            m = _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 3, 3, 3)), inv255);
+            m = _mm_or_ps(_mm_and_ps(m, colorMask), alphaOne);
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(weights[x * taps + t]), _mm_mul_ps(p, m)));
+        }
+
+        _mm_storeu_ps(dst + 4 * x, acc);
+    }
+}
+
+PX_TARGET_SSSE3
+static void ScaleColumnsSsse3(uint8_t *dst, uint32_t width, const float *rows, const float *weights, uint32_t taps)
+{
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 colorMask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+    const __m128 alphaMask = _mm_castsi128_ps(_mm_setr_epi32(0, 0, 0, -1));
+    uint32_t x, t;
+
+    for (x = 0; x < width; x++)
+    {
+        __m128 acc = _mm_setzero_ps();
+        __m128 a, f;
+        __m128i v;
+
+        for (t = 0; t < taps; t++)
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(weights[t]), _mm_loadu_ps(rows + 4 * ((size_t)t * width + x))));
+
+        // back to straight alpha, nothing covered stays transparent black
+        a = _mm_shuffle_ps(acc, acc, _MM_SHUFFLE(3, 3, 3, 3));
+        f = _mm_and_ps(_mm_div_ps(_mm_set1_ps(255.0f), a), _mm_cmpgt_ps(a, _mm_setzero_ps()));
+        acc = _mm_or_ps(_mm_and_ps(_mm_mul_ps(acc, f), colorMask), _mm_and_ps(acc, alphaMask));
+
+        v = _mm_cvttps_epi32(_mm_add_ps(acc, half));
+        v = _mm_packus_epi16(_mm_packs_epi32(v, v), v);
+        *(int *)(dst + 4 * x) = _mm_cvtsi128_si32(v);
+    }
+}
+#endif
+
+void PxEnableSimd(int enable)
+{
+#ifdef PX_SSSE3
+    g_haveSsse3 = enable ? -1 : 0;
+#else
+    (void)enable;
+#endif
+}
+
+void PxBgraToRgba(uint8_t *dst, const uint8_t *src, size_t count, int opaque)
+{
+    size_t i = 0;
+    uint8_t b;
+
+#ifdef PX_SSSE3
+    if (HaveSsse3())
+        i = BgraToRgbaSsse3(dst, src, count, opaque);
+#endif
+
+    for (; i < count; i++)
+    {
+        b = src[4 * i];
+        dst[4 * i] = src[4 * i + 2];
+        dst[4 * i + 1] = src[4 * i + 1];
+        dst[4 * i + 2] = b;
+        dst[4 * i + 3] = opaque ? 255 : src[4 * i + 3];
+    }
+}
+
+void PxBgrToRgba(uint8_t *dst, const uint8_t *src, size_t count)
+{
+    size_t i = 0;
+
+#ifdef PX_SSSE3
+    if (HaveSsse3())
+        i = BgrToRgbaSsse3(dst, src, count);
+#endif
+
+    for (; i < count; i++)
+    {
+        dst[4 * i] = src[3 * i + 2];
+        dst[4 * i + 1] = src[3 * i + 1];
+        dst[4 * i + 2] = src[3 * i];
+        dst[4 * i + 3] = 255;
+    }
+}
+
+int PxHasAlpha(const uint8_t *src, size_t count)
+{
+    size_t i = 0;
+
+#ifdef PX_SSSE3
+    int hasAlpha;
+
+    if (HaveSsse3())
+    {
+        i = HasAlphaSsse3(src, count, &hasAlpha);
+        if (hasAlpha)
+            return 1;
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        if (src[4 * i + 3] != 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+// Pixels set in the mask are transparent, all others opaque.
+static void ApplyMask(uint8_t *rgba, const uint8_t *mask, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        rgba[4 * i + 3] = (mask[4 * i] | mask[4 * i + 1] | mask[4 * i + 2]) ? 0 : 255;
+}
+
+void PxDibToRgba(uint8_t *dst, const uint8_t *src, uint32_t width, uint32_t height, int bottomUp, const uint8_t *mask)
+{
+    size_t stride = (size_t)width * 4;
+    size_t row;
+    uint32_t y;
+    int opaque = 1;
+
+    for (y = 0; y < height && opaque; y++)
+        opaque = !PxHasAlpha(src + y * stride, width);
+
+    for (y = 0; y < height; y++)
+    {
+        row = bottomUp ? height - 1 - y : y;
+        PxBgraToRgba(dst + y * stride, src + row * stride, width, opaque);
+
+        if (opaque && mask)
+            ApplyMask(dst + y * stride, mask + row * stride, width);
+    }
+}
+
+// at most this many source pixels overlap one destination pixel
+static uint32_t ScaleTaps(uint32_t srcSize, uint32_t dstSize)
+{
+    uint32_t taps = (srcSize + dstSize - 1) / dstSize + 1;
+
+    return taps < srcSize ? taps : srcSize;
+}
+
+// For each destination pixel: the first source pixel and the weights of taps
+// pixels from there, by how much of each is covered. Weights add up to 1.
+static void ComputeTaps(uint32_t srcSize, uint32_t dstSize, uint32_t taps, uint32_t *first, float *weights)
+{
+    double scale = (double)srcSize / dstSize;
+    double start, end, low, high;
+    uint32_t o, t, i;
+
+    for (o = 0; o < dstSize; o++)
+    {
+        start = o * scale;
+        end = (o + 1) * scale;
+        // the window stays inside the source, extra taps get no weight
+        first[o] = (uint32_t)start;
+        if (first[o] > srcSize - taps)
+            first[o] = srcSize - taps;
+
+        for (t = 0; t < taps; t++)
+        {
+            i = first[o] + t;
+            low = start > i ? start : i;
+            high = end < i + 1 ? end : i + 1;
+            weights[o * taps + t] = high > low ? (float)((high - low) / scale) : 0.0f;
+        }
+    }
+}
+
+static void ScaleRow(float *dst, uint32_t dstWidth, const uint8_t *src, const uint32_t *first, const float *weights, uint32_t taps)
+{
+    uint32_t x, t, c;
+    const uint8_t *px;
+    float acc[4], m;
+
+#ifdef PX_SSSE3
+    if (HaveSsse3())
+    {
+        ScaleRowSsse3(dst, dstWidth, src, first, weights, taps);
+        return;
+    }
+#endif
+
+    for (x = 0; x < dstWidth; x++)
+    {
+        px = src + 4 * first[x];
+        acc[0] = acc[1] = acc[2] = acc[3] = 0.0f;
+
+        for (t = 0; t < taps; t++, px += 4)
+        {
+            m = px[3] * (1.0f / 255);
+            for (c = 0; c < 3; c++)
+                acc[c] += weights[x * taps + t] * (px[c] * m);
+            acc[3] += weights[x * taps + t] * px[3];
+        }
+
+        for (c = 0; c < 4; c++)
+            dst[4 * x + c] = acc[c];
+    }
+}
+
+static void ScaleColumns(uint8_t *dst, uint32_t width, const float *rows, const float *weights, uint32_t taps)
+{
+    uint32_t x, t, c;
+    float acc[4], f, v;
+
+#ifdef PX_SSSE3
+    if (HaveSsse3())
+    {
+        ScaleColumnsSsse3(dst, width, rows, weights, taps);
+        return;
+    }
+#endif
+
+    for (x = 0; x < width; x++)
+    {
+        acc[0] = acc[1] = acc[2] = acc[3] = 0.0f;
+        for (t = 0; t < taps; t++)
+        {
+            for (c = 0; c < 4; c++)
+                acc[c] += weights[t] * rows[4 * ((size_t)t * width + x) + c];
+        }
+
+        f = acc[3] > 0.0f ? 255.0f / acc[3] : 0.0f;
+        for (c = 0; c < 4; c++)
+        {
+            v = (c < 3 ? acc[c] * f : acc[3]) + 0.5f;
+            dst[4 * x + c] = v < 255.0f ? (uint8_t)v : 255;
+        }
+    }
+}
+
+size_t PxScaleScratchSize(uint32_t srcWidth, uint32_t srcHeight, uint32_t dstWidth, uint32_t dstHeight)
+{
+    size_t tapsX = ScaleTaps(srcWidth, dstWidth);
+    size_t tapsY = ScaleTaps(srcHeight, dstHeight);
+
+    // horizontally scaled rows, weights, first pixels
+    return sizeof(float) * (4 * (size_t)dstWidth * srcHeight + dstWidth * tapsX + dstHeight * tapsY)
+        + sizeof(uint32_t) * ((size_t)dstWidth + dstHeight);
+}
+
+void PxScaleRgba(uint8_t *dst, uint32_t dstWidth, uint32_t dstHeight,
+                 const uint8_t *src, uint32_t srcWidth, uint32_t srcHeight, void *scratch)
+{
+    uint32_t tapsX = ScaleTaps(srcWidth, dstWidth);
+    uint32_t tapsY = ScaleTaps(srcHeight, dstHeight);
+    size_t rowSize = 4 * (size_t)dstWidth;
+    float *rows = scratch;
+    float *weightsX = rows + rowSize * srcHeight;
+    float *weightsY = weightsX + (size_t)dstWidth * tapsX;
+    uint32_t *firstX = (uint32_t *)(weightsY + (size_t)dstHeight * tapsY);
+    uint32_t *firstY = firstX + dstWidth;
+    uint32_t y;
+
+    ComputeTaps(srcWidth, dstWidth, tapsX, firstX, weightsX);
+    ComputeTaps(srcHeight, dstHeight, tapsY, firstY, weightsY);
+
+    for (y = 0; y < srcHeight; y++)
+        ScaleRow(rows + y * rowSize, dstWidth, src + y * 4 * (size_t)srcWidth, firstX, weightsX, tapsX);
+
+    for (y = 0; y < dstHeight; y++)
+        ScaleColumns(dst + y * rowSize, dstWidth, rows + firstY[y] * rowSize, weightsY + (size_t)y * tapsY, tapsY);
+}
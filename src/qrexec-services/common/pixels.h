@@ -0,0 +1,60 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Pixel format conversion for image transfers and icons. Uses SSSE3 when the CPU
+// has it, the results are the same either way. Platform independent.
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// SIMD is used when the CPU supports it, unless disabled here. Tests and benchmarks
+// compare against the scalar code this way.
+void PxEnableSimd(int enable);
+
+// Converts count BGRA pixels (as in 32 bpp DIBs) to RGBA, dst may be src.
+// With opaque set alpha is forced to 255, for bitmaps that don't use it.
+void PxBgraToRgba(uint8_t *dst, const uint8_t *src, size_t count, int opaque);
+
+// The same swap works the other way.
+#define PxRgbaToBgra(dst, src, count) PxBgraToRgba(dst, src, count, 0)
+
+// Converts count BGR pixels (as in 24 bpp DIBs) to opaque RGBA, dst must not overlap src.
+void PxBgrToRgba(uint8_t *dst, const uint8_t *src, size_t count);
+
+// Returns nonzero if any of the count BGRA/RGBA pixels has a nonzero alpha.
+int PxHasAlpha(const uint8_t *src, size_t count);
+
+// Converts a width x height 32 bpp BGRA DIB (rows not padded, bottom-up if bottomUp set)
+// to top-down straight RGBA rows in dst. Bitmaps that don't use alpha are opaque, or
+// take alpha from mask if given: an AND mask of the same layout converted to 32 bpp,
+// where set pixels are transparent (as GetIconInfo returns for icons).
+void PxDibToRgba(uint8_t *dst, const uint8_t *src, uint32_t width, uint32_t height, int bottomUp, const uint8_t *mask);
+
+// Scratch bytes PxScaleRgba needs for these sizes.
+size_t PxScaleScratchSize(uint32_t srcWidth, uint32_t srcHeight, uint32_t dstWidth, uint32_t dstHeight);
+
+// Downscales straight RGBA with a box filter: each destination pixel is the
+// area-weighted average of the source pixels it covers, colors weighted by alpha
+// so transparent pixels don't darken the edges. dst must not be larger than src
+// in either dimension. scratch holds PxScaleScratchSize bytes.
+void PxScaleRgba(uint8_t *dst, uint32_t dstWidth, uint32_t dstHeight,
+                 const uint8_t *src, uint32_t srcWidth, uint32_t srcHeight, void *scratch);
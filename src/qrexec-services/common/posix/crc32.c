@@ -0,0 +1,57 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+
+#include "crc32.h"
+
+static uint32_t g_crcTable[256];
+static int g_crcTableReady = 0;
+
+static void BuildTable(void)
+{
+    uint32_t value;
+    int i, bit;
+
+    for (i = 0; i < 256; i++)
+    {
+        value = (uint32_t)i;
+        for (bit = 0; bit < 8; bit++)
+            value = (value & 1) ? (value >> 1) ^ 0xedb88320 : value >> 1;
+        g_crcTable[i] = value;
+    }
+
+    g_crcTableReady = 1;
+}
+
+unsigned long Crc32_ComputeBuf(unsigned long inCrc32, const void *buf, size_t bufLen)
+{
+    const uint8_t *data = buf;
+    uint32_t crc32 = (uint32_t)inCrc32 ^ 0xffffffff;
+
+    if (!g_crcTableReady)
+        BuildTable();
+
+    while (bufLen-- > 0)
+        crc32 = g_crcTable[(crc32 ^ *data++) & 0xff] ^ (crc32 >> 8);
+
+    return crc32 ^ 0xffffffff;
+}
@@ -1,4 +1,4 @@
-<#
+/*
  * The Qubes OS Project, http://www.qubes-os.org
  *
  * Copyright (c) Invisible Things Lab
@@ -17,14 +17,12 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  *
- #>
+ */
 
-# Registry location for path hash -> full path mapping for GetImageRGBA
-$RegistryMapPath = 'HKLM:\Software\Invisible Things Lab\Qubes Tools'
-$RegistryMapKey = 'AppMap'
+// Stand-in for crc32.h from windows-utils when the portable code is built on
+// other systems. Same function and the same (IEEE 802.3, reflected) checksum.
 
-$desktopBaseName = $args[0]
+#pragma once
+#include <stddef.h>
 
-$desktopFullName = Get-ItemProperty -Path "$RegistryMapPath\$RegistryMapKey" -Name $desktopBaseName
-
-Invoke-Item $desktopFullName.$desktopBaseName
+unsigned long Crc32_ComputeBuf(unsigned long inCrc32, const void *buf, size_t bufLen);
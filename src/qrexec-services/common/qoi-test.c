@@ -0,0 +1,352 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Round trips of the QOI encoder and decoder (whole buffers and random chunks on
+// both ends), known encodings and malformed input the decoder must refuse.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qoi.h"
+
+#define MAX_PIXELS (1024 * 1024)
+
+static int g_failures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            g_failures++; \
+        } \
+    } while (0)
+
+static uint32_t g_random = 0x12345678;
+
+// xorshift, the same sequence on every run
+static uint32_t Random(void)
+{
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 17;
+    g_random ^= g_random << 5;
+    return g_random;
+}
+
+typedef enum _PATTERN
+{
+    PATTERN_NOISE, // RGB/RGBA ops
+    PATTERN_GRADIENT, // DIFF/LUMA ops
+    PATTERN_FLAT, // runs, longer than a single op
+    PATTERN_PALETTE, // INDEX ops
+    PATTERN_MIXED,
+} PATTERN;
+
+static uint8_t *MakeImage(uint32_t width, uint32_t height, PATTERN pattern)
+{
+    uint8_t *rgba = malloc((size_t)width * height * 4);
+    static const uint8_t palette[5][4] =
+    {
+        { 255, 0, 0, 255 }, { 0, 255, 0, 255 }, { 0, 0, 255, 128 }, { 12, 34, 56, 0 }, { 255, 255, 255, 255 },
+    };
+    uint32_t x, y;
+    uint8_t *p;
+
+    if (!rgba)
+        return NULL;
+
+    for (y = 0; y < height; y++)
+    {
+        for (x = 0; x < width; x++)
+        {
+            p = rgba + ((size_t)y * width + x) * 4;
+            switch (pattern == PATTERN_MIXED ? (PATTERN)((x / 16 + y / 8) % 4) : pattern)
+            {
+            case PATTERN_NOISE:
+                p[0] = (uint8_t)Random();
+                p[1] = (uint8_t)Random();
+                p[2] = (uint8_t)Random();
+                p[3] = (Random() % 4) ? 255 : (uint8_t)Random();
+                break;
+            case PATTERN_GRADIENT:
+                p[0] = (uint8_t)(x + y);
+                p[1] = (uint8_t)(x * 3 + (Random() % 3));
+                p[2] = (uint8_t)(y * 5 + x / 2);
+                p[3] = 255;
+                break;
+            case PATTERN_FLAT:
+                memset(p, (y / 16) % 2 ? 0x80 : 0x00, 3);
+                p[3] = 255;
+                break;
+            default:
+                memcpy(p, palette[Random() % 5], 4);
+                break;
+            }
+        }
+    }
+
+    return rgba;
+}
+
+// Encodes the image in chunks of random size (all at once if maxChunk is 0).
+static uint8_t *Encode(const uint8_t *rgba, uint32_t width, uint32_t height, size_t maxChunk, size_t *size)
+{
+    size_t pixels = (size_t)width * height;
+    size_t done = 0;
+    size_t count;
+    QOI_ENCODER encoder;
+    uint8_t *out = malloc(QOI_HEADER_SIZE + QOI_ENCODE_BOUND(pixels));
+
+    if (!out)
+        return NULL;
+
+    if (QoiEncodeBegin(&encoder, width, height, 1, out) != 0)
+    {
+        free(out);
+        return NULL;
+    }
+
+    *size = QOI_HEADER_SIZE;
+    while (done < pixels)
+    {
+        count = maxChunk ? 1 + Random() % maxChunk : pixels;
+        if (count > pixels - done)
+            count = pixels - done;
+
+        *size += QoiEncodePixels(&encoder, rgba + done * 4, count, out + *size);
+        done += count;
+    }
+
+    return out;
+}
+
+typedef struct _OUTPUT
+{
+    uint32_t Width;
+    uint32_t Height;
+    uint32_t Rows;
+    uint8_t *Rgba;
+    int Refuse; // the header callback refuses the image
+} OUTPUT;
+
+static int OnHeader(void *opaque, uint32_t width, uint32_t height, int hasAlpha)
+{
+    OUTPUT *output = opaque;
+
+    (void)hasAlpha;
+    if (output->Refuse)
+        return EPERM;
+
+    output->Width = width;
+    output->Height = height;
+    output->Rgba = malloc((size_t)width * height * 4);
+    return output->Rgba ? 0 : ENOMEM;
+}
+
+static int OnRow(void *opaque, uint32_t y, const uint8_t *rgba)
+{
+    OUTPUT *output = opaque;
+
+    if (y != output->Rows || y >= output->Height)
+        return EINVAL;
+
+    memcpy(output->Rgba + (size_t)y * output->Width * 4, rgba, (size_t)output->Width * 4);
+    output->Rows++;
+    return 0;
+}
+
+// Decodes data in chunks of random size (all at once if maxChunk is 0), returns
+// the first failure.
+static int Decode(const uint8_t *data, size_t size, size_t maxChunk, OUTPUT *output)
+{
+    QOI_DECODER decoder;
+    size_t done = 0;
+    size_t count;
+    int status = 0;
+
+    QoiDecodeInit(&decoder, MAX_PIXELS, OnHeader, OnRow, output);
+    while (status == 0 && done < size)
+    {
+        count = maxChunk ? 1 + Random() % maxChunk : size;
+        if (count > size - done)
+            count = size - done;
+
+        status = QoiDecode(&decoder, data + done, count);
+        done += count;
+    }
+
+    if (status == 0)
+        status = QoiDecodeFinish(&decoder);
+
+    QoiDecodeCleanup(&decoder);
+    return status;
+}
+
+static void TestRoundTrip(uint32_t width, uint32_t height, PATTERN pattern)
+{
+    static const size_t chunks[] = { 0, 1, 7, 4096 };
+    uint8_t *rgba = MakeImage(width, height, pattern);
+    uint8_t *encoded;
+    size_t encodedSize;
+    OUTPUT output;
+    size_t i, j;
+
+    CHECK(rgba != NULL);
+    if (!rgba)
+        return;
+
+    for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+    {
+        encoded = Encode(rgba, width, height, chunks[i], &encodedSize);
+        CHECK(encoded != NULL);
+        if (!encoded)
+            break;
+
+        for (j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++)
+        {
+            memset(&output, 0, sizeof(output));
+            CHECK(Decode(encoded, encodedSize, chunks[j], &output) == 0);
+            CHECK(output.Width == width && output.Height == height && output.Rows == height);
+            CHECK(output.Rgba && memcmp(output.Rgba, rgba, (size_t)width * height * 4) == 0);
+            free(output.Rgba);
+        }
+
+        free(encoded);
+    }
+
+    free(rgba);
+}
+
+static void TestKnownEncoding(void)
+{
+    // the first pixel equals the initial previous pixel (a run), the next one
+    // differs by -1 in red (a DIFF op)
+    static const uint8_t rgba[] = { 0, 0, 0, 255, 255, 0, 0, 255 };
+    static const uint8_t expected[] =
+    {
+        'q', 'o', 'i', 'f', 0, 0, 0, 2, 0, 0, 0, 1, 4, 0,
+        0xc0, 0x5a,
+        0, 0, 0, 0, 0, 0, 0, 1,
+    };
+    uint8_t *encoded;
+    size_t encodedSize;
+
+    encoded = Encode(rgba, 2, 1, 0, &encodedSize);
+    CHECK(encoded != NULL);
+    if (!encoded)
+        return;
+
+    CHECK(encodedSize == sizeof(expected) && memcmp(encoded, expected, sizeof(expected)) == 0);
+    free(encoded);
+}
+
+static void TestCorrupt(void)
+{
+    uint8_t *rgba = MakeImage(37, 11, PATTERN_MIXED);
+    uint8_t *encoded;
+    uint8_t *copy;
+    size_t encodedSize;
+    OUTPUT output;
+
+    encoded = rgba ? Encode(rgba, 37, 11, 0, &encodedSize) : NULL;
+    copy = encoded ? malloc(encodedSize + 16) : NULL;
+    CHECK(copy != NULL);
+    if (!copy)
+        goto cleanup;
+
+    // bad magic
+    memcpy(copy, encoded, encodedSize);
+    copy[0] = 'x';
+    memset(&output, 0, sizeof(output));
+    CHECK(Decode(copy, encodedSize, 0, &output) == EINVAL);
+    free(output.Rgba);
+
+    // more pixels than allowed
+    memcpy(copy, encoded, encodedSize);
+    memset(copy + 4, 0xff, 8);
+    memset(&output, 0, sizeof(output));
+    CHECK(Decode(copy, encodedSize, 0, &output) != 0);
+    CHECK(output.Rgba == NULL);
+
+    // refused by the header callback
+    memset(&output, 0, sizeof(output));
+    output.Refuse = 1;
+    CHECK(Decode(encoded, encodedSize, 0, &output) != 0);
+
+    // truncated in the middle of the pixels, and right before the end marker
+    memset(&output, 0, sizeof(output));
+    CHECK(Decode(encoded, encodedSize / 2, 3, &output) == EINVAL);
+    free(output.Rgba);
+    memset(&output, 0, sizeof(output));
+    CHECK(Decode(encoded, encodedSize - QOI_END_SIZE, 0, &output) == EINVAL);
+    free(output.Rgba);
+
+    // damaged end marker
+    memcpy(copy, encoded, encodedSize);
+    copy[encodedSize - 1] = 2;
+    memset(&output, 0, sizeof(output));
+    CHECK(Decode(copy, encodedSize, 0, &output) == EINVAL);
+    free(output.Rgba);
+
+    // a run past the last pixel
+    memcpy(copy, encoded, encodedSize - QOI_END_SIZE);
+    copy[encodedSize - QOI_END_SIZE] = 0xc0 | 61;
+    memcpy(copy + encodedSize - QOI_END_SIZE + 1, encoded + encodedSize - QOI_END_SIZE, QOI_END_SIZE);
+    memset(&output, 0, sizeof(output));
+    CHECK(Decode(copy, encodedSize + 1, 5, &output) == EINVAL);
+    free(output.Rgba);
+
+    // data after the end marker
+    memcpy(copy, encoded, encodedSize);
+    copy[encodedSize] = 0;
+    memset(&output, 0, sizeof(output));
+    CHECK(Decode(copy, encodedSize + 1, 0, &output) == EINVAL);
+    free(output.Rgba);
+
+cleanup:
+    free(copy);
+    free(encoded);
+    free(rgba);
+}
+
+int main(void)
+{
+    PATTERN pattern;
+
+    TestKnownEncoding();
+
+    for (pattern = PATTERN_NOISE; pattern <= PATTERN_MIXED; pattern++)
+    {
+        TestRoundTrip(1, 1, pattern);
+        TestRoundTrip(7, 3, pattern);
+        TestRoundTrip(1, 200, pattern);
+        TestRoundTrip(333, 65, pattern);
+    }
+
+    TestCorrupt();
+
+    if (g_failures)
+        fprintf(stderr, "%d checks failed\n", g_failures);
+    return g_failures != 0;
+}
@@ -0,0 +1,378 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "qoi.h"
+
+#define QOI_OP_INDEX 0x00 // 00xxxxxx
+#define QOI_OP_DIFF 0x40 // 01xxxxxx
+#define QOI_OP_LUMA 0x80 // 10xxxxxx
+#define QOI_OP_RUN 0xc0 // 11xxxxxx
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK_2 0xc0
+
+#define QOI_MAX_RUN 62
+
+#define QOI_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define QOI_HASH(p) (((p)[0] * 3 + (p)[1] * 5 + (p)[2] * 7 + (p)[3] * 11) % 64)
+
+static const uint8_t g_qoiMagic[4] = { 'q', 'o', 'i', 'f' };
+static const uint8_t g_qoiEnd[QOI_END_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+static int SamePixel(const uint8_t *a, const uint8_t *b)
+{
+    uint32_t pa, pb;
+
+    memcpy(&pa, a, 4);
+    memcpy(&pb, b, 4);
+    return pa == pb;
+}
+
+static void WriteBe32(uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+static uint32_t ReadBe32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/*
+ * encoder
+ */
+
+int QoiEncodeBegin(QOI_ENCODER *encoder, uint32_t width, uint32_t height, int hasAlpha, uint8_t *out)
+{
+    if (width == 0 || height == 0)
+        return EINVAL;
+
+    memset(encoder, 0, sizeof(*encoder));
+    encoder->Previous[3] = 255;
+    encoder->PixelsLeft = (uint64_t)width * height;
+
+    memcpy(out, g_qoiMagic, sizeof(g_qoiMagic));
+    WriteBe32(out + 4, width);
+    WriteBe32(out + 8, height);
+    out[12] = hasAlpha ? 4 : 3;
+    out[13] = 0; // sRGB with linear alpha
+    return 0;
+}
+
+size_t QoiEncodePixels(QOI_ENCODER *encoder, const uint8_t *rgba, size_t count, uint8_t *out)
+{
+    uint8_t *p = out;
+    const uint8_t *px;
+    uint8_t *cached;
+    size_t i;
+
+    if (count > encoder->PixelsLeft)
+        count = (size_t)encoder->PixelsLeft;
+
+    for (i = 0; i < count; i++)
+    {
+        px = rgba + 4 * i;
+        encoder->PixelsLeft--;
+
+        if (SamePixel(px, encoder->Previous))
+        {
+            encoder->Run++;
+            if (encoder->Run == QOI_MAX_RUN || encoder->PixelsLeft == 0)
+            {
+                *p++ = QOI_OP_RUN | (uint8_t)(encoder->Run - 1);
+                encoder->Run = 0;
+            }
+            continue;
+        }
+
+        if (encoder->Run > 0)
+        {
+            *p++ = QOI_OP_RUN | (uint8_t)(encoder->Run - 1);
+            encoder->Run = 0;
+        }
+
+        cached = encoder->Index[QOI_HASH(px)];
+        if (SamePixel(px, cached))
+        {
+            *p++ = QOI_OP_INDEX | (uint8_t)QOI_HASH(px);
+        }
+        else
+        {
+            memcpy(cached, px, 4);
+
+            if (px[3] == encoder->Previous[3])
+            {
+                int8_t vr = (int8_t)(px[0] - encoder->Previous[0]);
+                int8_t vg = (int8_t)(px[1] - encoder->Previous[1]);
+                int8_t vb = (int8_t)(px[2] - encoder->Previous[2]);
+                int8_t vgr = vr - vg;
+                int8_t vgb = vb - vg;
+
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+                {
+                    *p++ = QOI_OP_DIFF | (uint8_t)((vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+                }
+                else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8)
+                {
+                    *p++ = QOI_OP_LUMA | (uint8_t)(vg + 32);
+                    *p++ = (uint8_t)((vgr + 8) << 4 | (vgb + 8));
+                }
+                else
+                {
+                    *p++ = QOI_OP_RGB;
+                    *p++ = px[0];
+                    *p++ = px[1];
+                    *p++ = px[2];
+                }
+            }
+            else
+            {
+                *p++ = QOI_OP_RGBA;
+                memcpy(p, px, 4);
+                p += 4;
+            }
+        }
+
+        memcpy(encoder->Previous, px, 4);
+    }
+
+    if (count > 0 && encoder->PixelsLeft == 0)
+    {
+        memcpy(p, g_qoiEnd, QOI_END_SIZE);
+        p += QOI_END_SIZE;
+    }
+
+    return p - out;
+}
+
+/*
+ * decoder
+ */
+
+void QoiDecodeInit(QOI_DECODER *decoder, uint64_t maxPixels, QOI_HEADER_CALLBACK header, QOI_ROW_CALLBACK row, void *opaque)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->MaxPixels = maxPixels;
+    decoder->Header = header;
+    decoder->Row = row;
+    decoder->Opaque = opaque;
+    decoder->Pixel[3] = 255;
+}
+
+void QoiDecodeCleanup(QOI_DECODER *decoder)
+{
+    free(decoder->RowBuffer);
+    decoder->RowBuffer = NULL;
+}
+
+static int ParseHeader(QOI_DECODER *decoder, const uint8_t *untrustedHeader)
+{
+    uint32_t width = ReadBe32(untrustedHeader + 4);
+    uint32_t height = ReadBe32(untrustedHeader + 8);
+    uint8_t channels = untrustedHeader[12];
+    int status;
+
+    if (memcmp(untrustedHeader, g_qoiMagic, sizeof(g_qoiMagic)) != 0)
+        return EINVAL;
+
+    if (width == 0 || height == 0 || (channels != 3 && channels != 4) || untrustedHeader[13] > 1)
+        return EINVAL;
+
+    if ((uint64_t)width * height > decoder->MaxPixels)
+        return EFBIG;
+
+    status = decoder->Header(decoder->Opaque, width, height, channels == 4);
+    if (status != 0)
+        return status;
+
+    decoder->RowBuffer = malloc((size_t)width * 4);
+    if (!decoder->RowBuffer)
+        return ENOMEM;
+
+    decoder->Width = width;
+    decoder->Height = height;
+    return 0;
+}
+
+static size_t OpSize(uint8_t tag)
+{
+    if (tag == QOI_OP_RGBA)
+        return 5;
+    if (tag == QOI_OP_RGB)
+        return 4;
+    if ((tag & QOI_MASK_2) == QOI_OP_LUMA)
+        return 2;
+    return 1;
+}
+
+// Applies one complete op to the current pixel and sets how many pixels it covers.
+static void DecodeOp(QOI_DECODER *decoder, const uint8_t *op)
+{
+    uint8_t *px = decoder->Pixel;
+    uint8_t tag = op[0];
+    int vg;
+
+    decoder->Run = 1;
+
+    if (tag == QOI_OP_RGBA)
+    {
+        memcpy(px, op + 1, 4);
+    }
+    else if (tag == QOI_OP_RGB)
+    {
+        memcpy(px, op + 1, 3);
+    }
+    else
+    {
+        switch (tag & QOI_MASK_2)
+        {
+        case QOI_OP_INDEX:
+            memcpy(px, decoder->Index[tag], 4);
+            break;
+        case QOI_OP_DIFF:
+            px[0] += ((tag >> 4) & 0x03) - 2;
+            px[1] += ((tag >> 2) & 0x03) - 2;
+            px[2] += (tag & 0x03) - 2;
+            break;
+        case QOI_OP_LUMA:
+            vg = (tag & 0x3f) - 32;
+            px[0] += vg - 8 + ((op[1] >> 4) & 0x0f);
+            px[1] += vg;
+            px[2] += vg - 8 + (op[1] & 0x0f);
+            break;
+        case QOI_OP_RUN:
+            // the pixel repeats, it is already in the index
+            decoder->Run = (tag & 0x3f) + 1;
+            return;
+        }
+    }
+
+    memcpy(decoder->Index[QOI_HASH(px)], px, 4);
+}
+
+int QoiDecode(QOI_DECODER *decoder, const uint8_t *untrustedData, size_t size)
+{
+    const uint8_t *op;
+    size_t opSize, take;
+    size_t pos = 0;
+    int status;
+
+    if (!decoder->RowBuffer)
+    {
+        take = QOI_MIN(QOI_HEADER_SIZE - decoder->PendingSize, size);
+        memcpy(decoder->Pending + decoder->PendingSize, untrustedData, take);
+        decoder->PendingSize += take;
+        pos += take;
+
+        if (decoder->PendingSize < QOI_HEADER_SIZE)
+            return 0;
+
+        decoder->PendingSize = 0;
+        status = ParseHeader(decoder, decoder->Pending);
+        if (status != 0)
+            return status;
+    }
+
+    while (decoder->Y < decoder->Height)
+    {
+        if (decoder->Run == 0)
+        {
+            if (decoder->PendingSize > 0)
+            {
+                // finish the op started in the previous call
+                opSize = OpSize(decoder->Pending[0]);
+                take = QOI_MIN(opSize - decoder->PendingSize, size - pos);
+                memcpy(decoder->Pending + decoder->PendingSize, untrustedData + pos, take);
+                decoder->PendingSize += take;
+                pos += take;
+
+                if (decoder->PendingSize < opSize)
+                    return 0;
+
+                op = decoder->Pending;
+                decoder->PendingSize = 0;
+            }
+            else
+            {
+                if (pos == size)
+                    return 0;
+
+                opSize = OpSize(untrustedData[pos]);
+                if (size - pos < opSize)
+                {
+                    memcpy(decoder->Pending, untrustedData + pos, size - pos);
+                    decoder->PendingSize = size - pos;
+                    return 0;
+                }
+
+                op = untrustedData + pos;
+                pos += opSize;
+            }
+
+            DecodeOp(decoder, op);
+        }
+
+        while (decoder->Run > 0 && decoder->Y < decoder->Height)
+        {
+            memcpy(decoder->RowBuffer + 4 * decoder->X, decoder->Pixel, 4);
+            decoder->Run--;
+
+            if (++decoder->X == decoder->Width)
+            {
+                status = decoder->Row(decoder->Opaque, decoder->Y, decoder->RowBuffer);
+                if (status != 0)
+                    return status;
+
+                decoder->X = 0;
+                decoder->Y++;
+            }
+        }
+    }
+
+    // a run past the last pixel is harmless, anything after the end marker is not
+    decoder->Run = 0;
+    while (pos < size)
+    {
+        if (decoder->EndSize == QOI_END_SIZE || untrustedData[pos] != g_qoiEnd[decoder->EndSize])
+            return EINVAL;
+
+        decoder->EndSize++;
+        pos++;
+    }
+
+    return 0;
+}
+
+int QoiDecodeFinish(QOI_DECODER *decoder)
+{
+    if (!decoder->RowBuffer || decoder->Y < decoder->Height || decoder->EndSize < QOI_END_SIZE)
+        return EINVAL;
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Streaming QOI ("Quite OK Image", https://qoiformat.org) encoder and decoder used
+// for clipboard images. Pixels are RGBA, 4 bytes each. Both ends work on any number
+// of pixels or bytes at a time so images never have to be kept twice in memory.
+// Platform independent, functions return 0 or an errno-style status.
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define QOI_HEADER_SIZE 14
+#define QOI_END_SIZE 8
+
+// most bytes QoiEncodePixels produces for count pixels (a pending run and the end marker included)
+#define QOI_ENCODE_BOUND(count) ((count) * 5 + 1 + QOI_END_SIZE)
+
+typedef struct _QOI_ENCODER
+{
+    uint8_t Index[64][4];
+    uint8_t Previous[4];
+    uint32_t Run;
+    uint64_t PixelsLeft;
+} QOI_ENCODER;
+
+// Writes QOI_HEADER_SIZE bytes of header to out and prepares encoding width * height pixels.
+// hasAlpha only goes into the header, all pixels are encoded with alpha.
+int QoiEncodeBegin(QOI_ENCODER *encoder, uint32_t width, uint32_t height, int hasAlpha, uint8_t *out);
+
+// Encodes the next count pixels into out, which must hold QOI_ENCODE_BOUND(count) bytes.
+// The end marker follows the last pixel of the image. Returns the number of bytes written.
+size_t QoiEncodePixels(QOI_ENCODER *encoder, const uint8_t *rgba, size_t count, uint8_t *out);
+
+// Called once the header is parsed, nonzero refuses the image.
+typedef int (*QOI_HEADER_CALLBACK)(void *opaque, uint32_t width, uint32_t height, int hasAlpha);
+// Called for every decoded row, top to bottom. rgba is only valid during the call.
+typedef int (*QOI_ROW_CALLBACK)(void *opaque, uint32_t y, const uint8_t *rgba);
+
+typedef struct _QOI_DECODER
+{
+    QOI_HEADER_CALLBACK Header;
+    QOI_ROW_CALLBACK Row;
+    void *Opaque;
+    uint64_t MaxPixels;
+
+    uint32_t Width;
+    uint32_t Height;
+    uint32_t X;
+    uint32_t Y;
+    uint8_t *RowBuffer; // allocated once the header is parsed
+
+    uint8_t Index[64][4];
+    uint8_t Pixel[4];
+    uint32_t Run; // pixels of the last op not stored yet
+
+    // header or op split between two QoiDecode calls
+    uint8_t Pending[QOI_HEADER_SIZE];
+    size_t PendingSize;
+    size_t EndSize; // bytes of the end marker seen
+} QOI_DECODER;
+
+// Images with more than maxPixels pixels are refused.
+void QoiDecodeInit(QOI_DECODER *decoder, uint64_t maxPixels, QOI_HEADER_CALLBACK header, QOI_ROW_CALLBACK row, void *opaque);
+void QoiDecodeCleanup(QOI_DECODER *decoder);
+
+// Decodes the next size bytes of the image, stops with EINVAL at anything malformed.
+int QoiDecode(QOI_DECODER *decoder, const uint8_t *untrustedData, size_t size);
+
+// Returns EINVAL unless the whole image including the end marker was decoded.
+int QoiDecodeFinish(QOI_DECODER *decoder);
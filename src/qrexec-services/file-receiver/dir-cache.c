@@ -0,0 +1,139 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <log.h>
+
+#include "linux.h"
+#include "unpack.h"
+#include "dir-cache.h"
+
+#define DIR_CACHE_INITIAL_SIZE 1024 // must be a power of 2
+
+DIR_CACHE_ENTRY *g_dirCache = NULL;
+UINT32 g_dirCacheSize = 0;
+UINT32 g_dirCacheCount = 0;
+
+// FNV-1a
+static UINT32 HashName(IN const char *name)
+{
+    UINT32 hash = 2166136261U;
+
+    while (*name)
+    {
+        hash ^= (BYTE)*name++;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static void UnixTimeToWindows(IN UINT32 unixTime, IN UINT32 unixTimeNsec, OUT FILETIME *windowsTime)
+{
+    ULARGE_INTEGER tmp;
+
+    tmp.QuadPart = ((UINT64)unixTime + UNIX_EPOCH_OFFSET) * 10000000ULL + unixTimeNsec / 100;
+    windowsTime->dwLowDateTime = tmp.LowPart;
+    windowsTime->dwHighDateTime = tmp.HighPart;
+}
+
+// Open addressing with linear probing, the table is never more than half full.
+static DIR_CACHE_ENTRY *FindSlot(IN DIR_CACHE_ENTRY *table, IN UINT32 size, IN const char *name, IN UINT32 hash)
+{
+    UINT32 i = hash & (size - 1);
+
+    while (table[i].Name)
+    {
+        if (table[i].Hash == hash && 0 == strcmp(table[i].Name, name))
+            break;
+
+        i = (i + 1) & (size - 1);
+    }
+
+    return &table[i];
+}
+
+static BOOL Grow(void)
+{
+    DIR_CACHE_ENTRY *table;
+    UINT32 size = g_dirCacheSize ? g_dirCacheSize * 2 : DIR_CACHE_INITIAL_SIZE;
+    UINT32 i;
+
+    table = calloc(size, sizeof(DIR_CACHE_ENTRY));
+    if (!table)
+        return FALSE;
+
+    for (i = 0; i < g_dirCacheSize; i++)
+    {
+        if (g_dirCache[i].Name)
+            *FindSlot(table, size, g_dirCache[i].Name, g_dirCache[i].Hash) = g_dirCache[i];
+    }
+
+    free(g_dirCache);
+    g_dirCache = table;
+    g_dirCacheSize = size;
+    return TRUE;
+}
+
+BOOL DirCacheAdd(IN const char *untrustedNameUtf8, IN const struct file_header *untrustedHeader)
+{
+    DIR_CACHE_ENTRY *entry;
+    UINT32 hash = HashName(untrustedNameUtf8);
+    BOOL added = FALSE;
+
+    if (2 * (g_dirCacheCount + 1) > g_dirCacheSize)
+    {
+        if (!Grow())
+            SendStatusAndExit(ENOMEM, untrustedNameUtf8);
+    }
+
+    entry = FindSlot(g_dirCache, g_dirCacheSize, untrustedNameUtf8, hash);
+    if (!entry->Name)
+    {
+        entry->Name = _strdup(untrustedNameUtf8);
+        if (!entry->Name)
+            SendStatusAndExit(ENOMEM, untrustedNameUtf8);
+
+        entry->Hash = hash;
+        g_dirCacheCount++;
+        added = TRUE;
+    }
+
+    // the last occurrence wins
+    UnixTimeToWindows(untrustedHeader->atime, untrustedHeader->atime_nsec, &entry->AccessTime);
+    UnixTimeToWindows(untrustedHeader->mtime, untrustedHeader->mtime_nsec, &entry->ModificationTime);
+    return added;
+}
+
+void DirCacheForEach(IN fDirCacheCallback callback)
+{
+    UINT32 i;
+
+    for (i = 0; i < g_dirCacheSize; i++)
+    {
+        if (g_dirCache[i].Name)
+            callback(&g_dirCache[i]);
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#pragma once
+#include <windows.h>
+
+#include "filecopy.h"
+
+// Set of directories created in this session. The sender resends every directory
+// after its children (to get the times right), so repeated entries only update
+// the times that are applied once at the end of the transfer.
+
+typedef struct _DIR_CACHE_ENTRY
+{
+    char *Name; // UTF-8, as received
+    UINT32 Hash;
+    FILETIME AccessTime;
+    FILETIME ModificationTime;
+} DIR_CACHE_ENTRY;
+
+typedef void(*fDirCacheCallback)(IN const DIR_CACHE_ENTRY *entry);
+
+// Returns TRUE if the directory was not seen before, FALSE if only its times were updated.
+BOOL DirCacheAdd(IN const char *untrustedNameUtf8, IN const struct file_header *untrustedHeader);
+
+void DirCacheForEach(IN fDirCacheCallback callback);
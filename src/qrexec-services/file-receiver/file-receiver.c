@@ -30,6 +30,7 @@
 #include <log.h>
 
 #include "wdk.h"
+#include "unpack.h"
 
 HANDLE g_stdin = INVALID_HANDLE_VALUE;
 HANDLE g_stdout = INVALID_HANDLE_VALUE;
@@ -37,8 +38,6 @@ HANDLE g_stderr = INVALID_HANDLE_VALUE;
 
 #define INCOMING_DIR_ROOT L"QubesIncoming"
 
-int ReceiveFiles();
-
 WCHAR g_mappedDriveLetter = L'\0';
 
 ULONG MapDriveLetter(IN const WCHAR *targetDirectory, OUT WCHAR *driveLetter)
@@ -0,0 +1,224 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <stdlib.h>
+#include <Strsafe.h>
+
+#include <log.h>
+#include <qubes-io.h>
+
+#include "journal.h"
+
+extern WCHAR g_mappedDriveLetter;
+
+HANDLE g_journal = INVALID_HANDLE_VALUE;
+CRITICAL_SECTION g_journalLock; // writer stage updates, either stage flushes on exit
+JOURNAL_RECORD g_journalRecord;
+ULONGLONG g_journalFlushTime = 0;
+
+// state from the interrupted transfer, constant after JournalOpen
+char g_journalPartialName[MAX_PATH_LENGTH];
+UINT64 g_journalPartialOffset = 0;
+
+static void GetJournalPath(OUT WCHAR *journalPath, IN size_t cchJournalPath)
+{
+    StringCchPrintf(journalPath, cchJournalPath, L"%c:\\%s", g_mappedDriveLetter, JOURNAL_NAME);
+}
+
+// Reads the previous record, returns FALSE if there is none or it's not valid.
+static BOOL ReadJournalRecord(IN HANDLE journal, OUT JOURNAL_RECORD *record)
+{
+    DWORD cbHeader = FIELD_OFFSET(JOURNAL_RECORD, PartialName);
+    DWORD cbRead;
+
+    if (!ReadFile(journal, record, cbHeader, &cbRead, NULL) || cbRead != cbHeader)
+        return FALSE;
+
+    if (record->Magic != JOURNAL_MAGIC || record->PartialNameLength > MAX_PATH_LENGTH - 1)
+        return FALSE;
+
+    if (!ReadFile(journal, record->PartialName, record->PartialNameLength, &cbRead, NULL) || cbRead != record->PartialNameLength)
+        return FALSE;
+
+    record->PartialName[record->PartialNameLength] = 0;
+    return TRUE;
+}
+
+void JournalInit(void)
+{
+    InitializeCriticalSection(&g_journalLock);
+}
+
+BOOL JournalOpen(IN UINT64 manifest, OUT struct resume_reply *resumePoint)
+{
+    WCHAR journalPath[MAX_PATH + 1];
+
+    ZeroMemory(resumePoint, sizeof(*resumePoint));
+    resumePoint->magic = FC_RESUME_REPLY_MAGIC;
+
+    // the writer stage may already be using it
+    if (INVALID_HANDLE_VALUE != g_journal)
+    {
+        LogError("journal already open");
+        return FALSE;
+    }
+
+    GetJournalPath(journalPath, RTL_NUMBER_OF(journalPath));
+    g_journal = CreateFile(journalPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_HIDDEN, NULL);
+    if (INVALID_HANDLE_VALUE == g_journal)
+    {
+        perror("CreateFile(journal)");
+        return FALSE;
+    }
+
+    if (ReadJournalRecord(g_journal, &g_journalRecord) && g_journalRecord.Manifest == manifest)
+    {
+        resumePoint->entries_done = g_journalRecord.EntriesDone;
+        if (g_journalRecord.PartialNameLength > 0)
+        {
+            resumePoint->flags |= FC_RESUME_PARTIAL;
+            resumePoint->offset = g_journalRecord.PartialOffset;
+            StringCchCopyA(g_journalPartialName, RTL_NUMBER_OF(g_journalPartialName), g_journalRecord.PartialName);
+            g_journalPartialOffset = g_journalRecord.PartialOffset;
+        }
+
+        LogInfo("resuming after %I64u entries, offset %I64u", resumePoint->entries_done, resumePoint->offset);
+    }
+    else
+    {
+        // different transfer, start over
+        ZeroMemory(&g_journalRecord, FIELD_OFFSET(JOURNAL_RECORD, PartialName));
+        g_journalRecord.Magic = JOURNAL_MAGIC;
+        g_journalRecord.Manifest = manifest;
+        g_journalRecord.PartialName[0] = 0;
+        JournalFlush();
+    }
+
+    return TRUE;
+}
+
+const char *JournalPartialName(void)
+{
+    return g_journalPartialName;
+}
+
+UINT64 JournalPartialOffset(void)
+{
+    return g_journalPartialOffset;
+}
+
+void JournalFlush(void)
+{
+    LARGE_INTEGER start;
+    DWORD cbRecord;
+
+    if (INVALID_HANDLE_VALUE == g_journal)
+        return;
+
+    EnterCriticalSection(&g_journalLock);
+    start.QuadPart = 0;
+    cbRecord = FIELD_OFFSET(JOURNAL_RECORD, PartialName) + g_journalRecord.PartialNameLength;
+    // the record only grows with the name, a longer stale tail is harmless
+    if (!SetFilePointerEx(g_journal, start, NULL, FILE_BEGIN) || !QioWriteBuffer(g_journal, &g_journalRecord, cbRecord))
+        perror("write(journal)");
+
+    g_journalFlushTime = GetTickCount64();
+    LeaveCriticalSection(&g_journalLock);
+}
+
+static void FlushIfDue(void)
+{
+    if (GetTickCount64() - g_journalFlushTime >= JOURNAL_FLUSH_INTERVAL)
+        JournalFlush();
+}
+
+void JournalEntryStarted(IN const char *name, IN UINT64 offset)
+{
+    size_t cbName;
+
+    if (INVALID_HANDLE_VALUE == g_journal)
+        return;
+
+    EnterCriticalSection(&g_journalLock);
+    if (FAILED(StringCbLengthA(name, sizeof(g_journalRecord.PartialName), &cbName)))
+        cbName = 0; // can't happen, names are limited to MAX_PATH_LENGTH - 1
+    CopyMemory(g_journalRecord.PartialName, name, cbName);
+    g_journalRecord.PartialNameLength = (UINT32)cbName;
+    g_journalRecord.PartialOffset = offset;
+    LeaveCriticalSection(&g_journalLock);
+
+    FlushIfDue();
+}
+
+void JournalAdvance(IN UINT64 size)
+{
+    if (INVALID_HANDLE_VALUE == g_journal)
+        return;
+
+    EnterCriticalSection(&g_journalLock);
+    g_journalRecord.PartialOffset += size;
+    LeaveCriticalSection(&g_journalLock);
+
+    FlushIfDue();
+}
+
+void JournalEntryDone(void)
+{
+    if (INVALID_HANDLE_VALUE == g_journal)
+        return;
+
+    EnterCriticalSection(&g_journalLock);
+    g_journalRecord.EntriesDone++;
+    g_journalRecord.PartialNameLength = 0;
+    g_journalRecord.PartialOffset = 0;
+    LeaveCriticalSection(&g_journalLock);
+
+    FlushIfDue();
+}
+
+void JournalEntryDiscarded(void)
+{
+    if (INVALID_HANDLE_VALUE == g_journal)
+        return;
+
+    EnterCriticalSection(&g_journalLock);
+    g_journalRecord.PartialNameLength = 0;
+    g_journalRecord.PartialOffset = 0;
+    LeaveCriticalSection(&g_journalLock);
+
+    FlushIfDue();
+}
+
+void JournalDelete(void)
+{
+    WCHAR journalPath[MAX_PATH + 1];
+
+    if (INVALID_HANDLE_VALUE == g_journal)
+        return;
+
+    CloseHandle(g_journal);
+    g_journal = INVALID_HANDLE_VALUE;
+
+    GetJournalPath(journalPath, RTL_NUMBER_OF(journalPath));
+    if (!DeleteFile(journalPath))
+        perror("DeleteFile(journal)");
+}
@@ -0,0 +1,72 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#pragma once
+#include <windows.h>
+
+#include "filecopy.h"
+
+// The resume journal (FC_CAP_RESUME) lives in the root of the incoming directory
+// and records how far the writer stage got, so an interrupted transfer can continue.
+// It is kept after a failed transfer and removed after a successful one.
+
+#define JOURNAL_NAME L".qubes-filecopy-resume"
+#define JOURNAL_MAGIC 0x4A434651 // "QFCJ"
+// the journal is rewritten at most this often (ms), and always before exit
+#define JOURNAL_FLUSH_INTERVAL 1000
+
+#pragma pack(push, 1)
+typedef struct _JOURNAL_RECORD
+{
+    UINT32 Magic;
+    UINT32 PartialNameLength; // 0 if no file is partially written
+    UINT64 Manifest;
+    UINT64 EntriesDone;
+    UINT64 PartialOffset;
+    char PartialName[MAX_PATH_LENGTH]; // UTF-8, only PartialNameLength bytes are stored
+} JOURNAL_RECORD;
+#pragma pack(pop)
+
+// Called once at startup, before the writer stage runs.
+void JournalInit(void);
+
+// Opens the journal and fills resumePoint from it if it belongs to the same manifest,
+// otherwise starts a new one. Returns FALSE if journaling is not possible or the
+// journal is already open.
+BOOL JournalOpen(IN UINT64 manifest, OUT struct resume_reply *resumePoint);
+
+// Name of the partially written file from the previous transfer ("" if none).
+const char *JournalPartialName(void);
+
+// Offset at which the partially written file continues.
+UINT64 JournalPartialOffset(void);
+
+// The functions below are called by the writer stage and do nothing if the journal is not open.
+void JournalEntryStarted(IN const char *name, IN UINT64 offset);
+void JournalAdvance(IN UINT64 size);
+void JournalEntryDone(void);
+// The entry was removed again and will be sent anew.
+void JournalEntryDiscarded(void);
+
+void JournalFlush(void);
+
+// Called after a successful transfer.
+void JournalDelete(void);
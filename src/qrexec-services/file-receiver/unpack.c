@@ -22,28 +22,31 @@
 #include <windows.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
-#include <Strsafe.h>
-#include <Shlwapi.h>
 
-#include <utf8-conv.h>
 #include <qubes-io.h>
 #include <log.h>
-#include <crc32.h>
 
 #include "linux.h"
 #include "filecopy.h"
+#include "filecopy-engine.h"
+#include "unpack.h"
+#include "writer.h"
+#include "journal.h"
 
-char g_untrustedName[MAX_PATH_LENGTH];
+// Stream parsing is done by the portable engine (filecopy-engine.c), this is the
+// backend that hands the entries to the writer stage.
+
+FCE_UNPACK g_unpack;
 INT64 g_bytesLimit = 0;
 INT64 g_filesLimit = 0;
-INT64 g_totalBytesReceived = 0;
-INT64 g_totalFilesReceived = 0;
-ULONG g_crc32 = 0;
+
+// both stages can fail, only one may report
+CRITICAL_SECTION g_exitLock;
 
 extern HANDLE g_stdin;
 extern HANDLE g_stdout;
-extern WCHAR g_mappedDriveLetter;
 
 void SetSizeLimit(IN INT64 bytesLimit, IN INT64 filesLimit)
 {
@@ -51,273 +54,175 @@ void SetSizeLimit(IN INT64 bytesLimit, IN INT64 filesLimit)
     g_filesLimit = filesLimit;
 }
 
-BOOL ReadWithCrc(IN HANDLE input, OUT void *buffer, IN DWORD bufferSize)
+void SendStatusAndExit(IN UINT32 statusCode, IN const char *lastFileName)
 {
-    BOOL ret;
+    // before the lock: a failing writer stage must be able to stop while the other one waits
+    WriterStop();
+    EnterCriticalSection(&g_exitLock); // never left, the process exits
 
-    LogVerbose("%lu", bufferSize);
-    ret = QioReadBuffer(input, buffer, bufferSize);
-    if (ret)
-        g_crc32 = Crc32_ComputeBuf(g_crc32, buffer, bufferSize);
+    if (statusCode == LEGAL_EOF)
+        statusCode = 0;
 
-    return ret;
+    LogDebug("status %lu, last file %S", statusCode, lastFileName);
+    JournalFlush();
+    FceUnpackSendResult(&g_unpack, statusCode, lastFileName);
+    CloseHandle(g_stdout);
+    exit(statusCode);
 }
 
-void SendStatusAndCrc(IN UINT32 statusCode, IN const char *lastFileName OPTIONAL)
+static char *DuplicateName(IN const char *untrustedNameUtf8)
 {
-    struct result_header header;
-    struct result_header_ext headerExt;
+    char *name = _strdup(untrustedNameUtf8);
 
-    LogVerbose("status %lu", statusCode);
-    header.error_code = statusCode;
-    header.crc32 = g_crc32;
-    if (!QioWriteBuffer(g_stdout, &header, sizeof(header)))
-    {
+    if (!name)
+        SendStatusAndExit(ENOMEM, untrustedNameUtf8);
 
-    }
+    return name;
+}
 
-    if (lastFileName)
-    {
-        headerExt.last_namelen = (UINT32)strlen(lastFileName);
-        QioWriteBuffer(g_stdout, &headerExt, sizeof(headerExt));
-        QioWriteBuffer(g_stdout, lastFileName, headerExt.last_namelen);
-    }
+static int UnpackRead(IN void *opaque, OUT void *buffer, IN size_t size)
+{
+    LogVerbose("%lu", (DWORD)size);
+    return QioReadBuffer(g_stdin, buffer, (DWORD)size) ? 0 : EIO;
 }
 
-void SendStatusAndExit(IN UINT32 statusCode, IN const char *lastFileName)
+static int UnpackReply(IN void *opaque, IN const void *buffer, IN size_t size)
 {
-    if (statusCode == LEGAL_EOF)
-        statusCode = 0;
+    BOOL ret;
 
-    LogDebug("status %lu, last file %S", statusCode, lastFileName);
-    SendStatusAndCrc(statusCode, lastFileName);
-    CloseHandle(g_stdout);
-    exit(statusCode);
+    // the writer stage may be reporting a failure at the same time
+    EnterCriticalSection(&g_exitLock);
+    ret = QioWriteBuffer(g_stdout, buffer, (DWORD)size);
+    LeaveCriticalSection(&g_exitLock);
+
+    return ret ? 0 : EIO;
 }
 
-void ProcessRegularFile(IN const struct file_header *untrustedHeader, IN const char *untrustedNameUtf8)
+static void *UnpackGetBuffer(IN void *opaque, OUT size_t *size)
 {
-    FC_COPY_STATUS copyStatus;
-    ULONG errorCode;
-    HANDLE outputFile;
-    WCHAR *untrustedFileName = NULL;
-    WCHAR trustedFilePath[MAX_PATH + 1];
-    HRESULT hresult;
-
-    errorCode = ConvertUTF8ToUTF16(untrustedNameUtf8, &untrustedFileName, NULL);
-    if (ERROR_SUCCESS != errorCode)
-        SendStatusAndExit(EINVAL, NULL);
-
-    LogDebug("file '%s'", untrustedFileName);
-    hresult = StringCchPrintf(
-        trustedFilePath,
-        RTL_NUMBER_OF(trustedFilePath),
-        L"%c:\\%s",
-        g_mappedDriveLetter,
-        untrustedFileName);
-
-    free(untrustedFileName);
-
-    if (FAILED(hresult))
-        SendStatusAndExit(EINVAL, untrustedNameUtf8);
-
-    outputFile = CreateFile(trustedFilePath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_NEW, 0, NULL);	/* safe because of chroot */
-    if (INVALID_HANDLE_VALUE == outputFile)
-    {
-        // maybe some more complete error code translation needed here, but
-        // anyway qfile-agent will handle only those listed below
-        if (GetLastError() == ERROR_FILE_EXISTS)
-            SendStatusAndExit(EEXIST, untrustedNameUtf8);
-        else if (GetLastError() == ERROR_ACCESS_DENIED)
-            SendStatusAndExit(EACCES, untrustedNameUtf8);
-        else
-            SendStatusAndExit(EIO, untrustedNameUtf8);
-    }
+    *size = FC_COPY_BUFFER_SIZE;
+    return WriterGetBuffer();
+}
 
-    g_totalBytesReceived += untrustedHeader->filelen;
-    if (g_bytesLimit && g_totalBytesReceived > g_bytesLimit)
-        SendStatusAndExit(EDQUOT, untrustedNameUtf8);
+static int UnpackBeginFile(IN void *opaque, IN const struct file_header *untrustedHeader, IN const char *untrustedNameUtf8, IN UINT64 resumeOffset)
+{
+    // the writer stage continues a resumed file where the journal says
+    WriterQueue(WRITER_OP_CREATE_FILE, untrustedHeader, DuplicateName(untrustedNameUtf8), NULL);
+    return 0;
+}
 
-    // receive file data from stdin
-    copyStatus = FcCopyFile(outputFile, g_stdin, untrustedHeader->filelen, &g_crc32, NULL);
-    if (copyStatus != COPY_FILE_OK)
-    {
-        SendStatusAndExit(EIO, untrustedNameUtf8);
-    }
+static int UnpackWriteData(IN void *opaque, IN void *buffer, IN size_t size)
+{
+    WriterQueueData(buffer, (DWORD)size); // safe cast: at most FC_COPY_BUFFER_SIZE
+    return 0;
+}
 
-    CloseHandle(outputFile);
+static int UnpackEndFile(IN void *opaque)
+{
+    WriterQueue(WRITER_OP_CLOSE_FILE, NULL, NULL, NULL);
+    return 0;
 }
 
-void ProcessDirectory(IN const struct file_header *untrustedHeader, IN const char *untrustedNameUtf8)
+static int UnpackMakeDirectory(IN void *opaque, IN const struct file_header *untrustedHeader, IN const char *untrustedNameUtf8)
 {
-    ULONG errorCode;
-    WCHAR *untrustedDirectoryName = NULL;
-    WCHAR trustedDirectoryPath[MAX_PATH + 1];
-    HRESULT hresult;
-
-    errorCode = ConvertUTF8ToUTF16(untrustedNameUtf8, &untrustedDirectoryName, NULL);
-    if (ERROR_SUCCESS != errorCode)
-        SendStatusAndExit(EINVAL, NULL);
-
-    LogDebug("dir '%s'", untrustedDirectoryName);
-    hresult = StringCchPrintf(
-        trustedDirectoryPath,
-        RTL_NUMBER_OF(trustedDirectoryPath),
-        L"%c:\\%s",
-        g_mappedDriveLetter,
-        untrustedDirectoryName);
-    free(untrustedDirectoryName);
-
-    if (FAILED(hresult))
-        SendStatusAndExit(EINVAL, untrustedNameUtf8);
-
-    if (!CreateDirectory(trustedDirectoryPath, NULL))
-    {	/* safe because of chroot */
-        errorCode = GetLastError();
-        if (ERROR_ALREADY_EXISTS != errorCode)
-            SendStatusAndExit(ENOTDIR, untrustedNameUtf8);
-    }
+    WriterQueue(WRITER_OP_DIRECTORY, untrustedHeader, DuplicateName(untrustedNameUtf8), NULL);
+    return 0;
 }
 
-void ProcessLink(IN const struct file_header *untrustedHeader, IN const char *untrustedNameUtf8)
+static int UnpackMakeLink(IN void *opaque, IN const struct file_header *untrustedHeader, IN const char *untrustedNameUtf8, IN const char *untrustedTargetUtf8)
 {
-    char untrustedLinkTargetPathUtf8[MAX_PATH_LENGTH];
-    DWORD linkTargetSize;
-    WCHAR *untrustedName = NULL;
-    WCHAR trustedFilePath[MAX_PATH + 1];
-    WCHAR *untrustedLinkTargetPath = NULL;
-    WCHAR untrustedLinkTargetAbsolutePath[MAX_PATH + 1];
-    BOOL success;
-    HRESULT hresult;
-    ULONG errorCode;
-    BOOL targetIsFile = FALSE; /* default to directory links */
-
-    errorCode = ConvertUTF8ToUTF16(untrustedNameUtf8, &untrustedName, NULL);
-    if (ERROR_SUCCESS != errorCode)
-        SendStatusAndExit(EINVAL, NULL);
-
-    LogDebug("link '%s'", untrustedName);
-    hresult = StringCchPrintf(
-        trustedFilePath,
-        RTL_NUMBER_OF(trustedFilePath),
-        L"%c:\\%s",
-        g_mappedDriveLetter,
-        untrustedName);
-
-    free(untrustedName);
-
-    if (FAILED(hresult))
-        SendStatusAndExit(EINVAL, untrustedNameUtf8);
-
-    if (untrustedHeader->filelen > MAX_PATH - 1)
-        SendStatusAndExit(ENAMETOOLONG, untrustedNameUtf8);
-
-    linkTargetSize = (DWORD) untrustedHeader->filelen; // sanitized above
-    if (!ReadWithCrc(g_stdin, untrustedLinkTargetPathUtf8, linkTargetSize))
-        SendStatusAndExit(EIO, untrustedNameUtf8);
-
-    untrustedLinkTargetPathUtf8[linkTargetSize] = 0;
-
-    errorCode = ConvertUTF8ToUTF16(untrustedLinkTargetPathUtf8, &untrustedLinkTargetPath, NULL);
-    if (ERROR_SUCCESS != errorCode)
-        SendStatusAndExit(EINVAL, untrustedNameUtf8);
-
-    LogDebug("target '%s'", untrustedLinkTargetPath);
-    /* TODO? sanitize link target path in any way? we don't allow to override
-     * existing files, so this shouldn't be a problem to leave it alone */
-
-    /* try to determine if link target is a file or directory */
-    if (PathIsRelative(untrustedLinkTargetPath))
-    {
-        WCHAR tempPath[MAX_PATH + 1];
-
-        hresult = StringCchPrintfW(
-            tempPath,
-            RTL_NUMBER_OF(tempPath),
-            L"%c:\\%s",
-            g_mappedDriveLetter,
-            untrustedLinkTargetPath);
-
-        *(PathFindFileName(tempPath)) = L'\0';
-        if (!PathCombine(untrustedLinkTargetAbsolutePath, tempPath, untrustedLinkTargetPath))
-        {
-            free(untrustedLinkTargetPath);
-            SendStatusAndExit(EINVAL, untrustedNameUtf8);
-        }
-
-        if (PathFileExists(untrustedLinkTargetAbsolutePath) && !PathIsDirectory(untrustedLinkTargetAbsolutePath))
-        {
-            targetIsFile = TRUE;
-        }
-    }
-    else
-    {
-        free(untrustedLinkTargetPath);
-        /* deny absolute links */
-        SendStatusAndExit(EPERM, untrustedNameUtf8);
-    }
+    if (strlen(untrustedTargetUtf8) > MAX_PATH - 1)
+        return ENAMETOOLONG;
 
-    success = CreateSymbolicLink(trustedFilePath, untrustedLinkTargetPath,
-        targetIsFile ? 0 : SYMBOLIC_LINK_FLAG_DIRECTORY);
+    WriterQueue(WRITER_OP_LINK, untrustedHeader, DuplicateName(untrustedNameUtf8), DuplicateName(untrustedTargetUtf8));
+    return 0;
+}
 
-    free(untrustedLinkTargetPath);
+static int UnpackFinish(IN void *opaque)
+{
+    // everything must be on disk before reporting success
+    WriterFinish();
+    return 0;
+}
 
-    if (!success)
-    {
-        if (GetLastError() == ERROR_FILE_EXISTS)
-            SendStatusAndExit(EEXIST, untrustedNameUtf8);
-        else if (GetLastError() == ERROR_ACCESS_DENIED)
-            SendStatusAndExit(EACCES, untrustedNameUtf8);
-        else if (GetLastError() == ERROR_PRIVILEGE_NOT_HELD)
-            SendStatusAndExit(EACCES, untrustedNameUtf8);
-        else
-            SendStatusAndExit(EIO, untrustedNameUtf8);
-    }
+static int UnpackSkipHole(IN void *opaque, IN UINT64 size)
+{
+    WriterQueueHole(size);
+    return 0;
 }
 
-void ProcessEntry(IN const struct file_header *untrustedHeader)
+static int UnpackOpenJournal(IN void *opaque, IN UINT64 manifest, OUT struct resume_reply *resumePoint, OUT const char **partialName)
 {
-    UINT32 nameSize;
-
-    if (untrustedHeader->namelen > MAX_PATH_LENGTH - 1)
-        SendStatusAndExit(ENAMETOOLONG, NULL);
-
-    nameSize = untrustedHeader->namelen;	/* sanitized above */
-    if (!ReadWithCrc(g_stdin, g_untrustedName, nameSize))
-        SendStatusAndExit(LEGAL_EOF, NULL);	// hopefully remote has produced error message
-
-    g_untrustedName[nameSize] = 0;
-    if (S_ISREG(untrustedHeader->mode))
-        ProcessRegularFile(untrustedHeader, g_untrustedName);
-    else if (S_ISLNK(untrustedHeader->mode))
-        ProcessLink(untrustedHeader, g_untrustedName);
-    else if (S_ISDIR(untrustedHeader->mode))
-        ProcessDirectory(untrustedHeader, g_untrustedName);
-    else
-        SendStatusAndExit(EINVAL, g_untrustedName);
+    // without a journal the transfer still works, just can't be resumed later
+    if (!JournalOpen(manifest, resumePoint))
+        LogWarning("resume journal not available");
+
+    *partialName = JournalPartialName();
+    return 0;
 }
 
+static int UnpackCopyDuplicate(IN void *opaque, IN const struct file_header *untrustedHeader, IN const char *untrustedNameUtf8,
+    IN const char *sourceName, IN const BYTE *untrustedHash, OUT int *matched)
+{
+    *matched = WriterCopyDuplicate(untrustedHeader, DuplicateName(untrustedNameUtf8), DuplicateName(sourceName), untrustedHash);
+    return 0;
+}
+
+static int UnpackWriteCompressed(IN void *opaque, IN void *buffer, IN size_t size, IN UINT32 originalSize, IN UINT32 untrustedCrc32)
+{
+    // safe cast: at most FC_COPY_BUFFER_SIZE
+    WriterQueueCompressed(buffer, (DWORD)size, originalSize, untrustedCrc32);
+    return 0;
+}
+
+static const FCE_UNPACK_BACKEND g_unpackBackend =
+{
+    UnpackRead,
+    UnpackReply,
+    UnpackGetBuffer,
+    UnpackBeginFile,
+    UnpackWriteData,
+    UnpackEndFile,
+    UnpackMakeDirectory,
+    UnpackMakeLink,
+    UnpackFinish,
+    UnpackSkipHole,
+    UnpackOpenJournal,
+    UnpackCopyDuplicate,
+    UnpackWriteCompressed,
+};
+
 int ReceiveFiles(void)
 {
-    struct file_header untrustedHeader;
+    int status;
+
+    InitializeCriticalSection(&g_exitLock);
+    JournalInit();
+
+    FceUnpackInit(&g_unpack, &g_unpackBackend, NULL);
+    g_unpack.BytesLimit = g_bytesLimit;
+    g_unpack.FilesLimit = g_filesLimit;
+
+    if (!WriterStart())
+        SendStatusAndExit(ENOMEM, NULL);
 
-    /* initialize checksum */
-    g_crc32 = 0;
-    while (ReadWithCrc(g_stdin, &untrustedHeader, sizeof untrustedHeader))
+    if (!WriterCanDecompress())
+        g_unpack.SupportedCaps &= ~FC_CAP_COMPRESS;
+
+    status = FceUnpack(&g_unpack);
+    if (status == LEGAL_EOF)
     {
-        /* check for end of transfer marker */
-        if (untrustedHeader.namelen == 0)
-        {
-            errno = 0;
-            break;
-        }
-
-        ProcessEntry(&untrustedHeader);
-        g_totalFilesReceived++;
-
-        if (g_filesLimit && g_totalFilesReceived > g_filesLimit)
-            SendStatusAndExit(EDQUOT, g_untrustedName);
+        // hopefully remote has produced error message, keep what was received so far
+        WriterFinish();
+        SendStatusAndExit(LEGAL_EOF, NULL);
     }
-    SendStatusAndCrc(errno, NULL);
-    return errno;
+
+    if (status != 0)
+        SendStatusAndExit(status, g_unpack.LastName);
+
+    JournalDelete();
+    EnterCriticalSection(&g_exitLock);
+    FceUnpackSendResult(&g_unpack, 0, NULL);
+    LeaveCriticalSection(&g_exitLock);
+    return 0;
 }
@@ -1,4 +1,4 @@
-<#
+/*
  * The Qubes OS Project, http://www.qubes-os.org
  *
  * Copyright (c) Invisible Things Lab
@@ -17,8 +17,14 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  *
- #>
+ */
 
-# Input is in locale-invariant format (2014-09-29T22:59:21+0000)
-$in = [Console]::In.ReadLine()
-Set-Date $in
+#pragma once
+#include <windows.h>
+
+#include "filecopy.h"
+
+// Exits the process after reporting the status (and optionally last file name) to the sender.
+void SendStatusAndExit(IN UINT32 statusCode, IN const char *lastFileName OPTIONAL);
+
+int ReceiveFiles(void);
@@ -0,0 +1,750 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <Strsafe.h>
+#include <Shlwapi.h>
+#include <compressapi.h>
+
+#include <utf8-conv.h>
+#include <qubes-io.h>
+#include <crc32.h>
+#include <log.h>
+
+#include "linux.h"
+#include "filecopy.h"
+#include "unpack.h"
+#include "writer.h"
+#include "dir-cache.h"
+#include "journal.h"
+
+extern WCHAR g_mappedDriveLetter;
+
+WRITER_OP g_writerQueue[WRITER_QUEUE_SIZE];
+LONG g_writerQueueHead = 0; // consumer
+LONG g_writerQueueTail = 0; // producer
+HANDLE g_writerQueueFree = NULL; // semaphore, free op slots
+HANDLE g_writerQueueUsed = NULL; // semaphore, queued ops
+
+BYTE *g_writerBuffers[WRITER_RING_BUFFERS];
+LONG g_writerNextBuffer = 0;
+HANDLE g_writerBuffersFree = NULL; // semaphore
+
+HANDLE g_writerThread = NULL;
+DWORD g_writerThreadId = 0;
+HANDLE g_writerAbortEvent = NULL; // the main thread is failing the transfer
+HANDLE g_writerStoppedEvent = NULL; // the writer thread is failing the transfer, it won't write anymore
+
+// file being written, truncated to the written data if the transfer fails; writer thread only
+HANDLE g_partialFile = INVALID_HANDLE_VALUE;
+
+LONG g_pendingCloses = 0;
+HANDLE g_closesDoneEvent = NULL;
+
+HANDLE g_duplicateDoneEvent = NULL;
+BOOL g_duplicateMatched = FALSE;
+BYTE *g_duplicateBuffer = NULL; // allocated on first use
+
+DECOMPRESSOR_HANDLE g_decompressor = NULL;
+BYTE *g_decompressBuffer = NULL; // FC_COMPRESS_BLOCK_SIZE
+
+// Paths are relative to the mapped drive that represents the incoming directory.
+static void GetTrustedPath(IN const char *untrustedNameUtf8, OUT WCHAR *trustedPath, IN size_t cchTrustedPath)
+{
+    ULONG errorCode;
+    WCHAR *untrustedName = NULL;
+    HRESULT hresult;
+
+    errorCode = ConvertUTF8ToUTF16(untrustedNameUtf8, &untrustedName, NULL);
+    if (ERROR_SUCCESS != errorCode)
+        SendStatusAndExit(EINVAL, NULL);
+
+    hresult = StringCchPrintf(
+        trustedPath,
+        cchTrustedPath,
+        L"%c:\\%s",
+        g_mappedDriveLetter,
+        untrustedName);
+
+    free(untrustedName);
+
+    if (FAILED(hresult))
+        SendStatusAndExit(EINVAL, untrustedNameUtf8);
+}
+
+// Sets allocation size and end of file before the data is written.
+static ULONG PreallocateFile(IN HANDLE file, IN UINT64 size)
+{
+    FILE_ALLOCATION_INFO allocationInfo;
+    FILE_END_OF_FILE_INFO endOfFileInfo;
+
+    if (size == 0)
+        return ERROR_SUCCESS;
+
+    allocationInfo.AllocationSize.QuadPart = size;
+    if (!SetFileInformationByHandle(file, FileAllocationInfo, &allocationInfo, sizeof(allocationInfo)))
+        return GetLastError();
+
+    endOfFileInfo.EndOfFile.QuadPart = size;
+    if (!SetFileInformationByHandle(file, FileEndOfFileInfo, &endOfFileInfo, sizeof(endOfFileInfo)))
+        return GetLastError();
+
+    return ERROR_SUCCESS;
+}
+
+// Holes are skipped when writing, end of file covers the trailing one.
+static ULONG MakeSparseFile(IN HANDLE file, IN UINT64 size)
+{
+    FILE_SET_SPARSE_BUFFER sparse;
+    FILE_END_OF_FILE_INFO endOfFileInfo;
+    DWORD cbReturned;
+
+    sparse.SetSparse = TRUE;
+    // not fatal, skipped holes will just be zero-filled
+    if (!DeviceIoControl(file, FSCTL_SET_SPARSE, &sparse, sizeof(sparse), NULL, 0, &cbReturned, NULL))
+        LogWarning("FSCTL_SET_SPARSE failed: 0x%x", GetLastError());
+
+    endOfFileInfo.EndOfFile.QuadPart = size;
+    if (!SetFileInformationByHandle(file, FileEndOfFileInfo, &endOfFileInfo, sizeof(endOfFileInfo)))
+        return GetLastError();
+
+    return ERROR_SUCCESS;
+}
+
+// The file was created (and preallocated) by the interrupted transfer, the reader
+// already checked it against the journal.
+static HANDLE OpenResumedFile(IN const WCHAR *trustedFilePath, IN const char *untrustedNameUtf8)
+{
+    HANDLE outputFile;
+    LARGE_INTEGER offset;
+
+    LogDebug("resuming '%s' at %I64u", trustedFilePath, JournalPartialOffset());
+    outputFile = CreateFile(trustedFilePath, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);	/* safe because of chroot */
+    if (INVALID_HANDLE_VALUE == outputFile)
+    {
+        if (GetLastError() == ERROR_ACCESS_DENIED)
+            SendStatusAndExit(EACCES, untrustedNameUtf8);
+        else
+            SendStatusAndExit(EIO, untrustedNameUtf8);
+    }
+
+    offset.QuadPart = JournalPartialOffset();
+    if (!SetFilePointerEx(outputFile, offset, NULL, FILE_BEGIN))
+        SendStatusAndExit(EIO, untrustedNameUtf8);
+
+    return outputFile;
+}
+
+static HANDLE CreateOutputFile(IN const struct file_header *untrustedHeader, IN const char *untrustedNameUtf8)
+{
+    HANDLE outputFile;
+    WCHAR trustedFilePath[MAX_PATH + 1];
+    ULONG errorCode;
+
+    GetTrustedPath(untrustedNameUtf8, trustedFilePath, RTL_NUMBER_OF(trustedFilePath));
+    LogDebug("file '%s'", trustedFilePath);
+
+    if (untrustedHeader->mode & FC_MODE_RESUMED)
+        return OpenResumedFile(trustedFilePath, untrustedNameUtf8);
+
+    outputFile = CreateFile(trustedFilePath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_NEW, FILE_FLAG_SEQUENTIAL_SCAN, NULL);	/* safe because of chroot */
+    if (INVALID_HANDLE_VALUE == outputFile)
+    {
+        // maybe some more complete error code translation needed here, but
+        // anyway qfile-agent will handle only those listed below
+        if (GetLastError() == ERROR_FILE_EXISTS)
+            SendStatusAndExit(EEXIST, untrustedNameUtf8);
+        else if (GetLastError() == ERROR_ACCESS_DENIED)
+            SendStatusAndExit(EACCES, untrustedNameUtf8);
+        else
+            SendStatusAndExit(EIO, untrustedNameUtf8);
+    }
+
+    // size is within limits here, reserve the space so NTFS can allocate it in as few extents as possible
+    // (sparse files only get their logical size, holes must stay unallocated)
+    if (untrustedHeader->mode & FC_MODE_SPARSE)
+        errorCode = MakeSparseFile(outputFile, untrustedHeader->filelen);
+    else
+        errorCode = PreallocateFile(outputFile, untrustedHeader->filelen);
+    if (ERROR_SUCCESS != errorCode)
+    {
+        if (ERROR_DISK_FULL == errorCode)
+            SendStatusAndExit(ENOSPC, untrustedNameUtf8);
+
+        LogWarning("Failed to preallocate %I64u bytes for '%S': 0x%x", untrustedHeader->filelen, untrustedNameUtf8, errorCode);
+    }
+
+    return outputFile;
+}
+
+static void CALLBACK CloseFileCallback(IN OUT PTP_CALLBACK_INSTANCE instance, IN void *context)
+{
+    CloseHandle((HANDLE) context);
+    if (InterlockedDecrement(&g_pendingCloses) == 0)
+        SetEvent(g_closesDoneEvent);
+}
+
+// Closes the handle in the thread pool unless too many closes are already pending.
+static void CloseOutputFile(IN HANDLE file)
+{
+    if (InterlockedIncrement(&g_pendingCloses) <= WRITER_MAX_PENDING_CLOSES)
+    {
+        if (TrySubmitThreadpoolCallback(CloseFileCallback, file, NULL))
+            return;
+
+        perror("TrySubmitThreadpoolCallback");
+    }
+
+    InterlockedDecrement(&g_pendingCloses);
+    CloseHandle(file);
+}
+
+static void CreateDirectoryEntry(IN const struct file_header *untrustedHeader, IN const char *untrustedNameUtf8)
+{
+    ULONG errorCode;
+    WCHAR trustedDirectoryPath[MAX_PATH + 1];
+
+    if (!DirCacheAdd(untrustedNameUtf8, untrustedHeader))
+        return; // already created in this session
+
+    GetTrustedPath(untrustedNameUtf8, trustedDirectoryPath, RTL_NUMBER_OF(trustedDirectoryPath));
+    LogDebug("dir '%s'", trustedDirectoryPath);
+
+    if (!CreateDirectory(trustedDirectoryPath, NULL))
+    {	/* safe because of chroot */
+        errorCode = GetLastError();
+        if (ERROR_ALREADY_EXISTS != errorCode)
+            SendStatusAndExit(ENOTDIR, untrustedNameUtf8);
+    }
+}
+
+// Called at the end of the transfer, so creating children doesn't change the times again.
+static void SetDirectoryTimes(IN const DIR_CACHE_ENTRY *entry)
+{
+    WCHAR trustedDirectoryPath[MAX_PATH + 1];
+    HANDLE directory;
+
+    GetTrustedPath(entry->Name, trustedDirectoryPath, RTL_NUMBER_OF(trustedDirectoryPath));
+
+    // FILE_FLAG_BACKUP_SEMANTICS required to access directories
+    directory = CreateFile(trustedDirectoryPath, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (INVALID_HANDLE_VALUE == directory)
+    {
+        LogWarning("Failed to open directory '%s': 0x%x", trustedDirectoryPath, GetLastError());
+        return;
+    }
+
+    if (!SetFileTime(directory, NULL, &entry->AccessTime, &entry->ModificationTime))
+        LogWarning("Failed to set times of directory '%s': 0x%x", trustedDirectoryPath, GetLastError());
+
+    CloseHandle(directory);
+}
+
+static void CreateLinkEntry(IN const struct file_header *untrustedHeader, IN const char *untrustedNameUtf8, IN const char *untrustedLinkTargetPathUtf8)
+{
+    WCHAR trustedFilePath[MAX_PATH + 1];
+    WCHAR *untrustedLinkTargetPath = NULL;
+    WCHAR untrustedLinkTargetAbsolutePath[MAX_PATH + 1];
+    BOOL success;
+    HRESULT hresult;
+    ULONG errorCode;
+    BOOL targetIsFile = FALSE; /* default to directory links */
+
+    GetTrustedPath(untrustedNameUtf8, trustedFilePath, RTL_NUMBER_OF(trustedFilePath));
+    LogDebug("link '%s'", trustedFilePath);
+
+    errorCode = ConvertUTF8ToUTF16(untrustedLinkTargetPathUtf8, &untrustedLinkTargetPath, NULL);
+    if (ERROR_SUCCESS != errorCode)
+        SendStatusAndExit(EINVAL, untrustedNameUtf8);
+
+    LogDebug("target '%s'", untrustedLinkTargetPath);
+    /* TODO? sanitize link target path in any way? we don't allow to override
+     * existing files, so this shouldn't be a problem to leave it alone */
+
+    /* try to determine if link target is a file or directory */
+    if (PathIsRelative(untrustedLinkTargetPath))
+    {
+        WCHAR tempPath[MAX_PATH + 1];
+
+        hresult = StringCchPrintfW(
+            tempPath,
+            RTL_NUMBER_OF(tempPath),
+            L"%c:\\%s",
+            g_mappedDriveLetter,
+            untrustedLinkTargetPath);
+
+        *(PathFindFileName(tempPath)) = L'\0';
+        if (!PathCombine(untrustedLinkTargetAbsolutePath, tempPath, untrustedLinkTargetPath))
+        {
+            free(untrustedLinkTargetPath);
+            SendStatusAndExit(EINVAL, untrustedNameUtf8);
+        }
+
+        if (PathFileExists(untrustedLinkTargetAbsolutePath) && !PathIsDirectory(untrustedLinkTargetAbsolutePath))
+        {
+            targetIsFile = TRUE;
+        }
+    }
+    else
+    {
+        free(untrustedLinkTargetPath);
+        /* deny absolute links */
+        SendStatusAndExit(EPERM, untrustedNameUtf8);
+    }
+
+    success = CreateSymbolicLink(trustedFilePath, untrustedLinkTargetPath,
+        targetIsFile ? 0 : SYMBOLIC_LINK_FLAG_DIRECTORY);
+
+    free(untrustedLinkTargetPath);
+
+    if (!success)
+    {
+        if (GetLastError() == ERROR_FILE_EXISTS)
+            SendStatusAndExit(EEXIST, untrustedNameUtf8);
+        else if (GetLastError() == ERROR_ACCESS_DENIED)
+            SendStatusAndExit(EACCES, untrustedNameUtf8);
+        else if (GetLastError() == ERROR_PRIVILEGE_NOT_HELD)
+            SendStatusAndExit(EACCES, untrustedNameUtf8);
+        else
+            SendStatusAndExit(EIO, untrustedNameUtf8);
+    }
+}
+
+// The copy is hashed while it's written, so the source is read only once.
+static BOOL CopyDuplicate(IN const struct file_header *untrustedHeader, IN const char *untrustedNameUtf8, IN const char *sourceNameUtf8, IN const BYTE *expectedHash)
+{
+    WCHAR sourcePath[MAX_PATH + 1];
+    WCHAR trustedFilePath[MAX_PATH + 1];
+    HANDLE source;
+    HANDLE outputFile;
+    LARGE_INTEGER sourceSize;
+    BCRYPT_HASH_HANDLE hash = NULL;
+    BYTE digest[FC_HASH_SIZE];
+    UINT64 cbRemaining = untrustedHeader->filelen;
+    DWORD cbRead;
+    BOOL matched = FALSE;
+
+    if (!g_duplicateBuffer)
+    {
+        g_duplicateBuffer = VirtualAlloc(NULL, FC_COPY_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (!g_duplicateBuffer)
+            SendStatusAndExit(ENOMEM, untrustedNameUtf8);
+    }
+
+    GetTrustedPath(sourceNameUtf8, sourcePath, RTL_NUMBER_OF(sourcePath));
+    LogDebug("copy of '%s'", sourcePath);
+    source = CreateFile(sourcePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (INVALID_HANDLE_VALUE == source)
+    {
+        // maybe removed locally in the meantime, just let the sender send it
+        LogWarning("Failed to open '%s': 0x%x", sourcePath, GetLastError());
+        return FALSE;
+    }
+
+    if (!GetFileSizeEx(source, &sourceSize) || (UINT64)sourceSize.QuadPart != untrustedHeader->filelen)
+    {
+        CloseHandle(source);
+        return FALSE;
+    }
+
+    outputFile = CreateOutputFile(untrustedHeader, untrustedNameUtf8);
+    g_partialFile = outputFile;
+    JournalEntryStarted(untrustedNameUtf8, 0);
+
+    hash = FcHashStart();
+    if (!hash)
+        goto cleanup;
+
+    while (cbRemaining > 0)
+    {
+        if (!ReadFile(source, g_duplicateBuffer, FC_COPY_BUFFER_SIZE, &cbRead, NULL) || cbRead == 0)
+            goto cleanup;
+
+        if (cbRead > cbRemaining)
+            goto cleanup; // grown since the check above
+
+        if (!FcHashUpdate(hash, g_duplicateBuffer, cbRead))
+            goto cleanup;
+
+        if (!QioWriteBuffer(outputFile, g_duplicateBuffer, cbRead))
+        {
+            if (GetLastError() == ERROR_DISK_FULL)
+                SendStatusAndExit(ENOSPC, untrustedNameUtf8);
+            else
+                SendStatusAndExit(EIO, untrustedNameUtf8);
+        }
+
+        cbRemaining -= cbRead;
+    }
+
+    matched = FcHashFinish(hash, digest) && 0 == memcmp(digest, expectedHash, FC_HASH_SIZE);
+    hash = NULL;
+
+cleanup:
+    if (hash)
+        FcHashFinish(hash, digest);
+    CloseHandle(source);
+    CloseHandle(outputFile);
+    g_partialFile = INVALID_HANDLE_VALUE;
+
+    if (matched)
+    {
+        JournalEntryDone();
+    }
+    else
+    {
+        LogDebug("copy of '%s' doesn't match", sourcePath);
+        GetTrustedPath(untrustedNameUtf8, trustedFilePath, RTL_NUMBER_OF(trustedFilePath));
+        if (!DeleteFile(trustedFilePath))
+            SendStatusAndExit(EIO, untrustedNameUtf8);
+        JournalEntryDiscarded();
+    }
+
+    return matched;
+}
+
+static void WriteOutput(IN HANDLE outputFile, IN const BYTE *buffer, IN DWORD size, IN const char *untrustedNameUtf8)
+{
+    if (!QioWriteBuffer(outputFile, buffer, size))
+    {
+        if (GetLastError() == ERROR_DISK_FULL)
+            SendStatusAndExit(ENOSPC, untrustedNameUtf8);
+        else
+            SendStatusAndExit(EIO, untrustedNameUtf8);
+    }
+}
+
+// The reader already added the block's checksum to the transfer crc32, so a block
+// that decompresses to anything else must fail the transfer here.
+static void WriteCompressedBlock(IN HANDLE outputFile, IN const WRITER_OP *op, IN const char *untrustedNameUtf8)
+{
+    SIZE_T cbDecompressed;
+
+    // raw XPRESS needs the exact decompressed size, the reader checked it's at most FC_COMPRESS_BLOCK_SIZE
+    if (!Decompress(g_decompressor, op->Buffer, op->Size, g_decompressBuffer, op->OriginalSize, &cbDecompressed) ||
+        cbDecompressed != op->OriginalSize)
+    {
+        LogWarning("Decompress failed: 0x%x", GetLastError());
+        SendStatusAndExit(EINVAL, untrustedNameUtf8);
+    }
+
+    ReleaseSemaphore(g_writerBuffersFree, 1, NULL);
+
+    if (Crc32_ComputeBuf(0, g_decompressBuffer, cbDecompressed) != op->Crc32)
+        SendStatusAndExit(EINVAL, untrustedNameUtf8);
+
+    WriteOutput(outputFile, g_decompressBuffer, op->OriginalSize, untrustedNameUtf8);
+    JournalAdvance(op->OriginalSize);
+}
+
+// The file was preallocated to its full size, the data past the write position never arrived.
+static void TruncatePartial(void)
+{
+    LARGE_INTEGER zero = { 0 };
+    FILE_END_OF_FILE_INFO endOfFileInfo;
+
+    if (INVALID_HANDLE_VALUE == g_partialFile)
+        return;
+
+    // skipped holes move the position too, so this is the end of the received data
+    if (!SetFilePointerEx(g_partialFile, zero, &endOfFileInfo.EndOfFile, FILE_CURRENT))
+    {
+        perror("SetFilePointerEx");
+        return;
+    }
+
+    LogDebug("truncating partial file to %I64d bytes", endOfFileInfo.EndOfFile.QuadPart);
+    if (!SetFileInformationByHandle(g_partialFile, FileEndOfFileInfo, &endOfFileInfo, sizeof(endOfFileInfo)))
+        perror("SetFileInformationByHandle(FileEndOfFileInfo)");
+
+    g_partialFile = INVALID_HANDLE_VALUE;
+}
+
+static DWORD WINAPI WriterThread(IN void *param)
+{
+    WRITER_OP *op;
+    HANDLE outputFile = INVALID_HANDLE_VALUE;
+    char *outputName = NULL; // for error reporting
+    UINT32 outputMode = 0;
+    BOOL finished = FALSE;
+    LARGE_INTEGER distance;
+    HANDLE waitHandles[2];
+
+    LogVerbose("start");
+    waitHandles[0] = g_writerAbortEvent; // first, queued operations don't matter anymore
+    waitHandles[1] = g_writerQueueUsed;
+    while (!finished)
+    {
+        if (WaitForMultipleObjects(RTL_NUMBER_OF(waitHandles), waitHandles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1)
+        {
+            TruncatePartial();
+            break;
+        }
+
+        op = &g_writerQueue[g_writerQueueHead];
+
+        switch (op->Type)
+        {
+        case WRITER_OP_CREATE_FILE:
+            outputFile = CreateOutputFile(&op->Header, op->Name);
+            g_partialFile = outputFile;
+            outputMode = op->Header.mode;
+            outputName = op->Name;
+            op->Name = NULL;
+            JournalEntryStarted(outputName, (op->Header.mode & FC_MODE_RESUMED) ? JournalPartialOffset() : 0);
+            break;
+
+        case WRITER_OP_DATA:
+            WriteOutput(outputFile, op->Buffer, op->Size, outputName);
+            ReleaseSemaphore(g_writerBuffersFree, 1, NULL);
+            JournalAdvance(op->Size);
+            break;
+
+        case WRITER_OP_COMPRESSED:
+            WriteCompressedBlock(outputFile, op, outputName);
+            break;
+
+        case WRITER_OP_HOLE:
+            distance.QuadPart = op->HoleSize;
+            if (!SetFilePointerEx(outputFile, distance, NULL, FILE_CURRENT))
+                SendStatusAndExit(EIO, outputName);
+            JournalAdvance(op->HoleSize);
+            break;
+
+        case WRITER_OP_CLOSE_FILE:
+            // duplicates are copied from sources right away, these can't wait
+            if (outputMode & FC_MODE_DEDUP_SOURCE)
+                CloseHandle(outputFile);
+            else
+                CloseOutputFile(outputFile);
+            outputFile = INVALID_HANDLE_VALUE;
+            g_partialFile = INVALID_HANDLE_VALUE;
+            free(outputName);
+            outputName = NULL;
+            JournalEntryDone();
+            break;
+
+        case WRITER_OP_DIRECTORY:
+            CreateDirectoryEntry(&op->Header, op->Name);
+            JournalEntryDone();
+            break;
+
+        case WRITER_OP_LINK:
+            CreateLinkEntry(&op->Header, op->Name, op->LinkTarget);
+            JournalEntryDone();
+            break;
+
+        case WRITER_OP_DUPLICATE:
+            g_duplicateMatched = CopyDuplicate(&op->Header, op->Name, op->SourceName, op->Hash);
+            SetEvent(g_duplicateDoneEvent);
+            break;
+
+        case WRITER_OP_FINISH:
+            // the stream may have ended in the middle of a file (LEGAL_EOF)
+            TruncatePartial();
+            DirCacheForEach(SetDirectoryTimes);
+            finished = TRUE;
+            break;
+        }
+
+        free(op->Name);
+        free(op->LinkTarget);
+        free(op->SourceName);
+        g_writerQueueHead = (g_writerQueueHead + 1) % WRITER_QUEUE_SIZE;
+        ReleaseSemaphore(g_writerQueueFree, 1, NULL);
+    }
+
+    LogVerbose("end");
+    return 0;
+}
+
+BOOL WriterStart(void)
+{
+    int i;
+
+    for (i = 0; i < WRITER_RING_BUFFERS; i++)
+    {
+        // page-aligned
+        g_writerBuffers[i] = VirtualAlloc(NULL, FC_COPY_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (!g_writerBuffers[i])
+        {
+            perror("VirtualAlloc");
+            return FALSE;
+        }
+    }
+
+    // not fatal, compression just isn't offered to the sender
+    g_decompressBuffer = VirtualAlloc(NULL, FC_COMPRESS_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!g_decompressBuffer || !CreateDecompressor(COMPRESS_ALGORITHM_XPRESS | COMPRESS_RAW, NULL, &g_decompressor))
+    {
+        LogWarning("Decompression not available: 0x%x", GetLastError());
+        g_decompressor = NULL;
+    }
+
+    g_writerBuffersFree = CreateSemaphore(NULL, WRITER_RING_BUFFERS, WRITER_RING_BUFFERS, NULL);
+    g_writerQueueFree = CreateSemaphore(NULL, WRITER_QUEUE_SIZE, WRITER_QUEUE_SIZE, NULL);
+    g_writerQueueUsed = CreateSemaphore(NULL, 0, WRITER_QUEUE_SIZE, NULL);
+    g_closesDoneEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    g_duplicateDoneEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    g_writerAbortEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    g_writerStoppedEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!g_writerBuffersFree || !g_writerQueueFree || !g_writerQueueUsed || !g_closesDoneEvent || !g_duplicateDoneEvent
+        || !g_writerAbortEvent || !g_writerStoppedEvent)
+    {
+        perror("CreateSemaphore");
+        return FALSE;
+    }
+
+    g_writerThread = CreateThread(NULL, 0, WriterThread, NULL, 0, &g_writerThreadId);
+    if (!g_writerThread)
+    {
+        perror("CreateThread");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void WriterStop(void)
+{
+    HANDLE waitHandles[2];
+
+    // not started or already finished, nothing is being written
+    if (!g_writerThread)
+        return;
+
+    if (GetCurrentThreadId() == g_writerThreadId)
+    {
+        TruncatePartial();
+        SetEvent(g_writerStoppedEvent);
+        return;
+    }
+
+    // the writer thread stops before the next operation, unless it's failing on its own
+    SetEvent(g_writerAbortEvent);
+    waitHandles[0] = g_writerThread;
+    waitHandles[1] = g_writerStoppedEvent;
+    WaitForMultipleObjects(RTL_NUMBER_OF(waitHandles), waitHandles, FALSE, INFINITE);
+}
+
+BOOL WriterCanDecompress(void)
+{
+    return g_decompressor != NULL;
+}
+
+void WriterFinish(void)
+{
+    WriterQueue(WRITER_OP_FINISH, NULL, NULL, NULL);
+    WaitForSingleObject(g_writerThread, INFINITE);
+    CloseHandle(g_writerThread);
+    g_writerThread = NULL;
+
+    while (InterlockedCompareExchange(&g_pendingCloses, 0, 0) != 0)
+        WaitForSingleObject(g_closesDoneEvent, INFINITE);
+}
+
+BYTE *WriterGetBuffer(void)
+{
+    BYTE *buffer;
+
+    WaitForSingleObject(g_writerBuffersFree, INFINITE);
+    // buffers are consumed in order, so the next one is always the oldest released
+    buffer = g_writerBuffers[g_writerNextBuffer];
+    g_writerNextBuffer = (g_writerNextBuffer + 1) % WRITER_RING_BUFFERS;
+    return buffer;
+}
+
+static WRITER_OP *GetQueueSlot(void)
+{
+    WRITER_OP *op;
+
+    WaitForSingleObject(g_writerQueueFree, INFINITE);
+    op = &g_writerQueue[g_writerQueueTail];
+    ZeroMemory(op, sizeof(*op));
+    return op;
+}
+
+static void CommitQueueSlot(void)
+{
+    g_writerQueueTail = (g_writerQueueTail + 1) % WRITER_QUEUE_SIZE;
+    ReleaseSemaphore(g_writerQueueUsed, 1, NULL);
+}
+
+void WriterQueue(IN WRITER_OP_TYPE type, IN const struct file_header *header OPTIONAL, IN char *name OPTIONAL, IN char *linkTarget OPTIONAL)
+{
+    WRITER_OP *op = GetQueueSlot();
+
+    op->Type = type;
+    if (header)
+        op->Header = *header;
+    op->Name = name;
+    op->LinkTarget = linkTarget;
+    CommitQueueSlot();
+}
+
+void WriterQueueData(IN BYTE *buffer, IN DWORD size)
+{
+    WRITER_OP *op = GetQueueSlot();
+
+    op->Type = WRITER_OP_DATA;
+    op->Buffer = buffer;
+    op->Size = size;
+    CommitQueueSlot();
+}
+
+void WriterQueueCompressed(IN BYTE *buffer, IN DWORD size, IN DWORD originalSize, IN UINT32 crc32)
+{
+    WRITER_OP *op = GetQueueSlot();
+
+    op->Type = WRITER_OP_COMPRESSED;
+    op->Buffer = buffer;
+    op->Size = size;
+    op->OriginalSize = originalSize;
+    op->Crc32 = crc32;
+    CommitQueueSlot();
+}
+
+void WriterQueueHole(IN UINT64 size)
+{
+    WRITER_OP *op = GetQueueSlot();
+
+    op->Type = WRITER_OP_HOLE;
+    op->HoleSize = size;
+    CommitQueueSlot();
+}
+
+BOOL WriterCopyDuplicate(IN const struct file_header *header, IN char *name, IN char *sourceName, IN const BYTE *hash)
+{
+    WRITER_OP *op = GetQueueSlot();
+
+    op->Type = WRITER_OP_DUPLICATE;
+    op->Header = *header;
+    op->Name = name;
+    op->SourceName = sourceName;
+    CopyMemory(op->Hash, hash, FC_HASH_SIZE);
+    CommitQueueSlot();
+
+    WaitForSingleObject(g_duplicateDoneEvent, INFINITE);
+    return g_duplicateMatched;
+}
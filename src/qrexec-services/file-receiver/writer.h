@@ -0,0 +1,99 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#pragma once
+#include <windows.h>
+
+#include "filecopy.h"
+
+// Receiving is split into two stages: the main thread drains stdin, verifies the crc
+// and queues operations, the writer thread applies them to disk in order. Data is passed
+// in a bounded ring of large buffers, so a disk stall doesn't stop the vchan immediately.
+
+// number of data buffers (FC_COPY_BUFFER_SIZE each) between the stages
+#define WRITER_RING_BUFFERS 8
+// number of queued operations
+#define WRITER_QUEUE_SIZE 64
+// closing freshly written files can be slow (real-time AV scanning), this many closes can be pending
+#define WRITER_MAX_PENDING_CLOSES 64
+
+typedef enum _WRITER_OP_TYPE
+{
+    WRITER_OP_CREATE_FILE,
+    WRITER_OP_DATA,
+    WRITER_OP_COMPRESSED,
+    WRITER_OP_HOLE,
+    WRITER_OP_CLOSE_FILE,
+    WRITER_OP_DIRECTORY,
+    WRITER_OP_LINK,
+    WRITER_OP_DUPLICATE,
+    WRITER_OP_FINISH,
+} WRITER_OP_TYPE;
+
+typedef struct _WRITER_OP
+{
+    WRITER_OP_TYPE Type;
+    struct file_header Header;
+    char *Name; // UTF-8, owned by the op
+    char *LinkTarget; // UTF-8, owned by the op
+    BYTE *Buffer; // ring buffer, WRITER_OP_DATA and WRITER_OP_COMPRESSED only
+    DWORD Size;
+    DWORD OriginalSize; // WRITER_OP_COMPRESSED only
+    UINT32 Crc32; // of the decompressed data, WRITER_OP_COMPRESSED only
+    UINT64 HoleSize; // WRITER_OP_HOLE only
+    char *SourceName; // UTF-8, owned by the op, WRITER_OP_DUPLICATE only
+    BYTE Hash[FC_HASH_SIZE]; // expected content, WRITER_OP_DUPLICATE only
+} WRITER_OP;
+
+BOOL WriterStart(void);
+
+// FALSE if compressed blocks can't be decompressed here (FC_CAP_COMPRESS must not be offered).
+BOOL WriterCanDecompress(void);
+
+// Stops the writer stage on the way out, from either stage. The file being written (if
+// any) is truncated to the data written so far, so a failed or interrupted transfer
+// doesn't leave a preallocated tail of zeros. The handle is left open, the caller is
+// about to exit.
+void WriterStop(void);
+
+// Waits for all queued operations (including pending closes) to complete.
+void WriterFinish(void);
+
+// Returns the next free ring buffer, blocks if the writer is behind.
+BYTE *WriterGetBuffer(void);
+
+// Ownership of Name/LinkTarget passes to the writer.
+void WriterQueue(IN WRITER_OP_TYPE type, IN const struct file_header *header OPTIONAL, IN char *name OPTIONAL, IN char *linkTarget OPTIONAL);
+
+// Queues the buffer returned by WriterGetBuffer.
+void WriterQueueData(IN BYTE *buffer, IN DWORD size);
+
+// Queues the buffer returned by WriterGetBuffer with a compressed block, the writer
+// decompresses it and fails the transfer if the result doesn't match.
+void WriterQueueCompressed(IN BYTE *buffer, IN DWORD size, IN DWORD originalSize, IN UINT32 crc32);
+
+// Skips over a hole in the current (sparse) file.
+void WriterQueueHole(IN UINT64 size);
+
+// Copies an already received file (FC_MODE_DEDUP_SOURCE) and waits for the copy.
+// Returns FALSE if the copy doesn't have the expected hash, it's removed then.
+// Ownership of name and sourceName passes to the writer.
+BOOL WriterCopyDuplicate(IN const struct file_header *header, IN char *name, IN char *sourceName, IN const BYTE *hash);
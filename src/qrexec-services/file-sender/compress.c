@@ -0,0 +1,199 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <math.h>
+#include <Shlwapi.h>
+#include <compressapi.h>
+
+#include <log.h>
+
+#include "compress.h"
+
+COMPRESSOR_HANDLE g_compressor = NULL;
+BYTE *g_compressInput = NULL; // FC_COMPRESS_BLOCK_SIZE
+BYTE *g_compressOutput = NULL;
+DWORD g_storedRun = 0; // blocks in a row that didn't compress
+
+// already compressed formats, not worth looking into
+static const WCHAR *g_compressedExtensions[] =
+{
+    L".7z", L".avi", L".bz2", L".cab", L".docx", L".flac", L".gif", L".gz", L".heic", L".jpeg",
+    L".jpg", L".mkv", L".mov", L".mp3", L".mp4", L".msi", L".ogg", L".png", L".pptx", L".rar",
+    L".tgz", L".webm", L".webp", L".xlsx", L".xz", L".zip", L".zst",
+};
+
+// these compress well, no need to look
+static const WCHAR *g_textExtensions[] =
+{
+    L".bmp", L".c", L".cpp", L".csv", L".doc", L".h", L".htm", L".html", L".ini", L".js",
+    L".json", L".log", L".md", L".py", L".rtf", L".sql", L".svg", L".tar", L".txt", L".vhd",
+    L".vhdx", L".xls", L".xml",
+};
+
+static BOOL HasExtension(IN const WCHAR *fileName, IN const WCHAR **extensions, IN size_t count)
+{
+    const WCHAR *extension = PathFindExtension(fileName);
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (0 == _wcsicmp(extension, extensions[i]))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+// Order-0 entropy in bits per byte: a cheap upper bound on what an LZ codec can't find.
+static double GetEntropy(IN const BYTE *data, IN DWORD size)
+{
+    DWORD counts[256] = { 0 };
+    double entropy = 0.0;
+    double p;
+    DWORD i;
+
+    for (i = 0; i < size; i++)
+        counts[data[i]]++;
+
+    for (i = 0; i < 256; i++)
+    {
+        if (counts[i] == 0)
+            continue;
+
+        p = (double)counts[i] / size;
+        entropy -= p * log2(p);
+    }
+
+    return entropy;
+}
+
+static BOOL ReadBlock(IN HANDLE file, IN DWORD size)
+{
+    DWORD offset = 0;
+    DWORD cbRead;
+
+    while (offset < size)
+    {
+        if (!ReadFile(file, g_compressInput + offset, size - offset, &cbRead, NULL))
+            return FALSE;
+
+        // truncated since its size was taken
+        if (cbRead == 0)
+        {
+            SetLastError(ERROR_HANDLE_EOF);
+            return FALSE;
+        }
+
+        offset += cbRead;
+    }
+
+    return TRUE;
+}
+
+static DWORD GetBlockSize(IN UINT64 remaining)
+{
+    if (remaining > FC_COMPRESS_BLOCK_SIZE)
+        return FC_COMPRESS_BLOCK_SIZE;
+
+    return (DWORD)remaining; // safe cast: less than FC_COMPRESS_BLOCK_SIZE
+}
+
+BOOL CompressInit(void)
+{
+    g_compressInput = VirtualAlloc(NULL, FC_COMPRESS_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    g_compressOutput = VirtualAlloc(NULL, FC_COMPRESS_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!g_compressInput || !g_compressOutput)
+        return FALSE;
+
+    // plain XPRESS: fast enough on both ends to not slow down the vchan
+    if (!CreateCompressor(COMPRESS_ALGORITHM_XPRESS | COMPRESS_RAW, NULL, &g_compressor))
+    {
+        LogWarning("CreateCompressor failed: 0x%x", GetLastError());
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOL CompressWorthTrying(IN HANDLE file, IN const WCHAR *fileName, IN UINT64 size)
+{
+    LARGE_INTEGER zero, position;
+    DWORD cbBlock;
+    double entropy;
+    BOOL readable;
+
+    g_storedRun = 0;
+
+    if (size < COMPRESS_MIN_SIZE || HasExtension(fileName, g_compressedExtensions, ARRAYSIZE(g_compressedExtensions)))
+        return FALSE;
+
+    if (HasExtension(fileName, g_textExtensions, ARRAYSIZE(g_textExtensions)))
+        return TRUE;
+
+    // unknown type, sample the first block
+    zero.QuadPart = 0;
+    if (!SetFilePointerEx(file, zero, &position, FILE_CURRENT))
+        return FALSE;
+
+    cbBlock = GetBlockSize(size);
+    readable = ReadBlock(file, cbBlock);
+    // sending reports read errors
+    if (!SetFilePointerEx(file, position, NULL, FILE_BEGIN) || !readable)
+        return FALSE;
+
+    entropy = GetEntropy(g_compressInput, cbBlock);
+    LogVerbose("%s: %.2f bits/byte", fileName, entropy);
+    return entropy < COMPRESS_MAX_ENTROPY;
+}
+
+BOOL CompressNextBlock(IN HANDLE file, IN UINT64 remaining, OUT COMPRESS_BLOCK *block)
+{
+    SIZE_T cbCompressed;
+
+    block->Data = g_compressInput;
+    block->Size = GetBlockSize(remaining);
+    block->Compressed = NULL;
+    block->CompressedSize = 0;
+
+    if (!ReadBlock(file, block->Size))
+        return FALSE;
+
+    if (g_storedRun >= COMPRESS_MAX_STORED_RUN)
+        return TRUE;
+
+    // output that doesn't fit isn't worth sending compressed
+    if (Compress(g_compressor, g_compressInput, block->Size, g_compressOutput,
+        block->Size - block->Size / COMPRESS_MIN_SAVING, &cbCompressed) && cbCompressed > 0)
+    {
+        block->Compressed = g_compressOutput;
+        block->CompressedSize = (DWORD)cbCompressed; // safe cast: less than block->Size
+        g_storedRun = 0;
+    }
+    else
+    {
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+            LogWarning("Compress failed: 0x%x", GetLastError());
+        g_storedRun++;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,56 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#pragma once
+#include "filecopy.h"
+
+// Adaptive compression of file data for FC_CAP_COMPRESS. Whether a file is compressed
+// at all is decided from its extension and the byte entropy of its first block, then
+// each block is only sent compressed if that saves enough.
+
+// smaller files are sent as they are
+#define COMPRESS_MIN_SIZE (4*1024)
+// bits per byte of the first block above which the file is considered incompressible
+#define COMPRESS_MAX_ENTROPY 7.5
+// a block is sent compressed only if that saves at least 1/COMPRESS_MIN_SAVING of it
+#define COMPRESS_MIN_SAVING 8
+// after this many blocks in a row that didn't compress the rest of the file is stored
+#define COMPRESS_MAX_STORED_RUN 8
+
+typedef struct _COMPRESS_BLOCK
+{
+    BYTE *Data; // file content
+    DWORD Size;
+    BYTE *Compressed; // NULL if the block should be stored
+    DWORD CompressedSize;
+} COMPRESS_BLOCK;
+
+// Allocates the buffers and the compressor, FALSE if compression isn't available.
+BOOL CompressInit(void);
+
+// Decides whether the file (from its current position) should be sent compressed.
+// The position is left unchanged.
+BOOL CompressWorthTrying(IN HANDLE file, IN const WCHAR *fileName, IN UINT64 size);
+
+// Reads the next block (at most FC_COMPRESS_BLOCK_SIZE bytes of the remaining ones)
+// and compresses it if that's worth it. The buffers are valid until the next call.
+// Returns FALSE with the last error set if the file can't be read.
+BOOL CompressNextBlock(IN HANDLE file, IN UINT64 remaining, OUT COMPRESS_BLOCK *block);
@@ -0,0 +1,224 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <log.h>
+
+#include "dedup.h"
+#include "filecopy-error.h"
+
+DEDUP_FILE *g_dedupFiles = NULL;
+SIZE_T g_dedupFilesCount = 0;
+SIZE_T g_dedupFilesCapacity = 0;
+SIZE_T g_dedupNextFile = 0;
+
+DEDUP_GROUP *g_dedupGroups = NULL;
+LONG g_dedupGroupsCount = 0;
+
+void DedupAddFile(IN const WCHAR *path, IN UINT64 size)
+{
+    DEDUP_FILE *file;
+
+    if (g_dedupFilesCount == g_dedupFilesCapacity)
+    {
+        SIZE_T newCapacity = g_dedupFilesCapacity ? 2 * g_dedupFilesCapacity : 1024;
+        DEDUP_FILE *newFiles = realloc(g_dedupFiles, newCapacity * sizeof(DEDUP_FILE));
+
+        if (!newFiles)
+            FcReportError(ERROR_OUTOFMEMORY, TRUE, L"DedupAddFile(%s) failed", path);
+
+        g_dedupFiles = newFiles;
+        g_dedupFilesCapacity = newCapacity;
+    }
+
+    file = &g_dedupFiles[g_dedupFilesCount++];
+    file->Size = size;
+    file->Group = DEDUP_NO_GROUP;
+    file->Path = NULL;
+    // only files that can have a useful duplicate are hashed
+    if (size >= DEDUP_MIN_SIZE)
+    {
+        file->Path = _wcsdup(path);
+        if (!file->Path)
+            FcReportError(ERROR_OUTOFMEMORY, TRUE, L"DedupAddFile(%s) failed", path);
+    }
+}
+
+static BOOL HashFile(IN const WCHAR *path, OUT BYTE *digest)
+{
+    HANDLE file;
+    BCRYPT_HASH_HANDLE hash;
+    BYTE *buffer;
+    BYTE discarded[FC_HASH_SIZE];
+    DWORD cbRead;
+    BOOL success = FALSE;
+
+    file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        LogWarning("Cannot open '%s': 0x%x", path, GetLastError());
+        return FALSE;
+    }
+
+    buffer = VirtualAlloc(NULL, FC_COPY_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    hash = FcHashStart();
+    if (!buffer || !hash)
+        goto cleanup;
+
+    while (TRUE)
+    {
+        if (!ReadFile(file, buffer, FC_COPY_BUFFER_SIZE, &cbRead, NULL))
+        {
+            LogWarning("Cannot read '%s': 0x%x", path, GetLastError());
+            goto cleanup;
+        }
+
+        if (cbRead == 0)
+            break;
+
+        if (!FcHashUpdate(hash, buffer, cbRead))
+            goto cleanup;
+    }
+
+    success = FcHashFinish(hash, digest);
+    hash = NULL;
+
+cleanup:
+    if (hash)
+        FcHashFinish(hash, discarded);
+    if (buffer)
+        VirtualFree(buffer, 0, MEM_RELEASE);
+    CloseHandle(file);
+    return success;
+}
+
+static int __cdecl CompareSize(IN const void *a, IN const void *b)
+{
+    const DEDUP_FILE *fileA = &g_dedupFiles[*(const SIZE_T *)a];
+    const DEDUP_FILE *fileB = &g_dedupFiles[*(const SIZE_T *)b];
+
+    if (fileA->Size != fileB->Size)
+        return fileA->Size < fileB->Size ? -1 : 1;
+
+    // keep the send order within the same size
+    return *(const SIZE_T *)a < *(const SIZE_T *)b ? -1 : 1;
+}
+
+static int __cdecl CompareHash(IN const void *a, IN const void *b)
+{
+    const DEDUP_FILE *fileA = &g_dedupFiles[*(const SIZE_T *)a];
+    const DEDUP_FILE *fileB = &g_dedupFiles[*(const SIZE_T *)b];
+    int result = memcmp(fileA->Hash, fileB->Hash, FC_HASH_SIZE);
+
+    if (result != 0)
+        return result;
+
+    return *(const SIZE_T *)a < *(const SIZE_T *)b ? -1 : 1;
+}
+
+// Groups files with identical hashes in one run of same-sized files.
+static void GroupBySize(IN OUT SIZE_T *order, IN SIZE_T count)
+{
+    SIZE_T i, valid = 0;
+    DEDUP_FILE *file, *previous;
+
+    for (i = 0; i < count; i++)
+    {
+        file = &g_dedupFiles[order[i]];
+        // files that can't be hashed are sent in full
+        if (HashFile(file->Path, file->Hash))
+            order[valid++] = order[i];
+    }
+
+    qsort(order, valid, sizeof(SIZE_T), CompareHash);
+    for (i = 1; i < valid; i++)
+    {
+        previous = &g_dedupFiles[order[i - 1]];
+        file = &g_dedupFiles[order[i]];
+        if (0 != memcmp(previous->Hash, file->Hash, FC_HASH_SIZE))
+            continue;
+
+        if (previous->Group == DEDUP_NO_GROUP)
+            previous->Group = g_dedupGroupsCount++;
+        file->Group = previous->Group;
+    }
+}
+
+void DedupFindDuplicates(void)
+{
+    SIZE_T *order;
+    SIZE_T i, runStart, candidates = 0;
+
+    order = malloc(g_dedupFilesCount * sizeof(SIZE_T) + 1);
+    if (!order)
+        FcReportError(ERROR_OUTOFMEMORY, TRUE, L"DedupFindDuplicates failed");
+
+    for (i = 0; i < g_dedupFilesCount; i++)
+    {
+        if (g_dedupFiles[i].Path)
+            order[candidates++] = i;
+    }
+
+    // only files with the same size need to be hashed
+    qsort(order, candidates, sizeof(SIZE_T), CompareSize);
+    runStart = 0;
+    for (i = 1; i <= candidates; i++)
+    {
+        if (i == candidates || g_dedupFiles[order[i]].Size != g_dedupFiles[order[runStart]].Size)
+        {
+            if (i - runStart > 1)
+                GroupBySize(&order[runStart], i - runStart);
+            runStart = i;
+        }
+    }
+
+    free(order);
+    for (i = 0; i < g_dedupFilesCount; i++)
+    {
+        free(g_dedupFiles[i].Path);
+        g_dedupFiles[i].Path = NULL;
+    }
+
+    g_dedupGroups = calloc(g_dedupGroupsCount + 1, sizeof(DEDUP_GROUP));
+    if (!g_dedupGroups)
+        FcReportError(ERROR_OUTOFMEMORY, TRUE, L"DedupFindDuplicates failed");
+
+    LogDebug("%Iu files, %ld groups of duplicates", g_dedupFilesCount, g_dedupGroupsCount);
+}
+
+DEDUP_FILE *DedupNextFile(void)
+{
+    if (g_dedupNextFile >= g_dedupFilesCount)
+        return NULL;
+
+    return &g_dedupFiles[g_dedupNextFile++];
+}
+
+DEDUP_GROUP *DedupGetGroup(IN const DEDUP_FILE *file)
+{
+    if (!file || file->Group == DEDUP_NO_GROUP)
+        return NULL;
+
+    return &g_dedupGroups[file->Group];
+}
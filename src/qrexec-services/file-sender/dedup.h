@@ -0,0 +1,55 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#pragma once
+#include "filecopy.h"
+
+// Finding files with identical content for FC_CAP_DEDUP. Regular files are registered
+// in the size pass and looked up in the same order when sending.
+
+// below this size a duplicate isn't worth the round trip to the receiver
+#define DEDUP_MIN_SIZE (64*1024)
+
+#define DEDUP_NO_GROUP (-1)
+
+typedef struct _DEDUP_FILE
+{
+    WCHAR *Path; // only until hashed
+    UINT64 Size;
+    LONG Group; // files with the same content, DEDUP_NO_GROUP if unique
+    BYTE Hash[FC_HASH_SIZE];
+} DEDUP_FILE;
+
+typedef struct _DEDUP_GROUP
+{
+    BOOL Sent; // a member was sent in full in this session
+    UINT64 SourceEntry;
+} DEDUP_GROUP;
+
+void DedupAddFile(IN const WCHAR *path, IN UINT64 size);
+
+// Hashes files with the same size and groups identical ones.
+void DedupFindDuplicates(void);
+
+// Returns the next regular file in the send order, NULL if there are no more.
+DEDUP_FILE *DedupNextFile(void);
+
+DEDUP_GROUP *DedupGetGroup(IN const DEDUP_FILE *file);
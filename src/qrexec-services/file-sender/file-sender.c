@@ -31,103 +31,119 @@
 #include <log.h>
 #include <utf8-conv.h>
 #include <qubes-io.h>
-#include <crc32.h>
+#include <config.h>
 
 #include "filecopy.h"
+#include "filecopy-engine.h"
 #include "linux.h"
 #include "filecopy-error.h"
 #include "gui-progress.h"
+#include "dedup.h"
+#include "multistream.h"
+#include "compress.h"
+#include "dir-enum.h"
 
 HANDLE g_stdin = INVALID_HANDLE_VALUE;
 HANDLE g_stdout = INVALID_HANDLE_VALUE;
 HANDLE g_stderr = INVALID_HANDLE_VALUE;
 
-INT64 g_totalSize = 0;
+volatile LONG64 g_totalSize = 0;
 BOOL g_cancelOperation = FALSE;
-UINT32 g_crc32 = 0;
+FCE_PACK g_pack; // stream state: crc32 and confirmed protocol extensions
 
-static BOOL WriteWithCrc(IN HANDLE output, IN const void *buffer, IN DWORD size)
+// splitting the transfer over several connections, see multistream.h
+BOOL g_multistream = FALSE;
+BOOL g_listingShards = FALSE; // only writing the lists for the helper streams
+BOOL g_directoriesOnly = FALSE; // final directory metadata after the helper streams
+
+// resuming (FC_CAP_RESUME)
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+UINT64 g_manifest = FNV_OFFSET_BASIS; // identifies the set of files being sent
+struct resume_reply g_resumePoint = { 0 };
+UINT64 g_entryIndex = 0;
+
+static int PackWrite(IN void *opaque, IN const void *buffer, IN size_t size)
 {
-    LogVerbose("size %lu", size);
-    g_crc32 = Crc32_ComputeBuf(g_crc32, buffer, size);
-    return QioWriteBuffer(output, buffer, size);
+    LogVerbose("size %lu", (DWORD)size);
+    return QioWriteBuffer(g_stdout, buffer, (DWORD)size) ? 0 : EIO;
 }
 
-static void NotifyProgress(IN DWORD size, IN FC_PROGRESS_TYPE progressType)
+static int PackRead(IN void *opaque, OUT void *buffer, IN size_t size)
 {
-    static UINT64 cbWrittenTotal = 0;
-    static UINT64 cbPreviousTotal = 0;
+    return QioReadBuffer(g_stdin, buffer, (DWORD)size) ? 0 : EIO;
+}
 
-    cbWrittenTotal += size;
-    if (cbWrittenTotal > cbPreviousTotal + PROGRESS_NOTIFY_DELTA || (progressType != PROGRESS_TYPE_NORMAL))
-    {
-        UpdateProgress(cbWrittenTotal, progressType);
-        cbPreviousTotal = cbWrittenTotal;
-    }
+static int PackWaitForInput(IN void *opaque, IN UINT32 timeout)
+{
+    return FcWaitForInput(g_stdin, timeout);
+}
+
+static const FCE_PACK_BACKEND g_packBackend =
+{
+    PackWrite,
+    PackRead,
+    PackWaitForInput,
+};
+
+static void NotifyProgress(IN DWORD size, IN FC_PROGRESS_TYPE progressType)
+{
+    if (progressType == PROGRESS_TYPE_NORMAL)
+        ProgressAdd(size);
+    else
+        UpdateProgress(0, progressType);
 }
 
 static void WaitForResult(void)
 {
-    struct result_header hdr;
-    struct result_header_ext hdr_ext;
-    char lastFilename[MAX_PATH + 1];
+    FCE_RESULT result;
     char lastFilenamePrefix[] = "; Last file: ";
 
     LogVerbose("start");
-    if (!QioReadBuffer(g_stdin, &hdr, sizeof(hdr)))
+    // also skips a late caps_reply or takes the result that came instead of a reply
+    if (FcePackReadResult(&g_pack, &result) != 0)
     {
         LogError("QioReadBuffer failed");
         exit(1);	// hopefully remote has produced error message
     }
 
-    if (!QioReadBuffer(g_stdin, &hdr_ext, sizeof(hdr_ext)))
-    {
-        // remote used old result_header struct
-        hdr_ext.last_namelen = 0;
-    }
-
-    if (hdr_ext.last_namelen > MAX_PATH)
-    {
-        // read only at most MAX_PATH chars
-        hdr_ext.last_namelen = MAX_PATH;
-    }
-
-    if (!QioReadBuffer(g_stdin, lastFilename, hdr_ext.last_namelen))
-    {
-        fprintf(stderr, "Failed to get last filename\n");
-        LogError("Failed to get last filename");
-        hdr_ext.last_namelen = 0;
-    }
-
-    lastFilename[hdr_ext.last_namelen] = '\0';
-
-    if (!hdr_ext.last_namelen)
+    if (!result.LastName[0])
     {
         /* set prefix to empty string */
         lastFilenamePrefix[0] = '\0';
     }
 
-    if (hdr.error_code != 0)
+    if (result.ErrorCode != 0)
     {
-        switch (hdr.error_code)
+        switch (result.ErrorCode)
         {
         case EEXIST:
-            FcReportError(ERROR_ALREADY_EXISTS, TRUE, L"File copy: not overwriting existing file. Clean incoming dir, and retry copy%hs%hs", lastFilenamePrefix, lastFilename);
+            FcReportError(ERROR_ALREADY_EXISTS, TRUE, L"File copy: not overwriting existing file. Clean incoming dir, and retry copy%hs%hs", lastFilenamePrefix, result.LastName);
             break;
         case EINVAL:
-            FcReportError(ERROR_INVALID_DATA, TRUE, L"File copy: Corrupted data from packer%hs%hs", lastFilenamePrefix, lastFilename);
+            FcReportError(ERROR_INVALID_DATA, TRUE, L"File copy: Corrupted data from packer%hs%hs", lastFilenamePrefix, result.LastName);
             break;
         default:
-            FcReportError(ERROR_UNIDENTIFIED_ERROR, TRUE, L"File copy: %hs%hs%hs", strerror(hdr.error_code), lastFilenamePrefix, lastFilename);
+            FcReportError(ERROR_UNIDENTIFIED_ERROR, TRUE, L"File copy: %hs%hs%hs", strerror(result.ErrorCode), lastFilenamePrefix, result.LastName);
         }
     }
 
-    if (hdr.crc32 != g_crc32)
+    if (!result.CrcMatches)
     {
         FcReportError(ERROR_INVALID_DATA, TRUE, L"File transfer failed: checksum mismatch");
     }
 }
 
+// A failed write usually means the receiver gave up, it says why in the result.
+static void CheckWrite(IN int status)
+{
+    if (status != 0)
+    {
+        WaitForResult();
+        exit(1);
+    }
+}
+
 static void WindowTimeToUnix(IN FILETIME *windowsTime, OUT unsigned int *unixTime, OUT unsigned int *unixTimeNsec)
 {
     ULARGE_INTEGER tmp;
@@ -139,23 +155,182 @@ static void WindowTimeToUnix(IN FILETIME *windowsTime, OUT unsigned int *unixTim
     *unixTime = (unsigned int) ((tmp.QuadPart / 10000000LL) - UNIX_EPOCH_OFFSET);
 }
 
-static void WriteHeaders(IN struct file_header *hdr, IN const WCHAR *fileName)
+// Caller frees the result.
+static char *GetFileNameUtf8(IN const WCHAR *fileName)
 {
     char *fileNameUtf8 = NULL;
     size_t cbFileNameUtf8;
 
-    LogVerbose("start");
     if (ERROR_SUCCESS != ConvertUTF16ToUTF8(fileName, &fileNameUtf8, &cbFileNameUtf8))
         FcReportError(GetLastError(), TRUE, L"Cannot convert path '%s' to UTF-8", fileName);
 
-    hdr->namelen = (UINT32)cbFileNameUtf8;
+    return fileNameUtf8;
+}
+
+static void WriteHeaders(IN struct file_header *hdr, IN const WCHAR *fileName)
+{
+    char *fileNameUtf8;
+
+    LogVerbose("start");
+    fileNameUtf8 = GetFileNameUtf8(fileName);
+    CheckWrite(FcePackEntry(&g_pack, hdr, fileNameUtf8));
+    free(fileNameUtf8);
+}
+
+static void NotifyProgress64(IN UINT64 size)
+{
+    ProgressAdd(size);
+}
+
+static void SendData(IN HANDLE input, IN const WCHAR *fileName, IN UINT64 size)
+{
+    FC_COPY_STATUS copyResult;
+
+    copyResult = FcCopyFile(g_stdout, input, size, &g_pack.Crc32, NotifyProgress);
 
-    if (!WriteWithCrc(g_stdout, hdr, sizeof(*hdr)) || !WriteWithCrc(g_stdout, fileNameUtf8, hdr->namelen))
+    // if COPY_FILE_WRITE_ERROR, hopefully remote will produce a message
+    if (copyResult != COPY_FILE_OK)
     {
-        WaitForResult();
-        exit(1);
+        if (copyResult != COPY_FILE_WRITE_ERROR)
+        {
+            FcReportError(GetLastError(), TRUE, L"Error copying file '%s': %hs", fileName, FcStatusToString(copyResult));
+        }
+        else
+        {
+            WaitForResult();
+            exit(1);
+        }
     }
+}
+
+// Sends allocated ranges as data records and everything in between as holes.
+static void SendSparseData(IN HANDLE input, IN const WCHAR *fileName, IN UINT64 size)
+{
+    FILE_ALLOCATED_RANGE_BUFFER query;
+    FILE_ALLOCATED_RANGE_BUFFER ranges[64];
+    DWORD cbReturned;
+    DWORD i;
+    BOOL moreData;
+    UINT64 offset = 0; // end of the last record sent
+    UINT64 rangeStart, rangeEnd;
+    LARGE_INTEGER position;
+
+    query.FileOffset.QuadPart = 0;
+    query.Length.QuadPart = size;
+
+    do
+    {
+        moreData = FALSE;
+        if (!DeviceIoControl(input, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), ranges, sizeof(ranges), &cbReturned, NULL))
+        {
+            if (GetLastError() != ERROR_MORE_DATA)
+                FcReportError(GetLastError(), TRUE, L"Cannot get allocated ranges of file '%s'", fileName);
+            moreData = TRUE;
+        }
+
+        for (i = 0; i < cbReturned / sizeof(ranges[0]); i++)
+        {
+            rangeStart = ranges[i].FileOffset.QuadPart;
+            rangeEnd = rangeStart + ranges[i].Length.QuadPart;
+            // the file may have changed since its size was taken
+            if (rangeEnd > size)
+                rangeEnd = size;
+            if (rangeStart < offset)
+                rangeStart = offset;
+            if (rangeStart >= rangeEnd)
+                continue;
+
+            if (rangeStart > offset)
+            {
+                CheckWrite(FcePackHole(&g_pack, rangeStart - offset));
+                NotifyProgress64(rangeStart - offset);
+            }
+
+            CheckWrite(FcePackDataRecord(&g_pack, rangeEnd - rangeStart));
+            position.QuadPart = rangeStart;
+            if (!SetFilePointerEx(input, position, NULL, FILE_BEGIN))
+                FcReportError(GetLastError(), TRUE, L"Cannot seek in file '%s'", fileName);
+            SendData(input, fileName, rangeEnd - rangeStart);
+            offset = rangeEnd;
+        }
+
+        if (moreData)
+        {
+            if (cbReturned < sizeof(ranges[0]))
+                FcReportError(ERROR_INVALID_DATA, TRUE, L"Cannot get allocated ranges of file '%s'", fileName);
+
+            i = cbReturned / sizeof(ranges[0]) - 1;
+            query.FileOffset.QuadPart = ranges[i].FileOffset.QuadPart + ranges[i].Length.QuadPart;
+            query.Length.QuadPart = size - query.FileOffset.QuadPart;
+        }
+    } while (moreData);
+
+    if (offset < size)
+    {
+        CheckWrite(FcePackHole(&g_pack, size - offset));
+        NotifyProgress64(size - offset);
+    }
+}
+
+// Sends size bytes from the current position as stored and compressed blocks.
+static void SendCompressedData(IN HANDLE input, IN const WCHAR *fileName, IN UINT64 size)
+{
+    COMPRESS_BLOCK block;
+
+    while (size > 0)
+    {
+        if (!CompressNextBlock(input, size, &block))
+            FcReportError(GetLastError(), TRUE, L"Cannot read file '%s'", fileName);
+
+        if (block.Compressed)
+            CheckWrite(FcePackCompressedBlock(&g_pack, block.Compressed, block.CompressedSize, block.Data, block.Size));
+        else
+            CheckWrite(FcePackStoredBlock(&g_pack, block.Data, block.Size));
+
+        NotifyProgress64(block.Size);
+        size -= block.Size;
+    }
+}
+
+static INT64 GetFileSizeByPath(IN const WCHAR *filePath);
+
+// Entries the receiver already has from an interrupted transfer are not sent again.
+static BOOL SkipResumedEntry(IN const WCHAR *fileName, IN DWORD fileAttributes)
+{
+    if (g_entryIndex >= g_resumePoint.entries_done)
+        return FALSE;
+
+    if (!(fileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+    {
+        NotifyProgress64(GetFileSizeByPath(fileName));
+        // keep the lookup in step, skipped files don't become sources
+        if (g_pack.Caps & FC_CAP_DEDUP)
+            DedupNextFile();
+    }
+
+    g_entryIndex++;
+    return TRUE;
+}
+
+// Returns FALSE if the receiver's copy didn't match and the file needs to be sent in full.
+static BOOL SendDuplicate(IN struct file_header *hdr, IN const WCHAR *fileName, IN const DEDUP_GROUP *group, IN const DEDUP_FILE *file)
+{
+    char *fileNameUtf8;
+    int matched;
+
+    fileNameUtf8 = GetFileNameUtf8(fileName);
+    // if the receiver failed it sent the result instead of the reply
+    CheckWrite(FcePackDuplicate(&g_pack, hdr, fileNameUtf8, group->SourceEntry, file->Hash, &matched));
     free(fileNameUtf8);
+
+    if (!matched)
+    {
+        LogDebug("receiver's copy of '%s' doesn't match, sending it", fileName);
+        return FALSE;
+    }
+
+    NotifyProgress64(hdr->filelen);
+    return TRUE;
 }
 
 static void ProcessSingleFile(IN const WCHAR *fileName, IN DWORD fileAttributes)
@@ -165,6 +340,18 @@ static void ProcessSingleFile(IN const WCHAR *fileName, IN DWORD fileAttributes)
     FILETIME accessTime, modificationTime;
 
     LogDebug("%s", fileName);
+    if (g_directoriesOnly && !(fileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        return;
+
+    if (g_multistream && !(fileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !MsIsLocalFile(fileName, g_listingShards))
+        return; // sent by a helper stream
+
+    if (g_listingShards)
+        return;
+
+    if (SkipResumedEntry(fileName, fileAttributes))
+        return;
+
     if (fileAttributes & FILE_ATTRIBUTE_DIRECTORY)
         hdr.mode = 0755 | 0040000;
     else
@@ -187,8 +374,10 @@ static void ProcessSingleFile(IN const WCHAR *fileName, IN DWORD fileAttributes)
 
     if ((fileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
     { /* FIXME: symlink */
-        FC_COPY_STATUS copyResult;
         LARGE_INTEGER size;
+        BOOL sparse;
+        DEDUP_FILE *dedupFile = NULL;
+        DEDUP_GROUP *dedupGroup = NULL;
 
         if (!GetFileSizeEx(input, &size))
         {
@@ -197,21 +386,63 @@ static void ProcessSingleFile(IN const WCHAR *fileName, IN DWORD fileAttributes)
         }
 
         hdr.filelen = size.QuadPart;
-        WriteHeaders(&hdr, fileName);
-        copyResult = FcCopyFile(g_stdout, input, hdr.filelen, &g_crc32, NotifyProgress);
 
-        // if COPY_FILE_WRITE_ERROR, hopefully remote will produce a message
-        if (copyResult != COPY_FILE_OK)
+        if (g_pack.Caps & FC_CAP_DEDUP)
         {
-            if (copyResult != COPY_FILE_WRITE_ERROR)
-            {
-                FcReportError(GetLastError(), TRUE, L"Error copying file '%s': %hs", fileName, FcStatusToString(copyResult));
-                CloseHandle(input);
-            }
+            dedupFile = DedupNextFile();
+            dedupGroup = DedupGetGroup(dedupFile);
+            // changed since it was hashed, don't bother
+            if (dedupGroup && dedupFile->Size != hdr.filelen)
+                dedupGroup = NULL;
+        }
+
+        if ((g_resumePoint.flags & FC_RESUME_PARTIAL) && g_entryIndex == g_resumePoint.entries_done)
+        {
+            LARGE_INTEGER offset;
+
+            // the receiver has the beginning of this file already
+            if (g_resumePoint.offset > hdr.filelen)
+                FcReportError(ERROR_INVALID_DATA, TRUE, L"Cannot resume file '%s': it was truncated", fileName);
+
+            offset.QuadPart = g_resumePoint.offset;
+            if (!SetFilePointerEx(input, offset, NULL, FILE_BEGIN))
+                FcReportError(GetLastError(), TRUE, L"Cannot seek in file '%s'", fileName);
+
+            hdr.mode |= FC_MODE_RESUMED;
+            if ((g_pack.Caps & FC_CAP_COMPRESS) && CompressWorthTrying(input, fileName, hdr.filelen - g_resumePoint.offset))
+                hdr.mode |= FC_MODE_COMPRESSED;
+
+            WriteHeaders(&hdr, fileName);
+            NotifyProgress64(g_resumePoint.offset);
+            if (hdr.mode & FC_MODE_COMPRESSED)
+                SendCompressedData(input, fileName, hdr.filelen - g_resumePoint.offset);
+            else
+                SendData(input, fileName, hdr.filelen - g_resumePoint.offset);
+        }
+        else if (!dedupGroup || !dedupGroup->Sent || !SendDuplicate(&hdr, fileName, dedupGroup, dedupFile))
+        {
+            // the first file of a group is sent in full, the receiver keeps it for the others
+            if (dedupGroup && !dedupGroup->Sent)
+                hdr.mode |= FC_MODE_DEDUP_SOURCE;
+
+            sparse = (g_pack.Caps & FC_CAP_SPARSE) && (fileAttributes & FILE_ATTRIBUTE_SPARSE_FILE);
+            if (sparse)
+                hdr.mode |= FC_MODE_SPARSE;
+            else if ((g_pack.Caps & FC_CAP_COMPRESS) && CompressWorthTrying(input, fileName, hdr.filelen))
+                hdr.mode |= FC_MODE_COMPRESSED;
+
+            WriteHeaders(&hdr, fileName);
+            if (sparse)
+                SendSparseData(input, fileName, hdr.filelen);
+            else if (hdr.mode & FC_MODE_COMPRESSED)
+                SendCompressedData(input, fileName, hdr.filelen);
             else
+                SendData(input, fileName, hdr.filelen);
+
+            if (hdr.mode & FC_MODE_DEDUP_SOURCE)
             {
-                WaitForResult();
-                exit(1);
+                dedupGroup->Sent = TRUE;
+                dedupGroup->SourceEntry = g_entryIndex;
             }
         }
     }
@@ -222,6 +453,8 @@ static void ProcessSingleFile(IN const WCHAR *fileName, IN DWORD fileAttributes)
         WriteHeaders(&hdr, fileName);
     }
 
+    g_entryIndex++;
+
     /* TODO */
 #if 0
     if (S_ISLNK(mode))
@@ -258,96 +491,192 @@ static INT64 GetFileSizeByPath(IN const WCHAR *filePath)
     return fileSize.QuadPart;
 }
 
-static INT64 ProcessDirectory(IN const WCHAR *directoryPath, IN BOOL calculateSize)
+static void ManifestAdd(IN const void *data, IN size_t size)
 {
-    WCHAR *currentPath;
-    size_t cchCurrentPath, cchSearchPath;
-    DWORD attributes;
-    WIN32_FIND_DATA findData;
-    WCHAR *searchPath;
-    HANDLE searchHandle;
-    INT64 size = 0;
+    const BYTE *bytes = data;
+    size_t i;
 
-    LogDebug("%s", directoryPath);
-    if ((attributes = GetFileAttributes(directoryPath)) == INVALID_FILE_ATTRIBUTES)
-        FcReportError(GetLastError(), TRUE, L"Cannot get attributes of '%s'", directoryPath);
-
-    if (!calculateSize)
-        ProcessSingleFile(directoryPath, attributes);
-
-    if (!(attributes & FILE_ATTRIBUTE_DIRECTORY))
+    for (i = 0; i < size; i++)
     {
-        if (calculateSize)
-            return GetFileSizeByPath(directoryPath);
-        else
-            return 0;
+        g_manifest ^= bytes[i];
+        g_manifest *= FNV_PRIME;
     }
+}
 
-    cchSearchPath = wcslen(directoryPath) + 3;
-    searchPath = malloc(sizeof(WCHAR)*cchSearchPath);
+// Any change in the files being sent makes the receiver start over instead of resuming.
+static void AddToManifest(IN const WCHAR *path)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
 
-    if (!searchPath)
-    {
-        FcReportError(ERROR_OUTOFMEMORY, TRUE, L"ProcessDirectory(%s) failed", directoryPath);
-    }
+    if (!GetFileAttributesEx(path, GetFileExInfoStandard, &data))
+        FcReportError(GetLastError(), TRUE, L"Cannot get attributes of '%s'", path);
+
+    ManifestAdd(path, (wcslen(path) + 1) * sizeof(WCHAR));
+    ManifestAdd(&data.dwFileAttributes, sizeof(data.dwFileAttributes));
+    ManifestAdd(&data.nFileSizeHigh, sizeof(data.nFileSizeHigh));
+    ManifestAdd(&data.nFileSizeLow, sizeof(data.nFileSizeLow));
+    ManifestAdd(&data.ftLastWriteTime, sizeof(data.ftLastWriteTime));
+}
 
-    if (FAILED(StringCchPrintf(searchPath, cchSearchPath, L"%s\\*", directoryPath)))
-        FcReportError(ERROR_BAD_PATHNAME, TRUE, L"ProcessDirectory(%s) failed", directoryPath);
+// path is extended in place for the children of a directory. fileSize is -1 if not
+// known from the listing of the parent.
+static INT64 ProcessEntry(IN OUT DIR_ENUM_PATH *path, IN DWORD attributes, IN INT64 fileSize, IN ULONG depth, IN BOOL calculateSize)
+{
+    DIR_ENUM dirEnum;
+    DIR_ENUM_ENTRY entry;
+    size_t parentLength;
+    DWORD status;
+    INT64 size = 0;
 
-    searchHandle = FindFirstFile(searchPath, &findData);
+    LogDebug("%s", path->Buffer);
+    if (!calculateSize)
+        ProcessSingleFile(path->Buffer, attributes);
+    else if (g_pack.Caps & FC_CAP_RESUME)
+        AddToManifest(path->Buffer);
 
-    if (searchHandle == INVALID_HANDLE_VALUE)
+    if (!(attributes & FILE_ATTRIBUTE_DIRECTORY))
     {
-        DWORD status = GetLastError();
-        if (status == ERROR_FILE_NOT_FOUND) // empty directory
+        if (!calculateSize)
             return 0;
-        FcReportError(status, TRUE, L"Cannot list directory '%s'", directoryPath);
-    }
 
-    do
-    {
-        if (!wcscmp(findData.cFileName, L".") || !wcscmp(findData.cFileName, L".."))
-            continue;
+        // the listing has the size of a link, not of its target
+        if (fileSize < 0 || (attributes & FILE_ATTRIBUTE_REPARSE_POINT))
+            size = GetFileSizeByPath(path->Buffer);
+        else
+            size = fileSize;
 
-        cchCurrentPath = wcslen(directoryPath) + wcslen(findData.cFileName) + 2;
-        currentPath = malloc(sizeof(WCHAR)*cchCurrentPath);
+        if (g_pack.Caps & FC_CAP_DEDUP)
+            DedupAddFile(path->Buffer, size);
+        if (g_multistream)
+            MsAddFile(size);
+        return size;
+    }
 
-        if (!currentPath)
-            FcReportError(ERROR_OUTOFMEMORY, TRUE, L"ProcessDirectory(%s) failed", directoryPath);
+    status = DirEnumOpen(path->Buffer, depth, &dirEnum);
+    if (status != ERROR_SUCCESS)
+        FcReportError(status, TRUE, L"Cannot list directory '%s'", path->Buffer);
 
+    while ((status = DirEnumNext(&dirEnum, &entry)) == ERROR_SUCCESS)
+    {
         // use forward slash here to send it also to the other end
-        if (FAILED(StringCchPrintf(currentPath, cchCurrentPath, L"%s/%s", directoryPath, findData.cFileName)))
-            FcReportError(ERROR_BAD_PATHNAME, TRUE, L"ProcessDirectory(%s) failed", directoryPath);
+        if (!DirEnumPathAppend(path, L'/', entry.Name, entry.NameLength, &parentLength))
+            FcReportError(ERROR_OUTOFMEMORY, TRUE, L"ProcessDirectory(%s) failed", path->Buffer);
 
-        size += ProcessDirectory(currentPath, calculateSize);
-        free(currentPath);
+        size += ProcessEntry(path, entry.Attributes, (INT64)entry.Size, depth + 1, calculateSize);
+        DirEnumPathTruncate(path, parentLength);
 
         if (g_cancelOperation)
             break;
-    } while (FindNextFile(searchHandle, &findData));
+    }
+
+    DirEnumClose(&dirEnum);
+    if (status != ERROR_SUCCESS && status != ERROR_NO_MORE_FILES)
+        FcReportError(status, TRUE, L"Cannot list directory '%s'", path->Buffer);
 
-    FindClose(searchHandle);
     // directory metadata is resent; this makes the code simple,
     // and the atime/mtime is set correctly at the second time
     if (!calculateSize)
-        ProcessSingleFile(directoryPath, attributes);
+        ProcessSingleFile(path->Buffer, attributes);
     return size;
 }
 
-static void NotifyEndAndWaitForResult(void)
+static INT64 ProcessDirectory(IN const WCHAR *directoryPath, IN BOOL calculateSize)
 {
-    struct file_header endHeader;
+    DIR_ENUM_PATH path;
+    DWORD attributes;
+    INT64 size;
+
+    if ((attributes = GetFileAttributes(directoryPath)) == INVALID_FILE_ATTRIBUTES)
+        FcReportError(GetLastError(), TRUE, L"Cannot get attributes of '%s'", directoryPath);
+
+    if (!DirEnumPathInit(&path, directoryPath))
+        FcReportError(ERROR_OUTOFMEMORY, TRUE, L"ProcessDirectory(%s) failed", directoryPath);
 
+    size = ProcessEntry(&path, attributes, -1, 0, calculateSize);
+    DirEnumPathFree(&path);
+    return size;
+}
+
+static void NotifyEndAndWaitForResult(void)
+{
     LogVerbose("start");
     /* nofity end of transfer */
-    ZeroMemory(&endHeader, sizeof(endHeader));
-    endHeader.namelen = 0;
-    endHeader.filelen = 0;
-    WriteWithCrc(g_stdout, &endHeader, sizeof(endHeader));
+    FcePackEnd(&g_pack);
 
     WaitForResult();
 }
 
+// Old receivers fail or stall on the capability probe (see filecopy-protocol.h), so
+// it's only sent to qubes listed in FilecopyExtensionTargets (names separated by
+// spaces). A transfer without an explicit target never negotiates.
+static BOOL TargetSupportsCaps(void)
+{
+    WCHAR target[MAX_PATH];
+    WCHAR targets[1024];
+    WCHAR *context = NULL;
+    WCHAR *name;
+    DWORD cchTarget;
+
+    cchTarget = GetEnvironmentVariable(L"QREXEC_REQUESTED_TARGET", target, RTL_NUMBER_OF(target));
+    if (cchTarget == 0 || cchTarget >= RTL_NUMBER_OF(target))
+        return FALSE;
+
+    if (ERROR_SUCCESS != CfgReadString(NULL, L"FilecopyExtensionTargets", targets, RTL_NUMBER_OF(targets), NULL))
+        return FALSE;
+
+    for (name = wcstok_s(targets, L" ", &context); name; name = wcstok_s(NULL, L" ", &context))
+    {
+        if (0 == wcscmp(name, target))
+            return TRUE;
+    }
+
+    LogDebug("'%s' not in FilecopyExtensionTargets", target);
+    return FALSE;
+}
+
+// Negotiates protocol extensions with receivers known to support them, see TargetSupportsCaps.
+static void NegotiateCaps(IN UINT32 allowed)
+{
+    DWORD requested = 0;
+    DWORD sparseFiles = 0;
+    DWORD resumeTransfers = 0;
+    DWORD deduplicateFiles = 0;
+    DWORD compressFiles = 0;
+    FILETIME now;
+    unsigned int unixTime, unixTimeNsec;
+
+    // each extension is opt-in as well
+    if (ERROR_SUCCESS == CfgReadDword(NULL, L"SparseFiles", &sparseFiles, NULL) && sparseFiles)
+        requested |= FC_CAP_SPARSE;
+    if (ERROR_SUCCESS == CfgReadDword(NULL, L"ResumeTransfers", &resumeTransfers, NULL) && resumeTransfers)
+        requested |= FC_CAP_RESUME;
+    if (ERROR_SUCCESS == CfgReadDword(NULL, L"DeduplicateFiles", &deduplicateFiles, NULL) && deduplicateFiles)
+        requested |= FC_CAP_DEDUP;
+    if (ERROR_SUCCESS == CfgReadDword(NULL, L"CompressFiles", &compressFiles, NULL) && compressFiles)
+        requested |= FC_CAP_COMPRESS;
+
+    requested &= allowed;
+    if (requested && !TargetSupportsCaps())
+        requested = 0;
+    if ((requested & FC_CAP_COMPRESS) && !CompressInit())
+        requested &= ~FC_CAP_COMPRESS;
+
+    GetSystemTimeAsFileTime(&now);
+    WindowTimeToUnix(&now, &unixTime, &unixTimeNsec);
+    CheckWrite(FcePackNegotiate(&g_pack, requested, unixTime));
+    LogDebug("requested caps 0x%x, using 0x%x", requested, g_pack.Caps);
+}
+
+// Asks the receiver where an interrupted transfer of the same files ended.
+static void RequestResumePoint(IN const WCHAR *currentDirectory)
+{
+    // relative paths in the manifest depend on it
+    ManifestAdd(currentDirectory, (wcslen(currentDirectory) + 1) * sizeof(WCHAR));
+
+    CheckWrite(FcePackRequestResume(&g_pack, g_manifest, &g_resumePoint));
+    LogInfo("resuming after %I64u entries, offset %I64u", g_resumePoint.entries_done, g_resumePoint.offset);
+}
+
 static WCHAR *GetAbsolutePath(IN const WCHAR *currentDirectory, IN const WCHAR *path)
 {
     WCHAR *absolutePath;
@@ -374,10 +703,66 @@ static WCHAR *GetAbsolutePath(IN const WCHAR *currentDirectory, IN const WCHAR *
     return absolutePath;
 }
 
-int __cdecl wmain(int argc, WCHAR *argv[])
+static void SendArguments(IN int argc, IN WCHAR *argv[], IN const WCHAR *currentDirectory)
 {
     int i;
     WCHAR *directory, *baseName;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (g_cancelOperation)
+            break;
+
+        directory = GetAbsolutePath(currentDirectory, argv[i]);
+
+        if (!directory)
+        {
+            FcReportError(ERROR_BAD_PATHNAME, TRUE, L"GetAbsolutePath '%s'", argv[i]);
+        }
+
+        // absolute path has at least one character
+        if (PathGetCharType(directory[wcslen(directory) - 1]) & GCT_SEPARATOR)
+            directory[wcslen(directory) - 1] = L'\0';
+
+        baseName = _wcsdup(directory);
+        PathStripPath(baseName);
+        PathRemoveFileSpec(directory);
+
+        if (!SetCurrentDirectory(directory))
+            FcReportError(GetLastError(), TRUE, L"SetCurrentDirectory(%s)", directory);
+
+        ProcessDirectory(baseName, FALSE);
+        free(directory);
+        free(baseName);
+    }
+}
+
+static void IgnoreErrorState(IN BOOL errorOccurred)
+{
+}
+
+// One of the streams of a multistream transfer, the primary file-sender shows the progress.
+static int RunHelper(IN int argc, IN WCHAR *argv[])
+{
+    FcSetErrorCallback(NULL, IgnoreErrorState);
+    FcePackInit(&g_pack, &g_packBackend, NULL);
+    // resume and dedup rely on the entry order of a single stream
+    NegotiateCaps(FC_CAP_SPARSE | FC_CAP_COMPRESS);
+
+    MsRunHelper(argc, argv, ProcessSingleFile);
+
+    NotifyEndAndWaitForResult();
+    MsHelperDone(0);
+    return 0;
+}
+
+int __cdecl wmain(int argc, WCHAR *argv[])
+{
+    int i;
+    INT64 totalSize;
+    DWORD streams = 1;
+    LONG failedStreams = 0;
+    WCHAR target[MAX_PATH];
     WCHAR currentDirectory[MAX_PATH_LENGTH];
 
     g_stderr = GetStdHandle(STD_ERROR_HANDLE);
@@ -404,8 +789,22 @@ int __cdecl wmain(int argc, WCHAR *argv[])
         exit(1);
     }
 
+    if (argc > 1 && 0 == wcscmp(argv[1], MULTISTREAM_SHARD_ARG))
+        return RunHelper(argc - 2, argv + 2);
+
     NotifyProgress(0, PROGRESS_TYPE_INIT);
-    g_crc32 = 0;
+    FcePackInit(&g_pack, &g_packBackend, NULL);
+
+    // single stream by default, more need an explicit target domain
+    if (ERROR_SUCCESS == CfgReadDword(NULL, L"FilecopyStreams", &streams, NULL) && streams > 1)
+    {
+        if (!GetEnvironmentVariable(L"QREXEC_REQUESTED_TARGET", target, RTL_NUMBER_OF(target)))
+            target[0] = L'\0';
+        g_multistream = MsInit(streams, target);
+    }
+
+    // resume and dedup rely on the entry order of a single stream
+    NegotiateCaps(g_multistream ? (FC_CAP_SPARSE | FC_CAP_COMPRESS) : ~0U);
 
     if (!GetCurrentDirectory(RTL_NUMBER_OF(currentDirectory), currentDirectory))
     {
@@ -414,45 +813,52 @@ int __cdecl wmain(int argc, WCHAR *argv[])
     }
 
     // calculate total size for progressbar purpose
-    g_totalSize = 0;
+    totalSize = 0;
 
     for (i = 1; i < argc; i++)
     {
         if (g_cancelOperation)
             break;
         // do not change dir, as don't care about form of the path here
-        g_totalSize += ProcessDirectory(argv[i], TRUE);
+        totalSize += ProcessDirectory(argv[i], TRUE);
     }
 
-    for (i = 1; i < argc; i++)
-    {
-        if (g_cancelOperation)
-            break;
+    // the progress dialog is already running, publish the final value only
+    InterlockedExchange64(&g_totalSize, totalSize);
 
-        directory = GetAbsolutePath(currentDirectory, argv[i]);
+    if (g_pack.Caps & FC_CAP_DEDUP)
+        DedupFindDuplicates();
 
-        if (!directory)
-        {
-            FcReportError(ERROR_BAD_PATHNAME, TRUE, L"GetAbsolutePath '%s'", argv[i]);
-        }
+    if (g_pack.Caps & FC_CAP_RESUME)
+        RequestResumePoint(currentDirectory);
 
-        // absolute path has at least one character
-        if (PathGetCharType(directory[wcslen(directory) - 1]) & GCT_SEPARATOR)
-            directory[wcslen(directory) - 1] = L'\0';
+    if (g_multistream)
+    {
+        MsAssignShards();
+        g_listingShards = TRUE;
+        SendArguments(argc, argv, currentDirectory);
+        g_listingShards = FALSE;
+        MsStartHelpers();
+    }
 
-        baseName = _wcsdup(directory);
-        PathStripPath(baseName);
-        PathRemoveFileSpec(directory);
+    SendArguments(argc, argv, currentDirectory);
 
-        if (!SetCurrentDirectory(directory))
-            FcReportError(GetLastError(), TRUE, L"SetCurrentDirectory(%s)", directory);
-
-        ProcessDirectory(baseName, FALSE);
-        free(directory);
-        free(baseName);
+    if (g_multistream)
+    {
+        MsSendPendingShards(ProcessSingleFile);
+        failedStreams = MsWaitForHelpers();
+
+        // the helpers changed the directories after the primary stream sent them,
+        // the times from the last stream to finish would win
+        g_directoriesOnly = TRUE;
+        SendArguments(argc, argv, currentDirectory);
+        g_directoriesOnly = FALSE;
     }
 
     NotifyEndAndWaitForResult();
+    if (g_multistream && failedStreams > 0)
+        FcReportError(ERROR_UNIDENTIFIED_ERROR, TRUE, L"File copy: %ld of the parallel transfers failed, some files were not sent", failedStreams);
+
     NotifyProgress(0, PROGRESS_TYPE_DONE);
     return 0;
 }
@@ -21,18 +21,103 @@
 
 #include <windows.h>
 #include <commctrl.h>
+#include <shlwapi.h>
+#include <strsafe.h>
 
 #include <log.h>
 
 #include "filecopy-error.h"
 #include "gui-progress.h"
+#include "multistream.h"
 
-extern INT64 g_totalSize;
+extern volatile LONG64 g_totalSize;
 extern BOOL g_cancelOperation;
 
 HWND g_progressDialog = NULL;
 HANDLE g_progressWindowThread = NULL;
 
+// bytes processed so far, the only thing the copy loop touches
+volatile LONG64 g_progressBytes = 0;
+volatile LONG64 *g_progressCounter = &g_progressBytes;
+
+// sampling state, used by the dialog thread only
+UINT64 g_sampleBytes = 0;
+UINT64 g_sampleTime = 0; // ms since the dialog was created
+UINT64 g_bytesPerSecond = 0; // smoothed
+
+void ProgressAdd(IN UINT64 size)
+{
+    InterlockedExchangeAdd64(g_progressCounter, (LONG64)size);
+}
+
+void ProgressSetCounter(IN volatile LONG64 *counter)
+{
+    g_progressCounter = counter;
+}
+
+static void UpdateProgressText(IN HWND window, IN UINT64 done, IN UINT64 total)
+{
+    WCHAR doneText[32], totalText[32], rateText[32], timeText[64];
+    WCHAR text[256];
+    UINT64 left, secondsLeft, msLeft;
+
+    StrFormatByteSize64(done, doneText, RTL_NUMBER_OF(doneText));
+    StrFormatByteSize64(total, totalText, RTL_NUMBER_OF(totalText));
+    StrFormatByteSize64(g_bytesPerSecond, rateText, RTL_NUMBER_OF(rateText));
+
+    if (g_bytesPerSecond == 0 || done >= total)
+    {
+        StringCchPrintf(text, RTL_NUMBER_OF(text), L"%s of %s sent", doneText, totalText);
+    }
+    else
+    {
+        // rounded up, less than a second left is not "0 sec"
+        left = total - done;
+        secondsLeft = left / g_bytesPerSecond;
+        if (secondsLeft >= MAXDWORD / 1000)
+            msLeft = MAXDWORD;
+        else
+            msLeft = secondsLeft * 1000 + (left % g_bytesPerSecond * 1000 + g_bytesPerSecond - 1) / g_bytesPerSecond;
+
+        StrFromTimeInterval(timeText, RTL_NUMBER_OF(timeText), (DWORD)msLeft, 2);
+        StrTrim(timeText, L" ");
+        StringCchPrintf(text, RTL_NUMBER_OF(text), L"%s of %s sent (%s/s), about %s left", doneText, totalText, rateText, timeText);
+    }
+
+    SendMessage(window, TDM_UPDATE_ELEMENT_TEXT, TDE_CONTENT, (LPARAM)text);
+}
+
+// Called on the dialog thread about every 200 ms, elapsed is in ms since the dialog was created.
+static void SampleProgress(IN HWND window, IN UINT64 elapsed)
+{
+    // other streams of the transfer run in helper processes
+    UINT64 done = (UINT64)InterlockedCompareExchange64(&g_progressBytes, 0, 0) + MsHelperBytes();
+    UINT64 total = (UINT64)InterlockedCompareExchange64(&g_totalSize, 0, 0);
+    UINT64 rate;
+
+    // the total is still being calculated when the dialog appears
+    if (total == 0)
+        return;
+
+    if (done > total)
+        done = total;
+
+    SendMessage(window, TDM_SET_PROGRESS_BAR_POS, (WPARAM)(100ULL * done / total), 0);
+
+    if (elapsed < g_sampleTime + PROGRESS_TEXT_INTERVAL)
+        return;
+
+    rate = (done - min(done, g_sampleBytes)) * 1000 / (elapsed - g_sampleTime);
+    if (g_bytesPerSecond == 0)
+        g_bytesPerSecond = rate;
+    else
+        g_bytesPerSecond = (3 * rate + 7 * g_bytesPerSecond) / 10;
+
+    g_sampleBytes = done;
+    g_sampleTime = elapsed;
+    UpdateProgressText(window, done, total);
+}
+
 static HRESULT CALLBACK TaskDialogCallbackProc(IN HWND window, IN UINT notification, IN WPARAM wParam, IN LPARAM lParam, IN LONG_PTR context)
 {
     LogVerbose("hwnd 0x%x, code %lu", window, notification);
@@ -44,10 +129,14 @@ static HRESULT CALLBACK TaskDialogCallbackProc(IN HWND window, IN UINT notificat
     case TDN_DESTROYED:
         g_progressDialog = NULL;
         break;
+    case TDN_TIMER:
+        SampleProgress(window, wParam);
+        break;
     case TDN_BUTTON_CLICKED:
         if (wParam == IDCANCEL)
         {
             g_cancelOperation = TRUE;
+            MsCancel();
             return S_FALSE;
         }
         // IDOK -> close dialog
@@ -67,7 +156,7 @@ static DWORD TaskDialogThread(IN void *param)
     config.cbSize = sizeof(config);
     config.hInstance = NULL;
     config.dwCommonButtons = TDCBF_CANCEL_BUTTON;
-    config.dwFlags = TDF_SHOW_PROGRESS_BAR;
+    config.dwFlags = TDF_SHOW_PROGRESS_BAR | TDF_CALLBACK_TIMER;
     config.pszMainIcon = NULL;
     config.pszMainInstruction = L"Sending files";
     config.pszContent = L"Sending files, please wait";
@@ -116,13 +205,9 @@ void UpdateProgress(IN UINT64 written, IN FC_PROGRESS_TYPE progressType)
         break;
 
     case PROGRESS_TYPE_NORMAL:
+        // position is sampled by the dialog timer, see ProgressAdd
         if (g_progressDialog)
-        {
-            if (written)
-                SendNotifyMessage(g_progressDialog, TDM_SET_PROGRESS_BAR_POS, (WPARAM) (100ULL * written / g_totalSize), 0);
-            else
-                SendNotifyMessage(g_progressDialog, TDM_SET_PROGRESS_BAR_STATE, (WPARAM) PBST_NORMAL, 0);
-        }
+            SendNotifyMessage(g_progressDialog, TDM_SET_PROGRESS_BAR_STATE, (WPARAM) PBST_NORMAL, 0);
         break;
 
     case PROGRESS_TYPE_DONE:
@@ -22,4 +22,16 @@
 #pragma once
 #include "filecopy.h"
 
+// The dialog refreshes the text (throughput, time left) this often (ms), the bar
+// on every timer notification (about 200 ms).
+#define PROGRESS_TEXT_INTERVAL 1000
+
+// Only changes the dialog state, progress itself is reported with ProgressAdd.
 void UpdateProgress(IN UINT64 written, IN FC_PROGRESS_TYPE progressType);
+
+// Cheap enough to call for every copied chunk: just an atomic add, the dialog
+// thread samples the counter on its timer.
+void ProgressAdd(IN UINT64 size);
+
+// Makes ProgressAdd count to a different place (a helper stream counts to the primary one).
+void ProgressSetCounter(IN volatile LONG64 *counter);
@@ -0,0 +1,563 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <Strsafe.h>
+#include <Shlwapi.h>
+
+#include <log.h>
+#include <exec.h>
+
+#include "multistream.h"
+#include "filecopy-error.h"
+#include "gui-progress.h"
+
+#define QREXEC_CLIENT_VM L"qrexec-client-vm.exe"
+
+// primary side
+WCHAR *g_msTarget = NULL;
+HANDLE g_msSectionHandle = NULL;
+MULTISTREAM_SECTION *g_msSection = NULL;
+FILE *g_msLists[MULTISTREAM_MAX_STREAMS] = { 0 };
+WCHAR g_msListPaths[MULTISTREAM_MAX_STREAMS][MAX_PATH];
+SIZE_T g_msShardFiles[MULTISTREAM_MAX_STREAMS] = { 0 };
+// qrexec-client-vm of each helper, it exits after the helper (or when the call is refused)
+HANDLE g_msHelperProcesses[MULTISTREAM_MAX_STREAMS] = { 0 };
+
+UINT64 *g_msFileSizes = NULL; // in the send order
+BYTE *g_msFileShards = NULL;
+SIZE_T g_msFilesCount = 0;
+SIZE_T g_msFilesCapacity = 0;
+SIZE_T g_msNextFile = 0;
+
+// helper side
+MULTISTREAM_SHARD *g_msHelperShard = NULL;
+
+static MULTISTREAM_SECTION *OpenSection(IN DWORD primaryPid, IN BOOL create, OUT HANDLE *sectionHandle)
+{
+    WCHAR sectionName[64];
+    MULTISTREAM_SECTION *section;
+
+    StringCchPrintf(sectionName, RTL_NUMBER_OF(sectionName), MULTISTREAM_SECTION_NAME, primaryPid);
+    if (create)
+        *sectionHandle = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(MULTISTREAM_SECTION), sectionName);
+    else
+        *sectionHandle = OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, sectionName);
+
+    if (!*sectionHandle)
+    {
+        perror(create ? "CreateFileMapping" : "OpenFileMapping");
+        return NULL;
+    }
+
+    section = MapViewOfFile(*sectionHandle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(MULTISTREAM_SECTION));
+    if (!section)
+    {
+        perror("MapViewOfFile");
+        CloseHandle(*sectionHandle);
+        *sectionHandle = NULL;
+    }
+
+    return section;
+}
+
+BOOL MsInit(IN DWORD streams, IN const WCHAR *target OPTIONAL)
+{
+    LONG i;
+
+    if (streams > MULTISTREAM_MAX_STREAMS)
+        streams = MULTISTREAM_MAX_STREAMS;
+
+    // "@default" etc. would ask for the target again for every helper
+    if (!target || !target[0] || target[0] == L'@')
+    {
+        LogInfo("target domain not known, using a single stream");
+        return FALSE;
+    }
+
+    g_msTarget = _wcsdup(target);
+    if (!g_msTarget)
+        return FALSE;
+
+    g_msSection = OpenSection(GetCurrentProcessId(), TRUE, &g_msSectionHandle);
+    if (!g_msSection)
+        return FALSE;
+
+    g_msSection->Count = streams;
+    for (i = 0; i < g_msSection->Count; i++)
+    {
+        g_msSection->Shards[i].BytesDone = 0;
+        g_msSection->Shards[i].Status = SHARD_STATUS_PENDING;
+    }
+    g_msSection->Shards[0].Status = SHARD_STATUS_RUNNING;
+
+    LogInfo("using %lu streams to '%s'", streams, target);
+    return TRUE;
+}
+
+void MsAddFile(IN UINT64 size)
+{
+    if (g_msFilesCount == g_msFilesCapacity)
+    {
+        SIZE_T newCapacity = g_msFilesCapacity ? 2 * g_msFilesCapacity : 1024;
+        UINT64 *newSizes = realloc(g_msFileSizes, newCapacity * sizeof(UINT64));
+
+        if (!newSizes)
+            FcReportError(ERROR_OUTOFMEMORY, TRUE, L"MsAddFile failed");
+
+        g_msFileSizes = newSizes;
+        g_msFilesCapacity = newCapacity;
+    }
+
+    g_msFileSizes[g_msFilesCount++] = size;
+}
+
+static int __cdecl CompareSizeDescending(IN void *context, IN const void *a, IN const void *b)
+{
+    UINT64 sizeA = g_msFileSizes[*(const SIZE_T *)a];
+    UINT64 sizeB = g_msFileSizes[*(const SIZE_T *)b];
+
+    if (sizeA == sizeB)
+        return 0;
+    return sizeA > sizeB ? -1 : 1;
+}
+
+void MsAssignShards(void)
+{
+    SIZE_T *order;
+    SIZE_T i;
+    UINT64 load[MULTISTREAM_MAX_STREAMS] = { 0 };
+    LONG shard, target;
+    WCHAR tempPath[MAX_PATH];
+
+    if (g_msFilesCount > (SIZE_T)-1 / sizeof(SIZE_T))
+        FcReportError(ERROR_OUTOFMEMORY, TRUE, L"MsAssignShards failed");
+
+    // at least one element, calloc(0) may return NULL
+    order = calloc(max(g_msFilesCount, 1), sizeof(SIZE_T));
+    g_msFileShards = calloc(max(g_msFilesCount, 1), sizeof(BYTE));
+    if (!order || !g_msFileShards)
+        FcReportError(ERROR_OUTOFMEMORY, TRUE, L"MsAssignShards failed");
+
+    for (i = 0; i < g_msFilesCount; i++)
+        order[i] = i;
+
+    // largest first, each to the least loaded shard: all shards end at about the same time
+    qsort_s(order, g_msFilesCount, sizeof(SIZE_T), CompareSizeDescending, NULL);
+    for (i = 0; i < g_msFilesCount; i++)
+    {
+        target = 0;
+        for (shard = 1; shard < g_msSection->Count; shard++)
+        {
+            if (load[shard] < load[target])
+                target = shard;
+        }
+
+        g_msFileShards[order[i]] = (BYTE)target;
+        load[target] += g_msFileSizes[order[i]];
+        g_msShardFiles[target]++;
+    }
+
+    free(order);
+
+    if (!GetTempPath(RTL_NUMBER_OF(tempPath), tempPath))
+        FcReportError(GetLastError(), TRUE, L"GetTempPath failed");
+
+    for (shard = 1; shard < g_msSection->Count; shard++)
+    {
+        LogDebug("shard %ld: %Iu files, %I64u bytes", shard, g_msShardFiles[shard], load[shard]);
+        if (!GetTempFileName(tempPath, L"qfc", 0, g_msListPaths[shard]))
+            FcReportError(GetLastError(), TRUE, L"GetTempFileName failed");
+
+        g_msLists[shard] = _wfopen(g_msListPaths[shard], L"wb");
+        if (!g_msLists[shard])
+            FcReportError(ERROR_OPEN_FAILED, TRUE, L"Cannot create '%s'", g_msListPaths[shard]);
+    }
+
+    g_msNextFile = 0;
+}
+
+static void ListFile(IN LONG shard, IN const WCHAR *fileName)
+{
+    WCHAR currentDirectory[MAX_PATH_LENGTH];
+    DWORD cchCurrentDirectory;
+    FILE *list = g_msLists[shard];
+
+    cchCurrentDirectory = GetCurrentDirectory(RTL_NUMBER_OF(currentDirectory), currentDirectory);
+    if (!cchCurrentDirectory || cchCurrentDirectory >= RTL_NUMBER_OF(currentDirectory))
+        FcReportError(GetLastError(), TRUE, L"Failed to get current directory");
+
+    // <directory>\t<file name>\n, UTF-16
+    if (fwrite(currentDirectory, sizeof(WCHAR), cchCurrentDirectory, list) != cchCurrentDirectory
+        || fwrite(L"\t", sizeof(WCHAR), 1, list) != 1
+        || fwrite(fileName, sizeof(WCHAR), wcslen(fileName), list) != wcslen(fileName)
+        || fwrite(L"\n", sizeof(WCHAR), 1, list) != 1)
+    {
+        FcReportError(ERROR_WRITE_FAULT, TRUE, L"Cannot write '%s'", g_msListPaths[shard]);
+    }
+}
+
+BOOL MsIsLocalFile(IN const WCHAR *fileName, IN BOOL list)
+{
+    LONG shard;
+
+    // the tree changed since the size pass, anything new is sent here
+    if (g_msNextFile >= g_msFilesCount)
+        return TRUE;
+
+    shard = g_msFileShards[g_msNextFile++];
+    if (shard == 0)
+        return TRUE;
+
+    if (list)
+        ListFile(shard, fileName);
+
+    return FALSE;
+}
+
+static void StartHelper(IN LONG shard, IN const WCHAR *senderPath, IN const WCHAR *qrexecClientPath)
+{
+    WCHAR commandLine[3 * MAX_PATH + 128];
+    PROCESS_INFORMATION pi;
+    STARTUPINFO si = { 0 };
+
+    if (FAILED(StringCchPrintf(commandLine, RTL_NUMBER_OF(commandLine), QREXEC_CLIENT_VM L" %s%cqubes.Filecopy%c\"%s\" %s %lu %ld \"%s\"",
+        g_msTarget, QUBES_ARGUMENT_SEPARATOR, QUBES_ARGUMENT_SEPARATOR,
+        senderPath, MULTISTREAM_SHARD_ARG, GetCurrentProcessId(), shard, g_msListPaths[shard])))
+    {
+        FcReportError(ERROR_BAD_PATHNAME, TRUE, L"Failed to construct command line");
+    }
+
+    LogDebug("executing command: '%s'", commandLine);
+    si.cb = sizeof(si);
+    if (!CreateProcess(qrexecClientPath, commandLine, NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi))
+    {
+        // the files of this shard are missing, fail the transfer at the end
+        perror("CreateProcess");
+        g_msSection->Shards[shard].Status = SHARD_STATUS_FAILED;
+        return;
+    }
+
+    CloseHandle(pi.hThread);
+    g_msHelperProcesses[shard] = pi.hProcess;
+}
+
+// Returns FALSE if the helper hasn't connected within MULTISTREAM_PROMPT_DELAY.
+static BOOL WaitForHelperStart(IN LONG shard)
+{
+    ULONGLONG start = GetTickCount64();
+
+    while (g_msSection->Shards[shard].Status == SHARD_STATUS_PENDING)
+    {
+        if (GetTickCount64() - start >= MULTISTREAM_PROMPT_DELAY)
+            return FALSE;
+        Sleep(50);
+    }
+
+    return TRUE;
+}
+
+void MsStartHelpers(void)
+{
+    WCHAR senderPath[MAX_PATH];
+    WCHAR qrexecClientPath[MAX_PATH];
+    LONG shard;
+    BOOL firstHelper = TRUE;
+    BOOL policyAsks = FALSE;
+
+    if (!GetModuleFileName(NULL, senderPath, RTL_NUMBER_OF(senderPath)))
+        FcReportError(GetLastError(), TRUE, L"Failed to get own path");
+
+    // qubes-rpc-services\file-sender.exe -> bin\qrexec-client-vm.exe
+    StringCchCopy(qrexecClientPath, RTL_NUMBER_OF(qrexecClientPath), senderPath);
+    PathRemoveFileSpec(qrexecClientPath);
+    PathRemoveFileSpec(qrexecClientPath);
+    if (!PathAppend(qrexecClientPath, L"bin\\" QREXEC_CLIENT_VM))
+        FcReportError(ERROR_BAD_PATHNAME, TRUE, L"Cannot find " QREXEC_CLIENT_VM);
+
+    for (shard = 1; shard < g_msSection->Count; shard++)
+    {
+        if (fclose(g_msLists[shard]) != 0)
+            FcReportError(ERROR_WRITE_FAULT, TRUE, L"Cannot write '%s'", g_msListPaths[shard]);
+        g_msLists[shard] = NULL;
+
+        // fewer files than streams
+        if (g_msShardFiles[shard] == 0)
+        {
+            DeleteFile(g_msListPaths[shard]);
+            g_msSection->Shards[shard].Status = 0;
+            continue;
+        }
+
+        // left pending, the primary sends these files itself
+        if (policyAsks)
+            continue;
+
+        StartHelper(shard, senderPath, qrexecClientPath);
+
+        // all helpers go through the same policy, don't make the user confirm each one
+        if (firstHelper && !WaitForHelperStart(shard))
+        {
+            LogWarning("shard %ld: helper didn't connect, the policy probably asks the user; not starting more streams", shard);
+            policyAsks = TRUE;
+        }
+        firstHelper = FALSE;
+    }
+
+    g_msNextFile = 0;
+}
+
+// Returns TRUE once the helper has finished (or will never run).
+static BOOL HelperFinished(IN LONG shard)
+{
+    MULTISTREAM_SHARD *helper = &g_msSection->Shards[shard];
+
+    switch (helper->Status)
+    {
+    case SHARD_STATUS_RUNNING:
+        // a helper that crashed can't report, qrexec-client-vm exits with it
+        if (WaitForSingleObject(g_msHelperProcesses[shard], 0) != WAIT_OBJECT_0)
+            return FALSE;
+
+        InterlockedCompareExchange(&helper->Status, SHARD_STATUS_FAILED, SHARD_STATUS_RUNNING);
+        return TRUE;
+    }
+
+    return TRUE;
+}
+
+LONG MsWaitForHelpers(void)
+{
+    LONG shard;
+    LONG failed = 0;
+    BOOL finished;
+
+    do
+    {
+        finished = TRUE;
+        for (shard = 1; shard < g_msSection->Count; shard++)
+        {
+            if (!HelperFinished(shard))
+                finished = FALSE;
+        }
+
+        if (!finished)
+            Sleep(100);
+    } while (!finished);
+
+    for (shard = 1; shard < g_msSection->Count; shard++)
+    {
+        if (g_msSection->Shards[shard].Status != 0)
+        {
+            LogError("shard %ld failed: %ld", shard, g_msSection->Shards[shard].Status);
+            failed++;
+        }
+
+        if (g_msHelperProcesses[shard])
+        {
+            CloseHandle(g_msHelperProcesses[shard]);
+            g_msHelperProcesses[shard] = NULL;
+        }
+    }
+
+    return failed;
+}
+
+UINT64 MsHelperBytes(void)
+{
+    UINT64 bytes = 0;
+    LONG shard;
+
+    if (!g_msSection)
+        return 0;
+
+    for (shard = 1; shard < g_msSection->Count; shard++)
+        bytes += InterlockedCompareExchange64(&g_msSection->Shards[shard].BytesDone, 0, 0);
+
+    return bytes;
+}
+
+void MsCancel(void)
+{
+    if (g_msSection)
+        InterlockedExchange(&g_msSection->Cancel, TRUE);
+}
+
+static void __cdecl HelperExit(void)
+{
+    // any exit before MsHelperDone is a failure (FcReportError exits directly)
+    InterlockedCompareExchange(&g_msHelperShard->Status, SHARD_STATUS_FAILED, SHARD_STATUS_RUNNING);
+}
+
+// Sends the parents of fileName that weren't sent for the previous file.
+static void SendParents(IN WCHAR *fileName, IN OUT WCHAR *previousParent, IN fMsSendFile sendFile)
+{
+    WCHAR *separator;
+    size_t cchCommon = 0;
+    DWORD attributes;
+
+    // length of the part of previousParent that is also a parent of fileName, at a separator
+    while (previousParent[cchCommon] && previousParent[cchCommon] == fileName[cchCommon])
+        cchCommon++;
+    if (previousParent[cchCommon] || fileName[cchCommon] != L'/')
+    {
+        while (cchCommon > 0 && fileName[cchCommon] != L'/')
+            cchCommon--;
+    }
+
+    for (separator = wcschr(fileName + cchCommon + (cchCommon ? 1 : 0), L'/'); separator; separator = wcschr(separator + 1, L'/'))
+    {
+        *separator = L'\0';
+        attributes = GetFileAttributes(fileName);
+        if (attributes == INVALID_FILE_ATTRIBUTES)
+            FcReportError(GetLastError(), TRUE, L"Cannot get attributes of '%s'", fileName);
+
+        sendFile(fileName, attributes);
+        *separator = L'/';
+    }
+
+    separator = wcsrchr(fileName, L'/');
+    StringCchCopyN(previousParent, MAX_PATH_LENGTH, fileName, separator ? separator - fileName : 0);
+}
+
+// Sends the files from a list written by ListFile, the list is deleted.
+static void SendList(IN const WCHAR *listPath, IN MULTISTREAM_SECTION *section, IN BOOL sendParents, IN fMsSendFile sendFile)
+{
+    HANDLE listFile;
+    LARGE_INTEGER listSize;
+    WCHAR *list, *line, *nextLine, *fileName;
+    WCHAR *previousDirectory = L"";
+    WCHAR previousParent[MAX_PATH_LENGTH] = L"";
+    DWORD cbRead, attributes;
+
+    listFile = CreateFile(listPath, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (listFile == INVALID_HANDLE_VALUE)
+        FcReportError(GetLastError(), TRUE, L"Cannot open '%s'", listPath);
+
+    if (!GetFileSizeEx(listFile, &listSize) || listSize.QuadPart > MAXDWORD - sizeof(WCHAR))
+        FcReportError(GetLastError(), TRUE, L"Cannot get size of '%s'", listPath);
+
+    list = malloc((SIZE_T)listSize.QuadPart + sizeof(WCHAR));
+    if (!list)
+        FcReportError(ERROR_OUTOFMEMORY, TRUE, L"SendList failed");
+
+    if (!ReadFile(listFile, list, listSize.LowPart, &cbRead, NULL) || cbRead != listSize.LowPart)
+        FcReportError(GetLastError(), TRUE, L"Cannot read '%s'", listPath);
+
+    CloseHandle(listFile);
+    list[cbRead / sizeof(WCHAR)] = L'\0';
+
+    for (line = list; *line && !section->Cancel; line = nextLine)
+    {
+        nextLine = wcschr(line, L'\n');
+        if (!nextLine)
+            break;
+        *nextLine++ = L'\0';
+
+        fileName = wcschr(line, L'\t');
+        if (!fileName)
+            FcReportError(ERROR_INVALID_DATA, TRUE, L"Invalid list '%s'", listPath);
+        *fileName++ = L'\0';
+
+        if (wcscmp(line, previousDirectory) != 0)
+        {
+            if (!SetCurrentDirectory(line))
+                FcReportError(GetLastError(), TRUE, L"SetCurrentDirectory(%s)", line);
+            previousDirectory = line;
+            previousParent[0] = L'\0';
+        }
+
+        if (sendParents)
+            SendParents(fileName, previousParent, sendFile);
+
+        attributes = GetFileAttributes(fileName);
+        if (attributes == INVALID_FILE_ATTRIBUTES)
+            FcReportError(GetLastError(), TRUE, L"Cannot get attributes of '%s'", fileName);
+
+        sendFile(fileName, attributes);
+    }
+
+    free(list);
+}
+
+void MsSendPendingShards(IN fMsSendFile sendFile)
+{
+    LONG shard;
+
+    // everything passed to sendFile from now on is sent here
+    g_msNextFile = g_msFilesCount;
+
+    for (shard = 1; shard < g_msSection->Count; shard++)
+    {
+        if (InterlockedCompareExchange(&g_msSection->Shards[shard].Status, SHARD_STATUS_PRIMARY, SHARD_STATUS_PENDING) != SHARD_STATUS_PENDING)
+            continue;
+
+        LogInfo("shard %ld: helper didn't connect, sending its files here", shard);
+        // probably still waiting for the policy prompt, the call isn't needed anymore
+        if (g_msHelperProcesses[shard] && !TerminateProcess(g_msHelperProcesses[shard], ERROR_CANCELLED))
+            perror("TerminateProcess");
+
+        // the primary stream has already sent all directories
+        SendList(g_msListPaths[shard], g_msSection, FALSE, sendFile);
+        InterlockedExchange(&g_msSection->Shards[shard].Status, 0);
+    }
+}
+
+void MsRunHelper(IN int argc, IN WCHAR *argv[], IN fMsSendFile sendFile)
+{
+    HANDLE sectionHandle;
+    MULTISTREAM_SECTION *section;
+    MULTISTREAM_SHARD *helperShard;
+    LONG shard;
+
+    if (argc < 3)
+        FcReportError(ERROR_INVALID_PARAMETER, TRUE, L"Usage: file-sender " MULTISTREAM_SHARD_ARG L" <pid> <shard> <list>");
+
+    section = OpenSection(wcstoul(argv[0], NULL, 10), FALSE, &sectionHandle);
+    if (!section)
+        FcReportError(GetLastError(), TRUE, L"Cannot connect to the primary file-sender");
+
+    shard = wcstol(argv[1], NULL, 10);
+    if (shard < 1 || shard >= section->Count)
+        FcReportError(ERROR_INVALID_PARAMETER, TRUE, L"Invalid shard %s", argv[1]);
+
+    helperShard = &section->Shards[shard];
+    if (InterlockedCompareExchange(&helperShard->Status, SHARD_STATUS_RUNNING, SHARD_STATUS_PENDING) != SHARD_STATUS_PENDING)
+    {
+        // the connection was accepted too late, end it without any files
+        LogInfo("shard %ld: already sent by the primary stream", shard);
+        return;
+    }
+
+    g_msHelperShard = helperShard;
+    atexit(HelperExit);
+    ProgressSetCounter(&g_msHelperShard->BytesDone);
+
+    SendList(argv[2], section, TRUE, sendFile);
+}
+
+void MsHelperDone(IN LONG status)
+{
+    if (g_msHelperShard)
+        InterlockedCompareExchange(&g_msHelperShard->Status, status, SHARD_STATUS_RUNNING);
+}
@@ -0,0 +1,103 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#pragma once
+#include "filecopy.h"
+
+// Splitting a transfer over several qubes.Filecopy connections ("streams") to the same
+// domain. The primary file-sender assigns regular files to shards by size, writes the
+// list of every other shard to a file and starts a helper file-sender for it through
+// qrexec-client-vm. Helpers report progress and status through a section shared with
+// the primary.
+//
+// Helpers send the parents of their files, so they exist on the receiving end. Their
+// times are only right once all files are in place: the primary waits for the helpers
+// and sends the metadata of all directories again at the end of its stream.
+//
+// Every helper is a separate qrexec call, checked by the policy like the primary one.
+// If the policy asks the user, each helper would show another prompt: the first helper
+// is started alone and the others only if it connects within MULTISTREAM_PROMPT_DELAY.
+// Shards whose helper hasn't connected by the time the primary has sent its own files
+// are sent by the primary (a helper connecting later exits without sending anything).
+
+#define MULTISTREAM_MAX_STREAMS 8
+// a helper that takes longer to connect probably waits for the user, ms
+#define MULTISTREAM_PROMPT_DELAY 2000
+#define MULTISTREAM_SECTION_NAME L"Local\\qubes-filecopy-%lu"
+#define MULTISTREAM_SHARD_ARG L"--shard"
+
+#define SHARD_STATUS_PENDING (-1) // helper not started yet
+#define SHARD_STATUS_RUNNING (-2)
+#define SHARD_STATUS_PRIMARY (-3) // sent by the primary, the helper must not start
+#define SHARD_STATUS_FAILED 1
+// 0 when done
+
+typedef struct _MULTISTREAM_SHARD
+{
+    volatile LONG64 BytesDone;
+    volatile LONG Status; // SHARD_STATUS_*
+} MULTISTREAM_SHARD;
+
+typedef struct _MULTISTREAM_SECTION
+{
+    volatile LONG Cancel; // set by the primary
+    LONG Count;
+    MULTISTREAM_SHARD Shards[MULTISTREAM_MAX_STREAMS]; // [0] is the primary
+} MULTISTREAM_SECTION;
+
+// Primary side. target is the domain the primary stream was requested for, only
+// an explicit name can be used for more connections. Returns FALSE if the transfer
+// has to use a single stream.
+BOOL MsInit(IN DWORD streams, IN const WCHAR *target OPTIONAL);
+
+// Called for every regular file in the size pass, in the send order.
+void MsAddFile(IN UINT64 size);
+
+// Assigns files to shards (largest first to the least loaded one).
+void MsAssignShards(void);
+
+// Called for every regular file in the send order, returns FALSE if the file
+// belongs to a helper. If list is set, the file is written to the helper's list instead.
+BOOL MsIsLocalFile(IN const WCHAR *fileName, IN BOOL list);
+
+// Closes the lists and starts the helpers (maybe only the first one, see above).
+void MsStartHelpers(void);
+
+// Sends the files of shards whose helper hasn't connected, with sendFile called like
+// in MsRunHelper. Called once the primary has sent its own files.
+typedef void (*fMsSendFile)(IN const WCHAR *fileName, IN DWORD attributes);
+void MsSendPendingShards(IN fMsSendFile sendFile);
+
+// Waits for all helpers, returns the number of failed ones.
+LONG MsWaitForHelpers(void);
+
+// Bytes sent by the helpers, for the progress dialog.
+UINT64 MsHelperBytes(void);
+
+void MsCancel(void);
+
+// Helper side: argv after MULTISTREAM_SHARD_ARG is <primary pid> <shard> <list>.
+// Sends the files from the list (with their parent directories), sendFile is called
+// with the current directory set. Sends nothing if the primary has taken the shard.
+void MsRunHelper(IN int argc, IN WCHAR *argv[], IN fMsSendFile sendFile);
+
+// Called by the helper when the transfer has finished, status 0 on success.
+void MsHelperDone(IN LONG status);
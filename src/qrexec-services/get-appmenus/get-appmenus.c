@@ -0,0 +1,551 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+// qubes.GetAppMenus: lists the start menu shortcuts as .desktop entries and maps
+// their names and icon names to the shortcut paths in the app map, for
+// qubes.StartApp and qubes.GetImageRGBA.
+//
+// Directories are walked on this thread and each shortcut is handled in the thread
+// pool as soon as it's found. The entries are collected and written out sorted once
+// all are ready, so the output doesn't depend on thread timing. Shortcuts that
+// haven't changed since the last run are taken from the index instead of being
+// read again.
+
+#include <windows.h>
+#include <ShlObj.h>
+#include <Knownfolders.h>
+#include <bcrypt.h>
+#include <strsafe.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <qubes-io.h>
+#include <log.h>
+
+#include "app-map.h"
+#include "dir-enum.h"
+#include "menu-index.h"
+#include "shortcut.h"
+
+#define PINNED_ITEMS_DIR L"Microsoft\\Internet Explorer\\Quick Launch\\User Pinned\\StartMenu"
+#define SHORTCUT_EXTENSION L".lnk"
+#define SHA1_SIZE 20
+
+// A shortcut found by the walk.
+typedef struct _MENU_JOB
+{
+    WCHAR *Path;
+    size_t RootLength; // the start menu directory it was found in
+    size_t DirectoryLength; // the directory it is in
+    UINT64 WriteTime;
+    UINT64 Size;
+    const MENU_ENTRY *Cached; // from the index, NULL if it has to be read
+} MENU_JOB;
+
+MENU_INDEX g_index;
+BCRYPT_ALG_HANDLE g_sha1 = NULL;
+PTP_CALLBACK_ENVIRON g_pool = NULL;
+TP_CALLBACK_ENVIRON g_poolEnvironment;
+
+// output and results are shared by the pool threads
+CRITICAL_SECTION g_resultsLock;
+MENU_ENTRY *g_results = NULL;
+size_t g_resultsCount = 0;
+size_t g_resultsCapacity = 0;
+APP_MAP_PAIR *g_pairs = NULL; // keys are owned, values are paths of the results
+size_t g_pairsCount = 0;
+size_t g_pairsCapacity = 0;
+char **g_output = NULL; // .desktop lines of each entry, UTF-8
+size_t g_outputCount = 0;
+size_t g_outputCapacity = 0;
+BOOL g_outputFailed = FALSE;
+size_t g_unchangedCount = 0;
+
+static BOOL HashPath(IN const WCHAR *path, OUT char *hash)
+{
+    BCRYPT_HASH_HANDLE hashHandle = NULL;
+    BYTE digest[SHA1_SIZE];
+    char *pathUtf8 = NULL;
+    int cbPath;
+    NTSTATUS status;
+    BOOL success = FALSE;
+    int i;
+
+    // the same hash the old script produced: SHA1 of the UTF-8 path
+    cbPath = WideCharToMultiByte(CP_UTF8, 0, path, -1, NULL, 0, NULL, NULL);
+    pathUtf8 = cbPath > 0 ? malloc(cbPath) : NULL;
+    if (!pathUtf8 || !WideCharToMultiByte(CP_UTF8, 0, path, -1, pathUtf8, cbPath, NULL, NULL))
+        goto cleanup;
+
+    status = BCryptCreateHash(g_sha1, &hashHandle, NULL, 0, NULL, 0, 0);
+    if (!BCRYPT_SUCCESS(status))
+    {
+        perror2(status, "BCryptCreateHash");
+        goto cleanup;
+    }
+
+    status = BCryptHashData(hashHandle, (UCHAR *)pathUtf8, cbPath - 1, 0);
+    if (BCRYPT_SUCCESS(status))
+        status = BCryptFinishHash(hashHandle, digest, sizeof(digest), 0);
+    if (!BCRYPT_SUCCESS(status))
+    {
+        perror2(status, "BCryptHashData");
+        goto cleanup;
+    }
+
+    for (i = 0; i < SHA1_SIZE; i++)
+        sprintf_s(hash + 2 * i, 3, "%02x", digest[i]);
+
+    success = TRUE;
+
+cleanup:
+    if (hashHandle)
+        BCryptDestroyHash(hashHandle);
+    free(pathUtf8);
+    return success;
+}
+
+// Returns a copy of length characters of source with each occurence of find replaced.
+static WCHAR *ReplaceAll(IN const WCHAR *source, IN size_t length, IN const WCHAR *find, IN const WCHAR *replace)
+{
+    size_t cchFind = wcslen(find);
+    size_t cchReplace = wcslen(replace);
+    size_t i, j = 0;
+    WCHAR *result;
+
+    // each character can become a whole replacement at most
+    result = malloc((length * max(cchReplace, 1) + 1) * sizeof(WCHAR));
+    if (!result)
+        return NULL;
+
+    for (i = 0; i < length;)
+    {
+        if (cchFind && i + cchFind <= length && 0 == wcsncmp(source + i, find, cchFind))
+        {
+            memcpy(result + j, replace, cchReplace * sizeof(WCHAR));
+            j += cchReplace;
+            i += cchFind;
+        }
+        else
+        {
+            result[j++] = source[i++];
+        }
+    }
+
+    result[j] = L'\0';
+    return result;
+}
+
+static void ReplaceCharacter(IN OUT WCHAR *string, IN WCHAR find, IN WCHAR replace)
+{
+    for (; *string; string++)
+    {
+        if (*string == find)
+            *string = replace;
+    }
+}
+
+// Makes room for one more element in a growable array.
+static BOOL Reserve(IN OUT void **array, IN OUT size_t *capacity, IN size_t count, IN size_t elementSize)
+{
+    void *newArray;
+    size_t newCapacity;
+
+    if (count < *capacity)
+        return TRUE;
+
+    newCapacity = max(256, 2 * *capacity);
+    newArray = realloc(*array, newCapacity * elementSize);
+    if (!newArray)
+        return FALSE;
+
+    *array = newArray;
+    *capacity = newCapacity;
+    return TRUE;
+}
+
+// Keeps the entry for the index and the names for the app map. Takes ownership of
+// all strings, they are freed if there is no memory.
+static void AddResult(IN OUT MENU_ENTRY *entry, IN WCHAR *hashName, IN WCHAR *desktopName)
+{
+    BOOL reserved;
+
+    EnterCriticalSection(&g_resultsLock);
+
+    reserved = Reserve((void **)&g_results, &g_resultsCapacity, g_resultsCount, sizeof(MENU_ENTRY)) &&
+        Reserve((void **)&g_pairs, &g_pairsCapacity, g_pairsCount + 1, sizeof(APP_MAP_PAIR));
+
+    if (reserved)
+    {
+        g_results[g_resultsCount++] = *entry;
+        g_pairs[g_pairsCount].Key = hashName;
+        g_pairs[g_pairsCount++].Value = entry->Path;
+        g_pairs[g_pairsCount].Key = desktopName;
+        g_pairs[g_pairsCount++].Value = entry->Path;
+    }
+
+    LeaveCriticalSection(&g_resultsLock);
+
+    if (!reserved)
+    {
+        MenuEntryFree(entry);
+        free(hashName);
+        free(desktopName);
+    }
+}
+
+// Keeps the .desktop lines of the entry (the same ones the old script printed) for WriteOutput.
+static void AddOutput(IN const WCHAR *linkName, IN const WCHAR *name, IN const WCHAR *exec, IN const WCHAR *comment, IN const char *hash)
+{
+    WCHAR *lines = NULL;
+    char *linesUtf8 = NULL;
+    size_t cchLines;
+    int cbLines;
+
+    cchLines = 4 * wcslen(linkName) + wcslen(name) + wcslen(exec) + wcslen(comment) + MENU_HASH_LENGTH + 64;
+    lines = malloc(cchLines * sizeof(WCHAR));
+    if (!lines)
+        goto cleanup;
+
+    if (FAILED(StringCchPrintf(lines, cchLines, L"%s:Name=%s\n%s:Exec=%s\n%s:Comment=%s\n%s:Icon=%S\n",
+        linkName, name, linkName, exec, linkName, comment, linkName, hash)))
+        goto cleanup;
+
+    cbLines = WideCharToMultiByte(CP_UTF8, 0, lines, -1, NULL, 0, NULL, NULL);
+    linesUtf8 = cbLines > 0 ? malloc(cbLines) : NULL;
+    if (!linesUtf8 || !WideCharToMultiByte(CP_UTF8, 0, lines, -1, linesUtf8, cbLines, NULL, NULL))
+        goto cleanup;
+
+    EnterCriticalSection(&g_resultsLock);
+    if (Reserve((void **)&g_output, &g_outputCapacity, g_outputCount, sizeof(char *)))
+    {
+        g_output[g_outputCount++] = linesUtf8;
+        linesUtf8 = NULL;
+    }
+    LeaveCriticalSection(&g_resultsLock);
+
+cleanup:
+    free(lines);
+    free(linesUtf8);
+}
+
+static int __cdecl CompareOutput(IN const void *output1, IN const void *output2)
+{
+    return strcmp(*(const char *const *)output1, *(const char *const *)output2);
+}
+
+// Sends the collected entries sorted by their .desktop names (each one starts with it).
+static void WriteOutput(void)
+{
+    size_t i;
+
+    qsort(g_output, g_outputCount, sizeof(char *), CompareOutput);
+    for (i = 0; i < g_outputCount; i++)
+    {
+        if (!g_outputFailed && !QioWriteBuffer(GetStdHandle(STD_OUTPUT_HANDLE), g_output[i], (DWORD)strlen(g_output[i])))
+        {
+            perror("QioWriteBuffer");
+            g_outputFailed = TRUE;
+        }
+
+        free(g_output[i]);
+    }
+
+    free(g_output);
+    g_output = NULL;
+    g_outputCount = 0;
+    g_outputCapacity = 0;
+}
+
+static void ProcessShortcut(IN OUT MENU_JOB *job)
+{
+    MENU_ENTRY entry = { 0 };
+    const WCHAR *relativePath = job->Path + job->RootLength + 1;
+    const WCHAR *fileName = job->Path + job->DirectoryLength + 1;
+    const WCHAR *extension;
+    WCHAR *desktopFileName = NULL;
+    WCHAR *desktopName = NULL;
+    WCHAR *linkName = NULL;
+    WCHAR *location = NULL;
+    WCHAR *name = NULL;
+    WCHAR *exec = NULL;
+    WCHAR *hashName = NULL;
+    WCHAR *c;
+    size_t cchName, cchExec, i;
+
+    entry.Path = job->Path;
+    entry.WriteTime = job->WriteTime;
+    entry.Size = job->Size;
+    job->Path = NULL;
+
+    if (job->Cached)
+    {
+        entry.Comment = _wcsdup(job->Cached->Comment);
+        memcpy(entry.Hash, job->Cached->Hash, sizeof(entry.Hash));
+    }
+    else
+    {
+        // We send .LNK file hash as icon name since the name can't contain some characters
+        // that can be in a file path and the GetImageRGBA Qubes service needs to retrieve
+        // bitmap from this name alone.
+        entry.Comment = ShortcutReadDescription(entry.Path);
+        if (!HashPath(entry.Path, entry.Hash))
+            goto cleanup;
+    }
+
+    // listed without a description, as the old script did
+    if (!entry.Comment)
+        entry.Comment = _wcsdup(L"");
+    if (!entry.Comment)
+        goto cleanup;
+
+    // a comment spanning lines would break the output format
+    for (c = entry.Comment; *c; c++)
+    {
+        if (*c == L'\r' || *c == L'\n')
+            *c = L' ';
+    }
+
+    desktopFileName = _wcsdup(relativePath);
+    if (!desktopFileName)
+        goto cleanup;
+    ReplaceCharacter(desktopFileName, L' ', L'_');
+    ReplaceCharacter(desktopFileName, L'\\', L'-');
+
+    desktopName = ReplaceAll(desktopFileName, wcslen(desktopFileName), SHORTCUT_EXTENSION, L"");
+    linkName = ReplaceAll(desktopFileName, wcslen(desktopFileName), SHORTCUT_EXTENSION, L".desktop");
+    // the menu directory (with a trailing space) goes in front of the name
+    if (job->DirectoryLength > job->RootLength)
+        location = ReplaceAll(relativePath, job->DirectoryLength - job->RootLength - 1, L"\\", L"-");
+    else
+        location = _wcsdup(L"");
+    cchExec = 2 * wcslen(entry.Path) + 16;
+    exec = malloc(cchExec * sizeof(WCHAR));
+    hashName = malloc((MENU_HASH_LENGTH + 1) * sizeof(WCHAR));
+    if (!desktopName || !linkName || !location || !exec || !hashName)
+        goto cleanup;
+
+    extension = wcsrchr(fileName, L'.');
+    cchName = wcslen(location) + wcslen(fileName) + 2;
+    name = malloc(cchName * sizeof(WCHAR));
+    if (!name || FAILED(StringCchPrintf(name, cchName, L"%s%s%.*s", location, location[0] ? L" " : L"",
+        (int)(extension ? extension - fileName : wcslen(fileName)), fileName)))
+        goto cleanup;
+
+    // cmd.exe /c "path" with backslashes escaped
+    wcscpy_s(exec, cchExec, L"cmd.exe /c \"");
+    i = wcslen(exec);
+    for (c = entry.Path; *c; c++)
+    {
+        if (*c == L'\\')
+            exec[i++] = L'\\';
+        exec[i++] = *c;
+    }
+    exec[i++] = L'"';
+    exec[i] = L'\0';
+
+    StringCchPrintf(hashName, MENU_HASH_LENGTH + 1, L"%S", entry.Hash);
+
+    AddOutput(linkName, name, exec, entry.Comment, entry.Hash);
+
+    AddResult(&entry, hashName, desktopName);
+    ZeroMemory(&entry, sizeof(entry));
+    hashName = NULL;
+    desktopName = NULL;
+
+cleanup:
+    if (entry.Path)
+        LogWarning("skipped '%s'", entry.Path);
+    MenuEntryFree(&entry);
+    free(desktopFileName);
+    free(desktopName);
+    free(linkName);
+    free(location);
+    free(name);
+    free(exec);
+    free(hashName);
+    free(job);
+}
+
+static void CALLBACK ShortcutCallback(IN OUT PTP_CALLBACK_INSTANCE instance, IN void *context)
+{
+    ProcessShortcut(context);
+}
+
+// Handles the shortcut now if it's in the index, otherwise queues it for reading.
+static void AddShortcut(IN const DIR_ENUM_PATH *path, IN size_t rootLength, IN size_t directoryLength, IN const DIR_ENUM_ENTRY *file)
+{
+    MENU_JOB *job = calloc(1, sizeof(MENU_JOB));
+
+    if (!job)
+        return;
+
+    job->Path = _wcsdup(path->Buffer);
+    job->RootLength = rootLength;
+    job->DirectoryLength = directoryLength;
+    job->WriteTime = file->WriteTime;
+    job->Size = file->Size;
+    if (!job->Path)
+    {
+        free(job);
+        return;
+    }
+
+    job->Cached = MenuIndexFind(&g_index, job->Path, job->WriteTime, job->Size);
+    if (job->Cached)
+        g_unchangedCount++;
+    if (job->Cached || !TrySubmitThreadpoolCallback(ShortcutCallback, job, g_pool))
+        ProcessShortcut(job);
+}
+
+static BOOL IsShortcut(IN const DIR_ENUM_ENTRY *entry)
+{
+    size_t cchExtension = wcslen(SHORTCUT_EXTENSION);
+
+    return entry->NameLength > cchExtension &&
+        0 == _wcsnicmp(entry->Name + entry->NameLength - cchExtension, SHORTCUT_EXTENSION, cchExtension);
+}
+
+// path is extended in place for the children.
+static void WalkDirectory(IN OUT DIR_ENUM_PATH *path, IN size_t rootLength, IN ULONG depth)
+{
+    DIR_ENUM dirEnum;
+    DIR_ENUM_ENTRY entry;
+    size_t directoryLength = path->Length;
+    size_t parentLength;
+    DWORD status;
+
+    status = DirEnumOpen(path->Buffer, depth, &dirEnum);
+    if (status != ERROR_SUCCESS)
+    {
+        perror2(status, "DirEnumOpen");
+        return;
+    }
+
+    while ((status = DirEnumNext(&dirEnum, &entry)) == ERROR_SUCCESS)
+    {
+        // links to other places are not followed
+        if (entry.Attributes & FILE_ATTRIBUTE_REPARSE_POINT)
+            continue;
+
+        if (!(entry.Attributes & FILE_ATTRIBUTE_DIRECTORY) && !IsShortcut(&entry))
+            continue;
+
+        if (!DirEnumPathAppend(path, L'\\', entry.Name, entry.NameLength, &parentLength))
+            break;
+
+        if (entry.Attributes & FILE_ATTRIBUTE_DIRECTORY)
+            WalkDirectory(path, rootLength, depth + 1);
+        else
+            AddShortcut(path, rootLength, directoryLength, &entry);
+
+        DirEnumPathTruncate(path, parentLength);
+    }
+
+    DirEnumClose(&dirEnum);
+    if (status != ERROR_SUCCESS && status != ERROR_NO_MORE_FILES)
+        perror2(status, "DirEnumNext");
+}
+
+static void WalkMenu(IN REFKNOWNFOLDERID folderId, IN const WCHAR *subdirectory OPTIONAL)
+{
+    WCHAR *folderPath;
+    WCHAR root[MAX_PATH];
+    DIR_ENUM_PATH path;
+    HRESULT hresult;
+
+    hresult = SHGetKnownFolderPath(folderId, 0, NULL, &folderPath);
+    if (FAILED(hresult))
+    {
+        perror2(hresult, "SHGetKnownFolderPath");
+        return;
+    }
+
+    if (subdirectory)
+        hresult = StringCchPrintf(root, RTL_NUMBER_OF(root), L"%s\\%s", folderPath, subdirectory);
+    else
+        hresult = StringCchCopy(root, RTL_NUMBER_OF(root), folderPath);
+    CoTaskMemFree(folderPath);
+    if (FAILED(hresult))
+        return;
+
+    if (GetFileAttributes(root) == INVALID_FILE_ATTRIBUTES)
+        return; // no pinned items
+
+    LogDebug("%s", root);
+    if (!DirEnumPathInit(&path, root))
+        return;
+
+    WalkDirectory(&path, path.Length, 0);
+    DirEnumPathFree(&path);
+}
+
+int wmain(int argc, WCHAR *argv[])
+{
+    PTP_CLEANUP_GROUP cleanupGroup = NULL;
+    NTSTATUS status;
+
+    InitializeCriticalSection(&g_resultsLock);
+
+    status = BCryptOpenAlgorithmProvider(&g_sha1, BCRYPT_SHA1_ALGORITHM, NULL, 0);
+    if (!BCRYPT_SUCCESS(status))
+        return perror2(status, "BCryptOpenAlgorithmProvider");
+
+    // shortcuts that can't be queued are read on this thread
+    cleanupGroup = CreateThreadpoolCleanupGroup();
+    if (cleanupGroup)
+    {
+        InitializeThreadpoolEnvironment(&g_poolEnvironment);
+        SetThreadpoolCallbackCleanupGroup(&g_poolEnvironment, cleanupGroup, NULL);
+        g_pool = &g_poolEnvironment;
+    }
+
+    MenuIndexLoad(&g_index);
+
+    // "All users" menu
+    WalkMenu(&FOLDERID_CommonPrograms, NULL);
+    // Current user menu
+    WalkMenu(&FOLDERID_StartMenu, NULL);
+    // Pinned Start Menu items
+    WalkMenu(&FOLDERID_RoamingAppData, PINNED_ITEMS_DIR);
+
+    if (cleanupGroup)
+    {
+        CloseThreadpoolCleanupGroupMembers(cleanupGroup, FALSE, NULL);
+        CloseThreadpoolCleanupGroup(cleanupGroup);
+        DestroyThreadpoolEnvironment(&g_poolEnvironment);
+    }
+
+    WriteOutput();
+    LogInfo("%Iu shortcuts, %Iu unchanged", g_resultsCount, g_unchangedCount);
+
+    // a partial listing must not remove anything
+    if (!g_outputFailed)
+    {
+        // the icon name for GetImageRGBA, the .desktop name for StartApp
+        AppMapWrite(g_pairs, g_pairsCount);
+        MenuIndexSave(g_results, g_resultsCount);
+    }
+
+    BCryptCloseAlgorithmProvider(g_sha1, 0);
+    return g_outputFailed ? ERROR_BROKEN_PIPE : ERROR_SUCCESS;
+}
@@ -0,0 +1,274 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#include <windows.h>
+#include <ShlObj.h>
+#include <Knownfolders.h>
+#include <strsafe.h>
+#include <stdlib.h>
+
+#include <qubes-io.h>
+#include <log.h>
+
+#include "menu-index.h"
+
+#define MENU_INDEX_FILE L"Qubes\\AppMenus.idx"
+#define MENU_INDEX_MAGIC 0x31494d51 // "QMI1"
+
+// larger files are treated as corrupted
+#define MENU_INDEX_MAX_SIZE (16*1024*1024)
+
+// File: MENU_INDEX_HEADER, then for each entry MENU_INDEX_RECORD followed by
+// the path and the comment (without terminating nulls).
+typedef struct _MENU_INDEX_HEADER
+{
+    DWORD Magic;
+    DWORD Count;
+} MENU_INDEX_HEADER;
+
+typedef struct _MENU_INDEX_RECORD
+{
+    UINT64 WriteTime;
+    UINT64 Size;
+    DWORD PathLength; // characters
+    DWORD CommentLength; // characters
+    char Hash[MENU_HASH_LENGTH];
+} MENU_INDEX_RECORD;
+
+static BOOL GetIndexPath(IN BOOL create, OUT WCHAR *path, IN size_t cchPath)
+{
+    WCHAR *localAppData;
+    WCHAR *separator;
+    HRESULT hresult;
+    int status;
+
+    hresult = SHGetKnownFolderPath(&FOLDERID_LocalAppData, 0, NULL, &localAppData);
+    if (FAILED(hresult))
+    {
+        perror2(hresult, "SHGetKnownFolderPath");
+        return FALSE;
+    }
+
+    hresult = StringCchPrintf(path, cchPath, L"%s\\%s", localAppData, MENU_INDEX_FILE);
+    CoTaskMemFree(localAppData);
+    if (FAILED(hresult))
+    {
+        perror2(hresult, "StringCchPrintf");
+        return FALSE;
+    }
+
+    if (create)
+    {
+        separator = wcsrchr(path, L'\\');
+        *separator = L'\0';
+        status = SHCreateDirectoryEx(NULL, path, NULL);
+        *separator = L'\\';
+        if (status != ERROR_SUCCESS && status != ERROR_ALREADY_EXISTS && status != ERROR_FILE_EXISTS)
+        {
+            perror2(status, "SHCreateDirectoryEx");
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static WCHAR *DuplicateString(IN const WCHAR *string, IN size_t length)
+{
+    WCHAR *copy = malloc((length + 1) * sizeof(WCHAR));
+
+    if (copy)
+    {
+        memcpy(copy, string, length * sizeof(WCHAR));
+        copy[length] = L'\0';
+    }
+
+    return copy;
+}
+
+static int CompareEntries(IN const void *a, IN const void *b)
+{
+    return wcscmp(((const MENU_ENTRY *)a)->Path, ((const MENU_ENTRY *)b)->Path);
+}
+
+// Fills index from the file contents, FALSE if they are not valid.
+static BOOL ParseIndex(IN const BYTE *data, IN DWORD size, OUT MENU_INDEX *index)
+{
+    const MENU_INDEX_HEADER *header = (const MENU_INDEX_HEADER *)data;
+    const MENU_INDEX_RECORD *record;
+    MENU_ENTRY *entry;
+    DWORD offset = sizeof(*header);
+    DWORD i;
+
+    if (size < sizeof(*header) || header->Magic != MENU_INDEX_MAGIC || header->Count > size / sizeof(*record))
+        return FALSE;
+
+    index->Entries = calloc(header->Count, sizeof(MENU_ENTRY));
+    if (!index->Entries)
+        return FALSE;
+
+    for (i = 0; i < header->Count; i++)
+    {
+        if (size - offset < sizeof(*record))
+            return FALSE;
+
+        record = (const MENU_INDEX_RECORD *)(data + offset);
+        offset += sizeof(*record);
+        if (record->PathLength == 0 || record->PathLength > MAXSHORT || record->CommentLength > MAXSHORT ||
+            (size - offset) / sizeof(WCHAR) < (DWORD)record->PathLength + record->CommentLength)
+            return FALSE;
+
+        entry = &index->Entries[index->Count++];
+        entry->WriteTime = record->WriteTime;
+        entry->Size = record->Size;
+        memcpy(entry->Hash, record->Hash, MENU_HASH_LENGTH);
+        entry->Hash[MENU_HASH_LENGTH] = 0;
+        entry->Path = DuplicateString((const WCHAR *)(data + offset), record->PathLength);
+        offset += record->PathLength * sizeof(WCHAR);
+        entry->Comment = DuplicateString((const WCHAR *)(data + offset), record->CommentLength);
+        offset += record->CommentLength * sizeof(WCHAR);
+
+        if (!entry->Path || !entry->Comment)
+            return FALSE;
+    }
+
+    qsort(index->Entries, index->Count, sizeof(MENU_ENTRY), CompareEntries);
+    return TRUE;
+}
+
+void MenuIndexLoad(OUT MENU_INDEX *index)
+{
+    WCHAR indexPath[MAX_PATH];
+    HANDLE file;
+    LARGE_INTEGER fileSize;
+    BYTE *data = NULL;
+
+    ZeroMemory(index, sizeof(*index));
+
+    if (!GetIndexPath(FALSE, indexPath, RTL_NUMBER_OF(indexPath)))
+        return;
+
+    file = CreateFile(indexPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return; // first run
+
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart > MENU_INDEX_MAX_SIZE)
+        goto cleanup;
+
+    data = malloc(fileSize.LowPart + 1);
+    if (!data || !QioReadBuffer(file, data, fileSize.LowPart))
+        goto cleanup;
+
+    if (!ParseIndex(data, fileSize.LowPart, index))
+    {
+        LogWarning("index '%s' is not valid, reading all shortcuts", indexPath);
+        MenuIndexFree(index);
+    }
+
+cleanup:
+    free(data);
+    CloseHandle(file);
+    LogDebug("%Iu entries", index->Count);
+}
+
+const MENU_ENTRY *MenuIndexFind(IN const MENU_INDEX *index, IN const WCHAR *path, IN UINT64 writeTime, IN UINT64 size)
+{
+    MENU_ENTRY key;
+    const MENU_ENTRY *entry;
+
+    if (index->Count == 0)
+        return NULL;
+
+    key.Path = (WCHAR *)path;
+    entry = bsearch(&key, index->Entries, index->Count, sizeof(MENU_ENTRY), CompareEntries);
+    if (!entry || entry->WriteTime != writeTime || entry->Size != size)
+        return NULL;
+
+    return entry;
+}
+
+void MenuIndexSave(IN const MENU_ENTRY *entries, IN size_t count)
+{
+    WCHAR indexPath[MAX_PATH];
+    WCHAR tempPath[MAX_PATH];
+    MENU_INDEX_HEADER header;
+    MENU_INDEX_RECORD record;
+    HANDLE file;
+    BOOL written;
+    size_t i;
+
+    if (!GetIndexPath(TRUE, indexPath, RTL_NUMBER_OF(indexPath)) ||
+        FAILED(StringCchPrintf(tempPath, RTL_NUMBER_OF(tempPath), L"%s.tmp", indexPath)))
+        return;
+
+    // written aside and moved in place, a parallel run never sees a partial index
+    file = CreateFile(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        perror("CreateFile");
+        return;
+    }
+
+    header.Magic = MENU_INDEX_MAGIC;
+    header.Count = (DWORD)count;
+    written = QioWriteBuffer(file, &header, sizeof(header));
+
+    for (i = 0; i < count && written; i++)
+    {
+        record.WriteTime = entries[i].WriteTime;
+        record.Size = entries[i].Size;
+        record.PathLength = (DWORD)wcslen(entries[i].Path);
+        record.CommentLength = (DWORD)wcslen(entries[i].Comment);
+        memcpy(record.Hash, entries[i].Hash, MENU_HASH_LENGTH);
+
+        written = QioWriteBuffer(file, &record, sizeof(record)) &&
+            QioWriteBuffer(file, entries[i].Path, record.PathLength * sizeof(WCHAR)) &&
+            QioWriteBuffer(file, entries[i].Comment, record.CommentLength * sizeof(WCHAR));
+    }
+
+    CloseHandle(file);
+
+    if (!written || !MoveFileEx(tempPath, indexPath, MOVEFILE_REPLACE_EXISTING))
+    {
+        perror("saving index");
+        DeleteFile(tempPath);
+    }
+}
+
+void MenuEntryFree(IN OUT MENU_ENTRY *entry)
+{
+    free(entry->Path);
+    free(entry->Comment);
+    entry->Path = NULL;
+    entry->Comment = NULL;
+}
+
+void MenuIndexFree(IN OUT MENU_INDEX *index)
+{
+    size_t i;
+
+    for (i = 0; i < index->Count; i++)
+        MenuEntryFree(&index->Entries[i]);
+
+    free(index->Entries);
+    ZeroMemory(index, sizeof(*index));
+}
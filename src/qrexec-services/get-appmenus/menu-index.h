@@ -0,0 +1,60 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+// What was read from each shortcut on the last run, kept on disk so a shortcut is
+// only read again when its size or modification time changes.
+
+#pragma once
+#include <windows.h>
+
+// lowercase hex SHA1 of the shortcut path, the icon name
+#define MENU_HASH_LENGTH 40
+
+typedef struct _MENU_ENTRY
+{
+    WCHAR *Path;
+    UINT64 WriteTime; // FILETIME
+    UINT64 Size;
+    WCHAR *Comment;
+    char Hash[MENU_HASH_LENGTH + 1];
+} MENU_ENTRY;
+
+// entries sorted by path
+typedef struct _MENU_INDEX
+{
+    MENU_ENTRY *Entries;
+    size_t Count;
+} MENU_INDEX;
+
+// Loads the index of the last run, empty if there is none or it can't be used.
+void MenuIndexLoad(OUT MENU_INDEX *index);
+
+// Returns the entry for path if the shortcut hasn't changed since, NULL otherwise.
+const MENU_ENTRY *MenuIndexFind(IN const MENU_INDEX *index, IN const WCHAR *path, IN UINT64 writeTime, IN UINT64 size);
+
+// Replaces the index on disk with count entries, in any order.
+void MenuIndexSave(IN const MENU_ENTRY *entries, IN size_t count);
+
+void MenuIndexFree(IN OUT MENU_INDEX *index);
+
+// Frees the strings of an entry.
+void MenuEntryFree(IN OUT MENU_ENTRY *entry);
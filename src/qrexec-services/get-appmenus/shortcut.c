@@ -0,0 +1,160 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#include <windows.h>
+#include <stdlib.h>
+
+#include <qubes-io.h>
+#include <log.h>
+
+#include "shortcut.h"
+
+#define LINK_HEADER_SIZE 0x4c
+
+// LinkFlags
+#define HAS_LINK_TARGET_ID_LIST 0x00000001
+#define HAS_LINK_INFO           0x00000002
+#define HAS_NAME                0x00000004
+#define IS_UNICODE              0x00000080
+
+#pragma pack(push, 1)
+typedef struct _SHELL_LINK_HEADER
+{
+    UINT32 HeaderSize;
+    BYTE LinkClsid[16];
+    UINT32 LinkFlags;
+    UINT32 FileAttributes;
+    FILETIME CreationTime;
+    FILETIME AccessTime;
+    FILETIME WriteTime;
+    UINT32 FileSize;
+    INT32 IconIndex;
+    UINT32 ShowCommand;
+    UINT16 HotKey;
+    BYTE Reserved[10];
+} SHELL_LINK_HEADER;
+#pragma pack(pop)
+
+// 00021401-0000-0000-C000-000000000046
+static const BYTE g_linkClsid[16] = { 0x01, 0x14, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 };
+
+// The description is the first string after the optional ID list and link info.
+static WCHAR *ParseDescription(IN const BYTE *data, IN DWORD size)
+{
+    const SHELL_LINK_HEADER *header = (const SHELL_LINK_HEADER *)data;
+    DWORD offset = LINK_HEADER_SIZE;
+    DWORD count, cbString;
+    UINT32 cbLinkInfo;
+    WCHAR *description;
+    int cchDescription;
+
+    if (size < LINK_HEADER_SIZE || header->HeaderSize != LINK_HEADER_SIZE || memcmp(header->LinkClsid, g_linkClsid, sizeof(g_linkClsid)) != 0)
+        return NULL;
+
+    if (header->LinkFlags & HAS_LINK_TARGET_ID_LIST)
+    {
+        if (offset + sizeof(UINT16) > size)
+            return NULL;
+        offset += sizeof(UINT16) + *(const UINT16 *)(data + offset);
+    }
+
+    if (header->LinkFlags & HAS_LINK_INFO)
+    {
+        if (offset + sizeof(UINT32) > size)
+            return NULL;
+        cbLinkInfo = *(const UINT32 *)(data + offset);
+        // the size includes itself
+        if (cbLinkInfo < sizeof(UINT32) || cbLinkInfo > size - offset)
+            return NULL;
+        offset += cbLinkInfo;
+    }
+
+    if (!(header->LinkFlags & HAS_NAME))
+        return calloc(1, sizeof(WCHAR));
+
+    if (offset + sizeof(UINT16) > size)
+        return NULL;
+
+    count = *(const UINT16 *)(data + offset);
+    offset += sizeof(UINT16);
+    cbString = (header->LinkFlags & IS_UNICODE) ? count * sizeof(WCHAR) : count;
+    if (cbString > size - offset)
+        return NULL;
+
+    description = malloc((count + 1) * sizeof(WCHAR));
+    if (!description)
+        return NULL;
+
+    if (header->LinkFlags & IS_UNICODE)
+    {
+        memcpy(description, data + offset, cbString);
+        cchDescription = count;
+    }
+    else
+    {
+        // strings of old shortcuts are in the system code page
+        cchDescription = count ? MultiByteToWideChar(CP_ACP, 0, (const char *)data + offset, count, description, count) : 0;
+    }
+
+    description[cchDescription] = L'\0';
+    return description;
+}
+
+WCHAR *ShortcutReadDescription(IN const WCHAR *path)
+{
+    HANDLE file;
+    LARGE_INTEGER fileSize;
+    BYTE *data = NULL;
+    WCHAR *description = NULL;
+
+    file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        perror("CreateFile");
+        return NULL;
+    }
+
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart > SHORTCUT_MAX_SIZE)
+    {
+        LogWarning("'%s' is not a usable shortcut", path);
+        goto cleanup;
+    }
+
+    data = malloc((size_t)fileSize.QuadPart + 1);
+    if (!data)
+        goto cleanup;
+
+    if (!QioReadBuffer(file, data, fileSize.LowPart))
+    {
+        perror("QioReadBuffer");
+        goto cleanup;
+    }
+
+    description = ParseDescription(data, fileSize.LowPart);
+    if (!description)
+        LogWarning("'%s' is not a valid shortcut", path);
+
+cleanup:
+    free(data);
+    CloseHandle(file);
+    return description;
+}
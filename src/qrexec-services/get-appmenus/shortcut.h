@@ -0,0 +1,34 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+// Reads what the start menu needs straight from .lnk files (MS-SHLLINK), without
+// COM, so shortcuts can be read from any thread.
+
+#pragma once
+#include <windows.h>
+
+// largest shortcut file read, real ones are a few KiB
+#define SHORTCUT_MAX_SIZE (1024*1024)
+
+// Returns the description (comment) of the shortcut, empty if it has none.
+// NULL if the file can't be read or isn't a shortcut. Free with free().
+WCHAR *ShortcutReadDescription(IN const WCHAR *path);
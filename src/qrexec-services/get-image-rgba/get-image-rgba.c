@@ -22,58 +22,164 @@
 #include <windows.h>
 #include <Shlwapi.h>
 #include <shellapi.h>
-
-#include <stdio.h>
-#include <io.h>
-#include <fcntl.h>
+#include <shlobj.h>
+#include <strsafe.h>
+#include <stdlib.h>
 
 #include <qubes-io.h>
 #include <utf8-conv.h>
+#include <config.h>
 #include <log.h>
 
-#define APP_MAP_KEY L"Software\\Invisible Things Lab\\Qubes Tools\\AppMap"
+#include "app-map.h"
+#include "icon-cache.h"
+#include "icon-rgba.h"
+
 #define MAX_PATH_LONG 32768
 #define INPUT_PREFIX "xdgicon:"
 
-DWORD GetShortcutPath(OUT WCHAR *linkPath, IN DWORD linkPathLength)
+// Sends icons for a list of names in one call, used for appmenus synchronization.
+// Input is one request per line, in the same form as the single one, until EOF.
+// Output is a record per request in the same order: ICON_RECORD, the request name
+// (with the prefix, without the size) and width * height straight RGBA pixels.
+// Icons that can't be read have 0 width and height.
+#define BATCH_ARG L"-batch"
+
+// more than the lines for any start menu
+#define BATCH_MAX_INPUT (1024*1024)
+
+#pragma pack(push, 1)
+typedef struct _ICON_RECORD
 {
-    char param[64] = { 0 };
-    DWORD status;
-    HKEY key = NULL;
-    WCHAR *valueName = NULL;
-    DWORD valueType;
-    DWORD size, i;
+    UINT32 NameSize;
+    UINT32 Width;
+    UINT32 Height;
+} ICON_RECORD;
+#pragma pack(pop)
+
+// Where rendered icons go: the plain service output or batch records.
+typedef struct _ICON_OUTPUT
+{
+    HANDLE Handle;
+    BOOL Batch;
+    const char *Name; // current request, batch only
+    BOOL Failed; // writing failed, nothing more can be sent
+} ICON_OUTPUT;
+
+// icon sizes that usually exist as resources, smallest first
+static const DWORD g_iconSizes[] = { 16, 20, 24, 32, 40, 48, 64, 96, 128, 256 };
+
+// Parses the "width height\n" line of a rendered icon.
+static BOOL ParseIconSize(IN const BYTE *data, IN DWORD size, OUT UINT32 *width, OUT UINT32 *height, OUT DWORD *cbHeader)
+{
+    char header[32];
+    char *end;
+    const BYTE *newline = memchr(data, '\n', min(size, sizeof(header) - 1));
+
+    if (!newline)
+        return FALSE;
+
+    *cbHeader = (DWORD)(newline - data + 1);
+    memcpy(header, data, *cbHeader);
+    header[*cbHeader] = 0;
+
+    *width = strtoul(header, &end, 10);
+    *height = strtoul(end, &end, 10);
+
+    // pixels and the final newline must follow
+    return *end == '\n' && *width <= ICON_MAX_SIZE && *height <= ICON_MAX_SIZE &&
+        size == *cbHeader + 4 * *width * *height + 1;
+}
+
+static BOOL WriteRecord(IN OUT ICON_OUTPUT *output, IN UINT32 width, IN UINT32 height, IN const BYTE *pixels OPTIONAL)
+{
+    ICON_RECORD record;
+
+    record.NameSize = (UINT32)strlen(output->Name);
+    record.Width = width;
+    record.Height = height;
 
-    // Input is in the form of: xdgicon:name
-    // Name is a sha1 hash of the file in this case, we'll look it up in the registry.
-    // It's set by GetAppMenus Qubes service.
-    size = QioReadUntilEof(GetStdHandle(STD_INPUT_HANDLE), param, sizeof(param) - 1);
-    if (size == 0)
+    if (!QioWriteBuffer(output->Handle, &record, sizeof(record)) ||
+        !QioWriteBuffer(output->Handle, output->Name, record.NameSize) ||
+        (pixels && !QioWriteBuffer(output->Handle, pixels, 4 * width * height)))
     {
-        status = perror("QioReadUntilEof(stdin)");
-        goto cleanup;
+        perror("QioWriteBuffer");
+        output->Failed = TRUE;
+        return FALSE;
     }
 
-    LogDebug("input: '%S'", param);
+    return TRUE;
+}
 
-    // Strip whitespaces at the end.
-    for (i = RTL_NUMBER_OF(param) - 1; i > 0; i--)
-    {
-        if (param[i] == 0)
-            continue;
+// Sends a rendered icon, returns FALSE if it couldn't be written.
+BOOL WriteIcon(IN void *context, IN const BYTE *data, IN DWORD size)
+{
+    ICON_OUTPUT *output = context;
+    UINT32 width, height;
+    DWORD cbHeader;
 
-        if (isspace(param[i]))
-        {
-            param[i] = 0;
-        }
-        else
+    if (!output->Batch)
+    {
+        if (!QioWriteBuffer(output->Handle, data, size))
         {
-            break; // stop on first non-space character
+            perror("QioWriteBuffer");
+            output->Failed = TRUE;
+            return FALSE;
         }
+
+        return TRUE;
+    }
+
+    if (!ParseIconSize(data, size, &width, &height, &cbHeader))
+    {
+        LogError("invalid icon data for '%S'", output->Name);
+        return WriteRecord(output, 0, 0, NULL);
+    }
+
+    return WriteRecord(output, width, height, data + cbHeader);
+}
+
+// request is the input line: xdgicon:name [size]
+// Name is a sha1 hash of the file in this case, we'll look it up in the app map.
+// It's set by GetAppMenus Qubes service.
+// iconName receives the name part of the input, it identifies the icon in the cache.
+// targetSize is the optional size after the name, 0 if not given. The request is
+// cut after the name.
+DWORD GetShortcutPath(IN const APP_MAP *appMap, IN OUT char *request, OUT WCHAR *linkPath, IN DWORD linkPathLength,
+    OUT WCHAR *iconName, IN DWORD iconNameLength, OUT DWORD *targetSize)
+{
+    DWORD status;
+    WCHAR *valueName = NULL;
+    const WCHAR *path;
+    size_t i;
+    char *sizeParam;
+
+    LogDebug("input: '%S'", request);
+
+    // Strip whitespaces at the end.
+    for (i = strlen(request); i > 0 && isspace(request[i - 1]); i--)
+        request[i - 1] = 0;
+
+    *targetSize = 0;
+    sizeParam = strrchr(request, ' ');
+    if (sizeParam)
+    {
+        *sizeParam++ = 0;
+        *targetSize = strtoul(sizeParam, NULL, 10);
+        // 0 sends the icon as it is
+        if (*targetSize > ICON_MAX_TARGET_SIZE)
+            *targetSize = ICON_MAX_TARGET_SIZE;
+    }
+
+    if (strncmp(request, INPUT_PREFIX, strlen(INPUT_PREFIX)) != 0)
+    {
+        LogError("invalid request '%S'", request);
+        SetLastError(status = ERROR_INVALID_PARAMETER);
+        goto cleanup;
     }
 
     // convert ascii to wchar
-    if (ERROR_SUCCESS != ConvertUTF8ToUTF16(param, &valueName, NULL))
+    if (ERROR_SUCCESS != ConvertUTF8ToUTF16(request, &valueName, NULL))
     {
         status = perror("ConvertUTF8ToUTF16");
         goto cleanup;
@@ -81,83 +187,97 @@ DWORD GetShortcutPath(OUT WCHAR *linkPath, IN DWORD linkPathLength)
 
     LogDebug("input converted: '%s'", valueName);
 
-    SetLastError(status = RegOpenKeyEx(HKEY_LOCAL_MACHINE, APP_MAP_KEY, 0, KEY_READ, &key));
-    if (status != ERROR_SUCCESS)
-    {
-        status = perror("RegOpenKeyEx(AppMap key)");
-        goto cleanup;
-    }
+    // each size is cached separately
+    if (FAILED(*targetSize ? StringCchPrintf(iconName, iconNameLength, L"%s-%lu", valueName + strlen(INPUT_PREFIX), *targetSize)
+        : StringCchCopy(iconName, iconNameLength, valueName + strlen(INPUT_PREFIX))))
+        iconName[0] = L'\0'; // not cached
 
-    size = linkPathLength * sizeof(WCHAR); // buffer size
-    SetLastError(status = RegQueryValueEx(key, valueName + strlen(INPUT_PREFIX), NULL, &valueType, (BYTE *) linkPath, &size));
-    if (status != ERROR_SUCCESS)
+    path = AppMapLookup(appMap, valueName + strlen(INPUT_PREFIX));
+    if (!path)
     {
-        status = perror("RegQueryValueEx");
+        LogError("'%s' is not in the app map", valueName);
+        SetLastError(status = ERROR_FILE_NOT_FOUND);
         goto cleanup;
     }
 
-    if (valueType != REG_SZ)
+    if (FAILED(StringCchCopy(linkPath, linkPathLength, path)))
     {
-        SetLastError(status = ERROR_DATATYPE_MISMATCH);
-        perror("RegQueryValueEx");
+        SetLastError(status = ERROR_BUFFER_OVERFLOW);
         goto cleanup;
     }
 
+    status = ERROR_SUCCESS;
+
 cleanup:
-    if (key)
-        RegCloseKey(key);
     if (valueName)
         free(valueName);
     return status;
 }
 
-int wmain(int argc, WCHAR *argv[])
+// Loads the icon resource that best fits targetSize: the smallest usual size not
+// below it, so it only needs to be scaled down. Windows picks the closest
+// resource if that size doesn't exist.
+HICON ExtractIconForSize(IN const WCHAR *iconPath, IN int iconIndex, IN DWORD targetSize)
+{
+    HICON icon = NULL;
+    DWORD loadSize = g_iconSizes[RTL_NUMBER_OF(g_iconSizes) - 1];
+    DWORD i;
+    HRESULT hresult;
+
+    if (targetSize == 0)
+        return ExtractIcon(0, iconPath, iconIndex);
+
+    for (i = 0; i < RTL_NUMBER_OF(g_iconSizes); i++)
+    {
+        if (g_iconSizes[i] >= targetSize)
+        {
+            loadSize = g_iconSizes[i];
+            break;
+        }
+    }
+
+    hresult = SHDefExtractIcon(iconPath, iconIndex, 0, &icon, NULL, loadSize);
+    if (hresult != S_OK)
+    {
+        LogWarning("SHDefExtractIcon(%s, %d, %lu) failed: 0x%x", iconPath, iconIndex, loadSize, hresult);
+        return ExtractIcon(0, iconPath, iconIndex);
+    }
+
+    LogDebug("loaded %s,%d at %lu for size %lu", iconPath, iconIndex, loadSize, targetSize);
+    return icon;
+}
+
+// Renders the icon of the shortcut (or takes it from the cache) and sends it to output.
+DWORD SendIcon(IN const WCHAR *linkPath, IN const WCHAR *iconName, IN DWORD targetSize, IN BOOL useCache,
+    IN OUT ICON_RGBA *iconRgba, IN OUT ICON_OUTPUT *output)
 {
-    WCHAR *linkPath = NULL;
-    WORD pi = -1;
-    ICONINFO ii;
     SHFILEINFO shfi = { 0 };
     HICON ico = NULL;
-    HDC dc;
-    BITMAP bm;
-    DWORD size;
-    BYTE *buffer;
-    BITMAPINFO bmi;
-    int x, y;
     DWORD_PTR ret;
     DWORD status;
-#ifdef WRITE_PPM
-    FILE *f1;
-#endif
+    FILETIME linkTime, sourceTime = { 0 };
+    BOOL cacheable;
+    const BYTE *outputBuffer;
+    DWORD cbOutput;
 
-    status = ERROR_NOT_ENOUGH_MEMORY;
-    linkPath = malloc(MAX_PATH_LONG*sizeof(WCHAR));
-    if (!linkPath)
-        goto cleanup;
-
-    // Set stdout to binary mode to prevent newline conversions.
-    _setmode(_fileno(stdout), _O_BINARY);
+    LogDebug("LinkPath: %s", linkPath);
 
-    // Read input and convert it to the shortcut path.
-    if (ERROR_SUCCESS != GetShortcutPath(linkPath, MAX_PATH_LONG))
+    // Times are taken before the icon is read, a later change invalidates the entry.
+    cacheable = useCache && iconName[0] && IconCacheFileTime(linkPath, &linkTime);
+    if (cacheable)
     {
-        status = perror("GetShortcutPath");
-        goto cleanup;
+        status = IconCacheServe(iconName, linkPath, WriteIcon, output);
+        if (status != ERROR_FILE_NOT_FOUND)
+            return status;
     }
 
-    LogDebug("LinkPath: %s", linkPath);
-
-    CoInitialize(NULL);
     // We use SHGFI_ICONLOCATION and load the icon manually later, because icons retrieved by
     // SHGFI_ICON always have the shortcut arrow overlay even if the overlay is not visible
     // normally (eg. for start menu shortcuts).
     ret = SHGetFileInfo(linkPath, 0, &shfi, sizeof(shfi), SHGFI_ICONLOCATION);
     LogDebug("SHGetFileInfo(%s) returned 0x%x, shfi.szDisplayName='%s', shfi.iIcon=%d", linkPath, ret, shfi.szDisplayName, shfi.iIcon);
     if (!ret)
-    {
-        status = perror("SHGetFileInfo(SHGFI_ICONLOCATION)");
-        goto cleanup;
-    }
+        return perror("SHGetFileInfo(SHGFI_ICONLOCATION)");
 
     if (shfi.szDisplayName[0] == 0)
     {
@@ -166,85 +286,142 @@ int wmain(int argc, WCHAR *argv[])
         // SHGFI_ICON which will retrieve an icon with the shortcut arrow overlay.
         ret = SHGetFileInfo(linkPath, 0, &shfi, sizeof(shfi), SHGFI_ICON);
         if (!ret)
-        {
-            status = perror("SHGetFileInfo(SHGFI_ICON)");
-            goto cleanup;
-        }
+            return perror("SHGetFileInfo(SHGFI_ICON)");
+
         ico = shfi.hIcon;
+        shfi.szDisplayName[0] = 0; // the icon comes from the shortcut itself
     }
     else
     {
-        ico = ExtractIcon(0, shfi.szDisplayName, shfi.iIcon);
+        // a source that can't be checked (a system icon library name) is not cached
+        if (cacheable)
+            cacheable = IconCacheFileTime(shfi.szDisplayName, &sourceTime);
+        ico = ExtractIconForSize(shfi.szDisplayName, shfi.iIcon, targetSize);
     }
 
-    // Create bitmap for the icon.
-    if (!GetIconInfo(ico, &ii))
+    status = ERROR_INVALID_DATA;
+    if (ico && IconRgbaRender(iconRgba, ico, targetSize, &outputBuffer, &cbOutput))
     {
-        status = perror("GetIconInfo");
-        goto cleanup;
-    }
+        status = WriteIcon(output, outputBuffer, cbOutput) ? ERROR_SUCCESS : ERROR_WRITE_FAULT;
 
-    dc = CreateCompatibleDC(NULL);
-    SelectObject(dc, ii.hbmColor);
+        if (status == ERROR_SUCCESS && cacheable)
+            IconCacheStore(iconName, linkPath, &linkTime, shfi.szDisplayName[0] ? shfi.szDisplayName : NULL, &sourceTime, outputBuffer, cbOutput);
+    }
 
-    // Retrieve the color bitmap of the icon.
-    GetObject(ii.hbmColor, sizeof(bm), &bm);
+    // the process keeps going in batch mode
+    if (ico)
+        DestroyIcon(ico);
 
-    size = bm.bmBitsPixel / 8 * bm.bmHeight * bm.bmWidth; // pixel buffer size
-    buffer = (BYTE *) malloc(size); // pixel buffer
-    ZeroMemory(&bmi, sizeof(BITMAPINFO));
-    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-    bmi.bmiHeader.biWidth = bm.bmWidth;
-    bmi.bmiHeader.biHeight = bm.bmHeight;
-    bmi.bmiHeader.biPlanes = bm.bmPlanes;
-    bmi.bmiHeader.biBitCount = bm.bmBitsPixel;
+    if (status != ERROR_SUCCESS)
+        LogError("LinkPath: %s", linkPath);
+    return status;
+}
 
-    // Copy pixel buffer.
-    GetDIBits(dc, ii.hbmColor, 0, bm.bmHeight, buffer, &bmi, DIB_RGB_COLORS);
+// Answers each line of the input with a record, a failed icon doesn't stop the rest.
+DWORD SendIcons(IN const APP_MAP *appMap, IN WCHAR *linkPath, IN BOOL useCache, IN OUT ICON_RGBA *iconRgba, IN OUT ICON_OUTPUT *output)
+{
+    char *input, *line, *next;
+    WCHAR iconName[64];
+    DWORD targetSize;
+    DWORD size;
+    DWORD count = 0;
 
-    LogDebug("Size: %dx%d", bm.bmWidth, bm.bmHeight);
-    printf("%d %d\n", bm.bmWidth, bm.bmHeight);
+    input = malloc(BATCH_MAX_INPUT + 1);
+    if (!input)
+        return ERROR_NOT_ENOUGH_MEMORY;
 
-#ifdef WRITE_PPM
-    // Create a PPM bitmap file.
-    f1 = fopen("icon.ppm", "w");
-    fprintf(f1, "P3\n");
-    fprintf(f1, "%d %d\n", bm.bmWidth, bm.bmHeight);
-    fprintf(f1, "255\n");
-#endif
+    size = QioReadUntilEof(GetStdHandle(STD_INPUT_HANDLE), input, BATCH_MAX_INPUT);
+    input[size] = 0;
+    if (size == BATCH_MAX_INPUT)
+        LogWarning("batch input truncated at %lu bytes", size);
 
-    // Output bitmap.
-    for (y = 0; y < bm.bmHeight; y++)
+    for (line = input; line && *line && !output->Failed; line = next)
     {
-        for (x = 0; x < bm.bmWidth; x++)
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = 0;
+
+        if (line[0] == 0 || (line[0] == '\r' && line[1] == 0))
+            continue;
+
+        // the record carries the name without the size
+        output->Name = line;
+        if (ERROR_SUCCESS != GetShortcutPath(appMap, line, linkPath, MAX_PATH_LONG, iconName, RTL_NUMBER_OF(iconName), &targetSize) ||
+            ERROR_SUCCESS != SendIcon(linkPath, iconName, targetSize, useCache, iconRgba, output))
         {
-            DWORD offset = (bm.bmHeight - y - 1) * 4 * bm.bmWidth + x * 4;
-            BYTE b = *(buffer + offset + 0);
-            BYTE g = *(buffer + offset + 1);
-            BYTE r = *(buffer + offset + 2);
-            BYTE a = *(buffer + offset + 3);
-
-            fwrite(buffer + offset, 4, 1, stdout);
-#ifdef WRITE_PPM
-            fprintf(f1, "%d %d %d ", r, g, b);
-#endif
+            if (!output->Failed)
+                WriteRecord(output, 0, 0, NULL);
         }
-#ifdef WRITE_PPM
-        fprintf(f1, "\n");
-#endif
+
+        count++;
     }
 
-    printf("\n");
+    free(input);
+    LogInfo("sent %lu icons", count);
+    return output->Failed ? ERROR_BROKEN_PIPE : ERROR_SUCCESS;
+}
 
-#ifdef WRITE_PPM
-    fclose(f1);
-#endif
+int wmain(int argc, WCHAR *argv[])
+{
+    WCHAR *linkPath = NULL;
+    WCHAR iconName[64];
+    char request[64] = { 0 };
+    DWORD status;
+    APP_MAP appMap;
+    ICON_OUTPUT output = { 0 };
+    DWORD useCache;
+    DWORD targetSize;
+    ICON_RGBA iconRgba;
 
-    status = ERROR_SUCCESS;
+    status = ERROR_NOT_ENOUGH_MEMORY;
+    linkPath = malloc(MAX_PATH_LONG*sizeof(WCHAR));
+    if (!linkPath)
+        goto cleanup;
+
+    output.Handle = GetStdHandle(STD_OUTPUT_HANDLE);
+    output.Batch = argc > 1 && 0 == wcscmp(argv[1], BATCH_ARG);
+
+    if (ERROR_SUCCESS != CfgReadDword(NULL, L"IconCache", &useCache, NULL))
+        useCache = TRUE;
+
+    status = AppMapOpen(&appMap);
+    if (status != ERROR_SUCCESS)
+    {
+        perror2(status, "AppMapOpen");
+        goto cleanup;
+    }
+
+    if (!IconRgbaInit(&iconRgba))
+    {
+        status = ERROR_INVALID_DATA;
+        goto cleanup;
+    }
+
+    // COM and the map are set up once for all icons of a batch
+    CoInitialize(NULL);
+
+    if (output.Batch)
+    {
+        status = SendIcons(&appMap, linkPath, useCache, &iconRgba, &output);
+        goto cleanup;
+    }
+
+    if (QioReadUntilEof(GetStdHandle(STD_INPUT_HANDLE), request, sizeof(request) - 1) == 0)
+    {
+        status = perror("QioReadUntilEof(stdin)");
+        goto cleanup;
+    }
+
+    // Read input and convert it to the shortcut path.
+    if (ERROR_SUCCESS != GetShortcutPath(&appMap, request, linkPath, MAX_PATH_LONG, iconName, RTL_NUMBER_OF(iconName), &targetSize))
+    {
+        status = perror("GetShortcutPath");
+        goto cleanup;
+    }
+
+    status = SendIcon(linkPath, iconName, targetSize, useCache, &iconRgba, &output);
 
 cleanup:
-    if (status != ERROR_SUCCESS && linkPath)
-        LogError("LinkPath: %s", linkPath);
     // Everything will be cleaned up upon process exit.
     LogDebug("returning %lu", status);
     return status;
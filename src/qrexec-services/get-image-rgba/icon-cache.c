@@ -0,0 +1,258 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <ShlObj.h>
+#include <Knownfolders.h>
+#include <strsafe.h>
+
+#include <qubes-io.h>
+#include <log.h>
+
+#include "icon-cache.h"
+
+#define ICON_CACHE_DIR L"Qubes\\IconCache"
+#define ICON_CACHE_MAGIC 0x32434951 // "QIC2", entries before RGBA output are stale
+
+// more than any icon needs, larger entries are treated as corrupted
+#define ICON_CACHE_MAX_ENTRY (64*1024*1024)
+
+// longest name accepted, the names are hashes
+#define ICON_CACHE_MAX_NAME 64
+
+// Entry file: the header, link path, source path (both without terminating null)
+// and the exact service output.
+typedef struct _ICON_CACHE_HEADER
+{
+    DWORD Magic;
+    DWORD LinkPathSize; // bytes
+    DWORD SourcePathSize; // bytes, 0 if the icon came from the shortcut itself
+    DWORD DataSize;
+    FILETIME LinkTime;
+    FILETIME SourceTime;
+} ICON_CACHE_HEADER;
+
+static BOOL GetEntryPath(IN const WCHAR *name, IN const WCHAR *extension, IN BOOL create, OUT WCHAR *path, IN size_t cchPath)
+{
+    WCHAR *localAppData;
+    const WCHAR *c;
+    HRESULT hresult;
+    int status;
+
+    // the name comes from the other side, it must be a plain file name
+    // ('-' separates the requested size)
+    for (c = name; *c; c++)
+    {
+        if (!((*c >= L'0' && *c <= L'9') || (*c >= L'a' && *c <= L'z') || (*c >= L'A' && *c <= L'Z') || *c == L'-'))
+            break;
+    }
+
+    if (c == name || *c || c - name > ICON_CACHE_MAX_NAME)
+    {
+        LogWarning("not caching icon '%s'", name);
+        return FALSE;
+    }
+
+    hresult = SHGetKnownFolderPath(&FOLDERID_LocalAppData, 0, NULL, &localAppData);
+    if (FAILED(hresult))
+    {
+        perror2(hresult, "SHGetKnownFolderPath");
+        return FALSE;
+    }
+
+    hresult = StringCchPrintf(path, cchPath, L"%s\\%s", localAppData, ICON_CACHE_DIR);
+    CoTaskMemFree(localAppData);
+    if (FAILED(hresult))
+    {
+        perror2(hresult, "StringCchPrintf");
+        return FALSE;
+    }
+
+    if (create)
+    {
+        status = SHCreateDirectoryEx(NULL, path, NULL);
+        if (status != ERROR_SUCCESS && status != ERROR_ALREADY_EXISTS && status != ERROR_FILE_EXISTS)
+        {
+            perror2(status, "SHCreateDirectoryEx");
+            return FALSE;
+        }
+    }
+
+    hresult = StringCchPrintf(path + wcslen(path), cchPath - wcslen(path), L"\\%s%s", name, extension);
+    if (FAILED(hresult))
+    {
+        perror2(hresult, "StringCchPrintf");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOL IconCacheFileTime(IN const WCHAR *path, OUT FILETIME *time)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+
+    if (!GetFileAttributesEx(path, GetFileExInfoStandard, &attributes))
+        return FALSE;
+
+    *time = attributes.ftLastWriteTime;
+    return TRUE;
+}
+
+static BOOL SameFileTime(IN const WCHAR *path, IN const FILETIME *expected)
+{
+    FILETIME time;
+
+    return IconCacheFileTime(path, &time) && CompareFileTime(&time, expected) == 0;
+}
+
+// Checks an entry against the current state of its files.
+static BOOL IsEntryValid(IN const ICON_CACHE_HEADER *header, IN UINT64 entrySize, IN const WCHAR *linkPath)
+{
+    const BYTE *paths = (const BYTE *)(header + 1);
+    WCHAR sourcePath[MAX_PATH];
+
+    if (header->Magic != ICON_CACHE_MAGIC || header->LinkPathSize % sizeof(WCHAR) != 0 ||
+        header->SourcePathSize % sizeof(WCHAR) != 0 || header->SourcePathSize >= sizeof(sourcePath))
+        return FALSE;
+
+    if (sizeof(*header) + (UINT64)header->LinkPathSize + header->SourcePathSize + header->DataSize != entrySize)
+        return FALSE;
+
+    if (wcslen(linkPath) * sizeof(WCHAR) != header->LinkPathSize || memcmp(paths, linkPath, header->LinkPathSize) != 0)
+        return FALSE;
+
+    if (!SameFileTime(linkPath, &header->LinkTime))
+        return FALSE;
+
+    if (header->SourcePathSize > 0)
+    {
+        memcpy(sourcePath, paths + header->LinkPathSize, header->SourcePathSize);
+        sourcePath[header->SourcePathSize / sizeof(WCHAR)] = L'\0';
+
+        if (!SameFileTime(sourcePath, &header->SourceTime))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+DWORD IconCacheServe(IN const WCHAR *name, IN const WCHAR *linkPath, IN ICON_CACHE_WRITE write, IN void *context)
+{
+    WCHAR entryPath[MAX_PATH];
+    HANDLE file, mapping = NULL;
+    const ICON_CACHE_HEADER *header = NULL;
+    LARGE_INTEGER entrySize;
+    DWORD status = ERROR_FILE_NOT_FOUND;
+
+    if (!GetEntryPath(name, L".rgba", FALSE, entryPath, RTL_NUMBER_OF(entryPath)))
+        return ERROR_FILE_NOT_FOUND;
+
+    file = CreateFile(entryPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return ERROR_FILE_NOT_FOUND;
+
+    if (!GetFileSizeEx(file, &entrySize) || entrySize.QuadPart < sizeof(*header) || entrySize.QuadPart > ICON_CACHE_MAX_ENTRY)
+        goto cleanup;
+
+    mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping)
+    {
+        perror("CreateFileMapping");
+        goto cleanup;
+    }
+
+    header = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!header)
+    {
+        perror("MapViewOfFile");
+        goto cleanup;
+    }
+
+    if (!IsEntryValid(header, entrySize.QuadPart, linkPath))
+        goto cleanup;
+
+    LogDebug("serving '%s' from the cache", name);
+    status = ERROR_SUCCESS;
+    if (!write(context, (const BYTE *)(header + 1) + header->LinkPathSize + header->SourcePathSize, header->DataSize))
+        status = ERROR_WRITE_FAULT;
+
+cleanup:
+    if (header)
+        UnmapViewOfFile(header);
+    if (mapping)
+        CloseHandle(mapping);
+    CloseHandle(file);
+
+    if (status == ERROR_FILE_NOT_FOUND)
+    {
+        LogDebug("removing stale cache entry for '%s'", name);
+        DeleteFile(entryPath);
+    }
+
+    return status;
+}
+
+void IconCacheStore(IN const WCHAR *name, IN const WCHAR *linkPath, IN const FILETIME *linkTime,
+    IN const WCHAR *sourcePath OPTIONAL, IN const FILETIME *sourceTime OPTIONAL,
+    IN const BYTE *data, IN DWORD size)
+{
+    WCHAR entryPath[MAX_PATH];
+    WCHAR tempPath[MAX_PATH];
+    ICON_CACHE_HEADER header = { 0 };
+    HANDLE file;
+    BOOL written;
+
+    if (!GetEntryPath(name, L".rgba", TRUE, entryPath, RTL_NUMBER_OF(entryPath)) ||
+        !GetEntryPath(name, L".tmp", FALSE, tempPath, RTL_NUMBER_OF(tempPath)))
+        return;
+
+    header.Magic = ICON_CACHE_MAGIC;
+    header.LinkPathSize = (DWORD)(wcslen(linkPath) * sizeof(WCHAR));
+    header.LinkTime = *linkTime;
+    if (sourcePath && sourceTime)
+    {
+        header.SourcePathSize = (DWORD)(wcslen(sourcePath) * sizeof(WCHAR));
+        header.SourceTime = *sourceTime;
+    }
+    header.DataSize = size;
+
+    // written aside and moved in place, readers never see a partial entry
+    file = CreateFile(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        perror("CreateFile");
+        return;
+    }
+
+    written = QioWriteBuffer(file, &header, sizeof(header)) &&
+        QioWriteBuffer(file, linkPath, header.LinkPathSize) &&
+        (header.SourcePathSize == 0 || QioWriteBuffer(file, sourcePath, header.SourcePathSize)) &&
+        QioWriteBuffer(file, data, size);
+
+    CloseHandle(file);
+
+    if (!written || !MoveFileEx(tempPath, entryPath, MOVEFILE_REPLACE_EXISTING))
+    {
+        perror("caching icon");
+        DeleteFile(tempPath);
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Encoded icons are kept on disk so repeated requests (an appmenus refresh asks for
+// every shortcut) skip resolving and rendering the icon. An entry stays valid while
+// the shortcut and the file the icon comes from keep their modification times.
+
+#pragma once
+#include <windows.h>
+
+// Returns the last write time of path, FALSE if it can't be read.
+BOOL IconCacheFileTime(IN const WCHAR *path, OUT FILETIME *time);
+
+// Sends the cached data, returns FALSE if it couldn't be written.
+typedef BOOL (*ICON_CACHE_WRITE)(IN void *context, IN const BYTE *data, IN DWORD size);
+
+// Passes the cached output for name to write if the entry is still valid, stale
+// entries are removed. Returns ERROR_FILE_NOT_FOUND if there is nothing usable,
+// other errors if writing the output failed.
+DWORD IconCacheServe(IN const WCHAR *name, IN const WCHAR *linkPath, IN ICON_CACHE_WRITE write, IN void *context);
+
+// Stores the output for name. The times must be taken before the icon was read,
+// so a change while it was being rendered invalidates the entry.
+void IconCacheStore(IN const WCHAR *name, IN const WCHAR *linkPath, IN const FILETIME *linkTime,
+    IN const WCHAR *sourcePath OPTIONAL, IN const FILETIME *sourceTime OPTIONAL,
+    IN const BYTE *data, IN DWORD size);
@@ -20,6 +20,7 @@
  */
 
 #include <Windows.h>
+#include <bcrypt.h>
 #include <stdio.h>
 #include <strsafe.h>
 #include <string.h>
@@ -30,17 +31,65 @@
 
 #include "filecopy-error.h"
 #include "dvm2.h"
+#include "dvm-stream.h"
 
-void SendFile(IN const WCHAR *filePath)
+// Both directions are streamed at the same time: the edited file is received into
+// a temp file on its own thread while the original is still being sent.
+
+// delta offer, see dvm2.h
+BOOL g_deltaOffered = FALSE;
+UINT64 g_deltaNonce = 0;
+HANDLE g_snapshotFile = INVALID_HANDLE_VALUE; // the content as sent, deltas apply to it
+HANDLE g_snapshotDone = NULL; // set when the whole file was sent
+
+// Keeps a copy of the data being sent for applying a delta reply.
+static BOOL SnapshotSent(IN const BYTE *data, IN DWORD size, IN UINT64 bytesDone)
 {
-    const WCHAR *base, *base1, *base2;
-    char *baseUtf8;
-    char basePadded[DVM_FILENAME_SIZE];
-    HANDLE stdOut = GetStdHandle(STD_OUTPUT_HANDLE);
-    HANDLE file = CreateFile(filePath, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    return QioWriteBuffer(g_snapshotFile, data, size);
+}
 
-    if (file == INVALID_HANDLE_VALUE)
-        FcReportError(GetLastError(), TRUE, L"open '%s'", filePath);
+// Returns FALSE if deltas can't be offered, the file is sent without the offer then.
+static BOOL PrepareDeltaOffer(OUT struct dvm_delta_offer *offer)
+{
+    WCHAR tempDirPath[MAX_PATH + 1];
+    WCHAR snapshotPath[MAX_PATH];
+
+    // the nonce proves that a delta reply comes from an editor that read the offer
+    if (!BCRYPT_SUCCESS(BCryptGenRandom(NULL, (UCHAR *)&g_deltaNonce, sizeof(g_deltaNonce), BCRYPT_USE_SYSTEM_PREFERRED_RNG)))
+        return FALSE;
+
+    if (!GetTempPath(ARRAYSIZE(tempDirPath), tempDirPath) || !GetTempFileName(tempDirPath, L"qvs", 0, snapshotPath))
+        return FALSE;
+
+    g_snapshotFile = CreateFile(snapshotPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (g_snapshotFile == INVALID_HANDLE_VALUE)
+    {
+        DeleteFile(snapshotPath);
+        return FALSE;
+    }
+
+    g_snapshotDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!g_snapshotDone)
+    {
+        CloseHandle(g_snapshotFile);
+        g_snapshotFile = INVALID_HANDLE_VALUE;
+        return FALSE;
+    }
+
+    offer->magic = DVM_DELTA_OFFER_MAGIC;
+    offer->block_size = DVM_DELTA_BLOCK_SIZE;
+    offer->nonce = g_deltaNonce;
+    return TRUE;
+}
+
+// Fills the file name block, with the delta offer if the name leaves room for it.
+// Must be done before the receiving starts, it decides how the reply is read.
+void PrepareNameBlock(IN const WCHAR *filePath, OUT char *nameBlock)
+{
+    const WCHAR *base, *base1, *base2;
+    char *baseUtf8, *baseTail;
+    struct dvm_delta_offer offer;
 
     base1 = wcsrchr(filePath, L'\\');
     base2 = wcsrchr(filePath, L'/');
@@ -61,37 +110,162 @@ void SendFile(IN const WCHAR *filePath)
     if (ERROR_SUCCESS != ConvertUTF16ToUTF8(base, &baseUtf8, NULL))
         FcReportError(GetLastError(), TRUE, L"Failed to convert filename '%s' to UTF8", base);
 
-    if (strlen(baseUtf8) >= DVM_FILENAME_SIZE)
-        baseUtf8 += strlen(baseUtf8) - DVM_FILENAME_SIZE + 1;
+    // keep the end of a long name (with the extension)
+    baseTail = baseUtf8;
+    if (strlen(baseTail) >= DVM_FILENAME_SIZE)
+        baseTail += strlen(baseTail) - DVM_FILENAME_SIZE + 1;
 
-    ZeroMemory(basePadded, sizeof(basePadded));
-    StringCbCopyA(basePadded, sizeof(basePadded), baseUtf8);
+    ZeroMemory(nameBlock, DVM_FILENAME_SIZE);
+    StringCbCopyA(nameBlock, DVM_FILENAME_SIZE, baseTail);
+
+    if (strlen(baseTail) < DVM_DELTA_FILENAME_SIZE && PrepareDeltaOffer(&offer))
+    {
+        memcpy(nameBlock + DVM_DELTA_FILENAME_SIZE, &offer, sizeof(offer));
+        g_deltaOffered = TRUE;
+    }
 
     free(baseUtf8);
+}
+
+void SendFile(IN const WCHAR *filePath, IN const char *nameBlock)
+{
+    HANDLE stdOut = GetStdHandle(STD_OUTPUT_HANDLE);
+    HANDLE file = CreateFile(filePath, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
 
-    if (!QioWriteBuffer(stdOut, basePadded, DVM_FILENAME_SIZE))
+    if (file == INVALID_HANDLE_VALUE)
+        FcReportError(GetLastError(), TRUE, L"open '%s'", filePath);
+
+    if (!QioWriteBuffer(stdOut, nameBlock, DVM_FILENAME_SIZE))
         FcReportError(GetLastError(), TRUE, L"send filename to dispVM");
 
-    if (!QioCopyUntilEof(stdOut, file))
+    if (!DvmStreamCopy(stdOut, file, g_deltaOffered ? SnapshotSent : NULL))
         FcReportError(GetLastError(), TRUE, L"send file to dispVM");
 
+    if (g_deltaOffered)
+        SetEvent(g_snapshotDone);
+
     CloseHandle(file);
     fprintf(stderr, "File sent\n");
     CloseHandle(stdOut);
 }
 
+// Reads up to size bytes, less only at the end of input.
+static DWORD ReadPrefix(IN HANDLE input, OUT void *buffer, IN DWORD size)
+{
+    DWORD cbTotal = 0, cbRead;
+
+    while (cbTotal < size)
+    {
+        if (!ReadFile(input, (BYTE *)buffer + cbTotal, size - cbTotal, &cbRead, NULL))
+        {
+            if (GetLastError() == ERROR_BROKEN_PIPE)
+                break;
+            FcReportError(GetLastError(), TRUE, L"receiving file from dispVM");
+        }
+
+        if (cbRead == 0)
+            break;
+
+        cbTotal += cbRead;
+    }
+
+    return cbTotal;
+}
+
+// Copies the sent content to the temp file and overwrites the changed blocks.
+static void ApplyDelta(IN HANDLE input, IN const struct dvm_delta_header *untrustedHeader, IN HANDLE tempFile)
+{
+    struct dvm_delta_block untrustedBlock;
+    BYTE *buffer;
+    UINT64 blockCount, offset, blocksReceived = 0;
+    DWORD cbBlock;
+    LARGE_INTEGER position;
+
+    if (untrustedHeader->block_size != DVM_DELTA_BLOCK_SIZE)
+        FcReportError(ERROR_INVALID_DATA, TRUE, L"Unsupported delta from dispVM");
+
+    // the editor hashed what it received, the file itself may have changed since
+    WaitForSingleObject(g_snapshotDone, INFINITE);
+    position.QuadPart = 0;
+    if (!SetFilePointerEx(g_snapshotFile, position, NULL, FILE_BEGIN) || !DvmStreamCopy(tempFile, g_snapshotFile, NULL))
+        FcReportError(GetLastError(), TRUE, L"copy the sent file");
+
+    buffer = VirtualAlloc(NULL, DVM_DELTA_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!buffer)
+        FcReportError(GetLastError(), TRUE, L"allocate memory");
+
+    blockCount = (untrustedHeader->new_size + DVM_DELTA_BLOCK_SIZE - 1) / DVM_DELTA_BLOCK_SIZE;
+    while (TRUE)
+    {
+        if (!QioReadBuffer(input, &untrustedBlock, sizeof(untrustedBlock)))
+            FcReportError(GetLastError(), TRUE, L"receiving changes from dispVM");
+
+        if (untrustedBlock.index == DVM_DELTA_END)
+            break;
+
+        if (untrustedBlock.index >= blockCount)
+            FcReportError(ERROR_INVALID_DATA, TRUE, L"Invalid delta from dispVM");
+
+        offset = untrustedBlock.index * DVM_DELTA_BLOCK_SIZE;
+        cbBlock = (DWORD)min(DVM_DELTA_BLOCK_SIZE, untrustedHeader->new_size - offset);
+        if (!QioReadBuffer(input, buffer, cbBlock))
+            FcReportError(GetLastError(), TRUE, L"receiving changes from dispVM");
+
+        position.QuadPart = offset;
+        if (!SetFilePointerEx(tempFile, position, NULL, FILE_BEGIN) || !QioWriteBuffer(tempFile, buffer, cbBlock))
+            FcReportError(GetLastError(), TRUE, L"write temp file");
+
+        blocksReceived++;
+    }
+
+    position.QuadPart = untrustedHeader->new_size;
+    if (!SetFilePointerEx(tempFile, position, NULL, FILE_BEGIN) || !SetEndOfFile(tempFile))
+        FcReportError(GetLastError(), TRUE, L"truncate temp file");
+
+    VirtualFree(buffer, 0, MEM_RELEASE);
+    CloseHandle(g_snapshotFile); // deletes it
+    g_snapshotFile = INVALID_HANDLE_VALUE;
+    fprintf(stderr, "Received %I64u changed blocks of %I64u\n", blocksReceived, blockCount);
+}
+
+// Writes the edited file to the temp file as it arrives.
+static DWORD WINAPI ReceiveThread(IN void *param)
+{
+    HANDLE tempFile = param;
+    HANDLE stdIn = GetStdHandle(STD_INPUT_HANDLE);
+    struct dvm_delta_header untrustedHeader;
+    DWORD cbPrefix;
+
+    // an editor that took the delta offer starts with the header, others send the content
+    cbPrefix = ReadPrefix(stdIn, &untrustedHeader, sizeof(untrustedHeader));
+    if (g_deltaOffered
+        && cbPrefix == sizeof(untrustedHeader)
+        && 0 == memcmp(untrustedHeader.magic, DVM_DELTA_MAGIC, DVM_DELTA_MAGIC_SIZE)
+        && untrustedHeader.nonce == g_deltaNonce)
+    {
+        ApplyDelta(stdIn, &untrustedHeader, tempFile);
+        return ERROR_SUCCESS;
+    }
+
+    if (cbPrefix > 0 && !QioWriteBuffer(tempFile, &untrustedHeader, cbPrefix))
+        FcReportError(GetLastError(), TRUE, L"write temp file");
+
+    if (!DvmStreamCopy(tempFile, stdIn, NULL))
+        FcReportError(GetLastError(), TRUE, L"receiving file from dispVM");
+
+    return ERROR_SUCCESS;
+}
+
 #define MAX_PATH_LONG 32768
-void ReceiveFile(IN const WCHAR *fileName)
+// Starts receiving into a temp file, the returned thread finishes with the end of input.
+HANDLE StartReceiveFile(OUT WCHAR **tempFilePath, OUT HANDLE *tempFile)
 {
-    HANDLE tempFile;
     WCHAR *tempDirPath = NULL;
-    WCHAR *tempFilePath = NULL;
-    LARGE_INTEGER fileSize;
-    HANDLE stdIn = GetStdHandle(STD_INPUT_HANDLE);
+    HANDLE receiveThread;
 
     tempDirPath = malloc(MAX_PATH_LONG*sizeof(WCHAR));
-    tempFilePath = malloc(MAX_PATH_LONG*sizeof(WCHAR));
-    if (!tempDirPath || !tempFilePath)
+    *tempFilePath = malloc(MAX_PATH_LONG*sizeof(WCHAR));
+    if (!tempDirPath || !*tempFilePath)
         FcReportError(GetLastError(), TRUE, L"allocate memory");
 
     // prepare temporary path
@@ -100,18 +274,31 @@ void ReceiveFile(IN const WCHAR *fileName)
         FcReportError(GetLastError(), TRUE, L"Failed to get temp dir");
     }
 
-    if (!GetTempFileName(tempDirPath, L"qvm", 0, tempFilePath))
+    if (!GetTempFileName(tempDirPath, L"qvm", 0, *tempFilePath))
     {
         FcReportError(GetLastError(), TRUE, L"Failed to get temp file");
     }
 
+    free(tempDirPath);
+
     // create temp file
-    tempFile = CreateFile(tempFilePath, GENERIC_WRITE, 0, NULL, TRUNCATE_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (tempFile == INVALID_HANDLE_VALUE)
+    *tempFile = CreateFile(*tempFilePath, GENERIC_WRITE, 0, NULL, TRUNCATE_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (*tempFile == INVALID_HANDLE_VALUE)
         FcReportError(GetLastError(), TRUE, L"Failed to open temp file");
 
-    if (!QioCopyUntilEof(tempFile, stdIn))
-        FcReportError(GetLastError(), TRUE, L"receiving file from dispVM");
+    receiveThread = CreateThread(NULL, 0, ReceiveThread, *tempFile, 0, NULL);
+    if (!receiveThread)
+        FcReportError(GetLastError(), TRUE, L"Failed to start receiving");
+
+    return receiveThread;
+}
+
+void FinishReceiveFile(IN const WCHAR *fileName, IN HANDLE receiveThread, IN WCHAR *tempFilePath, IN HANDLE tempFile)
+{
+    LARGE_INTEGER fileSize;
+
+    WaitForSingleObject(receiveThread, INFINITE);
+    CloseHandle(receiveThread);
 
     if (!GetFileSizeEx(tempFile, &fileSize))
         FcReportError(GetLastError(), TRUE, L"GetFileSizeEx");
@@ -124,23 +311,29 @@ void ReceiveFile(IN const WCHAR *fileName)
         goto cleanup;
     }
 
+    fprintf(stderr, "Received %I64u bytes\n", fileSize.QuadPart);
     if (!MoveFileEx(tempFilePath, fileName, MOVEFILE_REPLACE_EXISTING | MOVEFILE_COPY_ALLOWED))
         FcReportError(GetLastError(), TRUE, L"rename");
 
 cleanup:
-    free(tempDirPath);
     free(tempFilePath);
 }
 
 int __cdecl wmain(int argc, WCHAR *argv[])
 {
+    HANDLE receiveThread;
+    WCHAR *tempFilePath;
+    HANDLE tempFile;
+    char nameBlock[DVM_FILENAME_SIZE];
+
     if (argc != 2)
         FcReportError(ERROR_BAD_ARGUMENTS, TRUE, L"OpenInVM - no file given?");
 
     fprintf(stderr, "OpenInVM starting\n");
-
-    SendFile(argv[1]);
-    ReceiveFile(argv[1]);
+    PrepareNameBlock(argv[1], nameBlock);
+    receiveThread = StartReceiveFile(&tempFilePath, &tempFile);
+    SendFile(argv[1], nameBlock);
+    FinishReceiveFile(argv[1], receiveThread, tempFilePath, tempFile);
 
     return 0;
 }
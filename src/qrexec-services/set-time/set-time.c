@@ -0,0 +1,182 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+// qubes.SetDateTime: sets the system time from a locale-invariant timestamp
+// on the input (2014-09-29T22:59:21+0000).
+
+#include <windows.h>
+
+#include <qubes-io.h>
+#include <log.h>
+
+#define FILETIME_PER_MINUTE (60 * 10000000LL)
+
+// Parses exactly count digits.
+static BOOL ParseNumber(IN OUT const char **input, IN int count, OUT WORD *value)
+{
+    const char *c = *input;
+
+    *value = 0;
+    for (; count > 0; count--, c++)
+    {
+        if (*c < '0' || *c > '9')
+            return FALSE;
+        *value = *value * 10 + (*c - '0');
+    }
+
+    *input = c;
+    return TRUE;
+}
+
+static BOOL ParseSeparator(IN OUT const char **input, IN char separator)
+{
+    if (**input != separator)
+        return FALSE;
+
+    (*input)++;
+    return TRUE;
+}
+
+// Fills time with the UTC time of the timestamp. Without an offset the time is local.
+static BOOL ParseTimestamp(IN const char *input, OUT SYSTEMTIME *time)
+{
+    SYSTEMTIME parsed = { 0 };
+    FILETIME fileTime;
+    ULARGE_INTEGER value;
+    WORD offsetHours, offsetMinutes;
+    LONGLONG offset;
+    char sign;
+
+    if (!ParseNumber(&input, 4, &parsed.wYear) || !ParseSeparator(&input, '-') ||
+        !ParseNumber(&input, 2, &parsed.wMonth) || !ParseSeparator(&input, '-') ||
+        !ParseNumber(&input, 2, &parsed.wDay) ||
+        !(ParseSeparator(&input, 'T') || ParseSeparator(&input, ' ')) ||
+        !ParseNumber(&input, 2, &parsed.wHour) || !ParseSeparator(&input, ':') ||
+        !ParseNumber(&input, 2, &parsed.wMinute) || !ParseSeparator(&input, ':') ||
+        !ParseNumber(&input, 2, &parsed.wSecond))
+        return FALSE;
+
+    // fractions of a second
+    if (ParseSeparator(&input, '.') || ParseSeparator(&input, ','))
+    {
+        if (!ParseNumber(&input, 3, &parsed.wMilliseconds))
+            return FALSE;
+        while (*input >= '0' && *input <= '9')
+            input++;
+    }
+
+    // also validates the fields
+    if (!SystemTimeToFileTime(&parsed, &fileTime))
+        return FALSE;
+
+    sign = *input;
+    if (sign == '\0' || sign == '\r' || sign == '\n')
+        return TzSpecificLocalTimeToSystemTime(NULL, &parsed, time);
+
+    if (sign == 'Z')
+    {
+        input++;
+        offset = 0;
+    }
+    else
+    {
+        // +hhmm, +hh:mm or +hh
+        input++;
+        if ((sign != '+' && sign != '-') || !ParseNumber(&input, 2, &offsetHours))
+            return FALSE;
+        ParseSeparator(&input, ':');
+        if (!ParseNumber(&input, 2, &offsetMinutes))
+            offsetMinutes = 0;
+        if (offsetHours > 14 || offsetMinutes > 59)
+            return FALSE;
+
+        offset = (offsetHours * 60 + offsetMinutes) * FILETIME_PER_MINUTE;
+        if (sign == '-')
+            offset = -offset;
+    }
+
+    if (*input != '\0' && *input != '\r' && *input != '\n')
+        return FALSE;
+
+    value.LowPart = fileTime.dwLowDateTime;
+    value.HighPart = fileTime.dwHighDateTime;
+    value.QuadPart -= offset;
+    fileTime.dwLowDateTime = value.LowPart;
+    fileTime.dwHighDateTime = value.HighPart;
+
+    return FileTimeToSystemTime(&fileTime, time);
+}
+
+// Present in administrator tokens, but disabled.
+static DWORD EnableSystemTimePrivilege(void)
+{
+    HANDLE token;
+    TOKEN_PRIVILEGES privileges;
+    DWORD status = ERROR_SUCCESS;
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &token))
+        return perror("OpenProcessToken");
+
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+    if (!LookupPrivilegeValue(NULL, SE_SYSTEMTIME_NAME, &privileges.Privileges[0].Luid))
+        status = perror("LookupPrivilegeValue");
+    // succeeds even if the privilege is missing, GetLastError tells
+    else if (!AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) || GetLastError() != ERROR_SUCCESS)
+        status = perror("AdjustTokenPrivileges");
+
+    CloseHandle(token);
+    return status;
+}
+
+int APIENTRY wWinMain(HINSTANCE instance, HINSTANCE previousInstance, WCHAR *commandLine, int showState)
+{
+    char input[64] = { 0 };
+    SYSTEMTIME time;
+    DWORD status;
+
+    if (!QioReadUntilEof(GetStdHandle(STD_INPUT_HANDLE), input, RTL_NUMBER_OF(input) - 1))
+    {
+        LogError("empty request");
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    LogDebug("request: %S", input);
+
+    if (!ParseTimestamp(input, &time))
+    {
+        LogError("invalid timestamp '%S'", input);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    status = EnableSystemTimePrivilege();
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    if (!SetSystemTime(&time))
+        return perror("SetSystemTime");
+
+    LogInfo("time set to %04u-%02u-%02u %02u:%02u:%02u UTC", time.wYear, time.wMonth, time.wDay,
+        time.wHour, time.wMinute, time.wSecond);
+    return ERROR_SUCCESS;
+}
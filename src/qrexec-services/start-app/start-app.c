@@ -0,0 +1,85 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+// qubes.StartApp: launches the start menu shortcut of a .desktop name listed by
+// qubes.GetAppMenus, the name is the service argument.
+
+#include <windows.h>
+#include <shellapi.h>
+
+#include <log.h>
+
+#include "app-map.h"
+
+int APIENTRY wWinMain(HINSTANCE instance, HINSTANCE previousInstance, WCHAR *commandLine, int showState)
+{
+    WCHAR **argv;
+    int argc;
+    APP_MAP appMap;
+    const WCHAR *path;
+    SHELLEXECUTEINFO info = { 0 };
+    DWORD status;
+
+    argv = CommandLineToArgvW(GetCommandLine(), &argc);
+    if (!argv)
+        return perror("CommandLineToArgvW");
+
+    if (argc < 2 || !argv[1][0])
+    {
+        LogError("no application name");
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    status = AppMapOpen(&appMap);
+    if (status != ERROR_SUCCESS)
+        return perror2(status, "AppMapOpen");
+
+    path = AppMapLookup(&appMap, argv[1]);
+    if (!path)
+    {
+        LogError("unknown application '%s'", argv[1]);
+        status = ERROR_FILE_NOT_FOUND;
+        goto cleanup;
+    }
+
+    LogDebug("%s: %s", argv[1], path);
+
+    // the shell may hand the launch over to COM
+    CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
+
+    // the default verb, like opening the shortcut from the start menu;
+    // no async launch, the process exits right after
+    info.cbSize = sizeof(info);
+    info.fMask = SEE_MASK_NOASYNC | SEE_MASK_FLAG_NO_UI;
+    info.lpFile = path;
+    info.nShow = SW_SHOWNORMAL;
+
+    if (!ShellExecuteEx(&info))
+        status = perror("ShellExecuteEx");
+
+    CoUninitialize();
+
+cleanup:
+    AppMapClose(&appMap);
+    LocalFree(argv);
+    return status;
+}
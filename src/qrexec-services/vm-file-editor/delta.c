@@ -0,0 +1,244 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <bcrypt.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <log.h>
+#include <qubes-io.h>
+
+#include "delta.h"
+
+BCRYPT_ALG_HANDLE g_deltaAlgorithm = NULL;
+BCRYPT_HASH_HANDLE g_deltaHash = NULL; // of the block being received
+DWORD g_deltaBlockFilled = 0;
+
+BYTE *g_blockHashes = NULL; // DELTA_HASH_SIZE bytes per block
+UINT64 g_blockCount = 0;
+UINT64 g_blockCapacity = 0;
+
+static BOOL StartBlockHash(void)
+{
+    NTSTATUS status = BCryptCreateHash(g_deltaAlgorithm, &g_deltaHash, NULL, 0, NULL, 0, 0);
+
+    if (!BCRYPT_SUCCESS(status))
+    {
+        perror2(status, "BCryptCreateHash");
+        g_deltaHash = NULL;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOL FinishBlockHash(OUT BYTE *digest)
+{
+    NTSTATUS status = BCryptFinishHash(g_deltaHash, digest, DELTA_HASH_SIZE, 0);
+
+    BCryptDestroyHash(g_deltaHash);
+    g_deltaHash = NULL;
+    if (!BCRYPT_SUCCESS(status))
+    {
+        perror2(status, "BCryptFinishHash");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOL HashBlock(IN const BYTE *data, IN DWORD size, OUT BYTE *digest)
+{
+    NTSTATUS status;
+
+    if (!StartBlockHash())
+        return FALSE;
+
+    status = BCryptHashData(g_deltaHash, (UCHAR *)data, size, 0);
+    if (!BCRYPT_SUCCESS(status))
+    {
+        perror2(status, "BCryptHashData");
+        FinishBlockHash(digest);
+        return FALSE;
+    }
+
+    return FinishBlockHash(digest);
+}
+
+// Stores the hash of the block being received.
+static BOOL AddBlock(void)
+{
+    UINT64 newCapacity;
+    BYTE *newHashes;
+
+    if (g_blockCount == g_blockCapacity)
+    {
+        newCapacity = g_blockCapacity ? 2 * g_blockCapacity : 1024;
+        newHashes = realloc(g_blockHashes, (size_t)(newCapacity * DELTA_HASH_SIZE));
+        if (!newHashes)
+        {
+            SetLastError(ERROR_OUTOFMEMORY);
+            return FALSE;
+        }
+
+        g_blockHashes = newHashes;
+        g_blockCapacity = newCapacity;
+    }
+
+    if (!FinishBlockHash(g_blockHashes + g_blockCount * DELTA_HASH_SIZE))
+        return FALSE;
+
+    g_blockCount++;
+    g_deltaBlockFilled = 0;
+    return TRUE;
+}
+
+BOOL DeltaInit(void)
+{
+    NTSTATUS status = BCryptOpenAlgorithmProvider(&g_deltaAlgorithm, BCRYPT_SHA256_ALGORITHM, NULL, 0);
+
+    if (!BCRYPT_SUCCESS(status))
+    {
+        perror2(status, "BCryptOpenAlgorithmProvider");
+        g_deltaAlgorithm = NULL;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOL DeltaUpdate(IN const BYTE *data, IN DWORD size, IN UINT64 bytesDone)
+{
+    DWORD chunk;
+    NTSTATUS status;
+
+    while (size > 0)
+    {
+        if (!g_deltaHash && !StartBlockHash())
+            return FALSE;
+
+        chunk = min(size, DVM_DELTA_BLOCK_SIZE - g_deltaBlockFilled);
+        status = BCryptHashData(g_deltaHash, (UCHAR *)data, chunk, 0);
+        if (!BCRYPT_SUCCESS(status))
+        {
+            perror2(status, "BCryptHashData");
+            return FALSE;
+        }
+
+        g_deltaBlockFilled += chunk;
+        data += chunk;
+        size -= chunk;
+
+        if (g_deltaBlockFilled == DVM_DELTA_BLOCK_SIZE && !AddBlock())
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOL DeltaFinish(void)
+{
+    if (g_deltaBlockFilled > 0)
+        return AddBlock();
+
+    return TRUE;
+}
+
+BOOL DeltaSend(IN HANDLE output, IN const WCHAR *filePath, IN UINT64 nonce)
+{
+    struct dvm_delta_header header;
+    struct dvm_delta_block record;
+    LARGE_INTEGER fileSize;
+    BYTE digest[DELTA_HASH_SIZE];
+    BYTE *buffer = NULL;
+    HANDLE file;
+    UINT64 index, offset;
+    UINT64 blocksSent = 0;
+    DWORD cbBlock, cbRead;
+    BOOL retval = FALSE;
+
+    file = CreateFile(filePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        perror("CreateFile");
+        return FALSE;
+    }
+
+    if (!GetFileSizeEx(file, &fileSize))
+    {
+        perror("GetFileSizeEx");
+        goto cleanup;
+    }
+
+    buffer = VirtualAlloc(NULL, DVM_DELTA_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!buffer)
+    {
+        perror("VirtualAlloc");
+        goto cleanup;
+    }
+
+    ZeroMemory(&header, sizeof(header));
+    memcpy(header.magic, DVM_DELTA_MAGIC, DVM_DELTA_MAGIC_SIZE);
+    header.new_size = fileSize.QuadPart;
+    header.block_size = DVM_DELTA_BLOCK_SIZE;
+    header.nonce = nonce;
+    if (!QioWriteBuffer(output, &header, sizeof(header)))
+        goto cleanup;
+
+    for (index = 0, offset = 0; offset < header.new_size; index++, offset += cbBlock)
+    {
+        cbBlock = (DWORD)min(DVM_DELTA_BLOCK_SIZE, header.new_size - offset);
+        if (!ReadFile(file, buffer, cbBlock, &cbRead, NULL) || cbRead != cbBlock)
+        {
+            perror("ReadFile");
+            goto cleanup;
+        }
+
+        if (index < g_blockCount)
+        {
+            if (!HashBlock(buffer, cbBlock, digest))
+                goto cleanup;
+
+            if (0 == memcmp(digest, g_blockHashes + index * DELTA_HASH_SIZE, DELTA_HASH_SIZE))
+                continue;
+        }
+
+        record.index = index;
+        if (!QioWriteBuffer(output, &record, sizeof(record)) || !QioWriteBuffer(output, buffer, cbBlock))
+            goto cleanup;
+
+        blocksSent++;
+    }
+
+    record.index = DVM_DELTA_END;
+    if (!QioWriteBuffer(output, &record, sizeof(record)))
+        goto cleanup;
+
+    LogInfo("sent %I64u of %I64u blocks", blocksSent, index);
+    retval = TRUE;
+
+cleanup:
+    if (buffer)
+        VirtualFree(buffer, 0, MEM_RELEASE);
+    CloseHandle(file);
+    return retval;
+}
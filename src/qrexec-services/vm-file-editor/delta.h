@@ -0,0 +1,43 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#pragma once
+#include <windows.h>
+
+#include "dvm2.h"
+
+// Hashes of DVM_DELTA_BLOCK_SIZE blocks of the file as it was received, so that
+// only the blocks changed by the editor are sent back (struct dvm_delta_header).
+
+// SHA-256
+#define DELTA_HASH_SIZE 32
+
+BOOL DeltaInit(void);
+
+// Hashes the next chunk of the received file, fits fDvmDataCallback.
+BOOL DeltaUpdate(IN const BYTE *data, IN DWORD size, IN UINT64 bytesDone);
+
+// Hashes the last partial block, call after the whole file is received.
+BOOL DeltaFinish(void);
+
+// Sends the delta header (with the nonce from the offer) and the blocks of the file
+// that differ from the received ones.
+BOOL DeltaSend(IN HANDLE output, IN const WCHAR *filePath, IN UINT64 nonce);
@@ -32,9 +32,13 @@
 #include <qubes-io.h>
 
 #include "dvm2.h"
+#include "dvm-stream.h"
+#include "delta.h"
 
 HANDLE g_stdIn = INVALID_HANDLE_VALUE;
 HANDLE g_stdOut = INVALID_HANDLE_VALUE;
+BOOL g_deltaOffered = FALSE; // the sender can apply block deltas, see dvm2.h
+UINT64 g_deltaNonce = 0;
 
 BOOL GetTempDirectory(OUT WCHAR **dirPath, OUT size_t *cchDirPath)
 {
@@ -110,6 +114,20 @@ WCHAR *GetTempFilePath(OUT WCHAR **tempDirPath)
     }
 
     fileNameUtf8[DVM_FILENAME_SIZE] = 0;
+
+    // a long name can reach into the offer's place, it must end before it
+    if (memchr(fileNameUtf8, 0, DVM_DELTA_FILENAME_SIZE))
+    {
+        struct dvm_delta_offer offer;
+
+        memcpy(&offer, fileNameUtf8 + DVM_DELTA_FILENAME_SIZE, sizeof(offer));
+        g_deltaOffered = offer.magic == DVM_DELTA_OFFER_MAGIC && offer.block_size == DVM_DELTA_BLOCK_SIZE;
+        g_deltaNonce = offer.nonce;
+    }
+
+    // without the hashes only the full file can be sent back
+    if (g_deltaOffered && !DeltaInit())
+        g_deltaOffered = FALSE;
     if (strchr(fileNameUtf8, '/'))
     {
         fprintf(stderr, "filename contains /");
@@ -166,12 +184,19 @@ BOOL ReceiveFile(IN const WCHAR *localFilePath)
         goto cleanup;
     }
 
-    if (!QioCopyUntilEof(localFile, g_stdIn))
+    // the reader thread keeps the vchan drained while the file is written (and hashed)
+    if (!DvmStreamCopy(localFile, g_stdIn, g_deltaOffered ? DeltaUpdate : NULL))
     {
         fprintf(stderr, "Failed to read/write file: 0x%x\n", GetLastError());
         goto cleanup;
     }
 
+    if (g_deltaOffered && !DeltaFinish())
+    {
+        fprintf(stderr, "Failed to hash file: 0x%x\n", GetLastError());
+        goto cleanup;
+    }
+
     retval = TRUE;
 
 cleanup:
@@ -196,7 +221,7 @@ BOOL SendFile(IN const WCHAR *localFilePath)
         goto cleanup;
     }
 
-    if (!QioCopyUntilEof(g_stdOut, localFile))
+    if (!DvmStreamCopy(g_stdOut, localFile, NULL))
     {
         fprintf(stderr, "Failed read/write file: 0x%x\n", GetLastError());
         goto cleanup;
@@ -210,6 +235,18 @@ cleanup:
     return retval;
 }
 
+// Sends only the blocks that changed since the file was received.
+BOOL SendDelta(IN const WCHAR *localFilePath)
+{
+    BOOL retval = DeltaSend(g_stdOut, localFilePath, g_deltaNonce);
+
+    if (!retval)
+        fprintf(stderr, "Failed to send changes: 0x%x\n", GetLastError());
+
+    CloseHandle(g_stdOut);
+    return retval;
+}
+
 int __cdecl wmain(int argc, WCHAR *argv[])
 {
     WIN32_FILE_ATTRIBUTE_DATA attributesPre, attributesPost;
@@ -303,7 +340,10 @@ int __cdecl wmain(int argc, WCHAR *argv[])
     if (attributesPre.ftLastWriteTime.dwLowDateTime != attributesPost.ftLastWriteTime.dwLowDateTime ||
         attributesPre.ftLastWriteTime.dwHighDateTime != attributesPost.ftLastWriteTime.dwHighDateTime)
     {
-        SendFile(filePath);
+        if (g_deltaOffered)
+            SendDelta(filePath);
+        else
+            SendFile(filePath);
     }
 
     exitCode = ERROR_SUCCESS;
@@ -20,9 +20,6 @@
  */
 
 #include <windows.h>
-#ifdef WRITE_PPM
-#include <strsafe.h>
-#endif
 
 #include <stdio.h>
 #include <io.h>
@@ -32,137 +29,305 @@
 #include <utf8-conv.h>
 #include <log.h>
 
+#include "icon-rgba.h"
+
+// Runs until stdout is closed and sends icons of new windows and changed icons.
+#define WATCH_ARG L"-watch"
+
+// windows that don't answer WM_GETICON in time are skipped, ms
+#define GET_ICON_TIMEOUT 200
+
+// how often an idle watcher checks that stdout is still open, ms
+#define OUTPUT_CHECK_INTERVAL 5000
+
+// Icon last sent for a window, watch mode only.
+typedef struct _SENT_ICON
+{
+    HWND Window;
+    UINT64 Hash;
+} SENT_ICON;
+
+ICON_RGBA g_iconRgba;
+BOOL g_watch = FALSE;
+SENT_ICON *g_sentIcons = NULL;
+size_t g_sentIconsCount = 0;
+size_t g_sentIconsCapacity = 0;
+UINT g_shellHookMessage = 0;
+
 HICON GetIcon(HWND window)
 {
-    HICON iconHandle;
+    DWORD_PTR iconHandle;
 
-    iconHandle = (HICON)SendMessage(window, WM_GETICON, ICON_BIG, 0);
-    if (iconHandle != NULL)
-        return iconHandle;
+    // a hung window must not stop the watch loop
+    if (SendMessageTimeout(window, WM_GETICON, ICON_BIG, 0, SMTO_ABORTIFHUNG, GET_ICON_TIMEOUT, &iconHandle) && iconHandle)
+        return (HICON)iconHandle;
 
-    iconHandle = (HICON)SendMessage(window, WM_GETICON, ICON_SMALL, 0);
-    if (iconHandle != NULL)
-        return iconHandle;
+    if (SendMessageTimeout(window, WM_GETICON, ICON_SMALL, 0, SMTO_ABORTIFHUNG, GET_ICON_TIMEOUT, &iconHandle) && iconHandle)
+        return (HICON)iconHandle;
 
-    iconHandle = (HICON)GetClassLongPtr(window, GCLP_HICON);
-    if (iconHandle != NULL)
-        return iconHandle;
+    iconHandle = GetClassLongPtr(window, GCLP_HICON);
+    if (iconHandle)
+        return (HICON)iconHandle;
 
-    iconHandle = (HICON)GetClassLongPtr(window, GCLP_HICONSM);
-    if (iconHandle != NULL)
-        return iconHandle;
+    iconHandle = GetClassLongPtr(window, GCLP_HICONSM);
+    if (iconHandle)
+        return (HICON)iconHandle;
 
     return NULL;
 }
 
-BOOL CALLBACK EnumWindowsProc(
-    _In_ HWND   hwnd,
-    _In_ LPARAM lParam
-    )
+// FNV-1a, to tell whether an icon changed since it was sent
+static UINT64 HashIcon(IN const BYTE *data, IN DWORD size)
+{
+    UINT64 hash = 0xcbf29ce484222325ULL;
+    DWORD i;
+
+    for (i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static SENT_ICON *FindSentIcon(IN HWND window)
+{
+    size_t i;
+
+    for (i = 0; i < g_sentIconsCount; i++)
+    {
+        if (g_sentIcons[i].Window == window)
+            return &g_sentIcons[i];
+    }
+
+    return NULL;
+}
+
+static SENT_ICON *AddSentIcon(IN HWND window)
+{
+    SENT_ICON *sentIcons;
+    size_t capacity;
+
+    if (g_sentIconsCount == g_sentIconsCapacity)
+    {
+        capacity = max(64, 2 * g_sentIconsCapacity);
+        sentIcons = realloc(g_sentIcons, capacity * sizeof(SENT_ICON));
+        if (!sentIcons)
+        {
+            perror("realloc");
+            return NULL;
+        }
+
+        g_sentIcons = sentIcons;
+        g_sentIconsCapacity = capacity;
+    }
+
+    g_sentIcons[g_sentIconsCount].Window = window;
+    g_sentIcons[g_sentIconsCount].Hash = 0;
+    return &g_sentIcons[g_sentIconsCount++];
+}
+
+static void ForgetWindow(IN HWND window)
+{
+    SENT_ICON *sentIcon = FindSentIcon(window);
+
+    // handles are reused, a new window with the same one must be sent again
+    if (sentIcon)
+        *sentIcon = g_sentIcons[--g_sentIconsCount];
+}
+
+static void SendWindowIcon(IN HWND window)
 {
-    ICONINFO ii;
     HICON ico;
-    HDC dc;
-    BITMAP bm;
+    const BYTE *output;
     DWORD size;
-    BYTE *buffer;
-    BITMAPINFO bmi;
-    int x, y;
-    DWORD status;
-#ifdef WRITE_PPM
-    FILE *f1;
-    CHAR path[MAX_PATH];
-#endif
-
-    if (!IsWindowVisible(hwnd))
-        return TRUE;
-    
-    ico = GetIcon(hwnd);
+    UINT64 hash;
+    SENT_ICON *sentIcon;
+
+    if (!IsWindowVisible(window))
+        return;
+
+    ico = GetIcon(window);
     if (ico == NULL)
-        return TRUE;
+        return;
 
-    LogDebug("Icon for window 0x%x (%I64d)", hwnd, hwnd);
-    printf("%p\n", hwnd);
+    // the window is only announced with an icon that can be sent
+    if (!IconRgbaRender(&g_iconRgba, ico, 0, &output, &size))
+        return;
 
-    // Create bitmap for the icon.
-    if (!GetIconInfo(ico, &ii))
+    if (g_watch)
     {
-        status = perror("GetIconInfo");
-        goto cleanup;
+        hash = HashIcon(output, size);
+        sentIcon = FindSentIcon(window);
+        if (sentIcon && sentIcon->Hash == hash)
+            return;
+
+        if (!sentIcon)
+            sentIcon = AddSentIcon(window);
+        if (sentIcon)
+            sentIcon->Hash = hash;
     }
 
-    dc = CreateCompatibleDC(NULL);
-    SelectObject(dc, ii.hbmColor);
-
-    // Retrieve the color bitmap of the icon.
-    GetObject(ii.hbmColor, sizeof(bm), &bm);
-
-    size = bm.bmBitsPixel / 8 * bm.bmHeight * bm.bmWidth; // pixel buffer size
-    buffer = (BYTE *)malloc(size); // pixel buffer
-    ZeroMemory(&bmi, sizeof(BITMAPINFO));
-    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-    bmi.bmiHeader.biWidth = bm.bmWidth;
-    bmi.bmiHeader.biHeight = bm.bmHeight;
-    bmi.bmiHeader.biPlanes = bm.bmPlanes;
-    bmi.bmiHeader.biBitCount = bm.bmBitsPixel;
-
-    // Copy pixel buffer.
-    GetDIBits(dc, ii.hbmColor, 0, bm.bmHeight, buffer, &bmi, DIB_RGB_COLORS);
-
-    LogDebug("Size: %dx%d", bm.bmWidth, bm.bmHeight);
-    printf("%d %d\n", bm.bmWidth, bm.bmHeight);
-
-#ifdef WRITE_PPM
-    // Create a PPM bitmap file.
-    StringCbPrintfA(path, sizeof(path), "icon-%x.ppm", hwnd);
-    f1 = fopen(path, "w");
-    fprintf(f1, "P3\n");
-    fprintf(f1, "%d %d\n", bm.bmWidth, bm.bmHeight);
-    fprintf(f1, "255\n");
-#endif
-
-    // Output bitmap.
-    for (y = 0; y < bm.bmHeight; y++)
+    LogDebug("Icon for window 0x%x (%I64d)", window, window);
+
+    printf("%p\n", window);
+    fwrite(output, size, 1, stdout);
+
+    if (g_watch)
     {
-        for (x = 0; x < bm.bmWidth; x++)
+        fflush(stdout);
+        if (ferror(stdout))
         {
-            DWORD offset = (bm.bmHeight - y - 1) * 4 * bm.bmWidth + x * 4;
-            BYTE b = *(buffer + offset + 0);
-            BYTE g = *(buffer + offset + 1);
-            BYTE r = *(buffer + offset + 2);
-            BYTE a = *(buffer + offset + 3);
-
-            fwrite(buffer + offset, 4, 1, stdout);
-#ifdef WRITE_PPM
-            fprintf(f1, "%d %d %d ", r, g, b);
-#endif
+            LogInfo("output closed, exiting");
+            PostQuitMessage(0);
         }
-#ifdef WRITE_PPM
-        fprintf(f1, "\n");
-#endif
     }
+}
+
+BOOL CALLBACK EnumWindowsProc(
+    _In_ HWND   hwnd,
+    _In_ LPARAM lParam
+    )
+{
+    SendWindowIcon(hwnd);
+    return TRUE;
+}
+
+static void CALLBACK WinEventProc(HWINEVENTHOOK hook, DWORD event, HWND window, LONG idObject, LONG idChild,
+    DWORD eventThread, DWORD eventTime)
+{
+    if (idObject != OBJID_WINDOW || idChild != CHILDID_SELF || !window)
+        return;
+
+    if (event == EVENT_OBJECT_DESTROY)
+        ForgetWindow(window);
+    else if (GetAncestor(window, GA_PARENT) == GetDesktopWindow())
+        SendWindowIcon(window); // shown top-level window
+}
+
+static LRESULT CALLBACK ShellHookWindowProc(HWND window, UINT message, WPARAM wParam, LPARAM lParam)
+{
+    // HSHELL_REDRAW comes with title and icon changes of taskbar windows
+    if (message == g_shellHookMessage && (wParam == HSHELL_REDRAW || wParam == HSHELL_WINDOWCREATED))
+    {
+        SendWindowIcon((HWND)lParam);
+        return 0;
+    }
+
+    return DefWindowProc(window, message, wParam, lParam);
+}
+
+// A write error is only seen when an icon is sent, without any window events the
+// watcher would never exit. An empty write fails too once the reading end is closed.
+static void CALLBACK CheckOutput(HWND window, UINT message, UINT_PTR timerId, DWORD time)
+{
+    DWORD written;
+
+    if (!WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), "", 0, &written, NULL))
+    {
+        LogInfo("output closed (%lu), exiting", GetLastError());
+        PostQuitMessage(0);
+    }
+}
 
-    printf("\n");
+// The shell hook needs a (hidden) top-level window, message-only ones get nothing.
+static HWND CreateShellHookWindow(void)
+{
+    WNDCLASSEX windowClass = { 0 };
+    HWND window;
 
-#ifdef WRITE_PPM
-    fclose(f1);
-#endif
+    windowClass.cbSize = sizeof(windowClass);
+    windowClass.lpfnWndProc = ShellHookWindowProc;
+    windowClass.hInstance = GetModuleHandle(NULL);
+    windowClass.lpszClassName = L"QubesWindowIconUpdater";
 
-    status = ERROR_SUCCESS;
+    if (!RegisterClassEx(&windowClass))
+    {
+        perror("RegisterClassEx");
+        return NULL;
+    }
 
-cleanup:
-    return TRUE;
+    window = CreateWindowEx(0, windowClass.lpszClassName, NULL, WS_POPUP, 0, 0, 0, 0, NULL, NULL, windowClass.hInstance, NULL);
+    if (!window)
+    {
+        perror("CreateWindowEx");
+        return NULL;
+    }
+
+    g_shellHookMessage = RegisterWindowMessage(L"SHELLHOOK");
+    if (!g_shellHookMessage || !RegisterShellHookWindow(window))
+    {
+        perror("RegisterShellHookWindow");
+        DestroyWindow(window);
+        return NULL;
+    }
+
+    return window;
+}
+
+// Sends all icons, then only new and changed ones as events come. When idle, only
+// the output is checked every OUTPUT_CHECK_INTERVAL.
+static int Watch(void)
+{
+    HWINEVENTHOOK hook;
+    HWND window;
+    UINT_PTR timer;
+    MSG message;
+
+    window = CreateShellHookWindow();
+    if (!window)
+        return 1;
+
+    // EVENT_OBJECT_DESTROY and EVENT_OBJECT_SHOW are adjacent
+    hook = SetWinEventHook(EVENT_OBJECT_DESTROY, EVENT_OBJECT_SHOW, NULL, WinEventProc, 0, 0,
+        WINEVENT_OUTOFCONTEXT | WINEVENT_SKIPOWNPROCESS);
+    if (!hook)
+    {
+        perror("SetWinEventHook");
+        return 1;
+    }
+
+    if (!EnumWindows(EnumWindowsProc, 0))
+        return 1;
+
+    timer = SetTimer(NULL, 0, OUTPUT_CHECK_INTERVAL, CheckOutput);
+    if (!timer)
+    {
+        perror("SetTimer");
+        return 1;
+    }
+
+    while (GetMessage(&message, NULL, 0, 0) > 0)
+    {
+        TranslateMessage(&message);
+        DispatchMessage(&message);
+    }
+
+    KillTimer(NULL, timer);
+    UnhookWinEvent(hook);
+    DeregisterShellHookWindow(window);
+    DestroyWindow(window);
+    return 0;
 }
 
 int wmain(int argc, WCHAR *argv[])
 {
-    WORD pi = -1;
+    int status = 0;
 
     // Set stdout to binary mode to prevent newline conversions.
     _setmode(_fileno(stdout), _O_BINARY);
 
-    if (!EnumWindows(EnumWindowsProc, 0))
+    if (!IconRgbaInit(&g_iconRgba))
         return 1;
 
-    return 0;
+    g_watch = argc > 1 && 0 == wcscmp(argv[1], WATCH_ARG);
+    if (g_watch)
+        status = Watch();
+    else if (!EnumWindows(EnumWindowsProc, 0))
+        status = 1;
+
+    IconRgbaCleanup(&g_iconRgba);
+    free(g_sentIcons);
+    return status;
 }
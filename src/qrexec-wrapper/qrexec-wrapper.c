@@ -818,7 +818,7 @@ void Usage(
     _In_ const PWSTR name
     )
 {
-    wprintf(L"Usage: %s domain|port|user_name|flags|command_line\n", name);
+    wprintf(L"Usage: %s domain|port|user_name|flags|target|command_line\n", name);
     wprintf(L"domain:       remote domain for data vchan\n");
     wprintf(L"port:         remote port for data vchan\n");
     wprintf(L"user_name:    user name to use for the child process or (null) for current user\n");
@@ -826,13 +826,14 @@ void Usage(
     wprintf(L"         0x01 act as vchan server (default is client)\n");
     wprintf(L"         0x02 pipe child process' io to vchan (default is not)\n");
     wprintf(L"         0x04 run the child process in the interactive session (requires that a user is logged on)\n");
+    wprintf(L"target:       domain requested by a local service call, passed to the child in QREXEC_REQUESTED_TARGET, or (null)\n");
     wprintf(L"command_line: local program to execute and connect to data vchan\n");
 }
 
 /**
  * @brief Entry point.
  * @param argc Number of command line arguments.
- * @param argv Expected arguments are: <domain> <port> <user_name> <flags> <command_line>
+ * @param argv Expected arguments are: <domain> <port> <user_name> <flags> <target> <command_line>
  *             domain:       remote domain for data vchan
  *             port:         remote port for data vchan
  *             user_name:    user name to use for the child process or (null) for current user
@@ -840,6 +841,8 @@ void Usage(
  *                      0x01 act as vchan server (default is client)
  *                      0x02 pipe child process' io to vchan (default is not)
  *                      0x04 run the child process in the interactive session (requires that a user is logged on)
+ *             target:       domain requested by a local service call, passed to the child
+ *                           in QREXEC_REQUESTED_TARGET, or (null)
  *             command_line: local program to execute and connect to data vchan
  * @return Error code.
  */
@@ -848,7 +851,7 @@ int __cdecl wmain(int argc, WCHAR *argv[])
     PCHILD_STATE child = NULL;
     int domain, port, flags;
     BOOL piped, interactive;
-    PWSTR domainName, portStr, flagsStr, userName, commandLine;
+    PWSTR domainName, portStr, flagsStr, userName, targetDomain, commandLine;
     DWORD status = ERROR_NOT_ENOUGH_MEMORY;
 
     LogVerbose("start");
@@ -857,9 +860,10 @@ int __cdecl wmain(int argc, WCHAR *argv[])
     portStr = GetArgument();
     userName = GetArgument();
     flagsStr = GetArgument();
+    targetDomain = GetArgument();
     commandLine = GetArgument();
 
-    if (!domainName || !portStr || !userName || !flagsStr || !commandLine)
+    if (!domainName || !portStr || !userName || !flagsStr || !targetDomain || !commandLine)
     {
         Usage(argv[0]);
         return ERROR_INVALID_PARAMETER;
@@ -892,6 +896,10 @@ int __cdecl wmain(int argc, WCHAR *argv[])
     if (wcscmp(userName, L"(null)") == 0)
         userName = NULL;
 
+    // this process serves only one request, the child inherits its environment
+    if (wcscmp(targetDomain, L"(null)") != 0 && !SetEnvironmentVariable(L"QREXEC_REQUESTED_TARGET", targetDomain))
+        perror("SetEnvironmentVariable(QREXEC_REQUESTED_TARGET)");
+
     status = CreatePublicPipeSecurityDescriptor(&child->PipeSd, &child->PipeAcl);
     if (ERROR_SUCCESS != status)
     {
@@ -757,56 +757,292 @@ cleanup:
     return status;
 }
 
-NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPath, IN BOOLEAN ignoreErrors)
+// Directory copy: every directory entry is a task, run by a fixed set of threads.
+// A thread takes the newest task from its own queue, so the copy goes depth first
+// and few tasks are pending. With its queue empty it steals the oldest task of
+// another thread, which is nearest the root and usually brings a whole subtree.
+// A directory gets its attributes and security after all its children are done,
+// by the thread that completes the last of them.
+
+#define COPY_THREADS 8
+
+// Listed directories keep their source and target handles until they get their
+// security, up to this many handles in total. Directories over the budget reopen them.
+#define COPY_HANDLE_BUDGET 512
+
+typedef enum _COPY_TASK_TYPE
+{
+    CopyTaskFile,
+    CopyTaskDirectory,
+    CopyTaskReparsePoint,
+} COPY_TASK_TYPE;
+
+typedef struct _COPY_TASK
+{
+    LIST_ENTRY ListEntry;
+    COPY_TASK_TYPE Type;
+    struct _COPY_TASK *Parent;
+    LONG Pending; // directories: unfinished children, +1 while listing
+    NTSTATUS Status; // directories: the security isn't copied after a failure
+    HANDLE Source; // directories: kept for finishing if the budget allows
+    HANDLE Target;
+    PWCHAR SourcePath;
+    PWCHAR TargetPath;
+} COPY_TASK;
+
+// There is no Win32 subsystem to provide locks: a count of interested threads
+// and an event for those that have to wait.
+typedef struct _COPY_LOCK
+{
+    LONG Count;
+    HANDLE Event;
+} COPY_LOCK;
+
+typedef struct _COPY_CONTEXT COPY_CONTEXT;
+
+typedef struct _COPY_QUEUE
+{
+    COPY_LOCK Lock;
+    LIST_ENTRY Tasks;
+    ULONG Index;
+    HANDLE Thread;
+    COPY_CONTEXT *Context;
+} COPY_QUEUE;
+
+struct _COPY_CONTEXT
+{
+    COPY_QUEUE Queues[COPY_THREADS];
+    HANDLE WorkEvent; // set for idle threads when tasks are queued
+    LONG IdleThreads;
+    LONG HandleBudget;
+    BOOLEAN IgnoreErrors;
+    volatile LONG Finished; // the root directory is done
+    NTSTATUS Status; // of the root directory
+};
+
+static NTSTATUS CopyCreateEvent(OUT HANDLE *event)
 {
-    UNICODE_STRING dirNameU = { 0 };
     OBJECT_ATTRIBUTES oa;
-    HANDLE dir = NULL, target = NULL;
-    NTSTATUS status;
-    IO_STATUS_BLOCK iosb;
-    BOOLEAN firstQuery = TRUE;
-    FILE_FULL_DIR_INFORMATION *dirInfo = NULL, *entry;
-    HANDLE event = NULL;
-    WCHAR *fullPath = NULL;
-    WCHAR *fullTargetPath = NULL;
 
-    if (!RtlDosPathNameToNtPathName_U(sourcePath, &dirNameU, NULL, NULL))
+    InitializeObjectAttributes(&oa, NULL, 0, NULL, NULL);
+    return ZwCreateEvent(event, EVENT_ALL_ACCESS, &oa, SynchronizationEvent, FALSE);
+}
+
+static void CopyLockAcquire(IN OUT COPY_LOCK *lock)
+{
+    if (InterlockedIncrement(&lock->Count) > 1)
+        ZwWaitForSingleObject(lock->Event, FALSE, NULL);
+}
+
+static void CopyLockRelease(IN OUT COPY_LOCK *lock)
+{
+    if (InterlockedDecrement(&lock->Count) > 0)
+        ZwSetEvent(lock->Event, NULL);
+}
+
+// Paths are parent path + backslash + name, or just the parent paths without a name.
+static COPY_TASK *CopyTaskCreate(IN COPY_TASK_TYPE type, IN COPY_TASK *parent OPTIONAL,
+    IN const PWCHAR sourcePath, IN const PWCHAR targetPath, IN const WCHAR *name OPTIONAL, IN ULONG cchName)
+{
+    COPY_TASK *task;
+    SIZE_T cchSource = wcslen(sourcePath);
+    SIZE_T cchTarget = wcslen(targetPath);
+    SIZE_T cchSuffix = name ? cchName + 1 : 0;
+
+    if (cchSource + cchSuffix >= MAX_PATH_LONG || cchTarget + cchSuffix >= MAX_PATH_LONG)
     {
-        NtLog(TRUE, L"[!] RtlDosPathNameToNtPathName_U(%s) failed\n", sourcePath);
-        status = STATUS_UNSUCCESSFUL;
-        goto cleanup;
+        NtLog(TRUE, L"[!] Path too long: %s\\%.*s\n", sourcePath, cchName, name);
+        return NULL;
+    }
+
+    task = RtlAllocateHeap(g_Heap, HEAP_ZERO_MEMORY,
+        sizeof(COPY_TASK) + (cchSource + cchTarget + 2 * cchSuffix + 2) * sizeof(WCHAR));
+    if (!task)
+    {
+        NtLog(TRUE, L"[!] RtlAllocateHeap(task) failed\n");
+        return NULL;
     }
 
-    NtLog(FALSE, L"[D] %s\n", sourcePath);
+    task->Type = type;
+    task->Parent = parent;
+    task->Pending = 1;
+    task->Status = STATUS_SUCCESS;
+    task->SourcePath = (PWCHAR) (task + 1);
+    task->TargetPath = task->SourcePath + cchSource + cchSuffix + 1;
 
-    status = FileCreateDirectory(targetPath);
+    RtlCopyMemory(task->SourcePath, sourcePath, cchSource * sizeof(WCHAR));
+    RtlCopyMemory(task->TargetPath, targetPath, cchTarget * sizeof(WCHAR));
+    if (name)
+    {
+        task->SourcePath[cchSource] = L'\\';
+        RtlCopyMemory(task->SourcePath + cchSource + 1, name, cchName * sizeof(WCHAR));
+        task->TargetPath[cchTarget] = L'\\';
+        RtlCopyMemory(task->TargetPath + cchTarget + 1, name, cchName * sizeof(WCHAR));
+    }
+
+    return task;
+}
+
+static void CopyQueuePush(IN COPY_QUEUE *queue, IN COPY_TASK *task)
+{
+    CopyLockAcquire(&queue->Lock);
+    InsertTailList(&queue->Tasks, &task->ListEntry);
+    CopyLockRelease(&queue->Lock);
+
+    if (queue->Context->IdleThreads > 0)
+        ZwSetEvent(queue->Context->WorkEvent, NULL);
+}
+
+static COPY_TASK *CopyQueueTake(IN COPY_QUEUE *queue, IN BOOLEAN newest)
+{
+    LIST_ENTRY *entry = NULL;
+
+    // unlocked peek, most queues are empty when stealing
+    if (IsListEmpty(&queue->Tasks))
+        return NULL;
+
+    CopyLockAcquire(&queue->Lock);
+    if (!IsListEmpty(&queue->Tasks))
+        entry = newest ? RemoveTailList(&queue->Tasks) : RemoveHeadList(&queue->Tasks);
+    CopyLockRelease(&queue->Lock);
+
+    return entry ? CONTAINING_RECORD(entry, COPY_TASK, ListEntry) : NULL;
+}
+
+static COPY_TASK *CopyGetTask(IN COPY_QUEUE *queue)
+{
+    COPY_TASK *task;
+    ULONG i;
+
+    task = CopyQueueTake(queue, TRUE);
+
+    for (i = 1; !task && i < COPY_THREADS; i++)
+        task = CopyQueueTake(&queue->Context->Queues[(queue->Index + i) % COPY_THREADS], FALSE);
+
+    return task;
+}
+
+// Copies the attributes and security after the children, so their creation doesn't
+// change the timestamps and restrictive access doesn't get in the way.
+static void CopyDirectoryFinish(IN COPY_CONTEXT *context, IN OUT COPY_TASK *task)
+{
+    HANDLE source = task->Source, target = task->Target;
+    NTSTATUS status;
+
+    if (!NT_SUCCESS(task->Status))
+        goto cleanup;
+
+    if (!source)
+    {
+        status = FileOpen(&source, task->SourcePath, FALSE, FALSE, FALSE);
+        if (!NT_SUCCESS(status))
+        {
+            NtLog(TRUE, L"[!] FileOpen(%s) failed: %x\n", task->SourcePath, status);
+            task->Status = status;
+            goto cleanup;
+        }
+
+        status = FileOpen(&target, task->TargetPath, TRUE, FALSE, FALSE);
+        if (!NT_SUCCESS(status))
+        {
+            NtLog(TRUE, L"[!] FileOpen(%s) failed: %x\n", task->TargetPath, status);
+            task->Status = status;
+            goto cleanup;
+        }
+    }
+
+    status = FileCopyBasicInformation(source, target);
     if (!NT_SUCCESS(status))
     {
-        NtLog(TRUE, L"[!] FileCreateDirectory(%s) failed: %x\n", targetPath, status);
-        if (!ignoreErrors)
+        NtLog(TRUE, L"[!] FileCopyBasicInformation(%s, %s) failed: %x\n", task->SourcePath, task->TargetPath, status);
+        if (!context->IgnoreErrors)
+        {
+            task->Status = status;
             goto cleanup;
+        }
     }
 
-    status = FileOpen(&dir, sourcePath, FALSE, FALSE, FALSE);
+    status = FileCopySecurity(source, target);
     if (!NT_SUCCESS(status))
     {
-        NtLog(TRUE, L"[!] FileOpen(%s) failed: %x\n", sourcePath, status);
-        goto cleanup;
+        NtLog(TRUE, L"[!] FileCopySecurity(%s, %s) failed: %x\n", task->SourcePath, task->TargetPath, status);
+        if (!context->IgnoreErrors)
+            task->Status = status;
     }
 
-    status = FileOpen(&target, targetPath, TRUE, FALSE, FALSE);
+cleanup:
+    if (source)
+        NtClose(source);
+    if (target)
+        NtClose(target);
+    if (task->Source)
+        InterlockedExchangeAdd(&context->HandleBudget, 2);
+}
+
+// The task is done along with all its children. So may be its parents,
+// if it was the last child they waited for.
+static void CopyTaskComplete(IN COPY_CONTEXT *context, IN COPY_TASK *task)
+{
+    COPY_TASK *parent;
+
+    while (TRUE)
+    {
+        parent = task->Parent;
+
+        if (!parent)
+        {
+            context->Status = task->Status;
+            RtlFreeHeap(g_Heap, 0, task);
+            InterlockedExchange(&context->Finished, TRUE);
+            ZwSetEvent(context->WorkEvent, NULL);
+            break;
+        }
+
+        RtlFreeHeap(g_Heap, 0, task);
+
+        if (InterlockedDecrement(&parent->Pending) > 0)
+            break;
+
+        CopyDirectoryFinish(context, parent);
+        task = parent;
+    }
+}
+
+// Creates the target directory and queues tasks for the entries.
+static void CopyDirectoryList(IN COPY_QUEUE *queue, IN OUT COPY_TASK *task)
+{
+    COPY_CONTEXT *context = queue->Context;
+    HANDLE dir = NULL, target = NULL;
+    NTSTATUS status;
+    IO_STATUS_BLOCK iosb;
+    BOOLEAN firstQuery = TRUE;
+    FILE_FULL_DIR_INFORMATION *dirInfo = NULL, *entry;
+    HANDLE event = NULL;
+    COPY_TASK *child;
+    COPY_TASK_TYPE type;
+
+    NtLog(FALSE, L"[D] %s\n", task->SourcePath);
+
+    status = FileCreateDirectory(task->TargetPath);
     if (!NT_SUCCESS(status))
     {
-        NtLog(TRUE, L"[!] FileOpen(%s) failed: %x\n", targetPath, status);
+        NtLog(TRUE, L"[!] FileCreateDirectory(%s) failed: %x\n", task->TargetPath, status);
+        if (!context->IgnoreErrors)
+            goto cleanup;
+    }
+
+    status = FileOpen(&dir, task->SourcePath, FALSE, FALSE, FALSE);
+    if (!NT_SUCCESS(status))
+    {
+        NtLog(TRUE, L"[!] FileOpen(%s) failed: %x\n", task->SourcePath, status);
         goto cleanup;
     }
 
-    status = FileCopyBasicInformation(dir, target);
+    status = FileOpen(&target, task->TargetPath, TRUE, FALSE, FALSE);
     if (!NT_SUCCESS(status))
     {
-        NtLog(TRUE, L"[!] FileCopyBasicInformation(%s, %s) failed: %x\n", sourcePath, targetPath, status);
-        if (!ignoreErrors)
-            goto cleanup;
+        NtLog(TRUE, L"[!] FileOpen(%s) failed: %x\n", task->TargetPath, status);
+        goto cleanup;
     }
 
     dirInfo = RtlAllocateHeap(g_Heap, 0, 16384);
@@ -817,14 +1053,7 @@ NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPat
         goto cleanup;
     }
 
-    InitializeObjectAttributes(&oa, NULL, 0, NULL, NULL);
-    status = ZwCreateEvent(
-        &event,
-        EVENT_ALL_ACCESS,
-        &oa,
-        SynchronizationEvent,
-        FALSE);
-
+    status = CopyCreateEvent(&event);
     if (!NT_SUCCESS(status))
     {
         NtLog(TRUE, L"[!] NtCreateEvent failed: %x\n", status);
@@ -857,7 +1086,7 @@ NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPat
 
         if (!NT_SUCCESS(status))
         {
-            NtLog(TRUE, L"[!] NtQueryDirectoryFile(%s) failed: %x\n", sourcePath, status);
+            NtLog(TRUE, L"[!] NtQueryDirectoryFile(%s) failed: %x\n", task->SourcePath, status);
             goto cleanup;
         }
 
@@ -872,29 +1101,18 @@ NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPat
                     entry->FileNameLength / 2, entry->FileName,
                     entry->FileAttributes, entry->EaSize, entry->AllocationSize.QuadPart);
 
-                if (!fullPath)
-                    fullPath = RtlAllocateHeap(g_Heap, HEAP_ZERO_MEMORY, MAX_PATH_LONG*sizeof(WCHAR));
-                if (!fullTargetPath)
-                    fullTargetPath = RtlAllocateHeap(g_Heap, HEAP_ZERO_MEMORY, MAX_PATH_LONG*sizeof(WCHAR));
-
-                wcscpy_s(fullPath, MAX_PATH_LONG - 1, sourcePath); // 1 for backslash
-                wcscat_s(fullPath, MAX_PATH_LONG, L"\\");
-                wcsncat_s(fullPath, MAX_PATH_LONG, entry->FileName, entry->FileNameLength / 2);
-                wcscpy_s(fullTargetPath, MAX_PATH_LONG - 1, targetPath); // 1 for backslash
-                wcscat_s(fullTargetPath, MAX_PATH_LONG, L"\\");
-                wcsncat_s(fullTargetPath, MAX_PATH_LONG, entry->FileName, entry->FileNameLength / 2);
-
                 if (entry->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
-                {
-                    FileCopyReparsePoint(fullPath, fullTargetPath);
-                }
+                    type = CopyTaskReparsePoint;
                 else if (entry->FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-                {
-                    FileCopyDirectory(fullPath, fullTargetPath, ignoreErrors);
-                }
+                    type = CopyTaskDirectory;
                 else
+                    type = CopyTaskFile;
+
+                child = CopyTaskCreate(type, task, task->SourcePath, task->TargetPath, entry->FileName, entry->FileNameLength / 2);
+                if (child)
                 {
-                    FileCopy(fullPath, fullTargetPath);
+                    InterlockedIncrement(&task->Pending);
+                    CopyQueuePush(queue, child);
                 }
             }
 
@@ -908,32 +1126,173 @@ NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPat
         firstQuery = FALSE;
     }
 
-    // copy ACLs after dealing with children so we don't get tripped by restrictive access
-    status = FileCopySecurity(dir, target);
-    if (!NT_SUCCESS(status))
+    status = STATUS_SUCCESS;
+
+    // Keep the handles for finishing, the children may take a while.
+    if (InterlockedExchangeAdd(&context->HandleBudget, -2) >= 2)
     {
-        NtLog(TRUE, L"[!] FileCopySecurity(%s, %s) failed: %x\n", sourcePath, targetPath, status);
-        if (!ignoreErrors)
-            goto cleanup;
+        task->Source = dir;
+        task->Target = target;
+        dir = NULL;
+        target = NULL;
+    }
+    else
+    {
+        InterlockedExchangeAdd(&context->HandleBudget, 2);
     }
-
-    status = STATUS_SUCCESS;
 
 cleanup:
-    if (dirNameU.Buffer)
-        RtlFreeUnicodeString(&dirNameU);
+    if (!NT_SUCCESS(status))
+        task->Status = status;
     if (dirInfo)
         RtlFreeHeap(g_Heap, 0, dirInfo);
-    if (fullPath)
-        RtlFreeHeap(g_Heap, 0, fullPath);
-    if (fullTargetPath)
-        RtlFreeHeap(g_Heap, 0, fullTargetPath);
     if (event)
         NtClose(event);
     if (dir)
         NtClose(dir);
     if (target)
         NtClose(target);
+
+    // the children may be done already
+    if (InterlockedDecrement(&task->Pending) == 0)
+    {
+        CopyDirectoryFinish(context, task);
+        CopyTaskComplete(context, task);
+    }
+}
+
+static NTSTATUS NTAPI CopyWorker(IN PVOID parameter)
+{
+    COPY_QUEUE *queue = parameter;
+    COPY_CONTEXT *context = queue->Context;
+    COPY_TASK *task;
+    LARGE_INTEGER timeout;
+
+    // only guards against a missed wakeup
+    timeout.QuadPart = -10LL * NANOTICKS;
+
+    while (!context->Finished)
+    {
+        task = CopyGetTask(queue);
+        if (!task)
+        {
+            // look again after becoming idle, tasks queued since then set the event
+            InterlockedIncrement(&context->IdleThreads);
+            task = CopyGetTask(queue);
+            if (!task && !context->Finished)
+                ZwWaitForSingleObject(context->WorkEvent, FALSE, &timeout);
+            InterlockedDecrement(&context->IdleThreads);
+
+            if (!task)
+                continue;
+        }
+
+        switch (task->Type)
+        {
+        case CopyTaskDirectory:
+            CopyDirectoryList(queue, task);
+            break;
+
+        case CopyTaskReparsePoint:
+            FileCopyReparsePoint(task->SourcePath, task->TargetPath);
+            CopyTaskComplete(context, task);
+            break;
+
+        default:
+            FileCopy(task->SourcePath, task->TargetPath);
+            CopyTaskComplete(context, task);
+            break;
+        }
+    }
+
+    // pass the wakeup on, the other idle threads have to see it too
+    ZwSetEvent(context->WorkEvent, NULL);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPath, IN BOOLEAN ignoreErrors)
+{
+    COPY_CONTEXT *context;
+    COPY_TASK *root;
+    NTSTATUS status;
+    ULONG i;
+
+    context = RtlAllocateHeap(g_Heap, HEAP_ZERO_MEMORY, sizeof(COPY_CONTEXT));
+    if (!context)
+    {
+        NtLog(TRUE, L"[!] RtlAllocateHeap(context) failed\n");
+        return STATUS_NO_MEMORY;
+    }
+
+    context->HandleBudget = COPY_HANDLE_BUDGET;
+    context->IgnoreErrors = ignoreErrors;
+
+    status = CopyCreateEvent(&context->WorkEvent);
+    if (!NT_SUCCESS(status))
+    {
+        NtLog(TRUE, L"[!] NtCreateEvent failed: %x\n", status);
+        goto cleanup;
+    }
+
+    for (i = 0; i < COPY_THREADS; i++)
+    {
+        context->Queues[i].Index = i;
+        context->Queues[i].Context = context;
+        InitializeListHead(&context->Queues[i].Tasks);
+
+        status = CopyCreateEvent(&context->Queues[i].Lock.Event);
+        if (!NT_SUCCESS(status))
+        {
+            NtLog(TRUE, L"[!] NtCreateEvent failed: %x\n", status);
+            goto cleanup;
+        }
+    }
+
+    root = CopyTaskCreate(CopyTaskDirectory, NULL, sourcePath, targetPath, NULL, 0);
+    if (!root)
+    {
+        status = STATUS_NO_MEMORY;
+        goto cleanup;
+    }
+
+    CopyQueuePush(&context->Queues[0], root);
+
+    // this thread is the first worker, fewer threads only make the copy slower
+    for (i = 1; i < COPY_THREADS; i++)
+    {
+        status = NtCreateThreadEx(&context->Queues[i].Thread, THREAD_ALL_ACCESS, NULL, NtCurrentProcess(),
+            CopyWorker, &context->Queues[i], 0, 0, 0, 0, NULL);
+
+        if (!NT_SUCCESS(status))
+        {
+            NtLog(TRUE, L"[!] NtCreateThreadEx failed: %x\n", status);
+            context->Queues[i].Thread = NULL;
+            break;
+        }
+    }
+
+    CopyWorker(&context->Queues[0]);
+
+    for (i = 1; i < COPY_THREADS; i++)
+    {
+        if (context->Queues[i].Thread)
+        {
+            ZwWaitForSingleObject(context->Queues[i].Thread, FALSE, NULL);
+            NtClose(context->Queues[i].Thread);
+        }
+    }
+
+    status = context->Status;
+
+cleanup:
+    for (i = 0; i < COPY_THREADS; i++)
+    {
+        if (context->Queues[i].Lock.Event)
+            NtClose(context->Queues[i].Lock.Event);
+    }
+    if (context->WorkEvent)
+        NtClose(context->WorkEvent);
+    RtlFreeHeap(g_Heap, 0, context);
     return status;
 }
 
@@ -113,6 +113,28 @@ NtQuerySystemTime(
     OUT LARGE_INTEGER *CurrentTime
     );
 
+// threads
+
+typedef NTSTATUS (NTAPI *PUSER_THREAD_START_ROUTINE)(
+    IN  PVOID ThreadParameter
+    );
+
+NTSTATUS
+NTAPI
+NtCreateThreadEx(
+    OUT HANDLE *ThreadHandle,
+    IN  ACCESS_MASK DesiredAccess,
+    IN  POBJECT_ATTRIBUTES ObjectAttributes OPTIONAL,
+    IN  HANDLE ProcessHandle,
+    IN  PUSER_THREAD_START_ROUTINE StartRoutine,
+    IN  PVOID Argument OPTIONAL,
+    IN  ULONG CreateFlags,
+    IN  SIZE_T ZeroBits,
+    IN  SIZE_T StackSize,
+    IN  SIZE_T MaximumStackSize,
+    IN  PVOID AttributeList OPTIONAL
+    );
+
 // process startup parameters
 
 typedef struct _PEB_LDR_DATA